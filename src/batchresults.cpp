@@ -0,0 +1,58 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/batchresults.hpp"
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+BatchResults::BatchResults (const size_t n)
+  : results(n), missing(n)
+{}
+
+bool
+BatchResults::Set (const size_t i, const RpcResult& res)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  CHECK_LT (i, results.size ());
+  CHECK (results[i] == nullptr) << "Result " << i << " set twice";
+  results[i] = std::make_unique<RpcResult> (res);
+
+  CHECK_GT (missing, 0);
+  --missing;
+  return missing == 0;
+}
+
+std::vector<RpcResult>
+BatchResults::Get () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK_EQ (missing, 0) << "Not all results of the batch are available";
+
+  std::vector<RpcResult> res;
+  res.reserve (results.size ());
+  for (const auto& r : results)
+    res.push_back (*r);
+
+  return res;
+}
+
+} // namespace charon
@@ -0,0 +1,81 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/batchresults.hpp"
+
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+using BatchResultsTests = testing::Test;
+
+TEST_F (BatchResultsTests, OrderPreserved)
+{
+  BatchResults batch(3);
+  EXPECT_FALSE (batch.Set (2, RpcResult (ParseJson ("2"))));
+  EXPECT_FALSE (batch.Set (0, RpcResult (ParseJson ("0"))));
+  EXPECT_TRUE (batch.Set (1, RpcResult (RpcServer::Error (42, "error",
+                                                          Json::Value ()))));
+
+  const auto res = batch.Get ();
+  ASSERT_EQ (res.size (), 3);
+  ASSERT_TRUE (res[0].IsSuccess ());
+  EXPECT_EQ (res[0].GetResult (), 0);
+  ASSERT_FALSE (res[1].IsSuccess ());
+  EXPECT_EQ (res[1].GetErrorCode (), 42);
+  ASSERT_TRUE (res[2].IsSuccess ());
+  EXPECT_EQ (res[2].GetResult (), 2);
+}
+
+TEST_F (BatchResultsTests, ConcurrentSet)
+{
+  constexpr size_t n = 100;
+  BatchResults batch(n);
+
+  std::vector<std::thread> threads;
+  std::vector<int> last(n, 0);
+  for (size_t i = 0; i < n; ++i)
+    threads.emplace_back ([&batch, &last, i] ()
+      {
+        last[i] = batch.Set (i, RpcResult (Json::Value (
+            static_cast<Json::UInt64> (i))));
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  size_t numLast = 0;
+  for (const auto l : last)
+    numLast += l;
+  EXPECT_EQ (numLast, 1);
+
+  const auto res = batch.Get ();
+  ASSERT_EQ (res.size (), n);
+  for (size_t i = 0; i < n; ++i)
+    EXPECT_EQ (res[i].GetResult ().asUInt64 (), i);
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,68 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "benchutils.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+namespace charon
+{
+
+double
+LatencySamples::GetMean () const
+{
+  CHECK (!samples.empty ());
+  return std::accumulate (samples.begin (), samples.end (), 0.0)
+            / samples.size ();
+}
+
+double
+LatencySamples::GetPercentile (const double p) const
+{
+  CHECK (!samples.empty ());
+  CHECK (p >= 0.0 && p <= 100.0);
+
+  std::vector<double> sorted(samples);
+  std::sort (sorted.begin (), sorted.end ());
+
+  const double rank = std::ceil (p / 100.0 * sorted.size ());
+  const size_t index = std::max<double> (rank, 1.0) - 1;
+
+  return sorted[std::min (index, sorted.size () - 1)];
+}
+
+void
+LatencySamples::Print (const std::string& name) const
+{
+  std::cout
+      << std::fixed << std::setprecision (1)
+      << name << ": " << samples.size () << " samples,"
+      << " mean " << GetMean () << " us,"
+      << " p50 " << GetPercentile (50) << " us,"
+      << " p99 " << GetPercentile (99) << " us,"
+      << " max " << GetPercentile (100) << " us"
+      << std::endl;
+}
+
+} // namespace charon
@@ -0,0 +1,117 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_BENCHUTILS_HPP
+#define CHARON_BENCHUTILS_HPP
+
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * Collection of latency samples for some operation that is measured in
+ * a benchmark.  It can print a summary (mean and percentiles) of the
+ * samples at the end.
+ */
+class LatencySamples
+{
+
+private:
+
+  /** The samples recorded so far, in microseconds.  */
+  std::vector<double> samples;
+
+public:
+
+  LatencySamples () = default;
+
+  /**
+   * Adds a new sample.
+   */
+  template <typename Rep, typename Period>
+    void
+    Add (const std::chrono::duration<Rep, Period>& d)
+  {
+    using Micros = std::chrono::duration<double, std::micro>;
+    samples.push_back (std::chrono::duration_cast<Micros> (d).count ());
+  }
+
+  /**
+   * Adds all samples from another instance to this one.
+   */
+  void
+  Merge (const LatencySamples& o)
+  {
+    samples.insert (samples.end (), o.samples.begin (), o.samples.end ());
+  }
+
+  /**
+   * Returns the mean of all samples in microseconds.
+   */
+  double GetMean () const;
+
+  /**
+   * Returns the given percentile (between 0 and 100) of all samples
+   * in microseconds.
+   */
+  double GetPercentile (double p) const;
+
+  /**
+   * Prints a summary of the samples to stdout, using the given name
+   * to describe what has been measured.
+   */
+  void Print (const std::string& name) const;
+
+};
+
+/**
+ * Simple timer that measures the CPU time consumed by the entire process
+ * (all threads) since it has been started.
+ */
+class CpuTimer
+{
+
+private:
+
+  /** The process CPU time at the start.  */
+  std::clock_t start;
+
+public:
+
+  CpuTimer ()
+    : start(std::clock ())
+  {}
+
+  /**
+   * Returns the number of CPU seconds used since the timer was started.
+   */
+  double
+  GetSeconds () const
+  {
+    return static_cast<double> (std::clock () - start) / CLOCKS_PER_SEC;
+  }
+
+};
+
+} // namespace charon
+
+#endif // CHARON_BENCHUTILS_HPP
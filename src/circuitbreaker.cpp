@@ -0,0 +1,92 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/circuitbreaker.hpp"
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+CircuitBreaker::CircuitBreaker (const size_t w, const double maxRate)
+  : windowSize(w), maxFailureRate(maxRate)
+{
+  CHECK_GT (windowSize, 0);
+}
+
+void
+CircuitBreaker::RecordCall (const bool failed)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (open)
+    return;
+
+  window.push_back (failed);
+  if (failed)
+    ++failures;
+
+  if (window.size () > windowSize)
+    {
+      if (window.front ())
+        --failures;
+      window.pop_front ();
+    }
+
+  /* We only judge the failure rate once we have a full window, so that
+     e.g. a single failed call right after startup does not open
+     the breaker.  */
+  if (window.size () < windowSize)
+    return;
+
+  if (failures > maxFailureRate * windowSize)
+    {
+      LOG (WARNING)
+          << failures << " of the last " << windowSize
+          << " backend calls failed, opening circuit breaker";
+      open = true;
+    }
+}
+
+void
+CircuitBreaker::RecordProbe (const bool healthy)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (healthy && open)
+    {
+      LOG (INFO) << "Backend is healthy again, closing circuit breaker";
+      open = false;
+      window.clear ();
+      failures = 0;
+    }
+  else if (!healthy && !open)
+    {
+      LOG (WARNING) << "Backend health probe failed, opening circuit breaker";
+      open = true;
+    }
+}
+
+bool
+CircuitBreaker::IsOpen () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return open;
+}
+
+} // namespace charon
@@ -0,0 +1,114 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/circuitbreaker.hpp"
+
+#include <gtest/gtest.h>
+
+namespace charon
+{
+namespace
+{
+
+using CircuitBreakerTests = testing::Test;
+
+TEST_F (CircuitBreakerTests, InitiallyClosed)
+{
+  CircuitBreaker b(10, 0.5);
+  EXPECT_FALSE (b.IsOpen ());
+}
+
+TEST_F (CircuitBreakerTests, ProbeOpensAndCloses)
+{
+  CircuitBreaker b(10, 0.5);
+
+  b.RecordProbe (true);
+  EXPECT_FALSE (b.IsOpen ());
+
+  b.RecordProbe (false);
+  EXPECT_TRUE (b.IsOpen ());
+  b.RecordProbe (false);
+  EXPECT_TRUE (b.IsOpen ());
+
+  b.RecordProbe (true);
+  EXPECT_FALSE (b.IsOpen ());
+}
+
+TEST_F (CircuitBreakerTests, NeedsFullWindow)
+{
+  CircuitBreaker b(4, 0.5);
+
+  b.RecordCall (true);
+  b.RecordCall (true);
+  b.RecordCall (true);
+  EXPECT_FALSE (b.IsOpen ());
+
+  b.RecordCall (false);
+  EXPECT_TRUE (b.IsOpen ());
+}
+
+TEST_F (CircuitBreakerTests, FailureRateThreshold)
+{
+  CircuitBreaker b(4, 0.5);
+
+  /* Two out of four failures is not more than half.  */
+  for (const bool failed : {false, false, true, true})
+    b.RecordCall (failed);
+  EXPECT_FALSE (b.IsOpen ());
+
+  b.RecordCall (true);
+  EXPECT_TRUE (b.IsOpen ());
+}
+
+TEST_F (CircuitBreakerTests, OldFailuresLeaveWindow)
+{
+  CircuitBreaker b(4, 0.5);
+
+  b.RecordCall (true);
+  b.RecordCall (true);
+  for (unsigned i = 0; i < 10; ++i)
+    b.RecordCall (false);
+  b.RecordCall (true);
+  b.RecordCall (true);
+  EXPECT_FALSE (b.IsOpen ());
+}
+
+TEST_F (CircuitBreakerTests, ClosingResetsWindow)
+{
+  CircuitBreaker b(4, 0.5);
+
+  for (unsigned i = 0; i < 4; ++i)
+    b.RecordCall (true);
+  ASSERT_TRUE (b.IsOpen ());
+
+  /* Calls while open are ignored.  */
+  for (unsigned i = 0; i < 4; ++i)
+    b.RecordCall (false);
+  EXPECT_TRUE (b.IsOpen ());
+
+  b.RecordProbe (true);
+  EXPECT_FALSE (b.IsOpen ());
+
+  /* After closing, a new full window is needed to open again.  */
+  for (unsigned i = 0; i < 3; ++i)
+    b.RecordCall (true);
+  EXPECT_FALSE (b.IsOpen ());
+}
+
+} // anonymous namespace
+} // namespace charon
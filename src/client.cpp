@@ -18,8 +18,12 @@
 
 #include "client.hpp"
 
+#include "private/batchresults.hpp"
 #include "private/pubsub.hpp"
+#include "private/resultcache.hpp"
+#include "private/rtttracker.hpp"
 #include "private/stanzas.hpp"
+#include "private/timerwheel.hpp"
 #include "private/xmppclient.hpp"
 
 #include <gloox/error.h>
@@ -34,10 +38,16 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <thread>
+#include <utility>
 #include <vector>
 
 namespace charon
@@ -51,9 +61,27 @@ namespace
 /** Default timeout for the client.  */
 constexpr auto DEFAULT_TIMEOUT = std::chrono::seconds (3);
 
+/** Default time for collecting pongs after the first one.  */
+constexpr auto DEFAULT_PONG_WINDOW = std::chrono::milliseconds (50);
+
+/** Weight of a new sample in the moving averages of round-trip times.  */
+constexpr double RTT_SAMPLE_WEIGHT = 0.25;
+
+/** Length of a tick of the timer wheel for call timeouts.  */
+constexpr auto TIMER_TICK = std::chrono::milliseconds (5);
+
+/** Number of buckets in the timer wheel (covering about five seconds).  */
+constexpr size_t TIMER_BUCKETS = 1024;
+
 /** Timeout for waitforchange calls on the client side.  */
 constexpr auto WAITFORCHANGE_TIMEOUT = std::chrono::seconds (5);
 
+/**
+ * Maximum number of servers we try for a single call, if they are busy
+ * or unavailable (and the timeout permits).
+ */
+constexpr unsigned MAX_CALL_ATTEMPTS = 3;
+
 /**
  * Abstraction of a started operation that times out after some time.  It also
  * has condition-variable functionality which allows to wait on it (and to
@@ -101,6 +129,16 @@ public:
       cv.wait_until (lock, endTime);
   }
 
+  /**
+   * Waits on the condition variable until the given time at the latest
+   * (or our endTime, whichever is earlier).
+   */
+  void
+  WaitUntil (std::unique_lock<std::mutex>& lock, const Clock::time_point t)
+  {
+    cv.wait_until (lock, std::min (t, endTime));
+  }
+
   /**
    * Notifies all waiting threads.
    */
@@ -124,104 +162,51 @@ public:
 /* ************************************************************************** */
 
 /**
- * Data for an ongoing RPC method call.
+ * Outcome of a request (for a single call or a batch) sent to a server.
  */
-struct OngoingRpcCall
+struct RpcResponseOutcome
 {
 
   /**
-   * Possible states for an ongoing RPC call.
+   * Set if the server replied with "service unavailable".  The request is
+   * then retried with another server if possible, and fails with an
+   * internal error otherwise.
+   *
+   * Note that this is something that should rarely happen in practice, since
+   * we should have gotten the server's "unavailable" presence notification
+   * and reselected a server already when the current one goes away.
    */
-  enum class State
-  {
-    /** The call is waiting for a server response.  */
-    WAITING,
-    /**
-     * The server replied with "service unavailable".  The RPC method
-     * corresponding to this request will fail with an internal error.
-     *
-     * Note that this is something that should rarely happen in practice, since
-     * we should have gotten the server's "unavailable" presence notification
-     * and reselected a server already when the current one goes away.
-     */
-    UNAVAILABLE,
-    /** We have a response and it was success.  */
-    RESPONSE_SUCCESS,
-    /** We have a response and it was an error.  */
-    RESPONSE_ERROR,
-  };
-
-  /** Condition variable (and timeout) for the response.  */
-  TimedConditionVariable cv;
-
-  /** Mutex for the condition variable.  */
-  std::mutex mut;
-
-  /** The state of this call.  */
-  State state;
-
-  /** JID to which we sent.  */
-  gloox::JID serverJid;
-
-  /** If success, the RPC result.  */
-  Json::Value result;
+  bool unavailable = false;
 
-  /** If error, the thrown error.  */
-  RpcServer::Error error;
-
-  template <typename Rep, typename Period>
-    explicit OngoingRpcCall (const std::chrono::duration<Rep, Period>& t)
-      : cv(t), state(State::WAITING), error(0)
-  {}
+  /** Otherwise, the results of the calls in the request (in order).  */
+  std::vector<RpcResult> results;
 
 };
 
 /**
- * IQ handler that waits for a specific RPC method result.
+ * Converts an RpcResponse stanza to the corresponding result.
  */
-class RpcResultHandler : public gloox::IqHandler
+RpcResult
+ResponseToResult (const RpcResponse& resp)
 {
+  if (resp.IsSuccess ())
+    return RpcResult (resp.GetRawResult ());
 
-private:
-
-  /**
-   * Data about the ongoing call.  This will be updated (and the waiting
-   * thread notified) when we receive our result.
-   */
-  std::shared_ptr<OngoingRpcCall> call;
-
-public:
-
-  explicit RpcResultHandler (std::shared_ptr<OngoingRpcCall> c)
-    : call(c)
-  {}
-
-  RpcResultHandler () = delete;
-  RpcResultHandler (const RpcResultHandler&) = delete;
-  void operator= (const RpcResultHandler&) = delete;
-
-  bool handleIq (const gloox::IQ& iq) override;
-  void handleIqID (const gloox::IQ& iq, int context) override;
-
-};
-
-bool
-RpcResultHandler::handleIq (const gloox::IQ& iq)
-{
-  LOG (WARNING) << "Ignoring IQ without id";
-  return false;
+  return RpcResult (RpcServer::Error (resp.GetErrorCode (),
+                                      resp.GetErrorMessage (),
+                                      resp.GetErrorData ()));
 }
 
-void
-RpcResultHandler::handleIqID (const gloox::IQ& iq, const int context)
+/**
+ * Extracts the outcome of an RPC request for numCalls calls from the
+ * server's IQ response.  A single call is expected to be answered by
+ * an RpcResponse, and more by an RpcBatchResponse.  Returns false if the
+ * IQ is not a valid response and should be ignored.
+ */
+bool
+ParseRpcResponse (const gloox::IQ& iq, const size_t numCalls,
+                  RpcResponseOutcome& res)
 {
-  std::unique_lock<std::mutex> lock(call->mut);
-  if (call->state != OngoingRpcCall::State::WAITING)
-    {
-      LOG (WARNING) << "Ignoring IQ for non-waiting call";
-      return;
-    }
-
   /* If we get a "service unavailable" reply from the server, it means that
      our selected server resource is no longer available.  */
   if (iq.subtype () == gloox::IQ::Error)
@@ -231,9 +216,8 @@ RpcResultHandler::handleIqID (const gloox::IQ& iq, const int context)
             && err->error () == gloox::StanzaErrorServiceUnavailable)
         {
           LOG (WARNING) << "Service unavailable";
-          call->state = OngoingRpcCall::State::UNAVAILABLE;
-          call->cv.Notify ();
-          return;
+          res.unavailable = true;
+          return true;
         }
     }
 
@@ -242,37 +226,78 @@ RpcResultHandler::handleIqID (const gloox::IQ& iq, const int context)
       LOG (WARNING)
           << "Ignoring IQ of type " << iq.subtype ()
           << " from " << iq.from ().full ();
-      return;
+      return false;
+    }
+
+  res.unavailable = false;
+  res.results.clear ();
+
+  if (numCalls == 1)
+    {
+      const auto* ext = iq.findExtension<RpcResponse> (RpcResponse::EXT_TYPE);
+      if (ext == nullptr)
+        {
+          LOG (WARNING)
+              << "Ignoring IQ from " << iq.from ().full ()
+              << " without RpcResponse extension";
+          return false;
+        }
+      if (!ext->IsValid ())
+        {
+          LOG (WARNING) << "Ignoring invalid RpcResponse stanza";
+          return false;
+        }
+
+      res.results.push_back (ResponseToResult (*ext));
+      return true;
     }
 
-  const auto* ext = iq.findExtension<RpcResponse> (RpcResponse::EXT_TYPE);
+  const auto* ext
+      = iq.findExtension<RpcBatchResponse> (RpcBatchResponse::EXT_TYPE);
   if (ext == nullptr)
     {
       LOG (WARNING)
           << "Ignoring IQ from " << iq.from ().full ()
-          << " without RpcResponse extension";
-      return;
+          << " without RpcBatchResponse extension";
+      return false;
     }
   if (!ext->IsValid ())
     {
-      LOG (WARNING) << "Ignoring invalid RpcResponse stanza";
-      return;
-    }
-
-  if (ext->IsSuccess ())
-    {
-      call->state = OngoingRpcCall::State::RESPONSE_SUCCESS;
-      call->result = ext->GetResult ();
+      LOG (WARNING) << "Ignoring invalid RpcBatchResponse stanza";
+      return false;
     }
-  else
+  if (ext->GetNumResponses () != numCalls)
     {
-      call->state = OngoingRpcCall::State::RESPONSE_ERROR;
-      call->error = RpcServer::Error (ext->GetErrorCode (),
-                                      ext->GetErrorMessage (),
-                                      ext->GetErrorData ());
+      LOG (WARNING)
+          << "Ignoring batch response with " << ext->GetNumResponses ()
+          << " results for " << numCalls << " calls";
+      return false;
     }
 
-  call->cv.Notify ();
+  for (size_t i = 0; i < numCalls; ++i)
+    res.results.push_back (ResponseToResult (ext->GetResponse (i)));
+
+  return true;
+}
+
+/**
+ * Constructs an internal-error result with the given message.
+ */
+RpcResult
+InternalError (const std::string& msg)
+{
+  return RpcResult (RpcServer::Error (
+      jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR, msg));
+}
+
+/**
+ * Constructs the results for a batch of n calls that all failed with
+ * the same internal error.
+ */
+std::vector<RpcResult>
+InternalErrors (const size_t n, const std::string& msg)
+{
+  return std::vector<RpcResult> (n, InternalError (msg));
 }
 
 /* ************************************************************************** */
@@ -306,13 +331,28 @@ private:
   /** The current state as JSON value.  */
   Json::Value state;
 
+  /**
+   * Whether or not we received a state since the last subscription (i.e.
+   * since the last call to ResetSync).  Only if this is true can we be
+   * sure that we will see all future state changes.
+   */
+  bool synced = false;
+
+  /**
+   * Callback invoked whenever we receive a state with a different ID
+   * than the previous one.  This is used to invalidate cached results.
+   */
+  const std::function<void ()> onNewStateId;
+
 public:
 
   /**
-   * Constructs a new instance for the given notification type.
+   * Constructs a new instance for the given notification type.  The
+   * callback is invoked on each change of the state ID.
    */
-  explicit NotificationState (std::unique_ptr<NotificationType> n)
-    : notification(std::move (n))
+  explicit NotificationState (std::unique_ptr<NotificationType> n,
+                              const std::function<void ()>& cb)
+    : notification(std::move (n)), onNewStateId(cb)
   {}
 
   NotificationState () = delete;
@@ -331,6 +371,17 @@ public:
    */
   PubSubImpl::ItemCallback GetItemCallback ();
 
+  /**
+   * Marks the state as not synced.  This is done when we lose or
+   * change the subscription, as updates may be missed in between.
+   */
+  void ResetSync ();
+
+  /**
+   * Returns true if we have received a state since the last ResetSync.
+   */
+  bool IsSynced ();
+
 };
 
 Json::Value
@@ -392,16 +443,40 @@ NotificationState::GetItemCallback ()
         }
 
       std::lock_guard<std::mutex> lock(mut);
+      const auto& newState = upd.GetState ();
+      const bool newId
+          = !hasState
+              || notification->ExtractStateId (state)
+                  != notification->ExtractStateId (newState);
+
       hasState = true;
-      state = upd.GetState ();
+      synced = true;
+      state = newState;
 
       LOG (INFO) << "Found new state for " << type;
       VLOG (1) << "New state:\n" << state;
 
+      if (newId && onNewStateId)
+        onNewStateId ();
+
       cv.notify_all ();
     };
 }
 
+void
+NotificationState::ResetSync ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  synced = false;
+}
+
+bool
+NotificationState::IsSynced ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return synced;
+}
+
 } // anonymous namespace
 
 /* ************************************************************************** */
@@ -418,6 +493,90 @@ private:
 
   class ConnectionAttempt;
 
+  /**
+   * Entry in the table of in-flight calls.  It holds the data of an
+   * ongoing call (which may be a batch of several method calls sent
+   * together) across all attempts to send it to a server.  The slot
+   * itself is passed to gloox as IQ handler for the requests, so that
+   * the tracking can be removed explicitly when the call times out.
+   *
+   * All members except owner and index are protected by mutAsync.
+   */
+  class CallSlot : public gloox::IqHandler
+  {
+
+  public:
+
+    /** The Impl instance this belongs to.  */
+    Impl& owner;
+
+    /** Index of this slot in the table.  */
+    const size_t index;
+
+    /**
+     * Generation of the slot, which is incremented each time a call
+     * using it is done.  Together with the index, this identifies a call
+     * and allows detecting stale references to a reused slot.
+     */
+    unsigned generation = 0;
+
+    /** Whether or not the slot is used by an ongoing call.  */
+    bool active = false;
+
+    /**
+     * The method calls being done.  If there is just one, it is sent as
+     * ordinary RpcRequest, and otherwise as RpcBatchRequest.
+     */
+    std::vector<Client::BatchCall> calls;
+
+    /** Time point at which the call times out.  */
+    std::chrono::steady_clock::time_point endTime;
+
+    /** Callback to invoke with the final results.  */
+    Client::BatchCompletion completion;
+
+    /** Whether or not the result should be put into the cache.  */
+    bool useCache = false;
+
+    /** The cache key for the call, if useCache is true.  */
+    std::string cacheKey;
+
+    /** The cache generation at which the call was started.  */
+    ResultCache::Generation cacheGen = 0;
+
+    /** Number of attempts started so far.  */
+    unsigned attempts = 0;
+
+    /** JID to which we sent the current attempt.  */
+    gloox::JID serverJid;
+
+    /** Time when the current attempt was sent.  */
+    std::chrono::steady_clock::time_point sentTime;
+
+    /**
+     * IQ id of the current attempt.  This is empty if there is currently
+     * no request sent to a server (e.g. while one is being discovered).
+     */
+    std::string iqId;
+
+    explicit CallSlot (Impl& o, const size_t i)
+      : owner(o), index(i)
+    {}
+
+    CallSlot () = delete;
+    CallSlot (const CallSlot&) = delete;
+    void operator= (const CallSlot&) = delete;
+
+    /**
+     * Returns a description of the call for log messages.
+     */
+    std::string Describe () const;
+
+    bool handleIq (const gloox::IQ& iq) override;
+    void handleIqID (const gloox::IQ& iq, int context) override;
+
+  };
+
   /** Reference to the corresponding Client class.  */
   Client& client;
 
@@ -440,6 +599,12 @@ private:
    */
   gloox::JID fullServerJid;
 
+  /**
+   * The maximum size of batch requests supported by the selected server
+   * (as reported in its pong), or zero if it does not support them.
+   */
+  size_t serverMaxBatch = 0;
+
   /**
    * Threads that are currently running pubsub subscriptions or have run some
    * in the past.  We mostly just collect threads here that will finish by
@@ -455,9 +620,104 @@ private:
    */
   std::weak_ptr<TimedConditionVariable> ongoingPing;
 
+  /** Time when the last ping was sent.  */
+  std::chrono::steady_clock::time_point pingSent;
+
+  /** Counter used to generate the nonces of our pings.  */
+  unsigned pingCounter = 0;
+
+  /** Nonce of the last ping sent, which servers echo in their pongs.  */
+  std::string pingNonce;
+
+  /**
+   * Data from a valid pong reply, i.e. a server instance that we can
+   * select.
+   */
+  struct PongCandidate
+  {
+
+    /** The instance's full JID.  */
+    gloox::JID jid;
+
+    /** The maximum batch size it supports.  */
+    size_t maxBatch;
+
+    /** The notifications it supports (if any).  */
+    std::unique_ptr<SupportedNotifications> sn;
+
+  };
+
+  /** Pongs received since the last ping, keyed by resource.  */
+  std::map<std::string, PongCandidate> pongs;
+
+  /** Time when the first of the current pongs was received.  */
+  std::chrono::steady_clock::time_point firstPong;
+
+  /** Policy for choosing among server instances.  */
+  std::unique_ptr<ServerSelector> selector;
+
+  /** Round-trip times measured for the server instances.  */
+  RttTracker rtts;
+
+  /**
+   * The cache for results, if enabled.  This must be declared before
+   * the notification states, as their callbacks reference it.
+   */
+  std::unique_ptr<ResultCache> cache;
+
   /** Current states for all the enabled notifications.  */
   std::map<std::string, std::unique_ptr<NotificationState>> states;
 
+  /**
+   * Mutex for the table of in-flight calls (the slots, their deadlines
+   * and the calls waiting for a server).
+   */
+  std::mutex mutAsync;
+
+  /** Condition variable to wake up the timer thread.  */
+  std::condition_variable cvTimer;
+
+  /** Condition variable to wake up the discovery thread.  */
+  std::condition_variable cvDiscovery;
+
+  /** Set to true when the helper threads should stop.  */
+  bool stopAsync = false;
+
+  /**
+   * Pooled slots for in-flight calls.  They are reused once a call is done,
+   * so that the table does not grow beyond the peak number of concurrent
+   * calls.  A deque is used because slots are registered with gloox as
+   * IQ handlers, and thus must not move in memory.
+   */
+  std::deque<CallSlot> slots;
+
+  /** Indices of slots that are free for reuse.  */
+  std::vector<size_t> freeSlots;
+
+  /** Deadlines of all active calls by slot index.  */
+  TimerWheel timers;
+
+  /** Calls waiting for a server, as slot index and generation.  */
+  std::vector<std::pair<size_t, unsigned>> needServer;
+
+  /**
+   * Interval at which the discovery thread probes server instances for
+   * a possible reselection, or zero if that is disabled.
+   */
+  Client::Duration reselectInterval = Client::Duration::zero ();
+
+  /** Time of the next probe for reselection.  */
+  std::chrono::steady_clock::time_point nextProbe;
+
+  /** Thread that fails calls when they time out.  */
+  std::thread timerThread;
+
+  /**
+   * Thread that runs server discovery (which may block) for calls that
+   * need a server while none is selected.
+   */
+  std::thread discoveryThread;
+
   void handlePresence (const gloox::Presence& p) override;
 
   /**
@@ -477,13 +737,45 @@ private:
   void ClearSelectedServer ();
 
   /**
-   * Sets the selected server to the given full JID.  This also notifies
-   * all waiters on that.
+   * Sets the selected server to the given full JID, which supports batches
+   * of the given size.  This also notifies all waiters on that.
    */
   void SetSelectedServer (std::unique_lock<std::mutex>& lock,
-                          const gloox::JID& jid,
+                          const gloox::JID& jid, size_t maxBatch,
                           const SupportedNotifications* sn);
 
+  /**
+   * Sends a ping to the server's bare JID and returns the condition variable
+   * for waiting on the replies, which is also set as ongoingPing.  Must be
+   * called with mut held.
+   */
+  std::shared_ptr<TimedConditionVariable> StartPing ();
+
+  /**
+   * Waits for pongs in reply to the given ping, until the pong window after
+   * the first one has passed or the ping timed out.  If untilSelected is
+   * true, we also return as soon as a server is selected (e.g. by another
+   * thread waiting on the same ping).  The caller must hold the given
+   * lock on mut.
+   */
+  void WaitForPongs (std::unique_lock<std::mutex>& lock,
+                     TimedConditionVariable& ping, bool untilSelected);
+
+  /**
+   * Passes the instances that replied with a pong (and the currently
+   * selected one, if any) to the ServerSelector, and selects the instance
+   * it chooses if that is not the current one already.  The pongs are
+   * cleared afterwards.  The caller must hold the given lock on mut.
+   */
+  void SelectFromPongs (std::unique_lock<std::mutex>& lock);
+
+  /**
+   * Sends a ping to probe all server instances, and possibly switches to
+   * another one based on their round-trip times.  This is done periodically
+   * by the discovery thread if reselection is enabled.
+   */
+  void ProbeServers ();
+
   /**
    * Tries to ensure that we have an active XMPP connection and also a
    * fullServerJid set.  If none is set yet, we send a ping or wait for the
@@ -502,6 +794,85 @@ private:
    */
   void FinishSubscriptions (std::unique_lock<std::mutex>& lock);
 
+  /**
+   * Flushes the result cache (if any) and marks all notification states
+   * as not synced.  This is done whenever our subscriptions change, since
+   * we may miss state changes in between.
+   */
+  void ResetCache ();
+
+  /**
+   * Returns true if the result cache is enabled and can be used right now,
+   * i.e. if we are sure to receive notifications for all state changes.
+   */
+  bool IsCacheUsable ();
+
+  /**
+   * Returns the slot for the given call if it is still ongoing, or null if
+   * the call is done already.  Must be called with mutAsync held.
+   */
+  CallSlot* GetActiveSlot (size_t index, unsigned gen);
+
+  /**
+   * Marks the call in the given slot as done, removes its deadline and
+   * returns its completion (which the caller should invoke without holding
+   * the lock).  If reuse is true, the slot is immediately made available
+   * for new calls.  Otherwise the caller has to do that with FreeSlot
+   * after any remaining gloox tracking of it is removed.  Must be called
+   * with mutAsync held.
+   */
+  Client::BatchCompletion ReleaseSlot (CallSlot& slot, bool reuse);
+
+  /**
+   * Starts the next attempt for the given call.  If we have a selected
+   * server, the request is sent right away.  Otherwise the call is queued
+   * for the discovery thread.
+   */
+  void StartAttempt (size_t index, unsigned gen);
+
+  /**
+   * Sends a request for the given call to the given server.  If the call
+   * is a batch that is too large for the server, it is instead split up
+   * into smaller ones, which are forwarded as separate calls.
+   */
+  void SendRequest (size_t index, unsigned gen, const gloox::JID& jid);
+
+  /**
+   * Returns the maximum batch size supported by the given server, which
+   * is zero unless it is still our selected server.
+   */
+  size_t GetMaxBatchSize (const gloox::JID& jid);
+
+  /**
+   * Forwards a batch of calls split up into chunks of at most the given
+   * size (or single calls if it is zero), and invokes the completion
+   * once all of them are done.
+   */
+  void ForwardInChunks (const std::vector<Client::BatchCall>& calls,
+                        size_t chunkSize, Client::Duration timeout,
+                        const Client::BatchCompletion& cb);
+
+  /**
+   * Processes an IQ response to a request sent for the given call, either
+   * finishing it or retrying with another server.
+   */
+  void HandleResponse (size_t index, unsigned gen, const gloox::IQ& iq);
+
+  /**
+   * Fails the given call (if still ongoing) with an internal error.
+   */
+  void FailCall (size_t index, unsigned gen, const std::string& msg);
+
+  /**
+   * Main function of the timer thread.
+   */
+  void RunTimer ();
+
+  /**
+   * Main function of the discovery thread.
+   */
+  void RunDiscovery ();
+
 protected:
 
   void HandleDisconnect () override;
@@ -512,21 +883,56 @@ public:
 
   ~Impl ();
 
+  /**
+   * Enables the result cache.
+   */
+  void EnableCache (size_t maxEntries);
+
   /**
    * Enables a new notification.
    */
   void AddNotification (std::unique_ptr<NotificationType> n);
 
+  /**
+   * Sets the policy for choosing among server instances.
+   */
+  void SetServerSelector (std::unique_ptr<ServerSelector> s);
+
+  /**
+   * Enables periodic probing for server reselection.
+   */
+  void EnableReselection (Client::Duration interval);
+
   /**
    * Returns the server's resource and tries to find one if none is there.
    */
   std::string GetServerResource ();
 
   /**
-   * Forwards the given RPC call to the server.
+   * Clears our selected server if it is (still) the given one.  This is
+   * done when a request to it fails because the server is busy or
+   * unavailable, so that the next attempt selects another one.
+   */
+  void ReleaseServer (const gloox::JID& jid);
+
+  /**
+   * Forwards the given RPC call to the server, taking at most the
+   * given timeout (including server discovery if needed).  If the server
+   * is busy or unavailable, another one is selected and the call retried
+   * with the remaining time.  The completion is invoked with the result.
+   */
+  void ForwardMethod (const std::string& method, const RawJson& params,
+                      Client::Duration timeout, const Client::Completion& cb);
+
+  /**
+   * Forwards a batch of RPC calls to the server, sending them in a single
+   * request if the server supports it.  This is otherwise like
+   * ForwardMethod, except that a retry with another server is only done
+   * if the server rejected all calls as busy.
    */
-  Json::Value ForwardMethod (const std::string& method,
-                             const Json::Value& params);
+  void ForwardBatch (const std::vector<Client::BatchCall>& calls,
+                     Client::Duration timeout,
+                     const Client::BatchCompletion& cb);
 
   /**
    * Waits for a state change of the given notification type.
@@ -536,40 +942,118 @@ public:
 };
 
 Client::Impl::Impl (Client& p, const gloox::JID& jid, const std::string& pwd)
-  : XmppClient(jid, pwd), client(p), fullServerJid(client.serverJid)
+  : XmppClient(jid, pwd), client(p), fullServerJid(client.serverJid),
+    selector(std::make_unique<LowestRttSelector> ()),
+    rtts(RTT_SAMPLE_WEIGHT), timers(TIMER_TICK, TIMER_BUCKETS)
 {
   RunWithClient ([this] (gloox::Client& c)
     {
       c.registerStanzaExtension (new RpcRequest ());
       c.registerStanzaExtension (new RpcResponse ());
+      c.registerStanzaExtension (new RpcBatchResponse ());
       c.registerStanzaExtension (new PingMessage ());
       c.registerStanzaExtension (new PongMessage ());
       c.registerStanzaExtension (new SupportedNotifications ());
+      c.registerStanzaExtension (new CancelRequest ());
 
       c.registerPresenceHandler (this);
     });
+
+  timerThread = std::thread ([this] ()
+    {
+      RunTimer ();
+    });
+  discoveryThread = std::thread ([this] ()
+    {
+      RunDiscovery ();
+    });
 }
 
 Client::Impl::~Impl ()
 {
+  {
+    std::lock_guard<std::mutex> lock(mutAsync);
+    stopAsync = true;
+    cvTimer.notify_all ();
+    cvDiscovery.notify_all ();
+  }
+  timerThread.join ();
+  discoveryThread.join ();
+
   RunWithClient ([this] (gloox::Client& c)
     {
       c.removePresenceHandler (this);
     });
 
-  std::unique_lock<std::mutex> lock(mut);
-  FinishSubscriptions (lock);
-}
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    FinishSubscriptions (lock);
+  }
+
+  /* Make sure that no more responses are processed (which would access
+     our state), and then fail all calls still outstanding.  */
+  Disconnect ();
+
+  std::vector<std::pair<size_t, Client::BatchCompletion>> outstanding;
+  RunWithClient ([&] (gloox::Client& c)
+    {
+      std::lock_guard<std::mutex> lock(mutAsync);
+      for (auto& slot : slots)
+        if (slot.active)
+          {
+            if (!slot.iqId.empty ())
+              c.removeIDHandler (&slot);
+            const size_t numCalls = slot.calls.size ();
+            outstanding.emplace_back (numCalls, ReleaseSlot (slot, true));
+          }
+    });
+  for (const auto& entry : outstanding)
+    entry.second (InternalErrors (entry.first, "client has been shut down"));
+}
+
+void
+Client::Impl::EnableCache (const size_t maxEntries)
+{
+  CHECK (cache == nullptr) << "Result cache is already enabled";
+  CHECK (states.empty ())
+      << "Result cache must be enabled before notifications are added";
+
+  cache = std::make_unique<ResultCache> (maxEntries);
+}
 
 void
 Client::Impl::AddNotification (std::unique_ptr<NotificationType> n)
 {
   const auto& type = n->GetType ();
-  auto s = std::make_unique<NotificationState> (std::move (n));
+  auto s = std::make_unique<NotificationState> (std::move (n), [this] ()
+    {
+      if (cache != nullptr)
+        cache->Flush ();
+    });
   const auto res = states.emplace (type, std::move (s));
   CHECK (res.second) << "Duplicate notification of type " << type;
 }
 
+void
+Client::Impl::SetServerSelector (std::unique_ptr<ServerSelector> s)
+{
+  CHECK (s != nullptr);
+
+  std::lock_guard<std::mutex> lock(mut);
+  selector = std::move (s);
+}
+
+void
+Client::Impl::EnableReselection (const Client::Duration interval)
+{
+  CHECK_GT (interval.count (), 0);
+
+  std::lock_guard<std::mutex> lock(mutAsync);
+  reselectInterval = interval;
+  nextProbe = std::chrono::steady_clock::now () + interval;
+  cvDiscovery.notify_all ();
+}
+
 /**
  * RAII helper class for setup and cleanup while we attempt to connect
  * to XMPP.
@@ -633,55 +1117,170 @@ Client::Impl::EnsureConnected ()
   if (ping == nullptr)
     {
       LOG (INFO) << "No full server JID, sending ping to " << client.serverJid;
+      ping = StartPing ();
+    }
 
-      ping = std::make_shared<TimedConditionVariable> (client.timeout);
-      RunWithClient ([this] (gloox::Client& c)
-        {
-          const gloox::JID serverJid(client.serverJid);
+  WaitForPongs (lock, *ping, true);
+  if (!HasFullServerJid ())
+    SelectFromPongs (lock);
+  ping->Notify ();
 
-          gloox::Message msg(gloox::Message::Normal, serverJid);
-          msg.addExtension (new PingMessage ());
+  if (HasFullServerJid ())
+    {
+      LOG (INFO) << "We now have a full server JID";
+      return fullServerJid;
+    }
 
-          c.send (msg);
-        });
+  LOG (WARNING) << "Waiting for pong timed out";
+  return gloox::JID ();
+}
 
-      ongoingPing = ping;
-    }
+std::shared_ptr<TimedConditionVariable>
+Client::Impl::StartPing ()
+{
+  auto ping = std::make_shared<TimedConditionVariable> (client.timeout);
+  pongs.clear ();
+  pingSent = std::chrono::steady_clock::now ();
+  pingNonce = std::to_string (++pingCounter);
 
-  while (true)
+  RunWithClient ([this] (gloox::Client& c)
     {
-      ping->Wait (lock);
+      const gloox::JID serverJid(client.serverJid);
 
-      if (ping->IsTimedOut ())
-        {
-          LOG (WARNING) << "Waiting for pong timed out";
-          return gloox::JID ();
-        }
+      gloox::Message msg(gloox::Message::Normal, serverJid);
+      msg.addExtension (new PingMessage (pingNonce));
 
-      if (HasFullServerJid ())
+      c.send (msg);
+    });
+
+  ongoingPing = ping;
+  return ping;
+}
+
+void
+Client::Impl::WaitForPongs (std::unique_lock<std::mutex>& lock,
+                            TimedConditionVariable& ping,
+                            const bool untilSelected)
+{
+  while (!ping.IsTimedOut ())
+    {
+      if (untilSelected && HasFullServerJid ())
+        return;
+
+      if (pongs.empty ())
         {
-          LOG (INFO) << "We now have a full server JID";
-          return fullServerJid;
+          ping.Wait (lock);
+          continue;
         }
+
+      /* Once the first pong is in, we give other instances a short time
+         to reply as well, so that we can choose the best one.  */
+      const auto windowEnd = firstPong + client.pongWindow;
+      if (std::chrono::steady_clock::now () >= windowEnd)
+        return;
+      ping.WaitUntil (lock, windowEnd);
+    }
+}
+
+void
+Client::Impl::SelectFromPongs (std::unique_lock<std::mutex>& lock)
+{
+  const std::string current = fullServerJid.resource ();
+
+  std::vector<ServerStats> candidates;
+  for (const auto& entry : pongs)
+    candidates.push_back (rtts.GetStats (entry.first));
+  if (!current.empty () && pongs.count (current) == 0)
+    candidates.push_back (rtts.GetStats (current));
+  if (candidates.empty ())
+    return;
+
+  const std::string chosen = selector->SelectServer (candidates, current);
+  if (chosen == current)
+    {
+      pongs.clear ();
+      return;
     }
+
+  const auto mit = pongs.find (chosen);
+  CHECK (mit != pongs.end ())
+      << "ServerSelector chose " << chosen << ", which is no candidate";
+  const PongCandidate selected = std::move (mit->second);
+  pongs.clear ();
+
+  /* We do not send an unavailable presence to the previous instance, as that
+     would make it cancel calls that are still in flight there.  */
+  if (!current.empty ())
+    LOG (INFO) << "Switching from server " << current << " to " << chosen;
+  SetSelectedServer (lock, selected.jid, selected.maxBatch,
+                     selected.sn.get ());
+}
+
+void
+Client::Impl::ProbeServers ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  /* If there is no selected server, the ordinary discovery takes care of
+     finding one.  */
+  if (connecting || !IsConnected () || !HasFullServerJid ())
+    return;
+  if (ongoingPing.lock () != nullptr)
+    return;
+
+  VLOG (1) << "Probing server instances for reselection";
+  auto ping = StartPing ();
+  WaitForPongs (lock, *ping, false);
+  SelectFromPongs (lock);
+  ping->Notify ();
 }
 
 void
 Client::Impl::ClearSelectedServer ()
 {
   fullServerJid = client.serverJid;
+  serverMaxBatch = 0;
+  ResetCache ();
+}
+
+void
+Client::Impl::ResetCache ()
+{
+  if (cache == nullptr)
+    return;
+
+  for (auto& entry : states)
+    entry.second->ResetSync ();
+  cache->Flush ();
+}
+
+bool
+Client::Impl::IsCacheUsable ()
+{
+  /* Without notifications, nothing would ever invalidate the cache.  */
+  if (cache == nullptr || states.empty ())
+    return false;
+
+  for (auto& entry : states)
+    if (!entry.second->IsSynced ())
+      return false;
+
+  return true;
 }
 
 void
 Client::Impl::SetSelectedServer (std::unique_lock<std::mutex>& lock,
                                  const gloox::JID& jid,
+                                 const size_t maxBatch,
                                  const SupportedNotifications* sn)
 {
   CHECK_EQ (jid.bareJID (), fullServerJid.bareJID ());
 
   fullServerJid = jid;
+  serverMaxBatch = maxBatch;
   LOG (INFO)
-      << "Found full server JID: " << fullServerJid.full ();
+      << "Found full server JID: " << fullServerJid.full ()
+      << " (maximum batch size " << serverMaxBatch << ")";
 
   gloox::Presence resp(gloox::Presence::Available, jid);
   RunWithClient ([&resp] (gloox::Client& c)
@@ -703,6 +1302,11 @@ Client::Impl::SetSelectedServer (std::unique_lock<std::mutex>& lock,
 
       AddPubSub (sn->GetService ());
 
+      /* Any updates received from the previous subscription (if any) may
+         have been incomplete, so cached results cannot be trusted until
+         the new subscriptions have delivered a state.  */
+      ResetCache ();
+
       const auto& n = sn->GetNotifications ();
       for (auto& entry : states)
         {
@@ -767,7 +1371,7 @@ Client::Impl::handlePresence (const gloox::Presence& p)
               }
           }
 
-        std::unique_lock<std::mutex> lock(mut);
+        std::lock_guard<std::mutex> lock(mut);
 
         if (p.from ().bareJID () != fullServerJid.bareJID ())
           {
@@ -777,13 +1381,40 @@ Client::Impl::handlePresence (const gloox::Presence& p)
             return;
           }
 
-        /* In case we get multiple replies, we pick the first only.  */
-        if (!HasFullServerJid ())
-          SetSelectedServer (lock, p.from (), sn);
-
+        /* Pongs that arrive while no ping is outstanding, or that answer
+           an earlier ping (by their nonce), would give wrong round-trip
+           times.  Servers that do not echo nonces yet are accepted as long
+           as a ping is outstanding.  */
         auto ping = ongoingPing.lock ();
-        if (ping != nullptr)
-          ping->Notify ();
+        if (ping == nullptr
+              || (!pong->GetNonce ().empty ()
+                    && pong->GetNonce () != pingNonce))
+          {
+            VLOG (1) << "Ignoring stale pong from " << p.from ().full ();
+            return;
+          }
+
+        /* The pong is recorded as candidate, and the choice among all
+           candidates is made once the pong window is over (by the thread
+           that sent the ping).  */
+        const auto now = std::chrono::steady_clock::now ();
+        const auto& resource = p.from ().resource ();
+        rtts.AddPingSample (resource,
+                            std::chrono::duration_cast<RttTracker::Duration> (
+                                now - pingSent));
+
+        if (pongs.empty ())
+          firstPong = now;
+        auto& candidate = pongs[resource];
+        candidate.jid = p.from ();
+        candidate.maxBatch = pong->GetMaxBatchSize ();
+        if (sn == nullptr)
+          candidate.sn.reset ();
+        else
+          candidate.sn.reset (
+              static_cast<SupportedNotifications*> (sn->clone ()));
+
+        ping->Notify ();
 
         return;
       }
@@ -791,6 +1422,7 @@ Client::Impl::handlePresence (const gloox::Presence& p)
     case gloox::Presence::Unavailable:
       {
         std::lock_guard<std::mutex> lock(mut);
+        pongs.erase (p.from ().resource ());
         if (p.from () == fullServerJid)
           {
             LOG (WARNING) << "Our server has become unavailable";
@@ -838,63 +1470,577 @@ Client::Impl::FinishSubscriptions (std::unique_lock<std::mutex>& lock)
   subscribeCalls.clear ();
 }
 
-Json::Value
+void
+Client::Impl::ReleaseServer (const gloox::JID& jid)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (fullServerJid == jid)
+    ClearSelectedServer ();
+}
+
+std::string
+Client::Impl::CallSlot::Describe () const
+{
+  std::ostringstream res;
+  if (calls.size () == 1)
+    res << "call to " << calls.front ().method;
+  else
+    res << "batch of " << calls.size () << " calls";
+  return res.str ();
+}
+
+bool
+Client::Impl::CallSlot::handleIq (const gloox::IQ& iq)
+{
+  LOG (WARNING) << "Ignoring IQ without id";
+  return false;
+}
+
+void
+Client::Impl::CallSlot::handleIqID (const gloox::IQ& iq, const int context)
+{
+  owner.HandleResponse (index, static_cast<unsigned> (context), iq);
+}
+
+Client::Impl::CallSlot*
+Client::Impl::GetActiveSlot (const size_t index, const unsigned gen)
+{
+  CHECK_LT (index, slots.size ());
+  auto& slot = slots[index];
+  if (!slot.active || slot.generation != gen)
+    return nullptr;
+  return &slot;
+}
+
+Client::BatchCompletion
+Client::Impl::ReleaseSlot (CallSlot& slot, const bool reuse)
+{
+  CHECK (slot.active);
+  slot.active = false;
+  ++slot.generation;
+  timers.Cancel (slot.index);
+
+  /* Release the data we no longer need right away, rather than keeping
+     it around until the slot is reused.  */
+  slot.calls.clear ();
+  slot.cacheKey.clear ();
+
+  Client::BatchCompletion res;
+  std::swap (res, slot.completion);
+
+  if (reuse)
+    freeSlots.push_back (slot.index);
+
+  return res;
+}
+
+void
 Client::Impl::ForwardMethod (const std::string& method,
-                             const Json::Value& params)
+                             const RawJson& params,
+                             const Client::Duration timeout,
+                             const Client::Completion& cb)
 {
-  const auto jid = EnsureConnected ();
-  if (!jid)
+  /* A single call is just handled as batch of one, which is then sent
+     as ordinary RpcRequest.  */
+  std::vector<Client::BatchCall> calls(1);
+  calls.front ().method = method;
+  calls.front ().params = params;
+
+  ForwardBatch (calls, timeout, [cb] (const std::vector<RpcResult>& res)
     {
-      std::ostringstream msg;
-      msg << "could not discover full server JID for " << client.serverJid;
-      throw RpcServer::Error (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
-                              msg.str ());
+      CHECK_EQ (res.size (), 1);
+      cb (res.front ());
+    });
+}
+
+void
+Client::Impl::ForwardBatch (const std::vector<Client::BatchCall>& calls,
+                            const Client::Duration timeout,
+                            const Client::BatchCompletion& cb)
+{
+  if (calls.empty ())
+    {
+      cb ({});
+      return;
     }
 
-  auto iq = std::make_unique<gloox::IQ> (gloox::IQ::Get, jid);
-  iq->addExtension (new RpcRequest (method, params));
+  /* Results are only cached (and looked up) while we are synced to all
+     notifications, as only then are we sure to flush the cache when the
+     state changes.  A resync flushes the cache as well, which starts a new
+     generation and thus prevents insertion of results from before.
+
+     Only single calls use the cache.  Batches are usually split up into
+     single calls anyway if a server does not support them.  */
+  const bool useCache = calls.size () == 1 && IsCacheUsable ();
+  std::string cacheKey;
+  ResultCache::Generation cacheGen = 0;
+  if (useCache)
+    {
+      const auto& call = calls.front ();
+      cacheKey = ResultCache::GetKey (call.method, call.params.GetValue ());
+      cacheGen = cache->GetGeneration ();
+
+      RawJson cached;
+      if (cache->Lookup (cacheKey, cached))
+        {
+          VLOG (1) << "Answering call to " << call.method << " from cache";
+          cb ({RpcResult (cached)});
+          return;
+        }
+    }
+
+  size_t index;
+  unsigned gen;
+  {
+    std::lock_guard<std::mutex> lock(mutAsync);
+
+    if (freeSlots.empty ())
+      {
+        index = slots.size ();
+        slots.emplace_back (*this, index);
+      }
+    else
+      {
+        index = freeSlots.back ();
+        freeSlots.pop_back ();
+      }
+
+    auto& slot = slots[index];
+    CHECK (!slot.active);
+    slot.active = true;
+    slot.calls = calls;
+    slot.endTime = std::chrono::steady_clock::now () + timeout;
+    slot.completion = cb;
+    slot.useCache = useCache;
+    slot.cacheKey = std::move (cacheKey);
+    slot.cacheGen = cacheGen;
+    slot.attempts = 0;
+    slot.iqId.clear ();
+    gen = slot.generation;
+
+    /* The timer thread only ticks while there are deadlines.  */
+    if (timers.IsEmpty ())
+      cvTimer.notify_all ();
+    timers.Schedule (index, slot.endTime);
+  }
+
+  StartAttempt (index, gen);
+}
+
+void
+Client::Impl::ForwardInChunks (const std::vector<Client::BatchCall>& calls,
+                               const size_t chunkSize,
+                               const Client::Duration timeout,
+                               const Client::BatchCompletion& cb)
+{
+  const size_t step = std::max<size_t> (chunkSize, 1);
+  auto results = std::make_shared<BatchResults> (calls.size ());
+
+  for (size_t start = 0; start < calls.size (); start += step)
+    {
+      const size_t end = std::min (calls.size (), start + step);
+      const std::vector<Client::BatchCall> chunk(calls.begin () + start,
+                                                 calls.begin () + end);
+
+      ForwardBatch (chunk, timeout,
+                    [results, start, cb] (const std::vector<RpcResult>& res)
+        {
+          bool done = false;
+          for (size_t i = 0; i < res.size (); ++i)
+            if (results->Set (start + i, res[i]))
+              done = true;
+
+          if (done)
+            cb (results->Get ());
+        });
+    }
+}
+
+void
+Client::Impl::StartAttempt (const size_t index, const unsigned gen)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutAsync);
+    auto* slot = GetActiveSlot (index, gen);
+    if (slot == nullptr)
+      return;
+    ++slot->attempts;
+    slot->iqId.clear ();
+  }
+
+  gloox::JID jid;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (!connecting && IsConnected () && HasFullServerJid ())
+      jid = fullServerJid;
+  }
+
+  if (jid)
+    {
+      SendRequest (index, gen, jid);
+      return;
+    }
+
+  std::lock_guard<std::mutex> lock(mutAsync);
+  needServer.emplace_back (index, gen);
+  cvDiscovery.notify_all ();
+}
+
+size_t
+Client::Impl::GetMaxBatchSize (const gloox::JID& jid)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  if (jid != fullServerJid)
+    return 0;
+  return serverMaxBatch;
+}
+
+void
+Client::Impl::SendRequest (const size_t index, const unsigned gen,
+                           const gloox::JID& jid)
+{
+  const size_t maxBatch = GetMaxBatchSize (jid);
+
+  size_t numTimedOut = 0;
+  Client::BatchCompletion timedOut;
+
+  std::vector<Client::BatchCall> toSplit;
+  Client::BatchCompletion splitCompletion;
+  Client::Duration splitTimeout;
 
-  auto call = std::make_shared<OngoingRpcCall> (client.timeout);
-  call->serverJid = iq->to ();
   RunWithClient ([&] (gloox::Client& c)
     {
+      /* We hold the client lock until the request has been sent (and
+         tracking of it set up).  The timer thread acquires it before
+         removing the tracking for timed out calls, so that it cannot miss
+         the request sent here.  */
+      std::unique_lock<std::mutex> lock(mutAsync);
+      auto* slot = GetActiveSlot (index, gen);
+      if (slot == nullptr)
+        return;
+
+      /* The server is told how long we are going to wait for the response
+         (after the time spent for discovery and earlier attempts), so that
+         it does not process the request anymore once we have given up.  */
+      const auto remaining = std::chrono::duration_cast<Client::Duration> (
+          slot->endTime - std::chrono::steady_clock::now ());
+      if (remaining <= Client::Duration::zero ())
+        {
+          LOG (WARNING)
+              << "Timed out before sending " << slot->Describe ();
+          numTimedOut = slot->calls.size ();
+          timedOut = ReleaseSlot (*slot, true);
+          return;
+        }
+
+      /* If the batch is too large for the server, the calls are forwarded
+         in smaller batches instead (once we no longer hold the locks).  */
+      const size_t numCalls = slot->calls.size ();
+      if (numCalls > 1 && numCalls > maxBatch)
+        {
+          LOG (INFO)
+              << "Splitting " << slot->Describe () << " for server "
+              << jid.full () << " with maximum batch size " << maxBatch;
+          toSplit = slot->calls;
+          splitTimeout = remaining;
+          splitCompletion = ReleaseSlot (*slot, true);
+          return;
+        }
+
+      /* We need the IQ id to cancel the request if we time out.  */
+      const auto id = c.getID ();
+      slot->serverJid = jid;
+      slot->iqId = id;
+      slot->sentTime = std::chrono::steady_clock::now ();
+
+      gloox::IQ iq(gloox::IQ::Get, jid, id);
+      if (numCalls == 1)
+        {
+          const auto& call = slot->calls.front ();
+          iq.addExtension (new RpcRequest (call.method, call.params,
+                                           remaining));
+        }
+      else
+        {
+          std::vector<std::unique_ptr<RpcRequest>> requests;
+          for (const auto& call : slot->calls)
+            requests.push_back (
+                std::make_unique<RpcRequest> (call.method, call.params));
+          iq.addExtension (new RpcBatchRequest (std::move (requests),
+                                                remaining));
+        }
+
       LOG (INFO)
-          << "Sending IQ request for method " << method
-          << " to " << iq->to ().full ();
-      c.send (*iq, new RpcResultHandler (call), 0, true);
+          << "Sending IQ request " << id << " for " << slot->Describe ()
+          << " to " << jid.full ();
+
+      lock.unlock ();
+      c.send (iq, slot, static_cast<int> (gen), false);
     });
-  iq.reset ();
 
+  if (timedOut)
+    timedOut (InternalErrors (numTimedOut,
+                              "timeout before the request could be sent"));
+
+  if (splitCompletion)
+    ForwardInChunks (toSplit, maxBatch, splitTimeout, splitCompletion);
+}
+
+void
+Client::Impl::HandleResponse (const size_t index, const unsigned gen,
+                              const gloox::IQ& iq)
+{
+  std::string description;
+  gloox::JID jid;
+  bool releaseServer = false;
+  Client::BatchCompletion cb;
+  std::unique_ptr<std::vector<RpcResult>> finalResults;
+  {
+    std::lock_guard<std::mutex> lock(mutAsync);
+    auto* slot = GetActiveSlot (index, gen);
+    if (slot == nullptr || slot->iqId != iq.id ())
+      {
+        LOG (WARNING)
+            << "Ignoring response " << iq.id ()
+            << " for call that is no longer waiting";
+        return;
+      }
+
+    RpcResponseOutcome res;
+    if (!ParseRpcResponse (iq, slot->calls.size (), res))
+      return;
+
+    description = slot->Describe ();
+    jid = slot->serverJid;
+
+    if (res.unavailable)
+      {
+        LOG (WARNING) << "Server " << jid.full () << " is unavailable";
+        releaseServer = true;
+        if (slot->attempts >= MAX_CALL_ATTEMPTS)
+          finalResults = std::make_unique<std::vector<RpcResult>> (
+              InternalErrors (slot->calls.size (),
+                              "selected server is unavailable"));
+      }
+    else
+      {
+        /* The server rejects the calls of a batch individually when it is
+           overloaded.  If some of them were processed, we keep their results
+           (and the busy errors for the others) rather than retrying the
+           whole batch.  */
+        bool allBusy = true;
+        for (const auto& r : res.results)
+          if (r.IsSuccess () || r.GetErrorCode () != RpcServer::ERROR_BUSY)
+            allBusy = false;
+
+        if (allBusy)
+          {
+            LOG (WARNING) << "Server " << jid.full () << " is busy";
+            releaseServer = true;
+          }
+        else
+          {
+            LOG (INFO) << "Received call result for " << description;
+
+            /* Only responses that the backend actually handled are a
+               measure of the call latency.  Busy rejections (also those of
+               an open circuit breaker) come back immediately, and would
+               make an overloaded server look like the fastest one.  */
+            rtts.AddCallSample (
+                jid.resource (),
+                std::chrono::duration_cast<RttTracker::Duration> (
+                    std::chrono::steady_clock::now () - slot->sentTime));
+          }
+
+        if (!allBusy || slot->attempts >= MAX_CALL_ATTEMPTS)
+          {
+            if (slot->useCache && res.results.front ().IsSuccess ())
+              cache->Insert (slot->cacheKey, slot->cacheGen,
+                             res.results.front ().GetRawResult ());
+            finalResults = std::make_unique<std::vector<RpcResult>> (
+                std::move (res.results));
+          }
+      }
+
+    if (finalResults != nullptr)
+      cb = ReleaseSlot (*slot, true);
+    else
+      slot->iqId.clear ();
+  }
+
+  if (releaseServer)
+    ReleaseServer (jid);
+
+  if (finalResults != nullptr)
+    {
+      cb (*finalResults);
+      return;
+    }
+
+  LOG (INFO) << "Retrying " << description << " with another server";
+  StartAttempt (index, gen);
+}
+
+void
+Client::Impl::FailCall (const size_t index, const unsigned gen,
+                        const std::string& msg)
+{
+  size_t numCalls;
+  Client::BatchCompletion cb;
+  {
+    std::lock_guard<std::mutex> lock(mutAsync);
+    auto* slot = GetActiveSlot (index, gen);
+    if (slot == nullptr)
+      return;
+    numCalls = slot->calls.size ();
+    cb = ReleaseSlot (*slot, true);
+  }
+
+  cb (InternalErrors (numCalls, msg));
+}
+
+void
+Client::Impl::RunTimer ()
+{
+  /* Data about a call that timed out, copied from its slot.  */
+  struct TimedOutCall
+  {
+    CallSlot* slot;
+    std::string description;
+    size_t numCalls;
+    gloox::JID serverJid;
+    std::string iqId;
+    Client::BatchCompletion completion;
+  };
+
+  std::vector<size_t> expired;
+  std::vector<TimedOutCall> calls;
+
+  std::unique_lock<std::mutex> lock(mutAsync);
+  while (!stopAsync)
+    {
+      if (timers.IsEmpty ())
+        {
+          cvTimer.wait (lock);
+          continue;
+        }
+
+      cvTimer.wait_for (lock, timers.GetTickLength ());
+      if (stopAsync)
+        break;
+
+      expired.clear ();
+      timers.Expire (std::chrono::steady_clock::now (), expired);
+      if (expired.empty ())
+        continue;
+
+      /* The slots are not freed yet, as gloox may still be tracking their
+         requests.  That is removed first, so that a response arriving
+         late can never be attributed to a new call in the same slot.  */
+      calls.clear ();
+      for (const auto index : expired)
+        {
+          auto& slot = slots[index];
+          TimedOutCall c;
+          c.slot = &slot;
+          c.description = slot.Describe ();
+          c.numCalls = slot.calls.size ();
+          c.serverJid = slot.serverJid;
+          c.iqId = slot.iqId;
+          c.completion = ReleaseSlot (slot, false);
+          calls.push_back (std::move (c));
+        }
+      lock.unlock ();
+
+      RunWithClient ([&calls] (gloox::Client& c)
+        {
+          for (const auto& call : calls)
+            {
+              if (call.iqId.empty ())
+                continue;
+
+              c.removeIDHandler (call.slot);
+
+              /* Tell the server that we are no longer interested in the
+                 result, so that it can drop the request if it has not
+                 processed it yet.  */
+              gloox::Message cancel(gloox::Message::Normal, call.serverJid);
+              cancel.addExtension (new CancelRequest (call.iqId));
+              c.send (cancel);
+            }
+        });
+
+      for (const auto& call : calls)
+        {
+          if (call.iqId.empty ())
+            {
+              LOG (WARNING)
+                  << "Timed out before sending " << call.description;
+              call.completion (InternalErrors (
+                  call.numCalls, "timeout before the request could be sent"));
+              continue;
+            }
+
+          LOG (WARNING) << "Timed out waiting for " << call.description;
+          std::ostringstream msg;
+          msg << "timeout waiting for result from " << call.serverJid.full ();
+          call.completion (InternalErrors (call.numCalls, msg.str ()));
+        }
+
+      lock.lock ();
+      for (const auto& call : calls)
+        freeSlots.push_back (call.slot->index);
+    }
+}
+
+void
+Client::Impl::RunDiscovery ()
+{
+  std::unique_lock<std::mutex> lock(mutAsync);
   while (true)
     {
-      std::unique_lock<std::mutex> callLock(call->mut);
-      call->cv.Wait (callLock);
+      while (!stopAsync && needServer.empty ())
+        {
+          if (reselectInterval == Client::Duration::zero ())
+            cvDiscovery.wait (lock);
+          else if (std::chrono::steady_clock::now () >= nextProbe)
+            break;
+          else
+            cvDiscovery.wait_until (lock, nextProbe);
+        }
+      if (stopAsync)
+        return;
 
-      switch (call->state)
+      if (needServer.empty ())
         {
-        case OngoingRpcCall::State::RESPONSE_SUCCESS:
-          LOG (INFO) << "Received success call result";
-          return call->result;
-        case OngoingRpcCall::State::RESPONSE_ERROR:
-          LOG (INFO) << "Received error call result";
-          throw call->error;
-
-        case OngoingRpcCall::State::UNAVAILABLE:
-          throw RpcServer::Error (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
-                                  "selected server is unavailable");
-
-        default:
-          break;
+          nextProbe = std::chrono::steady_clock::now () + reselectInterval;
+          lock.unlock ();
+          ProbeServers ();
+          lock.lock ();
+          continue;
         }
 
-      if (call->cv.IsTimedOut ())
+      /* All calls that are waiting now are served by the same discovery,
+         while new ones queue up for the next round.  */
+      std::vector<std::pair<size_t, unsigned>> calls;
+      calls.swap (needServer);
+      lock.unlock ();
+
+      const auto jid = EnsureConnected ();
+      for (const auto& c : calls)
         {
-          LOG (WARNING) << "Call to " << method << " timed out";
+          if (jid)
+            {
+              SendRequest (c.first, c.second, jid);
+              continue;
+            }
+
           std::ostringstream msg;
-          msg << "timeout waiting for result from " << call->serverJid.full ();
-          throw RpcServer::Error (jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
-                                  msg.str ());
+          msg << "could not discover full server JID for " << client.serverJid;
+          FailCall (c.first, c.second, msg.str ());
         }
+
+      lock.lock ();
     }
 }
 
@@ -922,6 +2068,7 @@ Client::Client (const std::string& srv, const std::string& v,
   : serverJid(srv), version(v)
 {
   SetTimeout (DEFAULT_TIMEOUT);
+  SetPongWindow (DEFAULT_PONG_WINDOW);
 
   const gloox::JID jid(jidStr);
   impl = std::make_unique<Impl> (*this, jid, password);
@@ -947,6 +2094,13 @@ Client::Disconnect ()
   impl->Disconnect ();
 }
 
+void
+Client::EnableCache (const size_t maxEntries)
+{
+  CHECK (impl != nullptr);
+  impl->EnableCache (maxEntries);
+}
+
 void
 Client::AddNotification (std::unique_ptr<NotificationType> n)
 {
@@ -954,6 +2108,20 @@ Client::AddNotification (std::unique_ptr<NotificationType> n)
   impl->AddNotification (std::move (n));
 }
 
+void
+Client::SetServerSelector (std::unique_ptr<ServerSelector> s)
+{
+  CHECK (impl != nullptr);
+  impl->SetServerSelector (std::move (s));
+}
+
+void
+Client::EnableReselection (const std::chrono::milliseconds interval)
+{
+  CHECK (impl != nullptr);
+  impl->EnableReselection (interval);
+}
+
 std::string
 Client::GetServerResource ()
 {
@@ -963,9 +2131,108 @@ Client::GetServerResource ()
 
 Json::Value
 Client::ForwardMethod (const std::string& method, const Json::Value& params)
+{
+  return ForwardMethod (method, params, timeout);
+}
+
+Json::Value
+Client::ForwardMethod (const std::string& method, const Json::Value& params,
+                       const std::chrono::milliseconds t)
+{
+  return ForwardRawMethod (method, RawJson (params), t).GetValue ();
+}
+
+RawJson
+Client::ForwardRawMethod (const std::string& method, const RawJson& params)
+{
+  return ForwardRawMethod (method, params, timeout);
+}
+
+RawJson
+Client::ForwardRawMethod (const std::string& method, const RawJson& params,
+                          const std::chrono::milliseconds t)
+{
+  return ForwardMethodAsync (method, params, t).get ();
+}
+
+void
+Client::ForwardMethodAsync (const std::string& method, const RawJson& params,
+                            const Completion& cb)
+{
+  ForwardMethodAsync (method, params, timeout, cb);
+}
+
+void
+Client::ForwardMethodAsync (const std::string& method, const RawJson& params,
+                            const std::chrono::milliseconds t,
+                            const Completion& cb)
+{
+  CHECK (impl != nullptr);
+  impl->ForwardMethod (method, params, t, cb);
+}
+
+std::future<RawJson>
+Client::ForwardMethodAsync (const std::string& method, const RawJson& params)
+{
+  return ForwardMethodAsync (method, params, timeout);
+}
+
+std::future<RawJson>
+Client::ForwardMethodAsync (const std::string& method, const RawJson& params,
+                            const std::chrono::milliseconds t)
+{
+  /* The completion has to be copyable, so we cannot move the promise
+     into it directly.  */
+  auto promise = std::make_shared<std::promise<RawJson>> ();
+  auto res = promise->get_future ();
+
+  ForwardMethodAsync (method, params, t, [promise] (const RpcResult& r)
+    {
+      if (r.IsSuccess ())
+        promise->set_value (r.GetRawResult ());
+      else
+        promise->set_exception (std::make_exception_ptr (RpcServer::Error (
+            r.GetErrorCode (), r.GetErrorMessage (), r.GetErrorData ())));
+    });
+
+  return res;
+}
+
+std::vector<RpcResult>
+Client::ForwardBatch (const std::vector<BatchCall>& calls)
+{
+  return ForwardBatch (calls, timeout);
+}
+
+std::vector<RpcResult>
+Client::ForwardBatch (const std::vector<BatchCall>& calls,
+                      const std::chrono::milliseconds t)
+{
+  auto promise = std::make_shared<std::promise<std::vector<RpcResult>>> ();
+  auto res = promise->get_future ();
+
+  ForwardBatchAsync (calls, t, [promise] (const std::vector<RpcResult>& r)
+    {
+      promise->set_value (r);
+    });
+
+  return res.get ();
+}
+
+void
+Client::ForwardBatchAsync (const std::vector<BatchCall>& calls,
+                           const BatchCompletion& cb)
+{
+  ForwardBatchAsync (calls, timeout, cb);
+}
+
+void
+Client::ForwardBatchAsync (const std::vector<BatchCall>& calls,
+                           const std::chrono::milliseconds t,
+                           const BatchCompletion& cb)
 {
   CHECK (impl != nullptr);
-  return impl->ForwardMethod (method, params);
+  impl->ForwardBatch (calls, t, cb);
 }
 
 Json::Value
@@ -21,13 +21,17 @@
 
 #include "notifications.hpp"
 #include "rpcserver.hpp"
+#include "serverselector.hpp"
 
 #include <json/json.h>
 
 #include <chrono>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace charon
 {
@@ -40,6 +44,32 @@ namespace charon
 class Client
 {
 
+public:
+
+  /** Callback that is invoked with the result of an asynchronous call.  */
+  using Completion = std::function<void (const RpcResult& res)>;
+
+  /**
+   * A single method call as part of a batch.
+   */
+  struct BatchCall
+  {
+
+    /** The method to call.  */
+    std::string method;
+
+    /** The params for the call.  */
+    RawJson params;
+
+  };
+
+  /**
+   * Callback that is invoked with the results of an asynchronous batch,
+   * in the same order as the calls.
+   */
+  using BatchCompletion
+      = std::function<void (const std::vector<RpcResult>& res)>;
+
 private:
 
   class Impl;
@@ -56,6 +86,12 @@ private:
   /** Current timeout when waiting for replies of the server JID.  */
   Duration timeout;
 
+  /**
+   * Time we wait for more pongs after the first one when looking for
+   * a server, so that we can choose the best among them.
+   */
+  Duration pongWindow;
+
   /**
    * The class implementing the main logic.  Its internals depend on private
    * libraries like gloox, so that the definition is not exposed in the header.
@@ -92,6 +128,33 @@ public:
     timeout = std::chrono::duration_cast<Duration> (t);
   }
 
+  /**
+   * Sets the time for which we collect pong replies from server instances
+   * after the first one, before choosing among them.  Zero means that the
+   * first instance to reply is selected.
+   */
+  template <typename Rep, typename Period>
+    void
+    SetPongWindow (const std::chrono::duration<Rep, Period>& t)
+  {
+    pongWindow = std::chrono::duration_cast<Duration> (t);
+  }
+
+  /**
+   * Sets the policy used to choose among server instances.  By default,
+   * a LowestRttSelector is used.  A new policy takes effect with the next
+   * selection of a server instance.
+   */
+  void SetServerSelector (std::unique_ptr<ServerSelector> s);
+
+  /**
+   * Enables periodic probing of the available server instances with
+   * the given interval.  The round-trip times measured for them are
+   * passed to the ServerSelector together with the current instance's,
+   * and the client switches to another instance if it decides so.
+   */
+  void EnableReselection (std::chrono::milliseconds interval);
+
   /**
    * Connects to XMPP and starts a thread that processes any data we receive.
    */
@@ -102,6 +165,17 @@ public:
    */
   void Disconnect ();
 
+  /**
+   * Enables caching of successful results of forwarded calls, keyed by
+   * method and params.  The cache is flushed whenever one of the enabled
+   * notifications sees a new state ID.  Results are only cached while
+   * we are subscribed to all notifications and have received a state for
+   * each since the subscription, so that no state change can be missed.
+   * This must be called before notifications are added (and thus the cache
+   * is only useful if they are).  At most maxEntries results are kept.
+   */
+  void EnableCache (size_t maxEntries);
+
   /**
    * Adds a new notification type that we are interested in.  This must only be
    * called before the client is connected.
@@ -125,10 +199,108 @@ public:
    * the server's JSON-RPC result.  In case of error, throws RpcServer::Error.
    * This can be called concurrently from multiple threads and the processing
    * will be properly synchronised.
+   *
+   * If the selected server rejects the call as busy (or is unavailable),
+   * another server is selected and the call retried within the timeout.
    */
   Json::Value ForwardMethod (const std::string& method,
                              const Json::Value& params);
 
+  /**
+   * Forwards the given RPC call with a timeout specific to this call
+   * (instead of the general one set by SetTimeout).  The timeout is also
+   * sent to the server, so that it can skip processing of the call if the
+   * response would be too late anyway.
+   */
+  Json::Value ForwardMethod (const std::string& method,
+                             const Json::Value& params,
+                             std::chrono::milliseconds t);
+
+  /**
+   * Forwards the given RPC call like ForwardMethod, but returns the result
+   * as RawJson.  It holds the serialised result as received from the
+   * server, and is only parsed if the caller asks for the Json::Value.
+   * This allows passing results through to somewhere else (like an HTTP
+   * response body) without parsing and reserialising them.
+   */
+  RawJson ForwardRawMethod (const std::string& method, const RawJson& params);
+
+  /**
+   * Forwards a call with raw params and result and a specific timeout.
+   */
+  RawJson ForwardRawMethod (const std::string& method, const RawJson& params,
+                            std::chrono::milliseconds t);
+
+  /**
+   * Forwards the given RPC call without blocking the calling thread.  The
+   * completion is invoked with the result (or error) once it is available
+   * or the call timed out.  It is called from one of the client's internal
+   * threads (e.g. the one processing the XMPP stream), or directly from
+   * within this method if the result is known already (e.g. cached).
+   * It must thus return quickly and not block on other calls through
+   * this client.
+   *
+   * This allows a single thread to keep many calls in flight at the same
+   * time.  The blocking ForwardMethod is a wrapper around this.
+   */
+  void ForwardMethodAsync (const std::string& method, const RawJson& params,
+                           const Completion& cb);
+
+  /**
+   * Forwards a call asynchronously with a specific timeout.
+   */
+  void ForwardMethodAsync (const std::string& method, const RawJson& params,
+                           std::chrono::milliseconds t, const Completion& cb);
+
+  /**
+   * Forwards a call asynchronously and returns a future for the result.
+   * If the call fails, the future holds the RpcServer::Error.
+   */
+  std::future<RawJson> ForwardMethodAsync (const std::string& method,
+                                           const RawJson& params);
+
+  /**
+   * Forwards a call asynchronously with a specific timeout and returns
+   * a future for the result.
+   */
+  std::future<RawJson> ForwardMethodAsync (const std::string& method,
+                                           const RawJson& params,
+                                           std::chrono::milliseconds t);
+
+  /**
+   * Forwards a batch of RPC calls to the server and returns their results
+   * (success or error for each) in order.  If the server supports it, the
+   * calls are sent together in a single request, which saves the overhead
+   * of processing and routing a stanza for each call.  Batches larger than
+   * what the server supports are split up as needed.
+   *
+   * If the server is busy or unavailable for the whole batch, it is retried
+   * with another server like for ForwardMethod.  Any other failure (e.g.
+   * a timeout) is returned as error result for the affected calls.
+   */
+  std::vector<RpcResult> ForwardBatch (const std::vector<BatchCall>& calls);
+
+  /**
+   * Forwards a batch of RPC calls with a specific timeout.
+   */
+  std::vector<RpcResult> ForwardBatch (const std::vector<BatchCall>& calls,
+                                       std::chrono::milliseconds t);
+
+  /**
+   * Forwards a batch of RPC calls without blocking the calling thread.
+   * The completion is invoked with all results once they are available,
+   * with the same constraints as for ForwardMethodAsync.
+   */
+  void ForwardBatchAsync (const std::vector<BatchCall>& calls,
+                          const BatchCompletion& cb);
+
+  /**
+   * Forwards a batch of RPC calls asynchronously with a specific timeout.
+   */
+  void ForwardBatchAsync (const std::vector<BatchCall>& calls,
+                          std::chrono::milliseconds t,
+                          const BatchCompletion& cb);
+
   /**
    * Waits for a state change of the given notification.  Returns immediately
    * if the passed-in known state does not match the actual current state.
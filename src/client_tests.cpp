@@ -28,12 +28,15 @@
 #include <gloox/presence.h>
 #include <gloox/presencehandler.h>
 
+#include <jsonrpccpp/common/errors.h>
+
 #include <gtest/gtest.h>
 
 #include <glog/logging.h>
 
 #include <atomic>
 #include <condition_variable>
+#include <future>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -84,7 +87,9 @@ private:
 
         LOG (INFO) << "Sleep done, sending pong now";
         gloox::Presence reply(gloox::Presence::Available, msg.from ());
-        reply.addExtension (new PongMessage (serverVersion));
+        auto pong = std::make_unique<PongMessage> (serverVersion);
+        pong->SetNonce (pongNonce.empty () ? ext->GetNonce () : pongNonce);
+        reply.addExtension (pong.release ());
 
         RunWithClient ([&reply] (gloox::Client& c)
           {
@@ -133,6 +138,9 @@ protected:
   /** The version string to return by the server.  */
   std::string serverVersion = SERVER_VERSION;
 
+  /** If set, the server uses this nonce instead of echoing the ping's.  */
+  std::string pongNonce;
+
   ClientServerDiscoveryTests ()
     : XmppClient(JIDWithResource (GetTestAccount (accServer), SERVER_RES),
                  GetTestAccount (accServer).password),
@@ -185,6 +193,13 @@ TEST_F (ClientServerDiscoveryTests, VersionMismatch)
   EXPECT_EQ (client.GetServerResource (), "");
 }
 
+TEST_F (ClientServerDiscoveryTests, StalePongIgnored)
+{
+  pongNonce = "stale";
+  client.SetTimeout (2 * PONG_DELAY);
+  EXPECT_EQ (client.GetServerResource (), "");
+}
+
 TEST_F (ClientServerDiscoveryTests, Timeout)
 {
   client.SetTimeout (PONG_DELAY / 2);
@@ -272,7 +287,8 @@ TEST_F (ClientServerDiscoveryTests, ConnectionFailure)
 
 /**
  * RpcServer that uses TestBackend, but applies a configurable delay on top
- * of it (i.e. delays responding to methods).
+ * of it (i.e. delays responding to methods).  It can also be told to reject
+ * a number of calls as busy.
  */
 class DelayedTestBackend : public TestBackend
 {
@@ -282,12 +298,21 @@ private:
   /** The delay for each method call.  */
   std::chrono::milliseconds delay;
 
+  /** Number of upcoming calls that will be rejected as busy.  */
+  std::atomic<unsigned> busyCalls;
+
 public:
 
   DelayedTestBackend ()
-    : delay(0)
+    : delay(0), busyCalls(0)
   {}
 
+  void
+  SetBusyCalls (const unsigned n)
+  {
+    busyCalls = n;
+  }
+
   template <typename Rep, typename Period>
     void
     SetDelay (const std::chrono::duration<Rep, Period>& d)
@@ -299,6 +324,13 @@ public:
   HandleMethod (const std::string& method, const Json::Value& params) override
   {
     std::this_thread::sleep_for (delay);
+
+    if (busyCalls > 0)
+      {
+        --busyCalls;
+        throw Error (RpcServer::ERROR_BUSY, "busy");
+      }
+
     return TestBackend::HandleMethod (method, params);
   }
 
@@ -378,6 +410,17 @@ TEST_F (ClientRpcForwardingTests, CallSuccess)
   EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["foo"])")), "foo");
 }
 
+TEST_F (ClientRpcForwardingTests, RawCall)
+{
+  auto srv = ConnectServer ();
+
+  RawJson params;
+  ASSERT_TRUE (RawJson::FromText (R"( [ "foo" ] )", params));
+  const auto res = client.ForwardRawMethod ("echo", params);
+  EXPECT_EQ (res.GetText (), R"("foo")");
+  EXPECT_EQ (res.GetValue (), "foo");
+}
+
 TEST_F (ClientRpcForwardingTests, CallError)
 {
   auto srv = ConnectServer ();
@@ -401,6 +444,52 @@ TEST_F (ClientRpcForwardingTests, CallTimeout)
                 RpcServer::Error);
 }
 
+TEST_F (ClientRpcForwardingTests, PerCallTimeout)
+{
+  auto srv = ConnectServer ();
+  client.SetTimeout (std::chrono::seconds (1));
+  backend.SetDelay (std::chrono::milliseconds (100));
+
+  /* Make sure the server is discovered already, so that the short timeout
+     is not used up by that.  */
+  ASSERT_NE (client.GetServerResource (), "");
+
+  EXPECT_THROW (client.ForwardMethod ("echo", ParseJson (R"(["foo"])"),
+                                      std::chrono::milliseconds (10)),
+                RpcServer::Error);
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["bar"])"),
+                                   std::chrono::milliseconds (500)),
+             "bar");
+
+  /* The server did not send the late response for the first call, since
+     the client cancelled it when giving up.  */
+  EXPECT_EQ (srv->GetNumCancelledCalls (), 1);
+}
+
+TEST_F (ClientRpcForwardingTests, RetriedWhenBusy)
+{
+  auto srv = ConnectServer ();
+  backend.SetBusyCalls (2);
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["foo"])")), "foo");
+}
+
+TEST_F (ClientRpcForwardingTests, AlwaysBusy)
+{
+  auto srv = ConnectServer ();
+  backend.SetBusyCalls (10);
+
+  try
+    {
+      client.ForwardMethod ("echo", ParseJson (R"(["foo"])"));
+      FAIL () << "Expected error not thrown";
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (INFO) << "Caught expected error: " << exc.what ();
+      EXPECT_EQ (exc.GetCode (), RpcServer::ERROR_BUSY);
+    }
+}
+
 TEST_F (ClientRpcForwardingTests, Reconnect)
 {
   client.Disconnect ();
@@ -430,6 +519,190 @@ TEST_F (ClientRpcForwardingTests, MultipleThreads)
     t.join ();
 }
 
+TEST_F (ClientRpcForwardingTests, AsyncFutures)
+{
+  auto srv = ConnectServer ();
+
+  /* All calls are started from this thread without waiting for any
+     of them, so they are all in flight at the same time.  */
+  constexpr unsigned n = 200;
+  std::vector<std::future<RawJson>> results;
+  for (unsigned i = 0; i < n; ++i)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append ("value " + std::to_string (i));
+      results.push_back (client.ForwardMethodAsync ("echo", params));
+    }
+
+  for (unsigned i = 0; i < n; ++i)
+    EXPECT_EQ (results[i].get ().GetValue (), "value " + std::to_string (i));
+}
+
+TEST_F (ClientRpcForwardingTests, AsyncFutureError)
+{
+  auto srv = ConnectServer ();
+  auto res = client.ForwardMethodAsync ("error", ParseJson (R"(["foo"])"));
+  EXPECT_THROW (res.get (), RpcServer::Error);
+}
+
+TEST_F (ClientRpcForwardingTests, AsyncCompletion)
+{
+  auto srv = ConnectServer ();
+
+  std::mutex mut;
+  std::condition_variable cv;
+  unsigned done = 0;
+  Json::Value result;
+  int errorCode = 0;
+
+  client.ForwardMethodAsync ("echo", ParseJson (R"(["foo"])"),
+                             [&] (const RpcResult& r)
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      EXPECT_TRUE (r.IsSuccess ());
+      result = r.GetResult ();
+      ++done;
+      cv.notify_all ();
+    });
+  client.ForwardMethodAsync ("error", ParseJson (R"(["bar"])"),
+                             [&] (const RpcResult& r)
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      EXPECT_FALSE (r.IsSuccess ());
+      errorCode = r.GetErrorCode ();
+      ++done;
+      cv.notify_all ();
+    });
+
+  std::unique_lock<std::mutex> lock(mut);
+  while (done < 2)
+    cv.wait (lock);
+
+  EXPECT_EQ (result, "foo");
+  EXPECT_EQ (errorCode, 42);
+}
+
+TEST_F (ClientRpcForwardingTests, AsyncTimeout)
+{
+  auto srv = ConnectServer ();
+  backend.SetDelay (std::chrono::milliseconds (100));
+  ASSERT_NE (client.GetServerResource (), "");
+
+  auto res = client.ForwardMethodAsync ("echo", ParseJson (R"(["foo"])"),
+                                        std::chrono::milliseconds (10));
+  ASSERT_EQ (res.wait_for (std::chrono::milliseconds (50)),
+             std::future_status::ready);
+  EXPECT_THROW (res.get (), RpcServer::Error);
+}
+
+TEST_F (ClientRpcForwardingTests, SlotsReusedAfterTimeout)
+{
+  auto srv = ConnectServer ();
+  ASSERT_NE (client.GetServerResource (), "");
+
+  /* Let a batch of calls time out, and then make more calls (which reuse
+     the slots of the timed-out ones) while their late responses may
+     still come in.  Each call must get its own result.  */
+  constexpr unsigned n = 20;
+  backend.SetDelay (std::chrono::milliseconds (50));
+  std::vector<std::future<RawJson>> results;
+  for (unsigned i = 0; i < n; ++i)
+    results.push_back (client.ForwardMethodAsync (
+        "echo", ParseJson (R"(["timeout"])"), std::chrono::milliseconds (10)));
+  for (auto& r : results)
+    EXPECT_THROW (r.get (), RpcServer::Error);
+
+  backend.SetDelay (std::chrono::milliseconds (0));
+  results.clear ();
+  for (unsigned i = 0; i < n; ++i)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append ("value " + std::to_string (i));
+      results.push_back (client.ForwardMethodAsync ("echo", params));
+    }
+  for (unsigned i = 0; i < n; ++i)
+    EXPECT_EQ (results[i].get ().GetValue (), "value " + std::to_string (i));
+}
+
+/**
+ * Constructs a batch call for the given method with a single string
+ * as params.
+ */
+Client::BatchCall
+MakeBatchCall (const std::string& method, const std::string& param)
+{
+  Json::Value params(Json::arrayValue);
+  params.append (param);
+
+  Client::BatchCall res;
+  res.method = method;
+  res.params = RawJson (params);
+
+  return res;
+}
+
+TEST_F (ClientRpcForwardingTests, Batch)
+{
+  auto srv = ConnectServer ();
+
+  const auto res = client.ForwardBatch (
+    {
+      MakeBatchCall ("echo", "foo"),
+      MakeBatchCall ("error", "bar"),
+      MakeBatchCall ("echo", "baz"),
+    });
+
+  ASSERT_EQ (res.size (), 3);
+  ASSERT_TRUE (res[0].IsSuccess ());
+  EXPECT_EQ (res[0].GetResult (), "foo");
+  ASSERT_FALSE (res[1].IsSuccess ());
+  EXPECT_EQ (res[1].GetErrorCode (), 42);
+  ASSERT_TRUE (res[2].IsSuccess ());
+  EXPECT_EQ (res[2].GetResult (), "baz");
+
+  EXPECT_TRUE (client.ForwardBatch ({}).empty ());
+}
+
+TEST_F (ClientRpcForwardingTests, BatchSplitForServer)
+{
+  auto srv = ConnectServer ();
+
+  /* This is more than the server supports in a single batch, so that it
+     has to be split up.  */
+  constexpr unsigned n = 250;
+  std::vector<Client::BatchCall> calls;
+  for (unsigned i = 0; i < n; ++i)
+    calls.push_back (MakeBatchCall ("echo", "value " + std::to_string (i)));
+
+  const auto res = client.ForwardBatch (calls);
+  ASSERT_EQ (res.size (), n);
+  for (unsigned i = 0; i < n; ++i)
+    {
+      ASSERT_TRUE (res[i].IsSuccess ());
+      EXPECT_EQ (res[i].GetResult (), "value " + std::to_string (i));
+    }
+}
+
+TEST_F (ClientRpcForwardingTests, BatchTimeout)
+{
+  auto srv = ConnectServer ();
+  backend.SetDelay (std::chrono::milliseconds (100));
+  ASSERT_NE (client.GetServerResource (), "");
+
+  const auto res = client.ForwardBatch (
+    {
+      MakeBatchCall ("echo", "foo"),
+      MakeBatchCall ("echo", "bar"),
+    }, std::chrono::milliseconds (10));
+
+  ASSERT_EQ (res.size (), 2);
+  for (const auto& r : res)
+    {
+      ASSERT_FALSE (r.IsSuccess ());
+      EXPECT_EQ (r.GetErrorCode (), jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR);
+    }
+}
+
 TEST_F (ClientRpcForwardingTests, ServerReselection)
 {
   /* Start by connecting a server instance and making a call to it, which
@@ -463,6 +736,66 @@ TEST_F (ClientRpcForwardingTests, ServerReselectionNotAvailable)
                 RpcServer::Error);
 }
 
+/**
+ * ServerSelector that prefers a fixed resource whenever it is among
+ * the candidates, and otherwise keeps the current choice.
+ */
+class FixedResourceSelector : public ServerSelector
+{
+
+private:
+
+  /** The preferred resource.  */
+  const std::string preferred;
+
+public:
+
+  explicit FixedResourceSelector (const std::string& p)
+    : preferred(p)
+  {}
+
+  std::string
+  SelectServer (const std::vector<ServerStats>& candidates,
+                const std::string& current) override
+  {
+    for (const auto& c : candidates)
+      if (c.resource == preferred)
+        return preferred;
+
+    if (current.empty ())
+      return candidates.front ().resource;
+    return current;
+  }
+
+};
+
+TEST_F (ClientRpcForwardingTests, CustomSelector)
+{
+  client.SetServerSelector (std::make_unique<FixedResourceSelector> ("b"));
+  client.SetPongWindow (std::chrono::milliseconds (500));
+
+  auto s1 = ConnectServer ("a");
+  auto s2 = ConnectServer ("b");
+
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["foo"])")), "foo");
+  EXPECT_EQ (client.GetServerResource (), "b");
+}
+
+TEST_F (ClientRpcForwardingTests, PeriodicReselection)
+{
+  auto s1 = ConnectServer ("a");
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["foo"])")), "foo");
+  EXPECT_EQ (client.GetServerResource (), "a");
+
+  auto s2 = ConnectServer ("b");
+  client.SetServerSelector (std::make_unique<FixedResourceSelector> ("b"));
+  client.EnableReselection (std::chrono::milliseconds (100));
+
+  std::this_thread::sleep_for (std::chrono::milliseconds (500));
+  EXPECT_EQ (client.GetServerResource (), "b");
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["bar"])")), "bar");
+}
+
 /* ************************************************************************** */
 
 /**
@@ -704,6 +1037,74 @@ TEST_F (ClientNotificationTests, Reconnect)
   w->Expect ("a", "value");
 }
 
+TEST_F (ClientNotificationTests, CachedResults)
+{
+  client.EnableCache (10);
+  ConnectClient ({"foo"});
+
+  auto s = ConnectServer ();
+  s->AddPubSub (GetServerConfig ().pubsub);
+
+  auto upd = UpdatableState::Create ();
+  s->AddNotification (upd->NewWaiter ("foo"));
+
+  client.GetServerResource ();
+
+  /* Without any state received, results are not cached yet.  */
+  const auto params = ParseJson (R"(["foo"])");
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+
+  auto w = CallWaitForChange ("foo", "");
+  upd->SetState ("a", "first");
+  w->Expect ("a", "first");
+
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (client.ForwardMethod ("echo", ParseJson (R"(["bar"])")), "bar");
+  EXPECT_EQ (backend.GetNumCalls (), 4);
+
+  w = CallWaitForChange ("foo", "a");
+  upd->SetState ("b", "second");
+  w->Expect ("b", "second");
+
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (backend.GetNumCalls (), 5);
+}
+
+TEST_F (ClientNotificationTests, CacheResetOnReconnect)
+{
+  client.EnableCache (10);
+  ConnectClient ({"foo"});
+
+  auto s = ConnectServer ();
+  s->AddPubSub (GetServerConfig ().pubsub);
+
+  auto upd = UpdatableState::Create ();
+  s->AddNotification (upd->NewWaiter ("foo"));
+
+  client.GetServerResource ();
+
+  auto w = CallWaitForChange ("foo", "");
+  upd->SetState ("a", "first");
+  w->Expect ("a", "first");
+
+  const auto params = ParseJson (R"(["foo"])");
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (backend.GetNumCalls (), 1);
+
+  /* After reconnecting, we may have missed updates, so the cache must
+     be flushed.  */
+  client.Disconnect ();
+  client.Connect ();
+  client.GetServerResource ();
+
+  EXPECT_EQ (client.ForwardMethod ("echo", params), "foo");
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
 TEST_F (ClientNotificationTests, TwoNotifications)
 {
   ConnectClient ({"foo", "bar"});
@@ -0,0 +1,118 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/concurrencylimit.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace charon
+{
+
+namespace
+{
+
+/**
+ * Calls slower than this multiple of the baseline latency (plus the slack
+ * below) are taken as a sign of congestion.
+ */
+constexpr double LATENCY_TOLERANCE = 2.0;
+
+/**
+ * Absolute slack on top of the latency tolerance in milliseconds, so that
+ * jitter of very fast calls does not count as congestion.
+ */
+constexpr double LATENCY_SLACK_MS = 1.0;
+
+/** Factor by which the limit is reduced on congestion.  */
+constexpr double DECREASE_FACTOR = 0.9;
+
+/**
+ * Weight with which the baseline moves towards slower samples.  This lets
+ * the baseline recover if the backend becomes slower in general (e.g.
+ * during block processing), so that we do not keep reducing the limit.
+ */
+constexpr double BASELINE_DRIFT = 0.01;
+
+} // anonymous namespace
+
+ConcurrencyLimit::ConcurrencyLimit (const unsigned minL, const unsigned maxL)
+  : minLimit(minL), maxLimit(maxL), limit(minL)
+{
+  CHECK_GT (minLimit, 0);
+  CHECK_LE (minLimit, maxLimit);
+}
+
+unsigned
+ConcurrencyLimit::Update (const double latencyMs, const unsigned inFlight,
+                          const bool overloaded)
+{
+  CHECK_GE (latencyMs, 0.0);
+
+  std::lock_guard<std::mutex> lock(mut);
+  ++samplesSinceDecrease;
+
+  bool congested = overloaded;
+  if (!overloaded)
+    {
+      if (baseline < 0.0 || latencyMs < baseline)
+        baseline = latencyMs;
+      else
+        baseline += BASELINE_DRIFT * (latencyMs - baseline);
+
+      congested = latencyMs > LATENCY_TOLERANCE * baseline + LATENCY_SLACK_MS;
+    }
+
+  if (congested)
+    {
+      /* Calls finishing right after a decrease were started with the
+         old limit, so we only decrease again once a full round of calls
+         has completed under the new one.  */
+      if (samplesSinceDecrease >= GetLimitInternal ())
+        {
+          limit = std::max<double> (minLimit, limit * DECREASE_FACTOR);
+          samplesSinceDecrease = 0;
+          VLOG (1) << "Decreased concurrency limit to " << limit;
+        }
+    }
+  else if (inFlight >= GetLimitInternal ())
+    {
+      /* Only increase the limit if it is actually in use.  Otherwise it
+         would grow without bounds while the load is low.  */
+      limit = std::min<double> (maxLimit, limit + 1.0 / limit);
+    }
+
+  return GetLimitInternal ();
+}
+
+unsigned
+ConcurrencyLimit::GetLimitInternal () const
+{
+  return static_cast<unsigned> (std::floor (limit));
+}
+
+unsigned
+ConcurrencyLimit::GetLimit () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return GetLimitInternal ();
+}
+
+} // namespace charon
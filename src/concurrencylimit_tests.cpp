@@ -0,0 +1,108 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/concurrencylimit.hpp"
+
+#include <gtest/gtest.h>
+
+namespace charon
+{
+namespace
+{
+
+using ConcurrencyLimitTests = testing::Test;
+
+TEST_F (ConcurrencyLimitTests, StartsAtMinimum)
+{
+  ConcurrencyLimit l(2, 10);
+  EXPECT_EQ (l.GetLimit (), 2);
+}
+
+TEST_F (ConcurrencyLimitTests, IncreasesWhenUsed)
+{
+  ConcurrencyLimit l(1, 10);
+
+  /* With the limit used up and steady latency, it is raised by one
+     per round of calls (i.e. by 1/limit per call).  */
+  EXPECT_EQ (l.Update (10.0, 1, false), 2);
+  EXPECT_EQ (l.Update (10.0, 2, false), 2);
+  EXPECT_EQ (l.Update (10.0, 2, false), 2);
+  EXPECT_EQ (l.Update (10.0, 2, false), 3);
+}
+
+TEST_F (ConcurrencyLimitTests, NoIncreaseWhenUnused)
+{
+  ConcurrencyLimit l(2, 10);
+  for (unsigned i = 0; i < 100; ++i)
+    l.Update (10.0, 1, false);
+  EXPECT_EQ (l.GetLimit (), 2);
+}
+
+TEST_F (ConcurrencyLimitTests, BoundedByMaximum)
+{
+  ConcurrencyLimit l(1, 5);
+  for (unsigned i = 0; i < 1000; ++i)
+    l.Update (10.0, 5, false);
+  EXPECT_EQ (l.GetLimit (), 5);
+}
+
+TEST_F (ConcurrencyLimitTests, DecreasesOnHighLatency)
+{
+  ConcurrencyLimit l(1, 100);
+  while (l.GetLimit () < 50)
+    l.Update (10.0, 100, false);
+
+  /* Latency way above the baseline reduces the limit, but only once
+     per round of calls.  */
+  EXPECT_EQ (l.Update (100.0, 50, false), 45);
+  for (unsigned i = 0; i < 44; ++i)
+    EXPECT_EQ (l.Update (100.0, 50, false), 45);
+  EXPECT_EQ (l.Update (100.0, 50, false), 40);
+}
+
+TEST_F (ConcurrencyLimitTests, DecreasesWhenOverloaded)
+{
+  ConcurrencyLimit l(1, 100);
+  while (l.GetLimit () < 20)
+    l.Update (10.0, 100, false);
+
+  EXPECT_EQ (l.Update (0.0, 20, true), 18);
+}
+
+TEST_F (ConcurrencyLimitTests, BoundedByMinimum)
+{
+  ConcurrencyLimit l(3, 100);
+  l.Update (10.0, 1, false);
+  for (unsigned i = 0; i < 100; ++i)
+    l.Update (0.0, 3, true);
+  EXPECT_EQ (l.GetLimit (), 3);
+}
+
+TEST_F (ConcurrencyLimitTests, SmallJitterIsNoCongestion)
+{
+  ConcurrencyLimit l(1, 10);
+
+  /* Very fast calls may vary by more than the relative tolerance, but
+     that is within the absolute slack.  */
+  for (unsigned i = 0; i < 100; ++i)
+    l.Update (i % 2 == 0 ? 0.1 : 0.5, 10, false);
+  EXPECT_EQ (l.GetLimit (), 10);
+}
+
+} // anonymous namespace
+} // namespace charon
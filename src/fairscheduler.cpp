@@ -0,0 +1,168 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/fairscheduler.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace charon
+{
+
+FairScheduler::FairScheduler (const unsigned maxAct, const size_t maxQueue)
+  : maxActive(maxAct), maxQueued(maxQueue)
+{
+  CHECK_GT (maxActive, 0);
+}
+
+bool
+FairScheduler::Submit (const std::string& flow, const double cost, Job j)
+{
+  CHECK_GE (cost, 0.0);
+
+  std::unique_lock<std::mutex> lock(mut);
+
+  /* While another thread is starting queued jobs, there may temporarily
+     be free slots even though the queue is not empty.  New jobs must not
+     overtake the queued ones in that case.  */
+  const bool mustQueue = (active >= maxActive || !queue.empty ());
+  if (mustQueue && queue.size () >= maxQueued)
+    return false;
+
+  double start = virtualTime;
+  const auto mit = lastFinish.find (flow);
+  if (mit != lastFinish.end ())
+    start = std::max (start, mit->second);
+  lastFinish[flow] = start + cost;
+
+  if (mustQueue)
+    {
+      queue.push ({start, nextSeq++, std::move (j)});
+      RunQueued (lock);
+      return true;
+    }
+
+  /* The job can be started right away.  It is now the one "in service",
+     so the virtual time advances to its start.  */
+  virtualTime = start;
+  ++active;
+  lock.unlock ();
+
+  j ();
+  return true;
+}
+
+void
+FairScheduler::Done ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  CHECK_GT (active, 0);
+  --active;
+
+  /* When idle, there is no backlog of any flow anymore.  */
+  if (active == 0 && queue.empty ())
+    lastFinish.clear ();
+
+  RunQueued (lock);
+}
+
+void
+FairScheduler::RunQueued (std::unique_lock<std::mutex>& lock)
+{
+  /* Jobs may call Done synchronously (e.g. if they are aborted already
+     before doing any work).  If we started the next job from there, each
+     such job would add to the stack, and a long backlog of them could
+     overflow it.  Instead, only one invocation starts jobs at any time
+     and loops until no more can be started; others just return, and their
+     freed slots are picked up by the loop.  */
+  if (draining)
+    return;
+  draining = true;
+
+  while (active < maxActive && !queue.empty ())
+    {
+      /* std::priority_queue::top only gives const access, but we are about
+         to pop the element anyway, so moving the job out is fine.  */
+      auto& top = const_cast<QueuedJob&> (queue.top ());
+      virtualTime = top.start;
+      Job next = std::move (top.job);
+      queue.pop ();
+      ++active;
+
+      PruneFlows ();
+
+      lock.unlock ();
+      try
+        {
+          next ();
+        }
+      catch (...)
+        {
+          lock.lock ();
+          draining = false;
+          throw;
+        }
+      lock.lock ();
+    }
+
+  draining = false;
+}
+
+void
+FairScheduler::PruneFlows ()
+{
+  for (auto it = lastFinish.begin (); it != lastFinish.end (); )
+    if (it->second <= virtualTime)
+      it = lastFinish.erase (it);
+    else
+      ++it;
+}
+
+void
+FairScheduler::SetMaxActive (const unsigned n)
+{
+  CHECK_GT (n, 0);
+
+  std::unique_lock<std::mutex> lock(mut);
+  maxActive = n;
+  RunQueued (lock);
+}
+
+unsigned
+FairScheduler::GetMaxActive () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return maxActive;
+}
+
+unsigned
+FairScheduler::GetNumActive () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return active;
+}
+
+size_t
+FairScheduler::GetQueueSize () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return queue.size ();
+}
+
+} // namespace charon
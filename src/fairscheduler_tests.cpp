@@ -0,0 +1,210 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/fairscheduler.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+using testing::ElementsAre;
+
+class FairSchedulerTests : public testing::Test
+{
+
+protected:
+
+  /** Names of the jobs that have been started, in order.  */
+  std::vector<std::string> started;
+
+  /**
+   * Submits a job that just records its name when started.
+   */
+  bool
+  Submit (FairScheduler& s, const std::string& flow, const double cost,
+          const std::string& name)
+  {
+    return s.Submit (flow, cost, [this, name] ()
+      {
+        started.push_back (name);
+      });
+  }
+
+};
+
+TEST_F (FairSchedulerTests, RunsImmediatelyIfPossible)
+{
+  FairScheduler s(2, 10);
+
+  ASSERT_TRUE (Submit (s, "a", 1.0, "first"));
+  ASSERT_TRUE (Submit (s, "a", 1.0, "second"));
+  ASSERT_TRUE (Submit (s, "a", 1.0, "third"));
+  EXPECT_THAT (started, ElementsAre ("first", "second"));
+  EXPECT_EQ (s.GetQueueSize (), 1);
+
+  s.Done ();
+  EXPECT_THAT (started, ElementsAre ("first", "second", "third"));
+  EXPECT_EQ (s.GetQueueSize (), 0);
+
+  s.Done ();
+  s.Done ();
+}
+
+TEST_F (FairSchedulerTests, QueueFull)
+{
+  FairScheduler s(1, 1);
+
+  ASSERT_TRUE (Submit (s, "a", 1.0, "running"));
+  ASSERT_TRUE (Submit (s, "a", 1.0, "queued"));
+  EXPECT_FALSE (Submit (s, "b", 1.0, "rejected"));
+
+  s.Done ();
+  s.Done ();
+  EXPECT_THAT (started, ElementsAre ("running", "queued"));
+}
+
+TEST_F (FairSchedulerTests, FlowsAreInterleaved)
+{
+  FairScheduler s(1, 100);
+
+  ASSERT_TRUE (Submit (s, "a", 1.0, "a0"));
+  for (const std::string name : {"a1", "a2", "a3"})
+    ASSERT_TRUE (Submit (s, "a", 1.0, name));
+  for (const std::string name : {"b1", "b2"})
+    ASSERT_TRUE (Submit (s, "b", 1.0, name));
+
+  for (unsigned i = 0; i < 6; ++i)
+    s.Done ();
+
+  EXPECT_THAT (started, ElementsAre ("a0", "b1", "a1", "b2", "a2", "a3"));
+}
+
+TEST_F (FairSchedulerTests, ExpensiveJobsGetLessTurns)
+{
+  FairScheduler s(1, 100);
+
+  ASSERT_TRUE (Submit (s, "c", 1.0, "blocker"));
+  ASSERT_TRUE (Submit (s, "heavy", 10.0, "h1"));
+  ASSERT_TRUE (Submit (s, "heavy", 10.0, "h2"));
+  for (const std::string name : {"l1", "l2", "l3"})
+    ASSERT_TRUE (Submit (s, "light", 1.0, name));
+
+  for (unsigned i = 0; i < 6; ++i)
+    s.Done ();
+
+  EXPECT_THAT (started,
+               ElementsAre ("blocker", "h1", "l1", "l2", "l3", "h2"));
+}
+
+TEST_F (FairSchedulerTests, IdleResetsShares)
+{
+  FairScheduler s(1, 100);
+
+  /* Flow "a" uses a lot before the scheduler becomes idle.  */
+  ASSERT_TRUE (Submit (s, "a", 100.0, "a1"));
+  s.Done ();
+
+  /* Afterwards, it competes on equal terms with "b" again.  */
+  ASSERT_TRUE (Submit (s, "c", 1.0, "blocker"));
+  ASSERT_TRUE (Submit (s, "a", 1.0, "a2"));
+  ASSERT_TRUE (Submit (s, "b", 1.0, "b1"));
+
+  for (unsigned i = 0; i < 3; ++i)
+    s.Done ();
+
+  EXPECT_THAT (started, ElementsAre ("a1", "blocker", "a2", "b1"));
+}
+
+TEST_F (FairSchedulerTests, RaisingLimitStartsQueued)
+{
+  FairScheduler s(1, 100);
+
+  for (const std::string name : {"first", "second", "third", "fourth"})
+    ASSERT_TRUE (Submit (s, "a", 1.0, name));
+  EXPECT_THAT (started, ElementsAre ("first"));
+
+  s.SetMaxActive (3);
+  EXPECT_THAT (started, ElementsAre ("first", "second", "third"));
+  EXPECT_EQ (s.GetNumActive (), 3);
+  EXPECT_EQ (s.GetQueueSize (), 1);
+
+  for (unsigned i = 0; i < 4; ++i)
+    s.Done ();
+  EXPECT_EQ (s.GetNumActive (), 0);
+}
+
+TEST_F (FairSchedulerTests, LoweringLimitDrainsRunning)
+{
+  FairScheduler s(3, 100);
+
+  for (const std::string name : {"a", "b", "c", "d", "e"})
+    ASSERT_TRUE (Submit (s, "a", 1.0, name));
+  EXPECT_THAT (started, ElementsAre ("a", "b", "c"));
+
+  /* With the lowered limit, the next job only starts once the number
+     of running jobs has dropped below it.  */
+  s.SetMaxActive (1);
+  s.Done ();
+  EXPECT_EQ (s.GetNumActive (), 2);
+  s.Done ();
+  EXPECT_EQ (s.GetNumActive (), 1);
+  EXPECT_THAT (started, ElementsAre ("a", "b", "c"));
+
+  s.Done ();
+  EXPECT_THAT (started, ElementsAre ("a", "b", "c", "d"));
+  EXPECT_EQ (s.GetNumActive (), 1);
+  EXPECT_EQ (s.GetMaxActive (), 1);
+
+  s.Done ();
+  s.Done ();
+  EXPECT_EQ (s.GetNumActive (), 0);
+}
+
+TEST_F (FairSchedulerTests, ManyJobsFinishingSynchronously)
+{
+  /* Jobs that are done right away (e.g. because the call has been aborted
+     already) call Done while they are being started.  This must not
+     recurse, or a long queue of them would overflow the stack.  */
+  constexpr unsigned n = 100000;
+  FairScheduler s(1, n);
+
+  ASSERT_TRUE (Submit (s, "a", 1.0, "blocker"));
+  unsigned finished = 0;
+  for (unsigned i = 0; i < n; ++i)
+    ASSERT_TRUE (s.Submit (i % 2 == 0 ? "a" : "b", 1.0, [&s, &finished] ()
+      {
+        ++finished;
+        s.Done ();
+      }));
+  EXPECT_EQ (s.GetQueueSize (), n);
+
+  s.Done ();
+  EXPECT_EQ (finished, n);
+  EXPECT_EQ (s.GetQueueSize (), 0);
+  EXPECT_EQ (s.GetNumActive (), 0);
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,78 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "inprocess.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+
+#include <glog/logging.h>
+
+#include <sstream>
+
+namespace charon
+{
+
+void
+InProcessRpcServer::AddMethod (const std::string& method, const Handler& h)
+{
+  const auto ins = handlers.emplace (method, h);
+  CHECK (ins.second) << "Method " << method << " has already been added";
+}
+
+Json::Value
+InProcessRpcServer::HandleMethod (const std::string& method,
+                                  const Json::Value& params)
+{
+  VLOG (1) << "In-process call to " << method;
+  VLOG (2) << "Parameters: " << params;
+
+  const auto mit = handlers.find (method);
+  if (mit == handlers.end ())
+    {
+      std::ostringstream msg;
+      msg << "method not found or not allowed: " << method;
+      throw Error (jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND, msg.str ());
+    }
+
+  return mit->second (params);
+}
+
+/* ************************************************************************** */
+
+InProcessUpdateWaiter::InProcessUpdateWaiter (const WaitFunction& w)
+  : wait(w)
+{}
+
+bool
+InProcessUpdateWaiter::WaitForUpdate (Json::Value& newState)
+{
+  VLOG (1) << "Waiting for in-process update...";
+
+  try
+    {
+      newState = wait ();
+      return true;
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (WARNING) << "Waiting for update returned error: " << exc.what ();
+      return false;
+    }
+}
+
+} // namespace charon
@@ -0,0 +1,124 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_INPROCESS_HPP
+#define CHARON_INPROCESS_HPP
+
+#include "rpcserver.hpp"
+#include "waiterthread.hpp"
+
+#include <json/json.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace charon
+{
+
+/**
+ * Implementation of RpcServer that answers calls by invoking handler
+ * functions directly in the same process, rather than forwarding them
+ * to a backend over the network.  This is meant for running the Charon
+ * server in the same process as the GSP (e.g. a game based on
+ * libxayagame), where it avoids the JSON serialisation, the HTTP framing
+ * and the TCP round trip of ForwardingRpcServer for each call.
+ *
+ * Handlers are registered per method, and calls to all other methods are
+ * answered with "method not found".  Typically the handlers just call
+ * the corresponding methods on the game object, for instance:
+ *
+ *   InProcessRpcServer rpc;
+ *   rpc.AddMethod ("getcurrentstate", [&game] (const Json::Value& params)
+ *     {
+ *       return game.GetCurrentJsonState ();
+ *     });
+ *
+ * Handlers signal errors by throwing RpcServer::Error.  They may be called
+ * concurrently from multiple threads (once all methods have been added),
+ * so must be thread-safe.
+ */
+class InProcessRpcServer : public RpcServer
+{
+
+public:
+
+  /** Type of handler functions for methods.  */
+  using Handler = std::function<Json::Value (const Json::Value& params)>;
+
+private:
+
+  /** The registered handlers by method name.  */
+  std::map<std::string, Handler> handlers;
+
+public:
+
+  InProcessRpcServer () = default;
+
+  InProcessRpcServer (const InProcessRpcServer&) = delete;
+  void operator= (const InProcessRpcServer&) = delete;
+
+  /**
+   * Registers the handler for the given method.
+   */
+  void AddMethod (const std::string& method, const Handler& h);
+
+  Json::Value HandleMethod (const std::string& method,
+                            const Json::Value& params) override;
+
+};
+
+/**
+ * Implementation of UpdateWaiter that waits for updates by calling a
+ * blocking function in the same process, e.g. one that waits for a change
+ * of the game state in libxayagame and returns the new state.  This is
+ * the in-process counterpart to RpcUpdateWaiter.
+ */
+class InProcessUpdateWaiter : public UpdateWaiter
+{
+
+public:
+
+  /**
+   * Type of the function called to wait for an update.  It should block
+   * until there may be an update and then return the new state (or JSON
+   * null if none is available), like the long-polling RPC methods.
+   * It may throw RpcServer::Error, in which case the call is retried.
+   */
+  using WaitFunction = std::function<Json::Value ()>;
+
+private:
+
+  /** The function we call.  */
+  const WaitFunction wait;
+
+public:
+
+  explicit InProcessUpdateWaiter (const WaitFunction& w);
+
+  InProcessUpdateWaiter () = delete;
+  InProcessUpdateWaiter (const InProcessUpdateWaiter&) = delete;
+  void operator= (const InProcessUpdateWaiter&) = delete;
+
+  bool WaitForUpdate (Json::Value& newState) override;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_INPROCESS_HPP
@@ -0,0 +1,123 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "inprocess.hpp"
+
+#include "testutils.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+namespace charon
+{
+namespace
+{
+
+/* ************************************************************************** */
+
+class InProcessRpcServerTests : public testing::Test
+{
+
+protected:
+
+  InProcessRpcServer server;
+
+  InProcessRpcServerTests ()
+  {
+    server.AddMethod ("echo", [] (const Json::Value& params)
+      {
+        return params[0];
+      });
+    server.AddMethod ("error", [] (const Json::Value& params)
+      {
+        throw RpcServer::Error (42, params[0].asString ());
+        return Json::Value ();
+      });
+  }
+
+};
+
+TEST_F (InProcessRpcServerTests, Success)
+{
+  EXPECT_EQ (server.HandleMethod ("echo", ParseJson ("[5]")), 5);
+}
+
+TEST_F (InProcessRpcServerTests, Error)
+{
+  try
+    {
+      server.HandleMethod ("error", ParseJson (R"(["foo"])"));
+      FAIL () << "Expected error not thrown";
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (INFO) << "Caught expected error: " << exc.what ();
+      EXPECT_EQ (exc.GetCode (), 42);
+      EXPECT_EQ (exc.GetMessage (), "foo");
+    }
+}
+
+TEST_F (InProcessRpcServerTests, MethodNotFound)
+{
+  try
+    {
+      server.HandleMethod ("foo", ParseJson ("[]"));
+      FAIL () << "Expected error not thrown";
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (INFO) << "Caught expected error: " << exc.what ();
+      EXPECT_EQ (exc.GetCode (), jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND);
+    }
+}
+
+/* ************************************************************************** */
+
+using InProcessUpdateWaiterTests = testing::Test;
+
+TEST_F (InProcessUpdateWaiterTests, Success)
+{
+  InProcessUpdateWaiter waiter([] ()
+    {
+      return ParseJson (R"({"foo": "bar"})");
+    });
+
+  Json::Value state;
+  ASSERT_TRUE (waiter.WaitForUpdate (state));
+  EXPECT_EQ (state, ParseJson (R"({"foo": "bar"})"));
+}
+
+TEST_F (InProcessUpdateWaiterTests, Error)
+{
+  InProcessUpdateWaiter waiter([] ()
+    {
+      throw RpcServer::Error (42, "error");
+      return Json::Value ();
+    });
+
+  Json::Value state;
+  EXPECT_FALSE (waiter.WaitForUpdate (state));
+}
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace charon
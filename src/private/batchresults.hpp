@@ -0,0 +1,81 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_BATCHRESULTS_HPP
+#define CHARON_BATCHRESULTS_HPP
+
+#include "rpcserver.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * Collects the results of a batch of calls that complete independently
+ * (and possibly concurrently from different threads), so that they can
+ * be passed on together in the original order once the last of them
+ * is in.  This is used for batch requests on both the client and the
+ * server side.  It is thread-safe.
+ */
+class BatchResults
+{
+
+private:
+
+  /** The results so far, with null for those still missing.  */
+  std::vector<std::unique_ptr<RpcResult>> results;
+
+  /** Number of results that are still missing.  */
+  size_t missing;
+
+  /** Mutex for the state.  */
+  mutable std::mutex mut;
+
+public:
+
+  /**
+   * Constructs an instance for a batch of n calls.
+   */
+  explicit BatchResults (size_t n);
+
+  BatchResults () = delete;
+  BatchResults (const BatchResults&) = delete;
+  void operator= (const BatchResults&) = delete;
+
+  /**
+   * Sets the result of the call with the given index, which must not have
+   * been set before.  Returns true if this was the last missing result,
+   * in which case the caller should retrieve and pass on all of them.
+   */
+  bool Set (size_t i, const RpcResult& res);
+
+  /**
+   * Returns the results in order.  Must only be called once all of them
+   * have been set.
+   */
+  std::vector<RpcResult> Get () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_BATCHRESULTS_HPP
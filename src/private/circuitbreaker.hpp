@@ -0,0 +1,94 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_CIRCUITBREAKER_HPP
+#define CHARON_CIRCUITBREAKER_HPP
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace charon
+{
+
+/**
+ * Circuit breaker that keeps track of the backend's health.  It is "closed"
+ * (i.e. calls can go through) while the backend is healthy, and "opens"
+ * when either an explicit health probe fails, or too many of the recent
+ * calls failed.  Once open, it only closes again when a health probe
+ * succeeds.
+ *
+ * This class only does the bookkeeping, and is thread-safe.
+ */
+class CircuitBreaker
+{
+
+private:
+
+  /** Number of recent calls taken into account for the failure rate.  */
+  const size_t windowSize;
+
+  /** Failure rate above which the breaker opens.  */
+  const double maxFailureRate;
+
+  /** Outcomes of the most recent calls (true for failures).  */
+  std::deque<bool> window;
+
+  /** Number of failures in the window.  */
+  size_t failures = 0;
+
+  /** Whether or not the breaker is open.  */
+  bool open = false;
+
+  /** Mutex for the state.  */
+  mutable std::mutex mut;
+
+public:
+
+  /**
+   * Constructs a closed breaker, which opens when more than the given
+   * fraction of the last w calls failed.
+   */
+  explicit CircuitBreaker (size_t w, double maxRate);
+
+  CircuitBreaker () = delete;
+  CircuitBreaker (const CircuitBreaker&) = delete;
+  void operator= (const CircuitBreaker&) = delete;
+
+  /**
+   * Records the outcome of an ordinary call.  Calls finishing while the
+   * breaker is open are ignored, since the probes decide about closing it.
+   */
+  void RecordCall (bool failed);
+
+  /**
+   * Records the outcome of a health probe.
+   */
+  void RecordProbe (bool healthy);
+
+  /**
+   * Returns true if the breaker is open, i.e. the backend is considered
+   * unhealthy right now.
+   */
+  bool IsOpen () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_CIRCUITBREAKER_HPP
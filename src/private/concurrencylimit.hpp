@@ -0,0 +1,98 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_CONCURRENCYLIMIT_HPP
+#define CHARON_CONCURRENCYLIMIT_HPP
+
+#include <mutex>
+
+namespace charon
+{
+
+/**
+ * Adaptive limit on the number of backend calls running at the same time.
+ * It is adjusted with additive increase / multiplicative decrease (AIMD)
+ * based on the observed call latencies:  The lowest latency seen recently
+ * is taken as baseline for an unloaded backend.  While calls finish not
+ * much slower than that and the limit is actually used up, it is raised
+ * by about one per round of calls.  When calls take much longer (i.e. they
+ * are queueing up inside the backend) or the backend reports that it is
+ * overloaded, the limit is reduced by a constant factor.
+ *
+ * This class only does the bookkeeping; enforcing the limit is up to
+ * the caller.  It is thread-safe.
+ */
+class ConcurrencyLimit
+{
+
+private:
+
+  /** Lower bound for the limit.  */
+  const unsigned minLimit;
+
+  /** Upper bound for the limit.  */
+  const unsigned maxLimit;
+
+  /** The current limit (fractional, for the additive increase).  */
+  double limit;
+
+  /** Baseline latency in milliseconds, or negative if not yet known.  */
+  double baseline = -1.0;
+
+  /** Number of samples seen since the last decrease of the limit.  */
+  unsigned samplesSinceDecrease = 0;
+
+  /** Mutex for the state.  */
+  mutable std::mutex mut;
+
+  /**
+   * Returns the current limit as integer.  Must be called with the
+   * lock held.
+   */
+  unsigned GetLimitInternal () const;
+
+public:
+
+  /**
+   * Constructs the limit, which starts at minL and stays between
+   * minL and maxL.
+   */
+  explicit ConcurrencyLimit (unsigned minL, unsigned maxL);
+
+  ConcurrencyLimit () = delete;
+  ConcurrencyLimit (const ConcurrencyLimit&) = delete;
+  void operator= (const ConcurrencyLimit&) = delete;
+
+  /**
+   * Records a finished call with the given latency.  inFlight is the
+   * number of calls that were running when it finished (including itself),
+   * and overloaded should be true if the backend rejected the call because
+   * of load.  Returns the updated limit.
+   */
+  unsigned Update (double latencyMs, unsigned inFlight, bool overloaded);
+
+  /**
+   * Returns the current limit.
+   */
+  unsigned GetLimit () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_CONCURRENCYLIMIT_HPP
@@ -0,0 +1,184 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_FAIRSCHEDULER_HPP
+#define CHARON_FAIRSCHEDULER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+
+namespace charon
+{
+
+/**
+ * Scheduler that limits the number of jobs running at the same time and
+ * queues the others, processing them in a fair order between "flows"
+ * (e.g. different clients of the server).  This uses start-time fair
+ * queueing:  Each job has an estimated cost, and each flow gets the same
+ * share of the total cost processed while it has jobs waiting, no matter
+ * how many jobs it has in the queue.
+ *
+ * Jobs are run on the thread calling Submit (if they can be started right
+ * away) or on one calling Done or SetMaxActive (when they are picked up
+ * from the queue).  They should thus just start some asynchronous
+ * processing and not block.  Jobs may call Done themselves before they
+ * return (e.g. if they have nothing to do).
+ */
+class FairScheduler
+{
+
+public:
+
+  /** Type of jobs being scheduled.  */
+  using Job = std::function<void ()>;
+
+private:
+
+  /** A job waiting in the queue.  */
+  struct QueuedJob
+  {
+
+    /** The virtual start time of the job.  */
+    double start;
+
+    /** Sequence number to make the order among equal start times FIFO.  */
+    uint64_t seq;
+
+    /** The job itself.  */
+    Job job;
+
+    /**
+     * Comparison for the priority queue, which puts the "largest" element
+     * first.  We want the smallest start time to be processed first.
+     */
+    friend bool
+    operator< (const QueuedJob& a, const QueuedJob& b)
+    {
+      if (a.start != b.start)
+        return a.start > b.start;
+      return a.seq > b.seq;
+    }
+
+  };
+
+  /**
+   * Maximum number of jobs running at the same time.  This may be changed
+   * while jobs are running; if it is lowered, running jobs are not affected
+   * but no new ones are started until we are below the limit again.
+   */
+  unsigned maxActive;
+
+  /** Maximum number of jobs waiting in the queue.  */
+  const size_t maxQueued;
+
+  /** Number of jobs currently running.  */
+  unsigned active = 0;
+
+  /** The queued jobs.  */
+  std::priority_queue<QueuedJob> queue;
+
+  /** The virtual time, i.e. the start time of the job last started.  */
+  double virtualTime = 0.0;
+
+  /**
+   * The virtual finish time of the last job submitted for each flow.
+   * Flows whose last job finishes before the current virtual time are
+   * removed, as they are equivalent to new flows.
+   */
+  std::map<std::string, double> lastFinish;
+
+  /** Next sequence number for queued jobs.  */
+  uint64_t nextSeq = 0;
+
+  /** Set while some thread is starting queued jobs in RunQueued.  */
+  bool draining = false;
+
+  /** Mutex for the state.  */
+  mutable std::mutex mut;
+
+  /**
+   * Removes flows from lastFinish that are not relevant anymore.
+   * Must be called with the lock held.
+   */
+  void PruneFlows ();
+
+  /**
+   * Starts queued jobs as long as the limit permits.  Must be called
+   * with the lock held, which is released while a job runs.  If another
+   * call (from a job started here or on another thread) is already doing
+   * this, then it returns right away.
+   */
+  void RunQueued (std::unique_lock<std::mutex>& lock);
+
+public:
+
+  /**
+   * Constructs a scheduler that runs at most the given number of jobs
+   * at the same time, and keeps at most maxQueue waiting.
+   */
+  explicit FairScheduler (unsigned maxAct, size_t maxQueue);
+
+  FairScheduler () = delete;
+  FairScheduler (const FairScheduler&) = delete;
+  void operator= (const FairScheduler&) = delete;
+
+  /**
+   * Submits a new job for the given flow and with the given estimated cost.
+   * It is started right away if possible, and queued otherwise.  Returns
+   * false (without taking the job) if the queue is full.
+   */
+  bool Submit (const std::string& flow, double cost, Job j);
+
+  /**
+   * Signals that one of the running jobs is done.  This starts the next
+   * job from the queue, if any.
+   */
+  void Done ();
+
+  /**
+   * Changes the maximum number of jobs running at the same time.  If it is
+   * raised, queued jobs are started right away (on the calling thread)
+   * as far as the new limit permits.
+   */
+  void SetMaxActive (unsigned n);
+
+  /**
+   * Returns the maximum number of jobs running at the same time.
+   */
+  unsigned GetMaxActive () const;
+
+  /**
+   * Returns the number of jobs currently running.
+   */
+  unsigned GetNumActive () const;
+
+  /**
+   * Returns the number of jobs waiting in the queue.
+   */
+  size_t GetQueueSize () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_FAIRSCHEDULER_HPP
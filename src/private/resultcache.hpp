@@ -0,0 +1,120 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_RESULTCACHE_HPP
+#define CHARON_RESULTCACHE_HPP
+
+#include "rawjson.hpp"
+
+#include <json/json.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace charon
+{
+
+/**
+ * Cache of successful RPC results (on the server or client), keyed by the
+ * method and its (canonicalised) params.  The cache is meant to be flushed
+ * whenever the backend state may have changed, e.g. on state notification
+ * updates.
+ *
+ * Each flush starts a new "generation".  Results are only inserted if no
+ * flush happened since the corresponding backend call was started, so that
+ * a call racing with a state change never puts an outdated result into
+ * the cache.
+ */
+class ResultCache
+{
+
+public:
+
+  /** Type for cache generations.  */
+  using Generation = uint64_t;
+
+private:
+
+  /** Maximum number of entries to keep.  */
+  const size_t maxEntries;
+
+  /** The cached results.  */
+  std::unordered_map<std::string, RawJson> entries;
+
+  /** The current generation.  */
+  Generation generation = 0;
+
+  /** Number of lookups that were answered from the cache.  */
+  uint64_t hits = 0;
+
+  /** Number of lookups that were not in the cache.  */
+  uint64_t misses = 0;
+
+  /** Mutex for the cache state.  */
+  mutable std::mutex mut;
+
+public:
+
+  explicit ResultCache (size_t maxEntries);
+
+  ResultCache () = delete;
+  ResultCache (const ResultCache&) = delete;
+  void operator= (const ResultCache&) = delete;
+
+  /**
+   * Returns the cache key for a given method call.
+   */
+  static std::string GetKey (const std::string& method,
+                             const Json::Value& params);
+
+  /**
+   * Looks up the result for the given key.  Returns true and sets the
+   * output argument if it is in the cache.
+   */
+  bool Lookup (const std::string& key, RawJson& result);
+
+  /**
+   * Returns the current generation.  This should be queried before a
+   * backend call is started, and passed to Insert with its result.
+   */
+  Generation GetGeneration () const;
+
+  /**
+   * Inserts a result for the given key that was retrieved by a call
+   * started at the given generation.  If the cache has been flushed since
+   * then (or it is full), the result is not stored.
+   */
+  void Insert (const std::string& key, Generation gen,
+               const RawJson& result);
+
+  /**
+   * Clears all entries and starts a new generation.
+   */
+  void Flush ();
+
+  uint64_t GetHits () const;
+  uint64_t GetMisses () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_RESULTCACHE_HPP
@@ -0,0 +1,92 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_RTTTRACKER_HPP
+#define CHARON_RTTTRACKER_HPP
+
+#include "serverselector.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace charon
+{
+
+/**
+ * Keeps track of the round-trip times a client measures for each server
+ * instance (by resource), as exponential moving averages.  Pings and
+ * RPC calls are tracked separately, since the latter include processing
+ * on the server.  This class is thread-safe.
+ */
+class RttTracker
+{
+
+public:
+
+  /** Duration type for the samples.  */
+  using Duration = ServerStats::Duration;
+
+private:
+
+  /** Weight of a new sample in the moving averages.  */
+  const double weight;
+
+  /** The stats for each resource we have seen.  */
+  std::map<std::string, ServerStats> stats;
+
+  /** Mutex for the stats.  */
+  mutable std::mutex mut;
+
+  /**
+   * Updates a moving average with a new sample.
+   */
+  void AddSample (Duration& avg, unsigned& samples, Duration value) const;
+
+public:
+
+  /**
+   * Constructs the tracker, with w being the weight for new samples.
+   */
+  explicit RttTracker (double w);
+
+  RttTracker () = delete;
+  RttTracker (const RttTracker&) = delete;
+  void operator= (const RttTracker&) = delete;
+
+  /**
+   * Records the round-trip time of a ping answered by the given instance.
+   */
+  void AddPingSample (const std::string& resource, Duration value);
+
+  /**
+   * Records the round-trip time of a call answered by the given instance.
+   */
+  void AddCallSample (const std::string& resource, Duration value);
+
+  /**
+   * Returns the stats for the given resource (with no samples if it
+   * has not been seen yet).
+   */
+  ServerStats GetStats (const std::string& resource) const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_RTTTRACKER_HPP
@@ -0,0 +1,103 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_SINGLEFLIGHT_HPP
+#define CHARON_SINGLEFLIGHT_HPP
+
+#include "rpcserver.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace charon
+{
+
+/**
+ * Tracker for backend calls in flight, which allows identical calls (by
+ * some key like the one of ResultCache) to be coalesced:  If a call is
+ * already in flight when an identical one comes in, the new caller is just
+ * attached to it and gets the same result, instead of running the
+ * backend call again.
+ *
+ * Callers can also attach an abort check.  A flight is only considered
+ * aborted if all its callers are, since otherwise some of them still
+ * need the result.
+ */
+class SingleFlight
+{
+
+private:
+
+  class Flight;
+
+  /** The flights currently open for new callers, by key.  */
+  std::map<std::string, std::shared_ptr<Flight>> flights;
+
+  /** Mutex for the map of flights.  */
+  std::mutex mut;
+
+public:
+
+  /** Handle for a flight, used to complete it.  */
+  using Handle = std::shared_ptr<Flight>;
+
+  SingleFlight () = default;
+
+  SingleFlight (const SingleFlight&) = delete;
+  void operator= (const SingleFlight&) = delete;
+
+  /**
+   * Joins a call with the given key.  If there is already one in flight,
+   * then the completion is attached to it and null is returned.  Otherwise,
+   * a new flight is started with the given completion and returned, and
+   * the caller must run the actual call and then invoke Complete.
+   *
+   * If an abort check is given, it tells whether this caller has given up
+   * on the call.  Callers without one never do.
+   */
+  Handle Join (const std::string& key, AsyncRpcServer::Completion cb,
+               AsyncRpcServer::AbortCheck aborted = nullptr);
+
+  /**
+   * Checks whether all callers of the given flight have been aborted.
+   * If they have, the flight is also detached, so that new callers start
+   * a new flight rather than joining the one that is going to be dropped.
+   */
+  bool IsAborted (const std::string& key, const Handle& f);
+
+  /**
+   * Finishes a flight with the given key and result.  This invokes all
+   * completions attached to it.
+   */
+  void Complete (const std::string& key, const Handle& f,
+                 const RpcResult& res);
+
+  /**
+   * Makes sure that all calls currently in flight will not be joined by
+   * new callers.  This is used when the backend state changes, since
+   * the ongoing calls may then return outdated results.
+   */
+  void Detach ();
+
+};
+
+} // namespace charon
+
+#endif // CHARON_SINGLEFLIGHT_HPP
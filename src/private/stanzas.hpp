@@ -19,14 +19,19 @@
 #ifndef CHARON_STANZAS_HPP
 #define CHARON_STANZAS_HPP
 
+#include "rawjson.hpp"
+
 #include <gloox/stanzaextension.h>
 #include <gloox/tag.h>
 
 #include <json/json.h>
 
+#include <chrono>
+#include <cstddef>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace charon
 {
@@ -76,21 +81,36 @@ public:
  * as part of an IQ stanza.  In XML, this is represented by a tag of
  * the following form:
  *
- *  <request xmlns="https://xaya.io/charon/">
+ *  <request xmlns="https://xaya.io/charon/" timeout="3000">
  *    <method>mymethod</method>
  *    <params>["json params", 42]</params>
  *  </request>
+ *
+ * The timeout attribute is optional.  If present, it specifies the time
+ * (in milliseconds) that the client is going to wait for a response.
+ * After that, the server need not process the request anymore.
  */
 class RpcRequest : public ValidatedStanzaExtension
 {
 
+public:
+
+  /** Duration type used for the timeout.  */
+  using Duration = std::chrono::milliseconds;
+
 private:
 
   /** The method name being called.  */
   std::string method;
 
-  /** The params data for the call.  */
-  Json::Value params;
+  /**
+   * The params data for the call.  When parsed from a tag, this is just
+   * validated and kept in serialised form.
+   */
+  RawJson params;
+
+  /** The timeout of the request, or zero if there is none.  */
+  Duration timeout = Duration::zero ();
 
 public:
 
@@ -106,7 +126,12 @@ public:
   /**
    * Constructs an instance with the given data.
    */
-  explicit RpcRequest (const std::string& m, const Json::Value& p);
+  explicit RpcRequest (const std::string& m, const RawJson& p);
+
+  /**
+   * Constructs an instance with the given data and timeout.
+   */
+  explicit RpcRequest (const std::string& m, const RawJson& p, Duration t);
 
   /**
    * Constructs an instance from a given tag.
@@ -121,10 +146,28 @@ public:
 
   const Json::Value&
   GetParams () const
+  {
+    return params.GetValue ();
+  }
+
+  const RawJson&
+  GetRawParams () const
   {
     return params;
   }
 
+  bool
+  HasTimeout () const
+  {
+    return timeout > Duration::zero ();
+  }
+
+  Duration
+  GetTimeout () const
+  {
+    return timeout;
+  }
+
   const std::string& filterString () const override;
   gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
   gloox::StanzaExtension* clone () const override;
@@ -156,8 +199,11 @@ private:
   /** If this is a success response.  */
   bool success;
 
-  /** On success, the result data.  */
-  Json::Value result;
+  /**
+   * On success, the result data.  When parsed from a tag, this is just
+   * validated and kept in serialised form.
+   */
+  RawJson result;
 
   /** On error, the error code.  */
   int errorCode;
@@ -180,7 +226,7 @@ public:
   /**
    * Constructs an instance for success with the given result.
    */
-  explicit RpcResponse (const Json::Value& res);
+  explicit RpcResponse (const RawJson& res);
 
   /**
    * Constructs an instance for error with the given data.
@@ -199,6 +245,7 @@ public:
   }
 
   const Json::Value& GetResult () const;
+  const RawJson& GetRawResult () const;
 
   int GetErrorCode () const;
   const std::string& GetErrorMessage () const;
@@ -211,14 +258,181 @@ public:
 
 };
 
+/**
+ * A gloox StanzaExtension representing a batch of JSON-RPC requests sent
+ * together in a single IQ stanza.  This saves the per-stanza overhead
+ * (routing and processing on the XMPP server) when a client has many
+ * calls to make at once.  In XML, it looks like this:
+ *
+ *  <batch xmlns="https://xaya.io/charon/" timeout="3000">
+ *    <request>
+ *      <method>first</method>
+ *      <params>[]</params>
+ *    </request>
+ *    <request>
+ *      <method>second</method>
+ *      <params>{"foo": 42}</params>
+ *    </request>
+ *  </batch>
+ *
+ * The requests are in the same format as for RpcRequest, except that they
+ * must not have a timeout of their own.  The timeout attribute of the batch
+ * is optional and applies to all of them.
+ *
+ * Batch requests and responses (RpcBatchResponse) use the same tag name,
+ * so only one of them should be registered with a gloox client.
+ */
+class RpcBatchRequest : public ValidatedStanzaExtension
+{
+
+public:
+
+  /** Duration type used for the timeout.  */
+  using Duration = RpcRequest::Duration;
+
+private:
+
+  /** The requests in the batch.  */
+  std::vector<std::unique_ptr<RpcRequest>> requests;
+
+  /** The timeout of the batch, or zero if there is none.  */
+  Duration timeout = Duration::zero ();
+
+public:
+
+  /** Extension type for RPC batch request extensions.  */
+  static constexpr int EXT_TYPE = gloox::ExtUser + 7;
+
+  /**
+   * Constructs an empty instance (for use as factory).  It will be marked
+   * as invalid.
+   */
+  RpcBatchRequest ();
+
+  /**
+   * Constructs an instance with the given requests and timeout (which may
+   * be zero for no timeout).  There must be at least one request, and none
+   * of them may have a timeout.
+   */
+  explicit RpcBatchRequest (std::vector<std::unique_ptr<RpcRequest>> r,
+                            Duration t);
+
+  /**
+   * Constructs an instance from a given tag.
+   */
+  explicit RpcBatchRequest (const gloox::Tag& t);
+
+  size_t
+  GetNumRequests () const
+  {
+    return requests.size ();
+  }
+
+  const RpcRequest&
+  GetRequest (const size_t i) const
+  {
+    return *requests.at (i);
+  }
+
+  bool
+  HasTimeout () const
+  {
+    return timeout > Duration::zero ();
+  }
+
+  Duration
+  GetTimeout () const
+  {
+    return timeout;
+  }
+
+  const std::string& filterString () const override;
+  gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
+  gloox::StanzaExtension* clone () const override;
+  gloox::Tag* tag () const override;
+
+};
+
+/**
+ * A gloox StanzaExtension representing the responses to a batch of
+ * requests, in the same order as the requests:
+ *
+ *  <batch xmlns="https://xaya.io/charon/">
+ *    <response>
+ *      <result>"first result"</result>
+ *    </response>
+ *    <response>
+ *      <error code="42">
+ *        <message>second failed</message>
+ *      </error>
+ *    </response>
+ *  </batch>
+ */
+class RpcBatchResponse : public ValidatedStanzaExtension
+{
+
+private:
+
+  /** The responses in the batch.  */
+  std::vector<std::unique_ptr<RpcResponse>> responses;
+
+public:
+
+  /** Extension type for RPC batch response extensions.  */
+  static constexpr int EXT_TYPE = gloox::ExtUser + 8;
+
+  /**
+   * Constructs an empty instance (for use as factory).  It will be marked
+   * as invalid.
+   */
+  RpcBatchResponse ();
+
+  /**
+   * Constructs an instance with the given responses.  There must be at
+   * least one of them.
+   */
+  explicit RpcBatchResponse (std::vector<std::unique_ptr<RpcResponse>> r);
+
+  /**
+   * Constructs an instance from a given tag.
+   */
+  explicit RpcBatchResponse (const gloox::Tag& t);
+
+  size_t
+  GetNumResponses () const
+  {
+    return responses.size ();
+  }
+
+  const RpcResponse&
+  GetResponse (const size_t i) const
+  {
+    return *responses.at (i);
+  }
+
+  const std::string& filterString () const override;
+  gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
+  gloox::StanzaExtension* clone () const override;
+  gloox::Tag* tag () const override;
+
+};
+
 /**
  * A gloox StanzaExtension representing a "ping" message:
  *
- *  <ping xmlns="https://xaya.io/charon/" />
+ *  <ping xmlns="https://xaya.io/charon/" nonce="abc" />
+ *
+ * The nonce attribute is optional.  If present, servers echo it in their
+ * pong, so that the client can match pongs to the ping they answer.
  */
 class PingMessage : public ValidatedStanzaExtension
 {
 
+private:
+
+  /** The nonce (may be empty).  */
+  std::string nonce;
+
 public:
 
   /** Extension type for ping extensions.  */
@@ -230,6 +444,22 @@ public:
    */
   PingMessage ();
 
+  /**
+   * Constructs a valid instance with the given nonce.
+   */
+  explicit PingMessage (const std::string& n);
+
+  /**
+   * Constructs an instance from a given tag.
+   */
+  explicit PingMessage (const gloox::Tag& t);
+
+  const std::string&
+  GetNonce () const
+  {
+    return nonce;
+  }
+
   const std::string& filterString () const override;
   gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
   gloox::StanzaExtension* clone () const override;
@@ -240,7 +470,12 @@ public:
 /**
  * A gloox StanzaExtension representing a "pong" message/presence:
  *
- *  <pong xmlns="https://xaya.io/charon/" version="server version" />
+ *  <pong xmlns="https://xaya.io/charon/" version="server version" batch="50"
+ *        nonce="abc" />
+ *
+ * The batch attribute is optional.  If present, the server accepts batch
+ * requests (RpcBatchRequest) with up to that many calls.  The nonce is
+ * the one of the ping that is answered (if it had one).
  */
 class PongMessage : public ValidatedStanzaExtension
 {
@@ -250,6 +485,15 @@ private:
   /** The server version string.  */
   std::string version;
 
+  /**
+   * The maximum number of calls in a batch request that the server accepts,
+   * or zero if it does not support batches.
+   */
+  size_t maxBatchSize = 0;
+
+  /** The nonce of the answered ping (may be empty).  */
+  std::string nonce;
+
 public:
 
   /** Extension type for pong extensions.  */
@@ -266,6 +510,12 @@ public:
    */
   explicit PongMessage (const std::string& v);
 
+  /**
+   * Constructs a valid instance for the given version string, which
+   * advertises support for batches of the given maximum size.
+   */
+  explicit PongMessage (const std::string& v, size_t b);
+
   /**
    * Constructs an instance from a given tag.
    */
@@ -280,6 +530,82 @@ public:
     return version;
   }
 
+  /**
+   * Returns the maximum supported batch size (or zero if the server
+   * does not support batch requests).
+   */
+  size_t
+  GetMaxBatchSize () const
+  {
+    return maxBatchSize;
+  }
+
+  const std::string&
+  GetNonce () const
+  {
+    return nonce;
+  }
+
+  /**
+   * Sets the nonce, echoing the one of the ping we answer.
+   */
+  void
+  SetNonce (const std::string& n)
+  {
+    nonce = n;
+  }
+
+  const std::string& filterString () const override;
+  gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
+  gloox::StanzaExtension* clone () const override;
+  gloox::Tag* tag () const override;
+
+};
+
+/**
+ * A gloox StanzaExtension representing a message that cancels an earlier
+ * RPC request (because the client is no longer waiting for the result):
+ *
+ *  <cancel xmlns="https://xaya.io/charon/" id="IQ id of the request" />
+ */
+class CancelRequest : public ValidatedStanzaExtension
+{
+
+private:
+
+  /** The IQ id of the cancelled request.  */
+  std::string id;
+
+public:
+
+  /** Extension type for cancel extensions.  */
+  static constexpr int EXT_TYPE = gloox::ExtUser + 6;
+
+  /**
+   * Constructs an empty instance, which can be used as a factory
+   * but is otherwise marked as invalid.
+   */
+  CancelRequest ();
+
+  /**
+   * Constructs a valid instance for the given request IQ id.
+   */
+  explicit CancelRequest (const std::string& i);
+
+  /**
+   * Constructs an instance from a given tag.
+   */
+  explicit CancelRequest (const gloox::Tag& t);
+
+  /**
+   * Returns the IQ id of the cancelled request.
+   */
+  const std::string&
+  GetId () const
+  {
+    return id;
+  }
+
   const std::string& filterString () const override;
   gloox::StanzaExtension* newInstance (const gloox::Tag* tag) const override;
   gloox::StanzaExtension* clone () const override;
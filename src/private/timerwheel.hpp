@@ -0,0 +1,155 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_TIMERWHEEL_HPP
+#define CHARON_TIMERWHEEL_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * Hashed timer wheel that keeps track of deadlines for a set of entries,
+ * identified by small integer IDs (e.g. indices into a pooled array).
+ * Time is divided into ticks of fixed length, and each entry is put into
+ * the bucket for its deadline's tick (modulo the number of buckets).
+ * Scheduling and cancelling are O(1), and expiring entries only looks at
+ * the buckets of the ticks that have passed.
+ *
+ * Deadlines are rounded up to the next tick, so entries expire at most
+ * one tick late (plus however late Expire is called).
+ *
+ * This class is not thread-safe; users have to synchronise it themselves.
+ */
+class TimerWheel
+{
+
+public:
+
+  /** Clock used for the deadlines.  */
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  /** Marker for "no entry" in the linked lists.  */
+  static constexpr size_t NONE = static_cast<size_t> (-1);
+
+  /**
+   * Data for one entry.  Entries in the same bucket are linked in a
+   * doubly-linked list, so that they can be removed in O(1).
+   */
+  struct Entry
+  {
+
+    /** The tick at which the entry expires.  */
+    uint64_t tick;
+
+    /** Previous entry in the bucket.  */
+    size_t prev;
+
+    /** Next entry in the bucket.  */
+    size_t next;
+
+    /** Whether or not the entry is currently scheduled.  */
+    bool scheduled = false;
+
+  };
+
+  /** Length of one tick.  */
+  const Clock::duration tickLength;
+
+  /** Time point corresponding to tick zero.  */
+  const Clock::time_point origin;
+
+  /** The last tick that has been processed by Expire.  */
+  uint64_t currentTick = 0;
+
+  /** For each bucket, the first entry in it (or NONE).  */
+  std::vector<size_t> buckets;
+
+  /** Data for all entries by ID.  */
+  std::vector<Entry> entries;
+
+  /** Number of currently scheduled entries.  */
+  size_t numScheduled = 0;
+
+  /**
+   * Removes the given entry from its bucket's list.
+   */
+  void Unlink (size_t id);
+
+public:
+
+  /**
+   * Constructs an empty wheel with the given tick length and number of
+   * buckets, starting at the given time.
+   */
+  explicit TimerWheel (Clock::duration tick, size_t numBuckets,
+                       Clock::time_point start = Clock::now ());
+
+  TimerWheel () = delete;
+  TimerWheel (const TimerWheel&) = delete;
+  void operator= (const TimerWheel&) = delete;
+
+  /**
+   * Schedules the entry with the given ID to expire at the given deadline.
+   * The entry must not be scheduled already.  Deadlines in the past
+   * expire with the next tick.
+   */
+  void Schedule (size_t id, Clock::time_point deadline);
+
+  /**
+   * Removes the entry from the wheel.  Returns true if it was scheduled.
+   */
+  bool Cancel (size_t id);
+
+  /**
+   * Advances the wheel to the given time, and appends the IDs of all
+   * entries that expired to the output vector.  Those entries are no
+   * longer scheduled afterwards.
+   */
+  void Expire (Clock::time_point now, std::vector<size_t>& expired);
+
+  /**
+   * Returns true if no entries are scheduled.
+   */
+  bool
+  IsEmpty () const
+  {
+    return numScheduled == 0;
+  }
+
+  /**
+   * Returns the length of a tick, i.e. how often Expire should be called
+   * while entries are scheduled.
+   */
+  Clock::duration
+  GetTickLength () const
+  {
+    return tickLength;
+  }
+
+};
+
+} // namespace charon
+
+#endif // CHARON_TIMERWHEEL_HPP
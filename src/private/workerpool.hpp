@@ -0,0 +1,109 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_WORKERPOOL_HPP
+#define CHARON_WORKERPOOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * A fixed-size pool of worker threads that process jobs from a bounded
+ * queue.  This is used by the server to run backend calls off the XMPP
+ * receive thread, so that a single slow call does not block processing
+ * of everything else on the connection.
+ */
+class WorkerPool
+{
+
+public:
+
+  /** Type of jobs that can be run on the pool.  */
+  using Job = std::function<void ()>;
+
+private:
+
+  /** Maximum number of jobs waiting in the queue.  */
+  const size_t maxQueued;
+
+  /** The queue of jobs waiting to be picked up by a worker.  */
+  std::deque<Job> queue;
+
+  /** Number of workers currently processing a job.  */
+  size_t busy = 0;
+
+  /** Set to true when the workers should shut down.  */
+  bool shouldStop = false;
+
+  /** Mutex for the queue.  */
+  mutable std::mutex mut;
+
+  /** Condition variable signalled when new jobs are available.  */
+  std::condition_variable cv;
+
+  /** The worker threads themselves.  */
+  std::vector<std::thread> workers;
+
+  /**
+   * Main function of the worker threads.
+   */
+  void RunWorker ();
+
+public:
+
+  /**
+   * Constructs the pool and starts the given number of worker threads.
+   * At most maxQueue jobs will be waiting in the queue at any time
+   * (not counting the ones being processed already or handed to an idle
+   * worker).  With zero, jobs are only accepted if a worker is idle.
+   */
+  explicit WorkerPool (unsigned threads, size_t maxQueue);
+
+  /**
+   * Processes all jobs still in the queue and then stops the workers.
+   */
+  ~WorkerPool ();
+
+  WorkerPool () = delete;
+  WorkerPool (const WorkerPool&) = delete;
+  void operator= (const WorkerPool&) = delete;
+
+  /**
+   * Adds a new job to the queue.  Returns false (and does not take the job)
+   * if no worker is idle and the queue is full.
+   */
+  bool Submit (Job j);
+
+  /**
+   * Returns the number of jobs currently waiting in the queue.
+   */
+  size_t GetQueueSize () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_WORKERPOOL_HPP
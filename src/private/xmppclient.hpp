@@ -24,6 +24,7 @@
 #include <gloox/loghandler.h>
 
 #include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -45,6 +46,32 @@ class PubSubImpl;
 class XmppClient : private gloox::ConnectionListener, private gloox::LogHandler
 {
 
+public:
+
+  /**
+   * The ways in which the receive thread can wait for incoming data.
+   */
+  enum class ReceiveMode
+  {
+
+    /**
+     * Check for new data without blocking, and sleep for a short time
+     * in between checks.  This works everywhere, but keeps the thread
+     * busy even when idle and delays incoming stanzas by up to the
+     * sleep time.
+     */
+    POLLING,
+
+    /**
+     * Block on the connection's socket (and a wake-up event) until
+     * there is actually something to do.  This is only available on
+     * systems that support it (and with a plain TCP connection), and
+     * otherwise falls back to POLLING.
+     */
+    EVENTS,
+
+  };
+
 private:
 
   /**
@@ -81,9 +108,24 @@ private:
   /** Signal for the receive loop to stop.  */
   std::atomic<bool> stopLoop;
 
+  /** The receive mode to use for the next connection.  */
+  ReceiveMode receiveMode;
+
+  /**
+   * File descriptor of an event object that is used to wake up the receive
+   * loop while it is blocked in EVENTS mode, or -1 if not supported.
+   */
+  int wakeFd;
+
   /** Current connection state (set by the onConnect/onDisconnect handlers).  */
   std::atomic<ConnectionState> connectionState;
 
+  /** Mutex for cvConnectionState.  */
+  std::mutex mutConnectionState;
+
+  /** Condition variable notified when the connection state changes.  */
+  std::condition_variable cvConnectionState;
+
   /**
    * Lock used to synchronise receives and other client accesses.  This has
    * to be recursive so that also callbacks triggered in reply to a message
@@ -98,6 +140,33 @@ private:
    */
   bool Receive ();
 
+  /**
+   * Runs the receive loop in POLLING mode.
+   */
+  void RunPollingLoop ();
+
+  /**
+   * Runs the receive loop in EVENTS mode, waiting for data on the given
+   * socket.
+   */
+  void RunEventLoop (int sock);
+
+  /**
+   * Returns the socket of the current connection that can be waited on
+   * in EVENTS mode, or -1 if that is not possible.
+   */
+  int GetSocket ();
+
+  /**
+   * Signals the receive loop to stop and waits for the thread to finish.
+   */
+  void StopReceiveLoop ();
+
+  /**
+   * Updates the connection state and notifies threads waiting for it.
+   */
+  void SetConnectionState (ConnectionState s);
+
   /**
    * Attaches the PubSubImpl for our configured service.
    */
@@ -147,6 +216,16 @@ public:
   XmppClient (const XmppClient&) = delete;
   void operator= (const XmppClient&) = delete;
 
+  /**
+   * Sets the receive mode to use.  This takes effect with the next call
+   * to Connect.
+   */
+  void
+  SetReceiveMode (const ReceiveMode m)
+  {
+    receiveMode = m;
+  }
+
   /**
    * Adds a pubsub handler for the given pubsub service JID.
    */
@@ -174,6 +253,13 @@ public:
    */
   void Disconnect ();
 
+  /**
+   * Changes the priority of our presence and broadcasts the updated
+   * presence to the server.  This only has an effect while connected;
+   * Connect always sets the priority passed to it.
+   */
+  void SetPriority (int priority);
+
   /**
    * Returns true if the client is successfully connected.
    */
@@ -194,7 +280,9 @@ public:
 
   /**
    * Runs a provided callback with access to the underlying gloox Client,
-   * synchronised with the receive loop.
+   * synchronised with the receive loop.  In EVENTS mode, the receive loop
+   * only holds the lock while actually processing incoming data, so this
+   * does not need to wait for it to wake up.
    */
   template <typename Fcn>
     void
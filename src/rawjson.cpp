@@ -0,0 +1,665 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rawjson.hpp"
+
+#include <glog/logging.h>
+
+#include <mutex>
+#include <sstream>
+
+namespace charon
+{
+
+namespace
+{
+
+/**
+ * Maximum nesting depth of arrays and objects that we accept in serialised
+ * JSON.  This is below the default limit of jsoncpp's reader, so that
+ * anything we validate can also be parsed later.
+ */
+constexpr unsigned MAX_DEPTH = 500;
+
+/** Whitespace characters allowed in JSON.  */
+constexpr const char* WHITESPACE = " \t\n\r";
+
+/**
+ * Simple validating scanner for serialised JSON (RFC 8259).  It just checks
+ * the syntax and records where values start and end, without building
+ * any representation of them.
+ */
+class JsonScanner
+{
+
+private:
+
+  /** The text being scanned.  */
+  const std::string& text;
+
+  /** The current position.  */
+  size_t pos = 0;
+
+  /**
+   * Returns the current character, or NUL if we are at the end.
+   */
+  char
+  Peek () const
+  {
+    return pos < text.size () ? text[pos] : '\0';
+  }
+
+  static bool
+  IsDigit (const char c)
+  {
+    return c >= '0' && c <= '9';
+  }
+
+  static bool
+  IsHexDigit (const char c)
+  {
+    return IsDigit (c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+  }
+
+  /**
+   * Scans the continuation bytes of a multi-byte UTF-8 sequence, whose
+   * lead byte (given) has just been consumed.  Overlong encodings,
+   * surrogates and code points beyond U+10FFFF are rejected, since the
+   * text may end up in XML verbatim.
+   */
+  bool
+  ScanUtf8Sequence (const unsigned char lead)
+  {
+    unsigned numCont;
+    unsigned char minSecond = 0x80;
+    unsigned char maxSecond = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF)
+      numCont = 1;
+    else if (lead >= 0xE0 && lead <= 0xEF)
+      {
+        numCont = 2;
+        if (lead == 0xE0)
+          minSecond = 0xA0;
+        else if (lead == 0xED)
+          maxSecond = 0x9F;
+      }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+      {
+        numCont = 3;
+        if (lead == 0xF0)
+          minSecond = 0x90;
+        else if (lead == 0xF4)
+          maxSecond = 0x8F;
+      }
+    else
+      return false;
+
+    for (unsigned i = 0; i < numCont; ++i, ++pos)
+      {
+        if (pos >= text.size ())
+          return false;
+
+        const auto c = static_cast<unsigned char> (text[pos]);
+        const unsigned char minByte = (i == 0 ? minSecond : 0x80);
+        const unsigned char maxByte = (i == 0 ? maxSecond : 0xBF);
+        if (c < minByte || c > maxByte)
+          return false;
+      }
+
+    return true;
+  }
+
+  bool
+  ScanLiteral (const char* lit)
+  {
+    for (; *lit != '\0'; ++lit, ++pos)
+      if (Peek () != *lit)
+        return false;
+    return true;
+  }
+
+  bool
+  ScanDigits ()
+  {
+    if (!IsDigit (Peek ()))
+      return false;
+    while (IsDigit (Peek ()))
+      ++pos;
+    return true;
+  }
+
+  bool
+  ScanNumber ()
+  {
+    if (Peek () == '-')
+      ++pos;
+
+    if (Peek () == '0')
+      ++pos;
+    else if (!ScanDigits ())
+      return false;
+
+    if (Peek () == '.')
+      {
+        ++pos;
+        if (!ScanDigits ())
+          return false;
+      }
+
+    if (Peek () == 'e' || Peek () == 'E')
+      {
+        ++pos;
+        if (Peek () == '+' || Peek () == '-')
+          ++pos;
+        if (!ScanDigits ())
+          return false;
+      }
+
+    return true;
+  }
+
+public:
+
+  explicit JsonScanner (const std::string& t)
+    : text(t)
+  {}
+
+  JsonScanner () = delete;
+  JsonScanner (const JsonScanner&) = delete;
+  void operator= (const JsonScanner&) = delete;
+
+  size_t
+  GetPosition () const
+  {
+    return pos;
+  }
+
+  bool
+  AtEnd () const
+  {
+    return pos == text.size ();
+  }
+
+  void
+  SkipWhitespace ()
+  {
+    while (true)
+      switch (Peek ())
+        {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+          ++pos;
+          break;
+        default:
+          return;
+        }
+  }
+
+  /**
+   * Scans a string literal (including the quotes).
+   */
+  bool
+  ScanString ()
+  {
+    if (Peek () != '"')
+      return false;
+    ++pos;
+
+    while (true)
+      {
+        if (pos >= text.size ())
+          return false;
+
+        const char c = text[pos++];
+        if (c == '"')
+          return true;
+        if (static_cast<unsigned char> (c) < 0x20)
+          return false;
+        if (static_cast<unsigned char> (c) >= 0x80)
+          {
+            if (!ScanUtf8Sequence (static_cast<unsigned char> (c)))
+              return false;
+            continue;
+          }
+        if (c != '\\')
+          continue;
+
+        switch (Peek ())
+          {
+          case '"':
+          case '\\':
+          case '/':
+          case 'b':
+          case 'f':
+          case 'n':
+          case 'r':
+          case 't':
+            ++pos;
+            break;
+          case 'u':
+            ++pos;
+            for (unsigned i = 0; i < 4; ++i, ++pos)
+              if (!IsHexDigit (Peek ()))
+                return false;
+            break;
+          default:
+            return false;
+          }
+      }
+  }
+
+  /**
+   * Scans an arbitrary value starting at the current position, which must
+   * not be whitespace.
+   */
+  bool
+  ScanValue (const unsigned depth)
+  {
+    if (depth > MAX_DEPTH)
+      return false;
+
+    switch (Peek ())
+      {
+      case '{':
+        return ScanObject (depth, nullptr);
+      case '[':
+        return ScanArray (depth, nullptr);
+      case '"':
+        return ScanString ();
+      case 't':
+        return ScanLiteral ("true");
+      case 'f':
+        return ScanLiteral ("false");
+      case 'n':
+        return ScanLiteral ("null");
+      default:
+        return ScanNumber ();
+      }
+  }
+
+  /**
+   * Scans an object.  If members is not null, the member values are
+   * stored into it by (raw, i.e. still quoted and escaped) name.
+   */
+  bool
+  ScanObject (const unsigned depth,
+              std::map<std::string, std::string>* members)
+  {
+    if (Peek () != '{')
+      return false;
+    ++pos;
+
+    SkipWhitespace ();
+    if (Peek () == '}')
+      {
+        ++pos;
+        return true;
+      }
+
+    while (true)
+      {
+        const size_t nameStart = pos;
+        if (!ScanString ())
+          return false;
+        const size_t nameEnd = pos;
+
+        SkipWhitespace ();
+        if (Peek () != ':')
+          return false;
+        ++pos;
+        SkipWhitespace ();
+
+        const size_t valueStart = pos;
+        if (!ScanValue (depth + 1))
+          return false;
+
+        if (members != nullptr)
+          {
+            const std::string name
+                = text.substr (nameStart, nameEnd - nameStart);
+            (*members)[name] = text.substr (valueStart, pos - valueStart);
+          }
+
+        SkipWhitespace ();
+        switch (Peek ())
+          {
+          case ',':
+            ++pos;
+            SkipWhitespace ();
+            break;
+          case '}':
+            ++pos;
+            return true;
+          default:
+            return false;
+          }
+      }
+  }
+
+  /**
+   * Scans an array.  If elements is not null, the element values are
+   * appended to it.
+   */
+  bool
+  ScanArray (const unsigned depth, std::vector<std::string>* elements)
+  {
+    if (Peek () != '[')
+      return false;
+    ++pos;
+
+    SkipWhitespace ();
+    if (Peek () == ']')
+      {
+        ++pos;
+        return true;
+      }
+
+    while (true)
+      {
+        const size_t valueStart = pos;
+        if (!ScanValue (depth + 1))
+          return false;
+        if (elements != nullptr)
+          elements->push_back (text.substr (valueStart, pos - valueStart));
+
+        SkipWhitespace ();
+        switch (Peek ())
+          {
+          case ',':
+            ++pos;
+            SkipWhitespace ();
+            break;
+          case ']':
+            ++pos;
+            return true;
+          default:
+            return false;
+          }
+      }
+  }
+
+};
+
+/**
+ * Removes all insignificant whitespace (i.e. outside of strings) from
+ * JSON text that has been validated already.  The text is embedded
+ * verbatim into messages to the backend, and some transports (like
+ * Unix domain sockets) use newlines as message delimiters.
+ */
+std::string
+Minify (std::string text)
+{
+  if (text.find_first_of (WHITESPACE) == std::string::npos)
+    return text;
+
+  std::string res;
+  res.reserve (text.size ());
+
+  bool inString = false;
+  for (size_t i = 0; i < text.size (); ++i)
+    {
+      const char c = text[i];
+      if (inString)
+        {
+          res.push_back (c);
+          if (c == '\\')
+            res.push_back (text[++i]);
+          else if (c == '"')
+            inString = false;
+          continue;
+        }
+
+      switch (c)
+        {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+          break;
+        case '"':
+          inString = true;
+          res.push_back (c);
+          break;
+        default:
+          res.push_back (c);
+          break;
+        }
+    }
+
+  return res;
+}
+
+/**
+ * Parses JSON text that has been validated already.  If jsoncpp fails
+ * to parse it anyway (e.g. because of numbers out of range), this logs
+ * a warning and returns null.
+ */
+Json::Value
+ParseValidated (const std::string& text)
+{
+  Json::CharReaderBuilder rbuilder;
+  rbuilder["allowComments"] = false;
+  rbuilder["strictRoot"] = false;
+  rbuilder["failIfExtra"] = true;
+
+  Json::Value res;
+  std::istringstream in(text);
+  std::string parseErrs;
+  if (!Json::parseFromStream (rbuilder, in, &res, &parseErrs))
+    {
+      LOG (WARNING) << "Failed parsing JSON:\n" << text << "\n" << parseErrs;
+      return Json::Value ();
+    }
+
+  return res;
+}
+
+/**
+ * Returns the serialised form of a Json::Value.
+ */
+std::string
+Serialise (const Json::Value& val)
+{
+  Json::StreamWriterBuilder wbuilder;
+  wbuilder["commentStyle"] = "None";
+  wbuilder["indentation"] = "";
+  wbuilder["enableYAMLCompatibility"] = false;
+  wbuilder["dropNullPlaceholders"] = false;
+  wbuilder["useSpecialFloats"] = false;
+
+  return Json::writeString (wbuilder, val);
+}
+
+} // anonymous namespace
+
+/**
+ * The actual data of a RawJson instance.  It has at least one of the two
+ * forms set on construction, and computes the other on demand.
+ */
+class RawJson::Data
+{
+
+private:
+
+  /** Whether this was constructed from a Json::Value.  */
+  const bool fromValue;
+
+  /** Flag for computing the text lazily.  */
+  mutable std::once_flag textOnce;
+
+  /** The serialised form (if computed already).  */
+  mutable std::string text;
+
+  /** Flag for computing the value lazily.  */
+  mutable std::once_flag valueOnce;
+
+  /** The parsed value (if computed already).  */
+  mutable Json::Value value;
+
+public:
+
+  explicit Data (const Json::Value& v)
+    : fromValue(true), value(v)
+  {
+    std::call_once (valueOnce, [] () {});
+  }
+
+  explicit Data (std::string t)
+    : fromValue(false), text(std::move (t))
+  {
+    std::call_once (textOnce, [] () {});
+  }
+
+  Data () = delete;
+  Data (const Data&) = delete;
+  void operator= (const Data&) = delete;
+
+  bool
+  IsFromValue () const
+  {
+    return fromValue;
+  }
+
+  const std::string&
+  GetText () const
+  {
+    std::call_once (textOnce, [this] ()
+      {
+        text = Serialise (value);
+      });
+    return text;
+  }
+
+  const Json::Value&
+  GetValue () const
+  {
+    std::call_once (valueOnce, [this] ()
+      {
+        value = ParseValidated (text);
+      });
+    return value;
+  }
+
+};
+
+RawJson::RawJson (std::shared_ptr<const Data> d)
+  : data(std::move (d))
+{}
+
+RawJson::RawJson ()
+  : RawJson(Json::Value ())
+{}
+
+RawJson::RawJson (const Json::Value& val)
+  : data(std::make_shared<Data> (val))
+{}
+
+bool
+RawJson::FromText (std::string text, RawJson& out)
+{
+  JsonScanner scanner(text);
+  scanner.SkipWhitespace ();
+  if (!scanner.ScanValue (0))
+    return false;
+  scanner.SkipWhitespace ();
+  if (!scanner.AtEnd ())
+    return false;
+
+  out = RawJson (std::make_shared<Data> (Minify (std::move (text))));
+  return true;
+}
+
+bool
+RawJson::SplitObject (const std::string& text,
+                      std::map<std::string, RawJson>& members)
+{
+  std::map<std::string, std::string> rawMembers;
+
+  JsonScanner scanner(text);
+  scanner.SkipWhitespace ();
+  if (!scanner.ScanObject (0, &rawMembers))
+    return false;
+  scanner.SkipWhitespace ();
+  if (!scanner.AtEnd ())
+    return false;
+
+  members.clear ();
+  for (auto& entry : rawMembers)
+    {
+      /* Names without escapes (the common case) can just be unquoted.
+         Others are decoded by jsoncpp.  */
+      std::string name;
+      if (entry.first.find ('\\') == std::string::npos)
+        name = entry.first.substr (1, entry.first.size () - 2);
+      else
+        name = ParseValidated (entry.first).asString ();
+
+      members[name] = RawJson (
+          std::make_shared<Data> (Minify (std::move (entry.second))));
+    }
+
+  return true;
+}
+
+bool
+RawJson::SplitArray (const std::string& text, std::vector<RawJson>& elements)
+{
+  std::vector<std::string> rawElements;
+
+  JsonScanner scanner(text);
+  scanner.SkipWhitespace ();
+  if (!scanner.ScanArray (0, &rawElements))
+    return false;
+  scanner.SkipWhitespace ();
+  if (!scanner.AtEnd ())
+    return false;
+
+  elements.clear ();
+  elements.reserve (rawElements.size ());
+  for (auto& e : rawElements)
+    elements.push_back (
+        RawJson (std::make_shared<Data> (Minify (std::move (e)))));
+
+  return true;
+}
+
+const std::string&
+RawJson::GetText () const
+{
+  return data->GetText ();
+}
+
+const Json::Value&
+RawJson::GetValue () const
+{
+  return data->GetValue ();
+}
+
+bool
+RawJson::IsNull () const
+{
+  if (data->IsFromValue ())
+    return data->GetValue ().isNull ();
+
+  /* Text is stored without insignificant whitespace.  */
+  return data->GetText () == "null";
+}
+
+} // namespace charon
@@ -0,0 +1,118 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_RAWJSON_HPP
+#define CHARON_RAWJSON_HPP
+
+#include <json/json.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * A JSON value that is held either in serialised form or as parsed
+ * Json::Value, and converted to the other form only when it is actually
+ * needed.  This allows large values (like game states) to be passed
+ * through from the backend's response to the XMPP stanza (and params the
+ * other way round) as validated text, without parsing and reserialising
+ * them on the way.
+ *
+ * Instances are immutable and cheap to copy; copies share the underlying
+ * data (including lazily converted forms).  They can be accessed from
+ * multiple threads concurrently.
+ */
+class RawJson
+{
+
+private:
+
+  class Data;
+
+  /** The underlying data.  */
+  std::shared_ptr<const Data> data;
+
+  explicit RawJson (std::shared_ptr<const Data> d);
+
+public:
+
+  /**
+   * Constructs an instance representing JSON null.
+   */
+  RawJson ();
+
+  /**
+   * Wraps an already parsed value.  This is implicit, so that Json::Value
+   * can be passed wherever a RawJson is expected.
+   */
+  RawJson (const Json::Value& val);
+
+  RawJson (const RawJson&) = default;
+  RawJson& operator= (const RawJson&) = default;
+
+  /**
+   * Validates the given serialised JSON text (without building a full
+   * Json::Value from it) and constructs an instance holding it.
+   * Insignificant whitespace is removed from the text.  Returns false
+   * if the text is not valid JSON (including invalid UTF-8 in strings).
+   */
+  static bool FromText (std::string text, RawJson& out);
+
+  /**
+   * Validates the given serialised JSON text, which must be an object,
+   * and splits it into its members.  The member values are returned as
+   * instances holding their text (without insignificant whitespace).
+   * Returns false if the text is invalid.
+   */
+  static bool SplitObject (const std::string& text,
+                           std::map<std::string, RawJson>& members);
+
+  /**
+   * Validates the given serialised JSON text, which must be an array,
+   * and splits it into its elements (like SplitObject).  Returns false
+   * if the text is invalid.
+   */
+  static bool SplitArray (const std::string& text,
+                          std::vector<RawJson>& elements);
+
+  /**
+   * Returns the value in serialised form.  If it is held as Json::Value,
+   * it is serialised on the first call.
+   */
+  const std::string& GetText () const;
+
+  /**
+   * Returns the value as parsed Json::Value.  If it is held as text, it is
+   * parsed on the first call.
+   */
+  const Json::Value& GetValue () const;
+
+  /**
+   * Returns true if the value is JSON null.
+   */
+  bool IsNull () const;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_RAWJSON_HPP
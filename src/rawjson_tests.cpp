@@ -0,0 +1,208 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rawjson.hpp"
+
+#include "testutils.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+using testing::ElementsAre;
+using testing::Pair;
+
+using RawJsonTests = testing::Test;
+
+TEST_F (RawJsonTests, DefaultIsNull)
+{
+  const RawJson val;
+  EXPECT_TRUE (val.IsNull ());
+  EXPECT_EQ (val.GetValue (), Json::Value ());
+  EXPECT_EQ (val.GetText (), "null");
+}
+
+TEST_F (RawJsonTests, FromValue)
+{
+  const RawJson val(ParseJson (R"({"foo": [1, 2, "bar"]})"));
+  EXPECT_FALSE (val.IsNull ());
+  EXPECT_EQ (val.GetText (), R"({"foo":[1,2,"bar"]})");
+}
+
+TEST_F (RawJsonTests, FromTextIsKeptVerbatim)
+{
+  const std::string text = R"({"foo":[1,2.5e-3,"bar"]})";
+  RawJson val;
+  ASSERT_TRUE (RawJson::FromText (text, val));
+  EXPECT_EQ (val.GetText (), text);
+  EXPECT_EQ (val.GetValue (), ParseJson (text));
+  EXPECT_FALSE (val.IsNull ());
+}
+
+TEST_F (RawJsonTests, FromTextDropsWhitespace)
+{
+  const std::string text = "\t{ \"foo\" :\r\n[1, 2.5e-3, \"b a\\\" r\"] }\n";
+  RawJson val;
+  ASSERT_TRUE (RawJson::FromText (text, val));
+  EXPECT_EQ (val.GetText (), R"({"foo":[1,2.5e-3,"b a\" r"]})");
+  EXPECT_EQ (val.GetValue (), ParseJson (text));
+
+  ASSERT_TRUE (RawJson::FromText (" null\n", val));
+  EXPECT_EQ (val.GetText (), "null");
+  EXPECT_TRUE (val.IsNull ());
+}
+
+TEST_F (RawJsonTests, ValidText)
+{
+  for (const std::string text : {"null", "true", "false", "0", "-1.5E+10",
+                                 R"("")", R"("a\"\\\/\b\f\n\r\t\u00ff")",
+                                 "[]", "{}", "[[], {}, [1, [2]]]",
+                                 R"({"a": {"b": null}, "c": []})"})
+    {
+      RawJson val;
+      EXPECT_TRUE (RawJson::FromText (text, val)) << text;
+      EXPECT_EQ (val.GetValue (), ParseJson (text)) << text;
+    }
+}
+
+TEST_F (RawJsonTests, InvalidText)
+{
+  for (const std::string text : {"", " ", "nul", "truex", "01", "1.", ".5",
+                                 "-", "1e", "+1", "'a'", R"("a)", R"("\x")",
+                                 R"("\u12G4")", "\"a\nb\"", "[1,]", "[1 2]",
+                                 "{,}", R"({"a"})", R"({"a": 1,})", "{1: 2}",
+                                 "[1] [2]", "[", "// comment\n[]"})
+    {
+      RawJson val;
+      EXPECT_FALSE (RawJson::FromText (text, val)) << text;
+    }
+}
+
+TEST_F (RawJsonTests, ValidUtf8)
+{
+  for (const std::string text : {"\"\xC2\xA9\"", "\"\xE2\x82\xAC\"",
+                                 "\"\xED\x9F\xBF\"", "\"\xEF\xBF\xBD\"",
+                                 "\"\xF0\x9F\x98\x80\"",
+                                 "\"\xF4\x8F\xBF\xBF\""})
+    {
+      RawJson val;
+      EXPECT_TRUE (RawJson::FromText (text, val)) << text;
+      EXPECT_EQ (val.GetValue (), ParseJson (text)) << text;
+    }
+}
+
+TEST_F (RawJsonTests, InvalidUtf8)
+{
+  for (const std::string text : {
+          /* Stray continuation byte and invalid lead bytes.  */
+          "\"\x80\"", "\"\xFE\"", "\"\xFF\"",
+          /* Truncated sequences.  */
+          "\"\xC2\"", "\"\xE2\x82\"", "\"\xF0\x9F\x98\"", "\"\xE2",
+          /* Overlong encodings.  */
+          "\"\xC0\xAF\"", "\"\xC1\xBF\"", "\"\xE0\x80\xAF\"",
+          "\"\xF0\x80\x80\xAF\"",
+          /* Surrogates and code points beyond U+10FFFF.  */
+          "\"\xED\xA0\x80\"", "\"\xF4\x90\x80\x80\"",
+          "\"\xF5\x80\x80\x80\"",
+        })
+    {
+      RawJson val;
+      EXPECT_FALSE (RawJson::FromText (text, val)) << text;
+    }
+
+  std::map<std::string, RawJson> members;
+  EXPECT_FALSE (RawJson::SplitObject ("{\"a\": \"\xC3\x28\"}", members));
+}
+
+TEST_F (RawJsonTests, NestingLimit)
+{
+  const std::string deep = std::string (1000, '[') + std::string (1000, ']');
+  RawJson val;
+  EXPECT_FALSE (RawJson::FromText (deep, val));
+}
+
+TEST_F (RawJsonTests, SplitObject)
+{
+  std::map<std::string, RawJson> members;
+  ASSERT_TRUE (RawJson::SplitObject (R"(
+    {
+      "id": 1,
+      "result": {"foo": [1, 2]},
+      "esc\"aped": null
+    }
+  )", members));
+
+  std::map<std::string, std::string> texts;
+  for (const auto& entry : members)
+    texts.emplace (entry.first, entry.second.GetText ());
+  EXPECT_THAT (texts, ElementsAre (
+    Pair ("esc\"aped", "null"),
+    Pair ("id", "1"),
+    Pair ("result", R"({"foo":[1,2]})")
+  ));
+}
+
+TEST_F (RawJsonTests, SplitObjectInvalid)
+{
+  std::map<std::string, RawJson> members;
+  EXPECT_FALSE (RawJson::SplitObject ("[]", members));
+  EXPECT_FALSE (RawJson::SplitObject (R"({"a": })", members));
+  EXPECT_FALSE (RawJson::SplitObject (R"({"a": 1} x)", members));
+}
+
+TEST_F (RawJsonTests, SplitArray)
+{
+  std::vector<RawJson> elements;
+  ASSERT_TRUE (RawJson::SplitArray (R"( [1, {"a": [2, 3]}, "x y", []] )",
+                                    elements));
+
+  std::vector<std::string> texts;
+  for (const auto& e : elements)
+    texts.push_back (e.GetText ());
+  EXPECT_THAT (texts, ElementsAre ("1", R"({"a":[2,3]})", R"("x y")", "[]"));
+
+  ASSERT_TRUE (RawJson::SplitArray ("[]", elements));
+  EXPECT_TRUE (elements.empty ());
+}
+
+TEST_F (RawJsonTests, SplitArrayInvalid)
+{
+  std::vector<RawJson> elements;
+  EXPECT_FALSE (RawJson::SplitArray ("{}", elements));
+  EXPECT_FALSE (RawJson::SplitArray ("[1,]", elements));
+  EXPECT_FALSE (RawJson::SplitArray ("[1] x", elements));
+}
+
+TEST_F (RawJsonTests, CopiesShareData)
+{
+  RawJson a;
+  ASSERT_TRUE (RawJson::FromText (R"({"foo": "bar"})", a));
+  const RawJson b = a;
+  EXPECT_EQ (&a.GetValue (), &b.GetValue ());
+}
+
+} // anonymous namespace
+} // namespace charon
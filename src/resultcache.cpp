@@ -0,0 +1,118 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/resultcache.hpp"
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+ResultCache::ResultCache (const size_t m)
+  : maxEntries(m)
+{}
+
+std::string
+ResultCache::GetKey (const std::string& method, const Json::Value& params)
+{
+  /* The JSON serialisation of jsoncpp is canonical already (in particular,
+     object members are always written in sorted order).  Method names
+     cannot contain a newline, so that makes the key unique.  */
+  Json::StreamWriterBuilder wbuilder;
+  wbuilder["commentStyle"] = "None";
+  wbuilder["indentation"] = "";
+  wbuilder["enableYAMLCompatibility"] = false;
+  wbuilder["dropNullPlaceholders"] = false;
+  wbuilder["useSpecialFloats"] = false;
+
+  return method + "\n" + Json::writeString (wbuilder, params);
+}
+
+bool
+ResultCache::Lookup (const std::string& key, RawJson& result)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = entries.find (key);
+  if (mit == entries.end ())
+    {
+      ++misses;
+      return false;
+    }
+
+  ++hits;
+  result = mit->second;
+  return true;
+}
+
+ResultCache::Generation
+ResultCache::GetGeneration () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return generation;
+}
+
+void
+ResultCache::Insert (const std::string& key, const Generation gen,
+                     const RawJson& result)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (gen != generation)
+    {
+      VLOG (1) << "Not caching result from old generation " << gen;
+      return;
+    }
+
+  if (entries.size () >= maxEntries)
+    {
+      VLOG (1) << "Result cache is full";
+      return;
+    }
+
+  entries.emplace (key, result);
+}
+
+void
+ResultCache::Flush ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  VLOG (1)
+      << "Flushing " << entries.size () << " cached results"
+      << " (generation " << generation << ")";
+
+  entries.clear ();
+  ++generation;
+}
+
+uint64_t
+ResultCache::GetHits () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return hits;
+}
+
+uint64_t
+ResultCache::GetMisses () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return misses;
+}
+
+} // namespace charon
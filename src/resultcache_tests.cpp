@@ -0,0 +1,115 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/resultcache.hpp"
+
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+namespace charon
+{
+namespace
+{
+
+class ResultCacheTests : public testing::Test
+{
+
+protected:
+
+  ResultCache cache;
+
+  ResultCacheTests ()
+    : cache(2)
+  {}
+
+  /**
+   * Looks up the key for the given call and returns the cached value
+   * or JSON null if there is none.
+   */
+  Json::Value
+  Get (const std::string& method, const std::string& params)
+  {
+    RawJson res;
+    if (!cache.Lookup (ResultCache::GetKey (method, ParseJson (params)), res))
+      return Json::Value ();
+
+    return res.GetValue ();
+  }
+
+  /**
+   * Inserts a value for the given call at the current generation.
+   */
+  void
+  Put (const std::string& method, const std::string& params,
+       const Json::Value& val)
+  {
+    cache.Insert (ResultCache::GetKey (method, ParseJson (params)),
+                  cache.GetGeneration (), val);
+  }
+
+};
+
+TEST_F (ResultCacheTests, KeysAreCanonical)
+{
+  EXPECT_EQ (ResultCache::GetKey ("foo", ParseJson (R"({"a": 1, "b": 2})")),
+             ResultCache::GetKey ("foo", ParseJson (R"({ "b":2,"a":1 })")));
+  EXPECT_NE (ResultCache::GetKey ("foo", ParseJson ("[1, 2]")),
+             ResultCache::GetKey ("foo", ParseJson ("[2, 1]")));
+  EXPECT_NE (ResultCache::GetKey ("foo", ParseJson ("[]")),
+             ResultCache::GetKey ("bar", ParseJson ("[]")));
+}
+
+TEST_F (ResultCacheTests, LookupAndFlush)
+{
+  EXPECT_TRUE (Get ("foo", "[1]").isNull ());
+  Put ("foo", "[1]", 42);
+  EXPECT_EQ (Get ("foo", "[1]"), 42);
+  EXPECT_TRUE (Get ("foo", "[2]").isNull ());
+
+  cache.Flush ();
+  EXPECT_TRUE (Get ("foo", "[1]").isNull ());
+
+  EXPECT_EQ (cache.GetHits (), 1);
+  EXPECT_EQ (cache.GetMisses (), 3);
+}
+
+TEST_F (ResultCacheTests, OldGeneration)
+{
+  const auto key = ResultCache::GetKey ("foo", ParseJson ("[]"));
+  const auto gen = cache.GetGeneration ();
+  cache.Flush ();
+  cache.Insert (key, gen, Json::Value (42));
+
+  RawJson res;
+  EXPECT_FALSE (cache.Lookup (key, res));
+}
+
+TEST_F (ResultCacheTests, MaxEntries)
+{
+  Put ("foo", "[1]", 1);
+  Put ("foo", "[2]", 2);
+  Put ("foo", "[3]", 3);
+
+  EXPECT_EQ (Get ("foo", "[1]"), 1);
+  EXPECT_EQ (Get ("foo", "[2]"), 2);
+  EXPECT_TRUE (Get ("foo", "[3]").isNull ());
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,360 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rpcbatcher.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+
+#include <glog/logging.h>
+
+#include <map>
+#include <sstream>
+
+namespace charon
+{
+
+/**
+ * A batch of calls that are collected and sent together.
+ */
+class BatchingRpcServer::Batch
+{
+
+public:
+
+  /** Data for one call in the batch.  */
+  struct Call
+  {
+
+    /** The method name.  */
+    std::string method;
+
+    /** The call's params.  */
+    RawJson params;
+
+    /** Abort check for the call (may be null).  */
+    AbortCheck aborted;
+
+    /** The completion callback for the call.  */
+    Completion cb;
+
+  };
+
+  /** The calls in the batch.  Their index is used as JSON-RPC ID.  */
+  std::vector<Call> calls;
+
+  /**
+   * Completes all calls with the same error.
+   */
+  void
+  Fail (const RpcServer::Error& err)
+  {
+    const RpcResult res(err);
+    for (const auto& c : calls)
+      c.cb (res);
+  }
+
+  /**
+   * Completes all calls that have been aborted with an error, and removes
+   * them from the batch.
+   */
+  void
+  DropAborted ()
+  {
+    std::vector<Call> remaining;
+    for (auto& c : calls)
+      {
+        if (c.aborted == nullptr || !c.aborted ())
+          {
+            remaining.push_back (std::move (c));
+            continue;
+          }
+
+        VLOG (1) << "Not sending aborted call to " << c.method;
+        const RpcServer::Error err(jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                   "call aborted");
+        c.cb (RpcResult (err));
+      }
+
+    calls = std::move (remaining);
+  }
+
+};
+
+namespace
+{
+
+/**
+ * Converts the (already split) response of a single call from a batch
+ * response to its result.  The result itself is passed on without
+ * parsing it.
+ */
+RpcResult
+ParseCallResponse (const std::map<std::string, RawJson>& resp)
+{
+  const auto mitRes = resp.find ("result");
+  if (mitRes != resp.end ())
+    return RpcResult (mitRes->second);
+
+  const auto mitErr = resp.find ("error");
+  if (mitErr != resp.end ())
+    {
+      const auto& err = mitErr->second.GetValue ();
+      if (err.isObject () && err["code"].isInt ()
+            && err["message"].isString ())
+        return RpcResult (RpcServer::Error (err["code"].asInt (),
+                                            err["message"].asString (),
+                                            err["data"]));
+    }
+
+  std::ostringstream msg;
+  msg << "invalid response for call in batch";
+  if (mitErr != resp.end ())
+    msg << ": " << mitErr->second.GetText ();
+  return RpcResult (RpcServer::Error (
+      jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, msg.str ()));
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+BatchingRpcServer::BatchingRpcServer (std::shared_ptr<RpcConnectionPool> p,
+                                      const size_t maxSize,
+                                      const std::chrono::milliseconds d,
+                                      const unsigned threads,
+                                      const size_t maxQueue)
+  : pool(std::move (p)), maxBatchSize(maxSize), maxDelay(d),
+    maxQueued(maxQueue)
+{
+  CHECK_GT (maxBatchSize, 0);
+  CHECK_GT (threads, 0);
+  CHECK_GT (maxQueued, 0);
+
+  senders.reserve (threads);
+  for (unsigned i = 0; i < threads; ++i)
+    senders.emplace_back ([this] ()
+      {
+        RunSender ();
+      });
+}
+
+BatchingRpcServer::~BatchingRpcServer ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  for (auto& s : senders)
+    s.join ();
+
+  CHECK (current == nullptr);
+  CHECK (ready.empty ());
+}
+
+void
+BatchingRpcServer::HandleMethodAsync (const std::string& method,
+                                      const RawJson& params,
+                                      Completion cb)
+{
+  HandleAbortableMethod (method, params, nullptr, std::move (cb));
+}
+
+void
+BatchingRpcServer::HandleAbortableMethod (const std::string& method,
+                                          const RawJson& params,
+                                          const AbortCheck& aborted,
+                                          Completion cb)
+{
+  VLOG (1) << "Attempted batched call to " << method;
+  VLOG (2) << "Parameters: " << params.GetText ();
+
+  if (methods.count (method) == 0)
+    {
+      std::ostringstream msg;
+      msg << "method not found or not allowed: " << method;
+      const RpcServer::Error err(jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND,
+                                 msg.str ());
+      cb (RpcResult (err));
+      return;
+    }
+
+  std::unique_lock<std::mutex> lock(mut);
+  CHECK (!shouldStop);
+
+  if (numQueued >= maxQueued)
+    {
+      lock.unlock ();
+      LOG (WARNING) << "Too many pending calls, rejecting call to " << method;
+      const RpcServer::Error err(RpcServer::ERROR_BUSY,
+                                 "server is overloaded");
+      cb (RpcResult (err));
+      return;
+    }
+
+  if (current == nullptr)
+    {
+      current = std::make_unique<Batch> ();
+      deadline = std::chrono::steady_clock::now () + maxDelay;
+    }
+
+  Batch::Call c;
+  c.method = method;
+  c.params = params;
+  c.aborted = aborted;
+  c.cb = std::move (cb);
+  current->calls.push_back (std::move (c));
+  ++numQueued;
+
+  if (current->calls.size () >= maxBatchSize)
+    ready.push_back (std::move (current));
+
+  cv.notify_all ();
+}
+
+void
+BatchingRpcServer::RunSender ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      if (!ready.empty ())
+        {
+          auto b = std::move (ready.front ());
+          ready.pop_front ();
+          CHECK_GE (numQueued, b->calls.size ());
+          numQueued -= b->calls.size ();
+
+          lock.unlock ();
+          SendBatch (*b);
+          lock.lock ();
+
+          continue;
+        }
+
+      if (current != nullptr)
+        {
+          if (shouldStop || std::chrono::steady_clock::now () >= deadline)
+            {
+              ready.push_back (std::move (current));
+              continue;
+            }
+
+          cv.wait_until (lock, deadline);
+          continue;
+        }
+
+      if (shouldStop)
+        return;
+
+      cv.wait (lock);
+    }
+}
+
+size_t
+BatchingRpcServer::GetNumQueuedCalls () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return numQueued;
+}
+
+void
+BatchingRpcServer::SendBatch (Batch& b)
+{
+  /* Calls may have been aborted while they were waiting for the batch
+     to fill up.  There is no point in sending those to the backend.  */
+  b.DropAborted ();
+  if (b.calls.empty ())
+    return;
+
+  VLOG (1) << "Sending batch of " << b.calls.size () << " calls";
+
+  /* Like in ForwardingRpcServer, the request is put together with the
+     serialised params directly, and the response is only split up into
+     the individual calls' results without parsing them.  */
+  std::ostringstream request;
+  request << "[";
+  for (size_t i = 0; i < b.calls.size (); ++i)
+    {
+      if (i > 0)
+        request << ",";
+      request
+          << R"({"jsonrpc":"2.0","id":)" << i
+          << R"(,"method":)"
+          << Json::valueToQuotedString (b.calls[i].method.c_str ());
+      if (!b.calls[i].params.IsNull ())
+        request << R"(,"params":)" << b.calls[i].params.GetText ();
+      request << "}";
+    }
+  request << "]";
+
+  std::string responseStr;
+  try
+    {
+      auto conn = pool->Get ();
+      conn.GetConnector ().SendRPCMessage (request.str (), responseStr);
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (WARNING) << "Sending batch failed: " << exc.what ();
+      b.Fail (exc);
+      return;
+    }
+
+  std::vector<RawJson> response;
+  if (!RawJson::SplitArray (responseStr, response))
+    {
+      LOG (WARNING) << "Invalid batch response:\n" << responseStr;
+      b.Fail (RpcServer::Error (jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                                "invalid batch response"));
+      return;
+    }
+
+  std::map<Json::UInt64, std::map<std::string, RawJson>> byId;
+  for (const auto& resp : response)
+    {
+      std::map<std::string, RawJson> members;
+      if (!RawJson::SplitObject (resp.GetText (), members))
+        continue;
+
+      const auto mitId = members.find ("id");
+      if (mitId == members.end () || !mitId->second.GetValue ().isUInt64 ())
+        continue;
+
+      const auto id = mitId->second.GetValue ().asUInt64 ();
+      byId.emplace (id, std::move (members));
+    }
+
+  for (size_t i = 0; i < b.calls.size (); ++i)
+    {
+      const auto mit = byId.find (i);
+      if (mit == byId.end ())
+        {
+          const RpcServer::Error err(
+              jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+              "no response for call in batch");
+          b.calls[i].cb (RpcResult (err));
+          continue;
+        }
+
+      b.calls[i].cb (ParseCallResponse (mit->second));
+    }
+}
+
+} // namespace charon
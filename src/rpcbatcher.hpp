@@ -0,0 +1,162 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_RPCBATCHER_HPP
+#define CHARON_RPCBATCHER_HPP
+
+#include "rpcpool.hpp"
+#include "rpcserver.hpp"
+
+#include <json/json.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * AsyncRpcServer that forwards calls to a list of allowed methods to
+ * a JSON-RPC backend (like ForwardingRpcServer), but collects calls
+ * that come in within a short time window and sends them together as
+ * a single JSON-RPC 2.0 batch request.  The results are then passed
+ * back to the individual calls.
+ *
+ * A batch is sent when it reaches the maximum size, or when the first
+ * call in it has been waiting for the maximum delay.  If too many calls
+ * are waiting to be sent already, new calls fail with an "overloaded"
+ * error (like with ThreadedRpcServer).  Calls that are aborted while they
+ * wait are not sent to the backend.
+ */
+class BatchingRpcServer : public AsyncRpcServer
+{
+
+private:
+
+  class Batch;
+
+  /** The list of allowed methods.  */
+  std::unordered_set<std::string> methods;
+
+  /** The connections to the backend.  */
+  std::shared_ptr<RpcConnectionPool> pool;
+
+  /** Maximum number of calls in a batch.  */
+  const size_t maxBatchSize;
+
+  /** Maximum time a call waits for more calls to batch it with.  */
+  const std::chrono::milliseconds maxDelay;
+
+  /** Maximum number of calls waiting to be sent.  */
+  const size_t maxQueued;
+
+  /** Number of calls in the current and ready batches.  */
+  size_t numQueued = 0;
+
+  /** The batch currently being collected (or null).  */
+  std::unique_ptr<Batch> current;
+
+  /** Time at which the current batch has to be sent at the latest.  */
+  std::chrono::steady_clock::time_point deadline;
+
+  /** Batches that are ready to be sent.  */
+  std::deque<std::unique_ptr<Batch>> ready;
+
+  /** Set to true when the sender threads should stop.  */
+  bool shouldStop = false;
+
+  /** Mutex for the batching state.  */
+  mutable std::mutex mut;
+
+  /** Condition variable signalled when the batching state changes.  */
+  std::condition_variable cv;
+
+  /** Threads sending batches to the backend.  */
+  std::vector<std::thread> senders;
+
+  /**
+   * Main function of the sender threads.
+   */
+  void RunSender ();
+
+  /**
+   * Sends a batch to the backend and completes all its calls.
+   */
+  void SendBatch (Batch& b);
+
+public:
+
+  /**
+   * Constructs an instance that sends batches of at most the given size
+   * through the connection pool, waiting at most the given delay for more
+   * calls.  Up to the given number of batches can be in flight at the
+   * same time, and up to maxQueue calls can wait for being sent.
+   */
+  explicit BatchingRpcServer (std::shared_ptr<RpcConnectionPool> p,
+                              size_t maxSize, std::chrono::milliseconds d,
+                              unsigned threads, size_t maxQueue);
+
+  /**
+   * Sends all pending calls and stops the sender threads.
+   */
+  ~BatchingRpcServer ();
+
+  BatchingRpcServer () = delete;
+  BatchingRpcServer (const BatchingRpcServer&) = delete;
+  void operator= (const BatchingRpcServer&) = delete;
+
+  /**
+   * Allows the given method.  Must be called before any calls are made.
+   */
+  void
+  AllowMethod (const std::string& method)
+  {
+    methods.insert (method);
+  }
+
+  void HandleMethodAsync (const std::string& method, const RawJson& params,
+                          Completion cb) override;
+
+  /**
+   * Queues an abortable call.  If the call has been aborted by the time
+   * its batch is sent, it is completed with an error instead of being
+   * included in the request.
+   */
+  void HandleAbortableMethod (const std::string& method,
+                              const RawJson& params,
+                              const AbortCheck& aborted,
+                              Completion cb) override;
+
+  /**
+   * Returns the number of calls that are waiting to be sent in a batch.
+   */
+  size_t GetNumQueuedCalls () const override;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_RPCBATCHER_HPP
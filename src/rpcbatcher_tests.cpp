@@ -0,0 +1,285 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rpcbatcher.hpp"
+
+#include "testutils.hpp"
+
+#include <jsonrpccpp/common/errors.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace charon
+{
+namespace
+{
+
+/**
+ * Collector for results of calls, keyed by some integer that is chosen
+ * by the test.
+ */
+class ResultCollector
+{
+
+private:
+
+  /** The results received so far.  */
+  std::map<int, RpcResult> results;
+
+  /** Mutex for the results.  */
+  std::mutex mut;
+
+  /** Condition variable signalled when a result is added.  */
+  std::condition_variable cv;
+
+public:
+
+  ResultCollector () = default;
+
+  /**
+   * Returns a completion callback that stores the result with the
+   * given key.
+   */
+  AsyncRpcServer::Completion
+  Get (const int key)
+  {
+    return [this, key] (const RpcResult& res)
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        const auto ins = results.emplace (key, res);
+        CHECK (ins.second) << "Duplicate result for " << key;
+        cv.notify_all ();
+      };
+  }
+
+  /**
+   * Waits for the result with the given key and returns it.
+   */
+  RpcResult
+  Wait (const int key)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (results.count (key) == 0)
+      cv.wait (lock);
+
+    return results.at (key);
+  }
+
+};
+
+class BatchingRpcServerTests : public testing::Test
+{
+
+private:
+
+  TestRpcBackend backend;
+
+protected:
+
+  /** Limit for queued calls used in tests that do not exercise it.  */
+  static constexpr size_t MAX_QUEUE = 100;
+
+  /** The connection pool used.  */
+  std::shared_ptr<RpcConnectionPool> pool;
+
+  ResultCollector results;
+
+  BatchingRpcServerTests ()
+    : pool(std::make_shared<RpcConnectionPool> (TestRpcBackend::URL, 2))
+  {}
+
+  /**
+   * Sets up the methods of the backend as allowed methods.
+   */
+  static void
+  AllowMethods (BatchingRpcServer& srv)
+  {
+    srv.AllowMethod ("echobypos");
+    srv.AllowMethod ("echobyname");
+    srv.AllowMethod ("error");
+  }
+
+};
+
+constexpr size_t BatchingRpcServerTests::MAX_QUEUE;
+
+TEST_F (BatchingRpcServerTests, SingleCall)
+{
+  BatchingRpcServer srv(pool, 10, std::chrono::milliseconds (1), 1,
+                        MAX_QUEUE);
+  AllowMethods (srv);
+
+  srv.HandleMethodAsync ("echobyname", ParseJson (R"({"value": 10})"),
+                         results.Get (1));
+
+  const auto res = results.Wait (1);
+  ASSERT_TRUE (res.IsSuccess ());
+  EXPECT_EQ (res.GetResult (), 10);
+}
+
+TEST_F (BatchingRpcServerTests, FullBatches)
+{
+  /* The delay is long enough that the test would time out if we did not
+     send batches once they are full.  */
+  BatchingRpcServer srv(pool, 3, std::chrono::hours (1), 2, MAX_QUEUE);
+  AllowMethods (srv);
+
+  for (int i = 0; i < 6; ++i)
+    {
+      Json::Value params(Json::arrayValue);
+      params.append (i);
+      srv.HandleMethodAsync ("echobypos", params, results.Get (i));
+    }
+
+  for (int i = 0; i < 6; ++i)
+    {
+      const auto res = results.Wait (i);
+      ASSERT_TRUE (res.IsSuccess ());
+      EXPECT_EQ (res.GetResult (), i);
+    }
+}
+
+TEST_F (BatchingRpcServerTests, MixedResults)
+{
+  BatchingRpcServer srv(pool, 10, std::chrono::milliseconds (10), 1,
+                        MAX_QUEUE);
+  AllowMethods (srv);
+
+  srv.HandleMethodAsync ("echobypos", ParseJson ("[5]"), results.Get (1));
+  srv.HandleMethodAsync ("error", ParseJson (R"(
+    {
+      "code": 42,
+      "msg": "error",
+      "data": {"foo": "bar"}
+    }
+  )"), results.Get (2));
+  srv.HandleMethodAsync ("donotcall", ParseJson ("[]"), results.Get (3));
+
+  const auto res1 = results.Wait (1);
+  ASSERT_TRUE (res1.IsSuccess ());
+  EXPECT_EQ (res1.GetResult (), 5);
+
+  const auto res2 = results.Wait (2);
+  ASSERT_FALSE (res2.IsSuccess ());
+  EXPECT_EQ (res2.GetErrorCode (), 42);
+  EXPECT_EQ (res2.GetErrorMessage (), "error");
+  EXPECT_EQ (res2.GetErrorData (), ParseJson (R"({"foo": "bar"})"));
+
+  const auto res3 = results.Wait (3);
+  ASSERT_FALSE (res3.IsSuccess ());
+  EXPECT_EQ (res3.GetErrorCode (), jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND);
+}
+
+TEST_F (BatchingRpcServerTests, QueueLimit)
+{
+  {
+    /* With the long delay, the calls stay queued until the server
+       is destructed (which sends the pending batch).  */
+    BatchingRpcServer srv(pool, 10, std::chrono::hours (1), 1, 2);
+    AllowMethods (srv);
+
+    srv.HandleMethodAsync ("echobypos", ParseJson ("[1]"), results.Get (1));
+    srv.HandleMethodAsync ("echobypos", ParseJson ("[2]"), results.Get (2));
+    EXPECT_EQ (srv.GetNumQueuedCalls (), 2);
+
+    srv.HandleMethodAsync ("echobypos", ParseJson ("[3]"), results.Get (3));
+    const auto res = results.Wait (3);
+    ASSERT_FALSE (res.IsSuccess ());
+    EXPECT_EQ (res.GetErrorCode (), RpcServer::ERROR_BUSY);
+    EXPECT_EQ (srv.GetNumQueuedCalls (), 2);
+  }
+
+  for (int i = 1; i <= 2; ++i)
+    {
+      const auto res = results.Wait (i);
+      ASSERT_TRUE (res.IsSuccess ());
+      EXPECT_EQ (res.GetResult (), i);
+    }
+}
+
+TEST_F (BatchingRpcServerTests, AbortedCallsNotSent)
+{
+  {
+    BatchingRpcServer srv(pool, 10, std::chrono::hours (1), 1, MAX_QUEUE);
+    AllowMethods (srv);
+
+    std::atomic<bool> aborted(false);
+    srv.HandleAbortableMethod ("echobypos", ParseJson ("[1]"),
+                               [&aborted] () { return aborted.load (); },
+                               results.Get (1));
+    srv.HandleAbortableMethod ("echobypos", ParseJson ("[2]"),
+                               [] () { return false; }, results.Get (2));
+    srv.HandleAbortableMethod ("error", ParseJson (R"({"code": 42})"),
+                               [] () { return true; }, results.Get (3));
+    aborted = true;
+  }
+
+  const auto res1 = results.Wait (1);
+  ASSERT_FALSE (res1.IsSuccess ());
+  EXPECT_EQ (res1.GetErrorMessage (), "call aborted");
+
+  const auto res2 = results.Wait (2);
+  ASSERT_TRUE (res2.IsSuccess ());
+  EXPECT_EQ (res2.GetResult (), 2);
+
+  const auto res3 = results.Wait (3);
+  ASSERT_FALSE (res3.IsSuccess ());
+  EXPECT_EQ (res3.GetErrorMessage (), "call aborted");
+}
+
+TEST_F (BatchingRpcServerTests, OnlyAbortedCalls)
+{
+  {
+    BatchingRpcServer srv(pool, 10, std::chrono::hours (1), 1, MAX_QUEUE);
+    AllowMethods (srv);
+
+    srv.HandleAbortableMethod ("echobypos", ParseJson ("[1]"),
+                               [] () { return true; }, results.Get (1));
+  }
+
+  const auto res = results.Wait (1);
+  ASSERT_FALSE (res.IsSuccess ());
+  EXPECT_EQ (res.GetErrorMessage (), "call aborted");
+}
+
+TEST_F (BatchingRpcServerTests, BackendUnavailable)
+{
+  auto otherPool = std::make_shared<RpcConnectionPool> (
+      "http://localhost:1", 1);
+  BatchingRpcServer srv(otherPool, 10, std::chrono::milliseconds (1), 1,
+                        MAX_QUEUE);
+  AllowMethods (srv);
+
+  srv.HandleMethodAsync ("echobypos", ParseJson ("[5]"), results.Get (1));
+  srv.HandleMethodAsync ("echobypos", ParseJson ("[6]"), results.Get (2));
+
+  EXPECT_FALSE (results.Wait (1).IsSuccess ());
+  EXPECT_FALSE (results.Wait (2).IsSuccess ());
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,218 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rpcpool.hpp"
+
+#include <jsonrpccpp/client/connectors/unixdomainsocketclient.h>
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+namespace
+{
+
+/** URL prefix for backends reachable through a Unix domain socket.  */
+const std::string UNIX_PREFIX = "unix:";
+
+} // anonymous namespace
+
+/**
+ * A single connection in the pool, consisting of the underlying connector
+ * (HTTP or Unix domain socket) and the JSON-RPC client on top of it.
+ */
+class RpcConnectionPool::Connection
+{
+
+private:
+
+  /** The connector.  */
+  std::unique_ptr<jsonrpc::IClientConnector> connector;
+
+  /** The HTTP connector, if this is an HTTP connection (null otherwise).  */
+  jsonrpc::HttpClient* http = nullptr;
+
+  /** The RPC client.  */
+  std::unique_ptr<jsonrpc::Client> client;
+
+public:
+
+  explicit Connection (const std::string& url)
+  {
+    if (url.compare (0, UNIX_PREFIX.size (), UNIX_PREFIX) == 0)
+      connector = std::make_unique<jsonrpc::UnixDomainSocketClient> (
+          url.substr (UNIX_PREFIX.size ()));
+    else
+      {
+        auto h = std::make_unique<jsonrpc::HttpClient> (url);
+        http = h.get ();
+        connector = std::move (h);
+      }
+
+    client = std::make_unique<jsonrpc::Client> (*connector);
+  }
+
+  Connection () = delete;
+  Connection (const Connection&) = delete;
+  void operator= (const Connection&) = delete;
+
+  void
+  SetTimeout (const long ms)
+  {
+    /* The Unix domain socket connector does not support timeouts.  */
+    if (http != nullptr)
+      http->SetTimeout (ms);
+  }
+
+  jsonrpc::Client&
+  GetClient ()
+  {
+    return *client;
+  }
+
+  jsonrpc::IClientConnector&
+  GetConnector ()
+  {
+    return *connector;
+  }
+
+};
+
+/* ************************************************************************** */
+
+RpcConnectionPool::Handle::Handle (RpcConnectionPool& p,
+                                   std::unique_ptr<Connection> c)
+  : pool(&p), conn(std::move (c))
+{}
+
+RpcConnectionPool::Handle::Handle (Handle&& o)
+  : pool(o.pool), conn(std::move (o.conn))
+{}
+
+RpcConnectionPool::Handle::~Handle ()
+{
+  if (conn != nullptr)
+    pool->Return (std::move (conn));
+}
+
+jsonrpc::Client&
+RpcConnectionPool::Handle::operator* ()
+{
+  CHECK (conn != nullptr);
+  return conn->GetClient ();
+}
+
+jsonrpc::Client*
+RpcConnectionPool::Handle::operator-> ()
+{
+  return &(**this);
+}
+
+jsonrpc::IClientConnector&
+RpcConnectionPool::Handle::GetConnector ()
+{
+  CHECK (conn != nullptr);
+  return conn->GetConnector ();
+}
+
+/* ************************************************************************** */
+
+RpcConnectionPool::RpcConnectionPool (const std::string& u,
+                                      const size_t maxConn)
+  : url(u), maxConnections(maxConn)
+{
+  CHECK_GT (maxConnections, 0);
+}
+
+RpcConnectionPool::~RpcConnectionPool ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK_EQ (idle.size (), total) << "Connections are still in use";
+}
+
+void
+RpcConnectionPool::SetTimeout (const long ms)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  /* Connections currently in use get the new timeout when they are
+     returned to the pool.  */
+  timeout = ms;
+  for (auto& c : idle)
+    c->SetTimeout (timeout);
+}
+
+RpcConnectionPool::Handle
+RpcConnectionPool::Get ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  while (true)
+    {
+      if (!idle.empty ())
+        {
+          auto c = std::move (idle.back ());
+          idle.pop_back ();
+          return Handle (*this, std::move (c));
+        }
+
+      if (total < maxConnections)
+        {
+          ++total;
+          VLOG (1)
+              << "Opening connection " << total << " to backend at " << url;
+
+          auto c = std::make_unique<Connection> (url);
+          if (timeout >= 0)
+            c->SetTimeout (timeout);
+
+          return Handle (*this, std::move (c));
+        }
+
+      cv.wait (lock);
+    }
+}
+
+void
+RpcConnectionPool::Return (std::unique_ptr<Connection> c)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (timeout >= 0)
+    c->SetTimeout (timeout);
+
+  idle.push_back (std::move (c));
+  cv.notify_one ();
+}
+
+size_t
+RpcConnectionPool::GetNumConnections () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return total;
+}
+
+size_t
+RpcConnectionPool::GetNumInUse () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return total - idle.size ();
+}
+
+} // namespace charon
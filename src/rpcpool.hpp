@@ -0,0 +1,166 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_RPCPOOL_HPP
+#define CHARON_RPCPOOL_HPP
+
+#include <jsonrpccpp/client.h>
+#include <jsonrpccpp/client/connectors/httpclient.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * A bounded pool of JSON-RPC client connections to some backend endpoint.
+ * Each connection is used by only one thread at a time, and is kept around
+ * after use so that the underlying HTTP connection can be kept alive and
+ * reused for later calls.
+ *
+ * Connections are created lazily as needed, up to the configured maximum.
+ * If all of them are in use, further requests for one block until one
+ * is returned to the pool.
+ *
+ * The backend is normally reached over HTTP.  If the URL has the form
+ * "unix:/path/to/socket", connections are made through the given Unix
+ * domain socket instead, which avoids the TCP and HTTP overhead for
+ * backends on the same host.
+ */
+class RpcConnectionPool
+{
+
+private:
+
+  class Connection;
+
+  /** The URL of the backend.  */
+  const std::string url;
+
+  /** Maximum number of connections to open.  */
+  const size_t maxConnections;
+
+  /** Timeout in milliseconds to set on the connections (or -1 if unset).  */
+  long timeout = -1;
+
+  /** Connections that are currently not in use.  */
+  std::vector<std::unique_ptr<Connection>> idle;
+
+  /** Total number of connections (idle and in use).  */
+  size_t total = 0;
+
+  /** Mutex for the pool state.  */
+  mutable std::mutex mut;
+
+  /** Condition variable signalled when a connection is returned.  */
+  std::condition_variable cv;
+
+  /**
+   * Returns a connection to the pool after use.
+   */
+  void Return (std::unique_ptr<Connection> c);
+
+public:
+
+  class Handle;
+
+  /**
+   * Constructs a pool for the given backend URL, which opens at most
+   * the given number of connections.
+   */
+  explicit RpcConnectionPool (const std::string& u, size_t maxConn);
+
+  ~RpcConnectionPool ();
+
+  RpcConnectionPool () = delete;
+  RpcConnectionPool (const RpcConnectionPool&) = delete;
+  void operator= (const RpcConnectionPool&) = delete;
+
+  /**
+   * Sets the timeout (in milliseconds) for calls on all connections.
+   * This has no effect for Unix domain socket connections.
+   */
+  void SetTimeout (long ms);
+
+  /**
+   * Checks out a connection from the pool for use by the caller.  If all
+   * connections are in use, this blocks until one becomes available.
+   * The connection is returned when the handle is destructed.
+   */
+  Handle Get ();
+
+  /**
+   * Returns the number of connections opened so far.
+   */
+  size_t GetNumConnections () const;
+
+  /**
+   * Returns the number of connections that are currently checked out.
+   */
+  size_t GetNumInUse () const;
+
+};
+
+/**
+ * A connection checked out from an RpcConnectionPool.  It gives access
+ * to the underlying JSON-RPC client while it is alive, and returns the
+ * connection to the pool when destructed.
+ */
+class RpcConnectionPool::Handle
+{
+
+private:
+
+  /** The pool this belongs to.  */
+  RpcConnectionPool* pool;
+
+  /** The connection itself.  */
+  std::unique_ptr<Connection> conn;
+
+  explicit Handle (RpcConnectionPool& p, std::unique_ptr<Connection> c);
+
+  friend class RpcConnectionPool;
+
+public:
+
+  Handle (Handle&& o);
+  ~Handle ();
+
+  Handle () = delete;
+  Handle (const Handle&) = delete;
+  void operator= (const Handle&) = delete;
+
+  jsonrpc::Client& operator* ();
+  jsonrpc::Client* operator-> ();
+
+  /**
+   * Gives access to the underlying connector, e.g. to send raw messages
+   * that the JSON-RPC client does not support directly.
+   */
+  jsonrpc::IClientConnector& GetConnector ();
+
+};
+
+} // namespace charon
+
+#endif // CHARON_RPCPOOL_HPP
@@ -0,0 +1,99 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rpcpool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+/** URL used for the pool.  No calls are actually made to it.  */
+constexpr const char* RPC_URL = "http://localhost:42042";
+
+using RpcConnectionPoolTests = testing::Test;
+
+TEST_F (RpcConnectionPoolTests, ConnectionsAreReused)
+{
+  RpcConnectionPool pool(RPC_URL, 5);
+
+  jsonrpc::Client* first;
+  {
+    auto c = pool.Get ();
+    first = &*c;
+    EXPECT_EQ (pool.GetNumInUse (), 1);
+  }
+  EXPECT_EQ (pool.GetNumInUse (), 0);
+
+  auto c = pool.Get ();
+  EXPECT_EQ (&*c, first);
+  EXPECT_EQ (pool.GetNumConnections (), 1);
+}
+
+TEST_F (RpcConnectionPoolTests, OpensConnectionsAsNeeded)
+{
+  RpcConnectionPool pool(RPC_URL, 5);
+
+  std::vector<RpcConnectionPool::Handle> handles;
+  for (unsigned i = 0; i < 3; ++i)
+    handles.push_back (pool.Get ());
+
+  EXPECT_EQ (pool.GetNumConnections (), 3);
+  EXPECT_EQ (pool.GetNumInUse (), 3);
+  EXPECT_NE (&*handles[0], &*handles[1]);
+
+  handles.clear ();
+  EXPECT_EQ (pool.GetNumConnections (), 3);
+  EXPECT_EQ (pool.GetNumInUse (), 0);
+}
+
+TEST_F (RpcConnectionPoolTests, BlocksWhenExhausted)
+{
+  RpcConnectionPool pool(RPC_URL, 1);
+  std::atomic<bool> gotSecond(false);
+
+  std::unique_ptr<std::thread> other;
+  {
+    auto c = pool.Get ();
+
+    other = std::make_unique<std::thread> ([&pool, &gotSecond] ()
+      {
+        auto c2 = pool.Get ();
+        gotSecond = true;
+      });
+
+    std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    EXPECT_FALSE (gotSecond);
+  }
+
+  other->join ();
+  EXPECT_TRUE (gotSecond);
+  EXPECT_EQ (pool.GetNumConnections (), 1);
+}
+
+} // anonymous namespace
+} // namespace charon
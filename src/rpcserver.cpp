@@ -18,25 +18,428 @@
 
 #include "rpcserver.hpp"
 
+#include "private/workerpool.hpp"
+
 #include <jsonrpccpp/common/errors.h>
 
 #include <glog/logging.h>
 
+#include <exception>
+#include <map>
 #include <sstream>
 
 namespace charon
 {
 
+/* ************************************************************************** */
+
+constexpr int RpcServer::ERROR_BUSY;
+
+bool
+RpcServer::IsBackendFailure (const int code)
+{
+  return code == jsonrpc::Errors::ERROR_CLIENT_CONNECTOR
+           || code == jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE;
+}
+
+RawJson
+RpcServer::HandleRawMethod (const std::string& method, const RawJson& params)
+{
+  return RawJson (HandleMethod (method, params.GetValue ()));
+}
+
+/* ************************************************************************** */
+
+RpcResult::RpcResult (const Json::Value& res)
+  : success(true), result(res)
+{}
+
+RpcResult::RpcResult (const RawJson& res)
+  : success(true), result(res)
+{}
+
+RpcResult::RpcResult (const RpcServer::Error& exc)
+  : success(false),
+    errorCode(exc.GetCode ()), errorMsg(exc.GetMessage ()),
+    errorData(exc.GetData ())
+{}
+
+const Json::Value&
+RpcResult::GetResult () const
+{
+  CHECK (success);
+  return result.GetValue ();
+}
+
+const RawJson&
+RpcResult::GetRawResult () const
+{
+  CHECK (success);
+  return result;
+}
+
+int
+RpcResult::GetErrorCode () const
+{
+  CHECK (!success);
+  return errorCode;
+}
+
+const std::string&
+RpcResult::GetErrorMessage () const
+{
+  CHECK (!success);
+  return errorMsg;
+}
+
+const Json::Value&
+RpcResult::GetErrorData () const
+{
+  CHECK (!success);
+  return errorData;
+}
+
+/* ************************************************************************** */
+
+ThreadedRpcServer::ThreadedRpcServer (RpcServer& b, const unsigned threads,
+                                      const size_t maxQueue)
+  : backend(b)
+{
+  workers = std::make_unique<WorkerPool> (threads, maxQueue);
+}
+
+ThreadedRpcServer::~ThreadedRpcServer () = default;
+
+void
+ThreadedRpcServer::HandleMethodAsync (const std::string& method,
+                                      const RawJson& params,
+                                      Completion cb)
+{
+  HandleAbortableMethod (method, params, nullptr, std::move (cb));
+}
+
+void
+ThreadedRpcServer::HandleAbortableMethod (const std::string& method,
+                                          const RawJson& params,
+                                          const AbortCheck& aborted,
+                                          Completion cb)
+{
+  /* The completion callback is shared between the job and the overload
+     case below, since Submit does not tell us if it moved from the job
+     when it fails.  */
+  auto sharedCb = std::make_shared<Completion> (std::move (cb));
+
+  const bool queued = workers->Submit ([this, method, params, aborted,
+                                        sharedCb] ()
+    {
+      if (aborted != nullptr && aborted ())
+        {
+          VLOG (1) << "Not processing aborted call to " << method;
+          const RpcServer::Error err(jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                     "call aborted");
+          (*sharedCb) (RpcResult (err));
+          return;
+        }
+
+      std::unique_ptr<RpcResult> res;
+      try
+        {
+          res = std::make_unique<RpcResult> (
+              backend.HandleRawMethod (method, params));
+        }
+      catch (const RpcServer::Error& exc)
+        {
+          res = std::make_unique<RpcResult> (exc);
+        }
+      catch (const std::exception& exc)
+        {
+          /* Other exceptions (e.g. from the JSON-RPC transport) must not
+             escape the worker thread, as that would terminate the process.
+             They are returned as internal error instead.  */
+          LOG (WARNING) << "Call to " << method << " failed: " << exc.what ();
+          const RpcServer::Error err(jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                     exc.what ());
+          res = std::make_unique<RpcResult> (err);
+        }
+
+      (*sharedCb) (*res);
+    });
+
+  if (!queued)
+    {
+      LOG (WARNING) << "Too many pending calls, rejecting call to " << method;
+      const RpcServer::Error err(RpcServer::ERROR_BUSY,
+                                 "server is overloaded");
+      (*sharedCb) (RpcResult (err));
+    }
+}
+
+size_t
+ThreadedRpcServer::GetNumQueuedCalls () const
+{
+  return workers->GetQueueSize ();
+}
+
+/* ************************************************************************** */
+
+namespace
+{
+
+/**
+ * Number of connections in the pool of a ForwardingRpcServer, if it is
+ * constructed just with the URL.
+ */
+constexpr size_t DEFAULT_CONNECTIONS = 16;
+
+/**
+ * Time for which a backend is taken out of rotation after a call to it
+ * failed with a connection error.  Afterwards, it gets calls again (and
+ * is taken out again if they still fail).
+ */
+constexpr auto BACKEND_RETRY_DELAY = std::chrono::seconds (1);
+
+/**
+ * Returns the error thrown for invalid responses from the backend.
+ */
+RpcServer::Error
+InvalidResponse ()
+{
+  return RpcServer::Error (jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE,
+                           "invalid response from backend");
+}
+
+/**
+ * Extracts the result from a serialised JSON-RPC response.  Only the
+ * response object itself is split up, and the result is returned without
+ * parsing it.  If the response is an error, it is thrown.
+ */
+RawJson
+ExtractResult (const std::string& response)
+{
+  std::map<std::string, RawJson> members;
+  if (!RawJson::SplitObject (response, members))
+    {
+      LOG (WARNING) << "Invalid response from backend:\n" << response;
+      throw InvalidResponse ();
+    }
+
+  const auto mitErr = members.find ("error");
+  if (mitErr != members.end ())
+    {
+      const auto& err = mitErr->second.GetValue ();
+      if (!err.isObject () || !err["code"].isInt ()
+            || !err["message"].isString ())
+        {
+          LOG (WARNING) << "Invalid error from backend:\n" << err;
+          throw InvalidResponse ();
+        }
+
+      throw RpcServer::Error (err["code"].asInt (), err["message"].asString (),
+                              err["data"]);
+    }
+
+  const auto mitRes = members.find ("result");
+  if (mitRes == members.end ())
+    {
+      LOG (WARNING) << "Backend response has no result:\n" << response;
+      throw InvalidResponse ();
+    }
+
+  return mitRes->second;
+}
+
+} // anonymous namespace
+
+/**
+ * State of one backend of a ForwardingRpcServer.
+ */
+class ForwardingRpcServer::Backend
+{
+
+public:
+
+  /** The connections to this backend.  */
+  const std::shared_ptr<RpcConnectionPool> pool;
+
+  /** Number of calls currently outstanding on this backend.  */
+  size_t outstanding = 0;
+
+  /** Whether the backend is healthy according to external checks.  */
+  bool healthy = true;
+
+  /** If the backend failed recently, the time until which it is skipped.  */
+  std::chrono::steady_clock::time_point failedUntil;
+
+  explicit Backend (std::shared_ptr<RpcConnectionPool> p)
+    : pool(std::move (p))
+  {}
+
+  Backend () = delete;
+  Backend (const Backend&) = delete;
+  void operator= (const Backend&) = delete;
+
+  /**
+   * Returns true if the backend should be used at the given time.
+   */
+  bool
+  IsAvailable (const std::chrono::steady_clock::time_point now) const
+  {
+    return healthy && now >= failedUntil;
+  }
+
+};
+
 ForwardingRpcServer::ForwardingRpcServer (const std::string& url)
-  : http(url), target(http)
+  : ForwardingRpcServer(std::make_shared<RpcConnectionPool> (
+        url, DEFAULT_CONNECTIONS))
 {}
 
+ForwardingRpcServer::ForwardingRpcServer (std::shared_ptr<RpcConnectionPool> p)
+  : ForwardingRpcServer(std::vector<std::shared_ptr<RpcConnectionPool>> ({p}))
+{}
+
+ForwardingRpcServer::ForwardingRpcServer (
+    const std::vector<std::shared_ptr<RpcConnectionPool>>& p)
+{
+  CHECK (!p.empty ()) << "ForwardingRpcServer needs at least one backend";
+  for (const auto& pool : p)
+    backends.push_back (std::make_unique<Backend> (pool));
+}
+
+ForwardingRpcServer::~ForwardingRpcServer () = default;
+
+void
+ForwardingRpcServer::SetBackendHealthy (const size_t index, const bool healthy)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK_LT (index, backends.size ());
+
+  auto& b = *backends[index];
+  if (b.healthy != healthy)
+    LOG (INFO)
+        << "Marking backend " << index << " as "
+        << (healthy ? "healthy" : "unhealthy");
+  b.healthy = healthy;
+}
+
+bool
+ForwardingRpcServer::IsBackendAvailable (const size_t index) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK_LT (index, backends.size ());
+  return backends[index]->IsAvailable (std::chrono::steady_clock::now ());
+}
+
+ForwardingRpcServer::Backend&
+ForwardingRpcServer::StartCall ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  const auto now = std::chrono::steady_clock::now ();
+
+  /* Prefer available backends, but fall back to all of them if none
+     is available.  Among those, choose the one with the fewest
+     outstanding calls.  */
+  Backend* best = nullptr;
+  bool bestAvailable = false;
+  for (size_t i = 0; i < backends.size (); ++i)
+    {
+      auto& b = *backends[(nextBackend + i) % backends.size ()];
+      const bool available = b.IsAvailable (now);
+
+      if (best == nullptr
+            || (available && !bestAvailable)
+            || (available == bestAvailable
+                  && b.outstanding < best->outstanding))
+        {
+          best = &b;
+          bestAvailable = available;
+        }
+    }
+
+  nextBackend = (nextBackend + 1) % backends.size ();
+  ++best->outstanding;
+  return *best;
+}
+
+void
+ForwardingRpcServer::FinishCall (Backend& b, const bool failed)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  CHECK_GT (b.outstanding, 0);
+  --b.outstanding;
+
+  if (failed && backends.size () > 1)
+    {
+      LOG (WARNING) << "Backend call failed, skipping the backend for a while";
+      b.failedUntil = std::chrono::steady_clock::now () + BACKEND_RETRY_DELAY;
+    }
+}
+
+/**
+ * RAII helper for a call to one of the backends.  The call is counted as
+ * outstanding on the backend for the lifetime of the instance, so that it
+ * is finished on every exit path (including unexpected exceptions).
+ */
+class ForwardingRpcServer::CallGuard
+{
+
+private:
+
+  /** The server this is for.  */
+  ForwardingRpcServer& server;
+
+  /** The backend used for the call.  */
+  Backend& backend;
+
+  /** Whether the backend failed to respond.  */
+  bool failed = false;
+
+public:
+
+  explicit CallGuard (ForwardingRpcServer& s)
+    : server(s), backend(server.StartCall ())
+  {}
+
+  ~CallGuard ()
+  {
+    server.FinishCall (backend, failed);
+  }
+
+  CallGuard () = delete;
+  CallGuard (const CallGuard&) = delete;
+  void operator= (const CallGuard&) = delete;
+
+  Backend&
+  GetBackend ()
+  {
+    return backend;
+  }
+
+  /**
+   * Marks the call as failed because the backend did not respond.
+   */
+  void
+  SetFailed ()
+  {
+    failed = true;
+  }
+
+};
+
 Json::Value
 ForwardingRpcServer::HandleMethod (const std::string& method,
                                    const Json::Value& params)
+{
+  return HandleRawMethod (method, RawJson (params)).GetValue ();
+}
+
+RawJson
+ForwardingRpcServer::HandleRawMethod (const std::string& method,
+                                      const RawJson& params)
 {
   VLOG (1) << "Attempted forwarding call to " << method;
-  VLOG (2) << "Parameters: " << params;
+  VLOG (2) << "Parameters: " << params.GetText ();
 
   if (methods.count (method) == 0)
     {
@@ -45,7 +448,33 @@ ForwardingRpcServer::HandleMethod (const std::string& method,
       throw Error (jsonrpc::Errors::ERROR_RPC_METHOD_NOT_FOUND, msg.str ());
     }
 
-  return target.CallMethod (method, params);
+  /* The request is put together with the serialised params directly,
+     and of the response only the outer object is split up.  */
+  std::ostringstream request;
+  request
+      << R"({"jsonrpc":"2.0","id":1,"method":)"
+      << Json::valueToQuotedString (method.c_str ());
+  if (!params.IsNull ())
+    request << R"(,"params":)" << params.GetText ();
+  request << "}";
+
+  CallGuard call(*this);
+  try
+    {
+      std::string response;
+      {
+        auto conn = call.GetBackend ().pool->Get ();
+        conn.GetConnector ().SendRPCMessage (request.str (), response);
+      }
+
+      return ExtractResult (response);
+    }
+  catch (const Error& exc)
+    {
+      if (IsBackendFailure (exc.GetCode ()))
+        call.SetFailed ();
+      throw;
+    }
 }
 
 } // namespace charon
@@ -19,17 +19,26 @@
 #ifndef CHARON_RPCSERVER_HPP
 #define CHARON_RPCSERVER_HPP
 
+#include "rawjson.hpp"
+#include "rpcpool.hpp"
+
 #include <json/json.h>
-#include <jsonrpccpp/client.h>
-#include <jsonrpccpp/client/connectors/httpclient.h>
 #include <jsonrpccpp/common/exception.h>
 
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <unordered_set>
 #include <string>
+#include <vector>
 
 namespace charon
 {
 
+class WorkerPool;
+
 /**
  * Interface for an RPC server that is able to handle method calls and reply
  * to them by returning a JSON result value or throwing an exception in case
@@ -47,6 +56,21 @@ public:
    */
   using Error = jsonrpc::JsonRpcException;
 
+  /**
+   * JSON-RPC error code (from the range reserved for implementation-defined
+   * server errors) for calls rejected because the server is too busy.
+   * Such calls have not been processed at all, so clients can safely retry
+   * them with another server.
+   */
+  static constexpr int ERROR_BUSY = -32050;
+
+  /**
+   * Returns true if the given error code means that a backend could not be
+   * reached or did not respond properly (e.g. a connection failure or
+   * timeout), as opposed to an ordinary error returned by the backend.
+   */
+  static bool IsBackendFailure (int code);
+
   RpcServer () = default;
   virtual ~RpcServer () = default;
 
@@ -58,35 +82,296 @@ public:
   virtual Json::Value HandleMethod (const std::string& method,
                                     const Json::Value& params) = 0;
 
+  /**
+   * Answers a call like HandleMethod, but with params and result as
+   * RawJson.  Implementations that can pass serialised JSON through
+   * without parsing it (like ForwardingRpcServer) override this; the
+   * default implementation just calls HandleMethod.
+   */
+  virtual RawJson HandleRawMethod (const std::string& method,
+                                   const RawJson& params);
+
+};
+
+/**
+ * The result of a JSON-RPC method call, which is either a success with
+ * some JSON result value, or an error with code, message and extra data.
+ */
+class RpcResult
+{
+
+private:
+
+  /** If this is a success result.  */
+  bool success;
+
+  /** On success, the result data.  */
+  RawJson result;
+
+  /** On error, the error code.  */
+  int errorCode;
+  /** On error, the error message.  */
+  std::string errorMsg;
+  /** On error, the extra data.  */
+  Json::Value errorData;
+
+public:
+
+  /**
+   * Constructs a success result with the given value.
+   */
+  explicit RpcResult (const Json::Value& res);
+
+  /**
+   * Constructs a success result with the given (possibly still
+   * serialised) value.
+   */
+  explicit RpcResult (const RawJson& res);
+
+  /**
+   * Constructs an error result from the given exception.
+   */
+  explicit RpcResult (const RpcServer::Error& exc);
+
+  RpcResult () = delete;
+  RpcResult (const RpcResult&) = default;
+  RpcResult& operator= (const RpcResult&) = default;
+
+  bool
+  IsSuccess () const
+  {
+    return success;
+  }
+
+  const Json::Value& GetResult () const;
+
+  /**
+   * Returns the result without forcing it to be parsed.
+   */
+  const RawJson& GetRawResult () const;
+
+  int GetErrorCode () const;
+  const std::string& GetErrorMessage () const;
+  const Json::Value& GetErrorData () const;
+
+};
+
+/**
+ * Interface for an RPC server that answers method calls asynchronously,
+ * by invoking a completion callback when the result is available.  This
+ * allows backends that do not block to have many calls in flight without
+ * tying up a thread for each of them.
+ *
+ * The Charon server uses this interface natively; ThreadedRpcServer
+ * can be used to run a synchronous RpcServer behind it.
+ */
+class AsyncRpcServer
+{
+
+public:
+
+  /** Callback that is invoked with the result of a call.  */
+  using Completion = std::function<void (const RpcResult& res)>;
+
+  /**
+   * Predicate that returns true once the result of a call is no longer
+   * needed, e.g. because its deadline has passed or it was cancelled.
+   */
+  using AbortCheck = std::function<bool ()>;
+
+  AsyncRpcServer () = default;
+  virtual ~AsyncRpcServer () = default;
+
+  /**
+   * Starts processing of a call to the given method with the given params.
+   * The completion callback must be invoked exactly once with the result,
+   * either directly from this method or later from any thread.
+   */
+  virtual void HandleMethodAsync (const std::string& method,
+                                  const RawJson& params,
+                                  Completion cb) = 0;
+
+  /**
+   * Starts processing of a call whose result may stop being needed before
+   * it is available.  Implementations may skip the processing if the
+   * abort check returns true before they get to it (e.g. while the call
+   * is queued), and complete it with an error instead.  By default,
+   * the check is just ignored.
+   */
+  virtual void
+  HandleAbortableMethod (const std::string& method, const RawJson& params,
+                         const AbortCheck& aborted, Completion cb)
+  {
+    HandleMethodAsync (method, params, std::move (cb));
+  }
+
+  /**
+   * Returns the number of calls that have been started but are still
+   * waiting to be processed (e.g. for a free worker thread), if the
+   * implementation knows about it.  This is used as a measure of load.
+   */
+  virtual size_t
+  GetNumQueuedCalls () const
+  {
+    return 0;
+  }
+
+};
+
+/**
+ * AsyncRpcServer that processes calls through a synchronous RpcServer
+ * instance on a pool of worker threads.  If too many calls are waiting
+ * for a free worker already, new calls fail with an "overloaded" error.
+ */
+class ThreadedRpcServer : public AsyncRpcServer
+{
+
+private:
+
+  /** The underlying synchronous backend.  */
+  RpcServer& backend;
+
+  /** The worker threads processing calls.  */
+  std::unique_ptr<WorkerPool> workers;
+
+public:
+
+  /**
+   * Constructs the adapter with the given number of worker threads and
+   * limit for the number of calls waiting for a worker.  With more than one
+   * thread, the backend must support concurrent calls.
+   */
+  explicit ThreadedRpcServer (RpcServer& b, unsigned threads, size_t maxQueue);
+
+  /**
+   * Finishes all pending calls and stops the worker threads.
+   */
+  ~ThreadedRpcServer ();
+
+  ThreadedRpcServer () = delete;
+  ThreadedRpcServer (const ThreadedRpcServer&) = delete;
+  void operator= (const ThreadedRpcServer&) = delete;
+
+  void HandleMethodAsync (const std::string& method, const RawJson& params,
+                          Completion cb) override;
+
+  /**
+   * Processes an abortable call.  If the call has been aborted by the
+   * time a worker picks it up, the backend is not called at all.
+   */
+  void HandleAbortableMethod (const std::string& method,
+                              const RawJson& params,
+                              const AbortCheck& aborted,
+                              Completion cb) override;
+
+  size_t GetNumQueuedCalls () const override;
+
 };
 
 /**
  * Implementation of RpcServer that just forwards calls to a certain list
  * of "allowed" methods to another JSON-RPC endpoint, and answers all others
  * with "method does not exist".
+ *
+ * Through HandleRawMethod, the params and result are passed through
+ * as serialised JSON, without parsing them into Json::Value.
+ *
+ * Calls may be made concurrently from multiple threads (once all allowed
+ * methods have been set up).  They are made through a pool of
+ * keep-alive connections, which may be shared with other users of
+ * the same backend.
+ *
+ * There may be multiple (equivalent) backends, e.g. several replicas of
+ * the same GSP.  Each call is then routed to the available backend with
+ * the fewest calls outstanding at the moment.  Backends are unavailable
+ * while they are marked as unhealthy explicitly, and for a short time
+ * after a call to them failed with a connection error.  If no backend
+ * is available, calls are routed among all of them anyway.
  */
 class ForwardingRpcServer : public RpcServer
 {
 
 private:
 
+  class Backend;
+  class CallGuard;
+
   /** The list of allowed methods.  */
   std::unordered_set<std::string> methods;
 
-  /** HTTP connector for the backend target.  */
-  jsonrpc::HttpClient http;
+  /** The backends we forward calls to.  */
+  std::vector<std::unique_ptr<Backend>> backends;
+
+  /**
+   * Index of the backend to start looking at for the next call, so that
+   * ties between equally loaded backends are broken round-robin.
+   */
+  size_t nextBackend = 0;
+
+  /** Mutex for the state of backends.  */
+  mutable std::mutex mut;
 
-  /** The RPC client we forward calls to.  */
-  jsonrpc::Client target;
+  /**
+   * Selects the backend to use for a call and marks the call as
+   * outstanding on it.
+   */
+  Backend& StartCall ();
+
+  /**
+   * Marks a call on the given backend as finished.  If the backend failed
+   * to respond, it is taken out of rotation for a while.
+   */
+  void FinishCall (Backend& b, bool failed);
 
 public:
 
   /**
    * Constructs a new instance with no allowed methods (for now) and the
-   * given RPC endpoint.
+   * given RPC endpoint.  It uses its own pool of connections.
    */
   explicit ForwardingRpcServer (const std::string& url);
 
+  /**
+   * Constructs a new instance with no allowed methods (for now) that
+   * forwards calls through the given connection pool.
+   */
+  explicit ForwardingRpcServer (std::shared_ptr<RpcConnectionPool> p);
+
+  /**
+   * Constructs a new instance with no allowed methods (for now) that
+   * balances calls between the backends of the given connection pools.
+   */
+  explicit ForwardingRpcServer (
+      const std::vector<std::shared_ptr<RpcConnectionPool>>& p);
+
+  ~ForwardingRpcServer ();
+
+  ForwardingRpcServer () = delete;
+  ForwardingRpcServer (const ForwardingRpcServer&) = delete;
+  void operator= (const ForwardingRpcServer&) = delete;
+
+  /**
+   * Returns the number of backends calls are balanced between.
+   */
+  size_t
+  GetNumBackends () const
+  {
+    return backends.size ();
+  }
+
+  /**
+   * Marks the backend with the given index as healthy or unhealthy (e.g.
+   * based on external health probes).  Unhealthy backends are not used
+   * as long as some other backend is available.
+   */
+  void SetBackendHealthy (size_t index, bool healthy);
+
+  /**
+   * Returns true if the backend with the given index is available for
+   * calls at the moment.
+   */
+  bool IsBackendAvailable (size_t index) const;
+
   /**
    * Allows the given method.
    */
@@ -99,6 +384,9 @@ public:
   Json::Value HandleMethod (const std::string& method,
                             const Json::Value& params) override;
 
+  RawJson HandleRawMethod (const std::string& method,
+                           const RawJson& params) override;
+
 };
 
 } // namespace charon
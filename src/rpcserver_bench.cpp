@@ -0,0 +1,218 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "inprocess.hpp"
+#include "rpcbatcher.hpp"
+#include "rpcserver.hpp"
+
+#include "benchutils.hpp"
+#include "testutils.hpp"
+
+#include <jsonrpccpp/client.h>
+#include <jsonrpccpp/client/connectors/httpclient.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+/** Number of calls made by each client thread.  */
+constexpr unsigned CALLS_PER_THREAD = 500;
+
+/* ************************************************************************** */
+
+/**
+ * RpcServer that forwards calls to the backend the way ForwardingRpcServer
+ * did before connection pooling, i.e. with a new HTTP connector for
+ * each call.  This is used as baseline.
+ */
+class UnpooledRpcServer : public RpcServer
+{
+
+public:
+
+  UnpooledRpcServer () = default;
+
+  Json::Value
+  HandleMethod (const std::string& method, const Json::Value& params) override
+  {
+    jsonrpc::HttpClient http(TestRpcBackend::URL);
+    jsonrpc::Client target(http);
+    return target.CallMethod (method, params);
+  }
+
+};
+
+/**
+ * RpcServer that makes blocking calls through an AsyncRpcServer, so that
+ * it can be used in the same benchmark code.
+ */
+class BlockingRpcServer : public RpcServer
+{
+
+private:
+
+  /** The underlying asynchronous server.  */
+  AsyncRpcServer& backend;
+
+public:
+
+  explicit BlockingRpcServer (AsyncRpcServer& b)
+    : backend(b)
+  {}
+
+  Json::Value
+  HandleMethod (const std::string& method, const Json::Value& params) override
+  {
+    std::promise<RpcResult> promise;
+    backend.HandleMethodAsync (method, params,
+                               [&promise] (const RpcResult& res)
+      {
+        promise.set_value (res);
+      });
+
+    const auto res = promise.get_future ().get ();
+    if (!res.IsSuccess ())
+      throw Error (res.GetErrorCode (), res.GetErrorMessage (),
+                   res.GetErrorData ());
+
+    return res.GetResult ();
+  }
+
+};
+
+/**
+ * Runs the given number of threads concurrently making calls through
+ * an RpcServer, and prints throughput and latency statistics.
+ */
+void
+RunCalls (RpcServer& srv, const unsigned threads, const std::string& name)
+{
+  using Clock = std::chrono::steady_clock;
+
+  std::mutex mut;
+  LatencySamples samples;
+
+  const auto start = Clock::now ();
+  std::vector<std::thread> clients;
+  for (unsigned i = 0; i < threads; ++i)
+    clients.emplace_back ([&srv, &mut, &samples] ()
+      {
+        Json::Value params(Json::arrayValue);
+        params.append (42);
+
+        LatencySamples mine;
+        for (unsigned j = 0; j < CALLS_PER_THREAD; ++j)
+          {
+            const auto before = Clock::now ();
+            CHECK_EQ (srv.HandleMethod ("echobypos", params).asInt (), 42);
+            mine.Add (Clock::now () - before);
+          }
+
+        std::lock_guard<std::mutex> lock(mut);
+        samples.Merge (mine);
+      });
+  for (auto& t : clients)
+    t.join ();
+  const auto duration = Clock::now () - start;
+
+  const double secs
+      = std::chrono::duration_cast<std::chrono::duration<double>> (
+            duration).count ();
+
+  std::ostringstream fullName;
+  fullName << name << " (" << threads << " threads)";
+  samples.Print (fullName.str ());
+  std::cout
+      << "  throughput: " << (threads * CALLS_PER_THREAD) / secs << " calls/s"
+      << std::endl;
+}
+
+class ForwardingRpcServerBenchmarks : public testing::TestWithParam<unsigned>
+{
+
+protected:
+
+  TestRpcBackend backend;
+
+};
+
+TEST_P (ForwardingRpcServerBenchmarks, Unpooled)
+{
+  UnpooledRpcServer srv;
+  RunCalls (srv, GetParam (), "Unpooled");
+}
+
+TEST_P (ForwardingRpcServerBenchmarks, Pooled)
+{
+  ForwardingRpcServer srv(std::make_shared<RpcConnectionPool> (
+      TestRpcBackend::URL, GetParam ()));
+  srv.AllowMethod ("echobypos");
+  RunCalls (srv, GetParam (), "Pooled");
+}
+
+TEST_P (ForwardingRpcServerBenchmarks, UnixSocket)
+{
+  ForwardingRpcServer srv(std::make_shared<RpcConnectionPool> (
+      TestRpcBackend::UNIX_URL, GetParam ()));
+  srv.AllowMethod ("echobypos");
+  RunCalls (srv, GetParam (), "Unix socket");
+}
+
+TEST_P (ForwardingRpcServerBenchmarks, InProcess)
+{
+  /* This does what the test backend's echobypos does, just directly.  */
+  InProcessRpcServer srv;
+  srv.AddMethod ("echobypos", [] (const Json::Value& params)
+    {
+      return params[0];
+    });
+  RunCalls (srv, GetParam (), "In-process");
+}
+
+TEST_P (ForwardingRpcServerBenchmarks, Batched)
+{
+  BatchingRpcServer batching(
+      std::make_shared<RpcConnectionPool> (TestRpcBackend::URL, 2),
+      GetParam (), std::chrono::milliseconds (1), 2, 1000);
+  batching.AllowMethod ("echobypos");
+
+  BlockingRpcServer srv(batching);
+  RunCalls (srv, GetParam (), "Batched");
+}
+
+INSTANTIATE_TEST_CASE_P (Threads, ForwardingRpcServerBenchmarks,
+                         testing::Values (1, 4, 16));
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace charon
@@ -18,92 +18,29 @@
 
 #include "rpcserver.hpp"
 
-#include "rpc-stubs/testbackendserverstub.h"
 #include "testutils.hpp"
 
-#include <jsonrpccpp/server/connectors/httpserver.h>
+#include <jsonrpccpp/common/errors.h>
 
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
 namespace charon
 {
 namespace
 {
 
-/** RPC port for our test backend server.  */
-constexpr int RPC_PORT = 42042;
-
-/** HTTP URL for the test backend server.  */
-constexpr const char* RPC_URL = "http://localhost:42042";
-
-/* ************************************************************************** */
-
-/**
- * Implementation of the "TestBackend" RPC server.
- */
-class TestBackendServer
-{
-
-private:
-
-  class Implementation : public TestBackendServerStub
-  {
-
-  public:
-
-    explicit Implementation (jsonrpc::AbstractServerConnector& conn)
-      : TestBackendServerStub(conn)
-    {}
-
-    int
-    echobypos (const int val) override
-    {
-      return val;
-    }
-
-    int
-    echobyname (const int val) override
-    {
-      return val;
-    }
-
-    int
-    error (const int code, const Json::Value& data,
-           const std::string& msg) override
-    {
-      throw jsonrpc::JsonRpcException (code, msg, data);
-    }
-
-    int
-    donotcall () override
-    {
-      LOG (FATAL) << "backend method donotcall was called";
-    }
-
-  };
-
-  /** The underlying HTTP server connector.  */
-  jsonrpc::HttpServer http;
-
-  /** The server implementation.  */
-  Implementation server;
-
-public:
-
-  TestBackendServer ()
-    : http(RPC_PORT), server(http)
-  {
-    server.StartListening ();
-  }
-
-  ~TestBackendServer ()
-  {
-    server.StopListening ();
-  }
-
-};
+using testing::ElementsAre;
 
 /* ************************************************************************** */
 
@@ -112,14 +49,14 @@ class ForwardingRpcServerTests : public testing::Test
 
 private:
 
-  TestBackendServer backend;
+  TestRpcBackend backend;
 
 protected:
 
   ForwardingRpcServer server;
 
   ForwardingRpcServerTests ()
-    : server(RPC_URL)
+    : server(TestRpcBackend::URL)
   {
     server.AllowMethod ("echobypos");
     server.AllowMethod ("echobyname");
@@ -139,6 +76,14 @@ TEST_F (ForwardingRpcServerTests, KeywordArguments)
              10);
 }
 
+TEST_F (ForwardingRpcServerTests, RawPassthrough)
+{
+  RawJson params;
+  ASSERT_TRUE (RawJson::FromText (R"( [ 5 ] )", params));
+  const auto res = server.HandleRawMethod ("echobypos", params);
+  EXPECT_EQ (res.GetValue (), 5);
+}
+
 TEST_F (ForwardingRpcServerTests, Error)
 {
   try
@@ -165,6 +110,30 @@ TEST_F (ForwardingRpcServerTests, Error)
     }
 }
 
+TEST_F (ForwardingRpcServerTests, UnixSocket)
+{
+  ForwardingRpcServer unixServer(TestRpcBackend::UNIX_URL);
+  unixServer.AllowMethod ("echobypos");
+  EXPECT_EQ (unixServer.HandleMethod ("echobypos", ParseJson ("[5]")), 5);
+}
+
+TEST_F (ForwardingRpcServerTests, UnixSocketRawParamsWithNewlines)
+{
+  /* The Unix socket transport delimits messages by newlines, so those must
+     not be passed through from the params.  */
+  ForwardingRpcServer unixServer(TestRpcBackend::UNIX_URL);
+  unixServer.AllowMethod ("echobypos");
+  unixServer.AllowMethod ("echobyname");
+
+  RawJson params;
+  ASSERT_TRUE (RawJson::FromText ("[\n1\n]", params));
+  EXPECT_EQ (unixServer.HandleRawMethod ("echobypos", params).GetValue (), 1);
+
+  ASSERT_TRUE (RawJson::FromText ("{\n  \"value\":\r\n  42\n}\n", params));
+  EXPECT_EQ (unixServer.HandleRawMethod ("echobyname", params).GetValue (),
+             42);
+}
+
 TEST_F (ForwardingRpcServerTests, MethodNotAllowed)
 {
   try
@@ -181,5 +150,225 @@ TEST_F (ForwardingRpcServerTests, MethodNotAllowed)
 
 /* ************************************************************************** */
 
+/**
+ * Test case for ForwardingRpcServer with multiple backends.  One of them
+ * is the test backend, and the other has nothing listening on its URL.
+ */
+class ForwardingRpcServerMultiBackendTests : public testing::Test
+{
+
+private:
+
+  TestRpcBackend backend;
+
+protected:
+
+  /** URL at which no backend is running.  */
+  static constexpr const char* DEAD_URL = "http://localhost:42043";
+
+  std::shared_ptr<RpcConnectionPool> dead;
+  std::shared_ptr<RpcConnectionPool> good;
+
+  ForwardingRpcServerMultiBackendTests ()
+    : dead(std::make_shared<RpcConnectionPool> (DEAD_URL, 1)),
+      good(std::make_shared<RpcConnectionPool> (TestRpcBackend::URL, 1))
+  {}
+
+  /**
+   * Sets up allowed methods on a server.
+   */
+  static void
+  AllowMethods (ForwardingRpcServer& server)
+  {
+    server.AllowMethod ("echobypos");
+  }
+
+};
+
+constexpr const char* ForwardingRpcServerMultiBackendTests::DEAD_URL;
+
+TEST_F (ForwardingRpcServerMultiBackendTests, Balanced)
+{
+  auto other = std::make_shared<RpcConnectionPool> (TestRpcBackend::URL, 1);
+  ForwardingRpcServer server({good, other});
+  AllowMethods (server);
+  ASSERT_EQ (server.GetNumBackends (), 2);
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ (server.HandleMethod ("echobypos", ParseJson ("[5]")), 5);
+
+  EXPECT_EQ (good->GetNumConnections (), 1);
+  EXPECT_EQ (other->GetNumConnections (), 1);
+}
+
+TEST_F (ForwardingRpcServerMultiBackendTests, FailedBackendSkipped)
+{
+  ForwardingRpcServer server({dead, good});
+  AllowMethods (server);
+
+  /* The first call goes to the dead backend, which is then skipped.  */
+  try
+    {
+      server.HandleMethod ("echobypos", ParseJson ("[5]"));
+      FAIL () << "Expected error not thrown";
+    }
+  catch (const RpcServer::Error& exc)
+    {
+      LOG (INFO) << "Caught expected error: " << exc.what ();
+      EXPECT_TRUE (RpcServer::IsBackendFailure (exc.GetCode ()));
+    }
+  EXPECT_FALSE (server.IsBackendAvailable (0));
+  EXPECT_TRUE (server.IsBackendAvailable (1));
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ (server.HandleMethod ("echobypos", ParseJson ("[5]")), 5);
+}
+
+TEST_F (ForwardingRpcServerMultiBackendTests, UnhealthyBackend)
+{
+  ForwardingRpcServer server({dead, good});
+  AllowMethods (server);
+  server.SetBackendHealthy (0, false);
+  EXPECT_FALSE (server.IsBackendAvailable (0));
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ (server.HandleMethod ("echobypos", ParseJson ("[5]")), 5);
+  EXPECT_EQ (dead->GetNumConnections (), 0);
+
+  server.SetBackendHealthy (0, true);
+  EXPECT_TRUE (server.IsBackendAvailable (0));
+}
+
+TEST_F (ForwardingRpcServerMultiBackendTests, NoBackendAvailable)
+{
+  auto other = std::make_shared<RpcConnectionPool> (TestRpcBackend::URL, 1);
+  ForwardingRpcServer server({good, other});
+  AllowMethods (server);
+  server.SetBackendHealthy (0, false);
+  server.SetBackendHealthy (1, false);
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ (server.HandleMethod ("echobypos", ParseJson ("[5]")), 5);
+  EXPECT_EQ (good->GetNumConnections (), 1);
+  EXPECT_EQ (other->GetNumConnections (), 1);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Test case for ThreadedRpcServer, which uses TestBackend as synchronous
+ * backend and records the results passed to completion callbacks.
+ */
+class ThreadedRpcServerTests : public testing::Test
+{
+
+private:
+
+  /** Mutex for the results.  */
+  std::mutex mut;
+
+  /** Condition variable signalled when a result is added.  */
+  std::condition_variable cv;
+
+  /**
+   * The results received so far, as string "foo" for success results
+   * and "error foo" for errors.
+   */
+  std::vector<std::string> results;
+
+protected:
+
+  TestBackend backend;
+
+  /**
+   * Returns a completion callback that records the result.
+   */
+  AsyncRpcServer::Completion
+  Recorder ()
+  {
+    return [this] (const RpcResult& res)
+      {
+        std::string str;
+        if (res.IsSuccess ())
+          str = res.GetResult ().asString ();
+        else
+          str = "error " + res.GetErrorMessage ();
+
+        std::lock_guard<std::mutex> lock(mut);
+        results.push_back (str);
+        cv.notify_all ();
+      };
+  }
+
+  /**
+   * Waits until the given number of results are there and returns them
+   * (sorted, since they may arrive in any order).
+   */
+  std::vector<std::string>
+  WaitForResults (const size_t num)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (results.size () < num)
+      cv.wait (lock);
+
+    auto res = results;
+    std::sort (res.begin (), res.end ());
+    return res;
+  }
+
+};
+
+TEST_F (ThreadedRpcServerTests, Results)
+{
+  ThreadedRpcServer server(backend, 2, 10);
+  server.HandleMethodAsync ("echo", ParseJson (R"(["foo"])"), Recorder ());
+  server.HandleMethodAsync ("error", ParseJson (R"(["bar"])"), Recorder ());
+
+  EXPECT_THAT (WaitForResults (2), ElementsAre ("error bar", "foo"));
+}
+
+TEST_F (ThreadedRpcServerTests, OtherException)
+{
+  ThreadedRpcServer server(backend, 1, 10);
+  server.HandleMethodAsync ("throw", ParseJson (R"(["foo"])"), Recorder ());
+  server.HandleMethodAsync ("echo", ParseJson (R"(["bar"])"), Recorder ());
+
+  EXPECT_THAT (WaitForResults (2), ElementsAre ("bar", "error foo"));
+}
+
+TEST_F (ThreadedRpcServerTests, Overloaded)
+{
+  ThreadedRpcServer server(backend, 1, 1);
+  for (unsigned i = 0; i < 3; ++i)
+    server.HandleMethodAsync ("slow", ParseJson (R"(["foo"])"), Recorder ());
+
+  /* The first call will be processed and the second queued.  Depending
+     on whether the first one was picked up by the worker before the others
+     were submitted, one or two of them will be rejected.  */
+  const auto res = WaitForResults (3);
+  EXPECT_EQ (res[0], "error server is overloaded");
+  EXPECT_EQ (res.back (), "foo");
+}
+
+TEST_F (ThreadedRpcServerTests, AbortedWhileQueued)
+{
+  ThreadedRpcServer server(backend, 1, 10);
+  server.HandleMethodAsync ("slow", ParseJson (R"(["foo"])"), Recorder ());
+
+  std::atomic<bool> aborted(false);
+  server.HandleAbortableMethod ("echo", ParseJson (R"(["bar"])"),
+                                [&aborted] () { return aborted.load (); },
+                                Recorder ());
+  server.HandleAbortableMethod ("echo", ParseJson (R"(["baz"])"),
+                                [] () { return false; }, Recorder ());
+  aborted = true;
+
+  EXPECT_THAT (WaitForResults (3),
+               ElementsAre ("foo", "error call aborted", "baz"));
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
+/* ************************************************************************** */
+
 } // anonymous namespace
 } // namespace charon
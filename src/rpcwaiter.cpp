@@ -27,8 +27,14 @@ namespace charon
 
 RpcUpdateWaiter::RpcUpdateWaiter (const std::string& url, const std::string& m,
                                   const Json::Value& alwaysBlock)
-  : method(m), params(Json::arrayValue),
-    http(url), target(http)
+  : RpcUpdateWaiter(std::make_shared<RpcConnectionPool> (url, 1),
+                    m, alwaysBlock)
+{}
+
+RpcUpdateWaiter::RpcUpdateWaiter (std::shared_ptr<RpcConnectionPool> p,
+                                  const std::string& m,
+                                  const Json::Value& alwaysBlock)
+  : method(m), params(Json::arrayValue), pool(std::move (p))
 {
   params.append (alwaysBlock);
 }
@@ -43,7 +49,8 @@ RpcUpdateWaiter::WaitForUpdate (Json::Value& newState)
 
   try
     {
-      newState = target.CallMethod (method, params);
+      auto conn = pool->Get ();
+      newState = conn->CallMethod (method, params);
       return true;
     }
   catch (const jsonrpc::JsonRpcException& exc)
@@ -56,7 +63,7 @@ RpcUpdateWaiter::WaitForUpdate (Json::Value& newState)
 void
 RpcUpdateWaiter::ShortTimeout ()
 {
-  http.SetTimeout (50);
+  pool->SetTimeout (50);
 }
 
 } // namespace charon
@@ -19,12 +19,12 @@
 #ifndef CHARON_RPCWAITER_HPP
 #define CHARON_RPCWAITER_HPP
 
+#include "rpcpool.hpp"
 #include "waiterthread.hpp"
 
 #include <json/json.h>
-#include <jsonrpccpp/client.h>
-#include <jsonrpccpp/client/connectors/httpclient.h>
 
+#include <memory>
 #include <mutex>
 #include <string>
 
@@ -54,11 +54,8 @@ private:
    */
   std::mutex mut;
 
-  /** HTTP connector for the backend target.  */
-  jsonrpc::HttpClient http;
-
-  /** The RPC client we forward calls to.  */
-  jsonrpc::Client target;
+  /** The connections to the backend we call.  */
+  std::shared_ptr<RpcConnectionPool> pool;
 
   /**
    * Sets a short timeout on the HTTP client, so that we can test what
@@ -78,6 +75,15 @@ public:
   explicit RpcUpdateWaiter (const std::string& url, const std::string& m,
                             const Json::Value& alwaysBlock);
 
+  /**
+   * Constructs a new instance that makes its calls through the given
+   * connection pool.  Note that each ongoing WaitForUpdate call keeps
+   * one of the pool's connections busy.
+   */
+  explicit RpcUpdateWaiter (std::shared_ptr<RpcConnectionPool> p,
+                            const std::string& m,
+                            const Json::Value& alwaysBlock);
+
   bool WaitForUpdate (Json::Value& newState) override;
 
 };
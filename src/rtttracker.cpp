@@ -0,0 +1,78 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/rtttracker.hpp"
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+RttTracker::RttTracker (const double w)
+  : weight(w)
+{
+  CHECK_GT (weight, 0.0);
+  CHECK_LE (weight, 1.0);
+}
+
+void
+RttTracker::AddSample (Duration& avg, unsigned& samples,
+                       const Duration value) const
+{
+  if (samples == 0)
+    avg = value;
+  else
+    avg += Duration (static_cast<Duration::rep> (
+        weight * (value - avg).count ()));
+
+  ++samples;
+}
+
+void
+RttTracker::AddPingSample (const std::string& resource, const Duration value)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& entry = stats[resource];
+  entry.resource = resource;
+  AddSample (entry.pingRtt, entry.pingSamples, value);
+}
+
+void
+RttTracker::AddCallSample (const std::string& resource, const Duration value)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& entry = stats[resource];
+  entry.resource = resource;
+  AddSample (entry.callRtt, entry.callSamples, value);
+}
+
+ServerStats
+RttTracker::GetStats (const std::string& resource) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = stats.find (resource);
+  if (mit != stats.end ())
+    return mit->second;
+
+  ServerStats res;
+  res.resource = resource;
+  return res;
+}
+
+} // namespace charon
@@ -0,0 +1,74 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/rtttracker.hpp"
+
+#include <gtest/gtest.h>
+
+namespace charon
+{
+namespace
+{
+
+using RttTrackerTests = testing::Test;
+
+TEST_F (RttTrackerTests, UnknownResource)
+{
+  RttTracker t(0.5);
+  const auto stats = t.GetStats ("foo");
+  EXPECT_EQ (stats.resource, "foo");
+  EXPECT_EQ (stats.pingSamples, 0);
+  EXPECT_EQ (stats.callSamples, 0);
+}
+
+TEST_F (RttTrackerTests, MovingAverage)
+{
+  RttTracker t(0.5);
+
+  t.AddPingSample ("foo", RttTracker::Duration (100));
+  EXPECT_EQ (t.GetStats ("foo").pingRtt, RttTracker::Duration (100));
+
+  t.AddPingSample ("foo", RttTracker::Duration (200));
+  EXPECT_EQ (t.GetStats ("foo").pingRtt, RttTracker::Duration (150));
+
+  t.AddPingSample ("foo", RttTracker::Duration (50));
+  const auto stats = t.GetStats ("foo");
+  EXPECT_EQ (stats.pingRtt, RttTracker::Duration (100));
+  EXPECT_EQ (stats.pingSamples, 3);
+}
+
+TEST_F (RttTrackerTests, PingsAndCallsSeparate)
+{
+  RttTracker t(0.5);
+  t.AddPingSample ("foo", RttTracker::Duration (10));
+  t.AddCallSample ("foo", RttTracker::Duration (1000));
+  t.AddCallSample ("bar", RttTracker::Duration (500));
+
+  auto stats = t.GetStats ("foo");
+  EXPECT_EQ (stats.pingRtt, RttTracker::Duration (10));
+  EXPECT_EQ (stats.pingSamples, 1);
+  EXPECT_EQ (stats.callRtt, RttTracker::Duration (1000));
+  EXPECT_EQ (stats.callSamples, 1);
+
+  stats = t.GetStats ("bar");
+  EXPECT_EQ (stats.pingSamples, 0);
+  EXPECT_EQ (stats.callRtt, RttTracker::Duration (500));
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -16,9 +16,17 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include "config.h"
+
 #include "server.hpp"
 
+#include "private/batchresults.hpp"
+#include "private/circuitbreaker.hpp"
+#include "private/concurrencylimit.hpp"
+#include "private/fairscheduler.hpp"
 #include "private/pubsub.hpp"
+#include "private/resultcache.hpp"
+#include "private/singleflight.hpp"
 #include "private/stanzas.hpp"
 #include "private/xmppclient.hpp"
 
@@ -27,10 +35,24 @@
 #include <gloox/message.h>
 #include <gloox/messagehandler.h>
 #include <gloox/presence.h>
+#include <gloox/presencehandler.h>
+
+#include <jsonrpccpp/common/errors.h>
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 /* Windows systems define a GetMessage macro, which makes this file fail to
    compile because of JsonRpcException::GetMessage.  We cannot rename the
@@ -45,10 +67,44 @@ namespace charon
 namespace
 {
 
+/** Clock used for request deadlines.  */
+using Clock = std::chrono::steady_clock;
+
+/** Default number of worker threads for processing requests.  */
+constexpr unsigned DEFAULT_WORKER_THREADS = 1;
+
+/** Default maximum number of requests waiting for a worker.  */
+constexpr size_t DEFAULT_MAX_QUEUED_REQUESTS = 1000;
+
+/**
+ * Maximum timeout of a request that we take into account.  Longer ones
+ * are capped to this, to avoid overflows when computing the deadline.
+ */
+constexpr auto MAX_REQUEST_TIMEOUT = std::chrono::hours (1);
+
+/**
+ * Maximum number of calls in a batch request that we accept.  This is
+ * advertised to clients in the pong.
+ */
+constexpr size_t MAX_BATCH_SIZE = 100;
+
+/**
+ * Weight of a new sample when updating the moving average of backend
+ * call latencies.
+ */
+constexpr double LATENCY_SAMPLE_WEIGHT = 0.1;
+
+/** Number of recent backend calls for which the circuit breaker tracks
+    the failure rate.  */
+constexpr size_t BREAKER_WINDOW = 20;
+
+/** Failure rate of recent calls beyond which the circuit breaker opens.  */
+constexpr double BREAKER_MAX_FAILURE_RATE = 0.5;
+
 /**
  * An enabled notification on the server.  This mostly wraps the corresponding
- * WaiterThread instance, but also has some more data like the pubsub node's
- * name for updates if the server is connected to XMPP.
+ * WaiterThread instance, but also has some more data like the pubsub nodes'
+ * names for updates on each of the server's connected XMPP clients.
  */
 class ServerNotification
 {
@@ -59,28 +115,33 @@ private:
   std::unique_ptr<WaiterThread> thread;
 
   /**
-   * The PubSubImpl we use to send notifications or null if the
-   * XMPP client is not connected and we are not sending out notifications
-   * for now.
+   * The PubSubImpl instances we use to send notifications, together with
+   * the node name we created on each of them.  Each connected XMPP client
+   * of the server has its own entry here.
    */
-  PubSubImpl* pubsub = nullptr;
+  std::map<PubSubImpl*, std::string> nodes;
 
-  /** The PubSub node name (if any).  */
-  std::string node;
+  /**
+   * Callback invoked (before publishing) whenever the state changes.
+   * This is used by the server to invalidate cached data.
+   */
+  const std::function<void ()> onUpdate;
 
   /**
    * Mutex to lock this between the waiter thread's update handler
    * and an external thread that may connect/disconnect the pubsub.
    */
-  std::mutex mut;
+  mutable std::mutex mut;
 
 public:
 
   /**
    * Constructs a new instance for the given WaiterThread.  This also sets
-   * up the update handler and starts the waiter thread.
+   * up the update handler and starts the waiter thread.  The given callback
+   * is invoked on each state change.
    */
-  explicit ServerNotification (std::unique_ptr<WaiterThread> t);
+  explicit ServerNotification (std::unique_ptr<WaiterThread> t,
+                               const std::function<void ()>& cb);
 
   /**
    * Stops the waiter thread and cleans everything up.
@@ -92,29 +153,27 @@ public:
   void operator= (const ServerNotification&) = delete;
 
   /**
-   * Connects a PubSub implementation and starts publishing there.
+   * Connects a PubSub implementation and starts publishing there
+   * (in addition to all others already connected).
    */
   void ConnectPubSub (PubSubImpl& p);
 
   /**
-   * Disconnects the PubSub instance and stops publishing updates.
+   * Disconnects the given PubSub instance and stops publishing updates
+   * to it.
    */
-  void DisconnectPubSub ();
+  void DisconnectPubSub (PubSubImpl& p);
 
   /**
-   * Returns the associated node string.
+   * Returns the node string associated to the given PubSub instance.
    */
-  const std::string&
-  GetNode () const
-  {
-    CHECK (pubsub != nullptr) << "PubSub is not connected";
-    return node;
-  }
+  std::string GetNode (PubSubImpl& p) const;
 
 };
 
-ServerNotification::ServerNotification (std::unique_ptr<WaiterThread> t)
-  : thread(std::move (t))
+ServerNotification::ServerNotification (std::unique_ptr<WaiterThread> t,
+                                        const std::function<void ()>& cb)
+  : thread(std::move (t)), onUpdate(cb)
 {
   thread->SetUpdateHandler ([this] (const Json::Value& data)
     {
@@ -122,6 +181,12 @@ ServerNotification::ServerNotification (std::unique_ptr<WaiterThread> t)
           << "Notifying update for " << thread->GetType ()
           << ":\n" << data;
 
+      /* Invalidate cached data before publishing the update, so that
+         clients reacting to the notification do not get stale results.
+         This is done even if we are not connected to a PubSub at the
+         moment.  */
+      onUpdate ();
+
       /* Locking is a bit tricky here.  The Publish call below may block
          for some time, because it is waiting for the server response.
          If the XMPP client is disconnected in the mean time, the waiter
@@ -129,24 +194,25 @@ ServerNotification::ServerNotification (std::unique_ptr<WaiterThread> t)
          notification is disconnected from PubSub.
 
          All this only works if we do not hold the lock on mut while
-         the Publish call is going on.  Thus we just lock while we copy
+         the Publish calls are going on.  Thus we just lock while we copy
          the data we need, and then process the data without keeping
          onto the lock.  */
 
-      PubSubImpl* p;
-      std::string n;
+      std::map<PubSubImpl*, std::string> targets;
       {
         std::lock_guard<std::mutex> lock(mut);
-        p = pubsub;
-        n = node;
+        targets = nodes;
       }
 
-      if (p == nullptr)
+      if (targets.empty ())
         return;
-      CHECK (!n.empty ());
 
       const NotificationUpdate payload(thread->GetType (), data);
-      p->Publish (n, payload.CreateTag ());
+      for (const auto& entry : targets)
+        {
+          CHECK (!entry.second.empty ());
+          entry.first->Publish (entry.second, payload.CreateTag ());
+        }
     });
 
   thread->Start ();
@@ -163,309 +229,1687 @@ ServerNotification::ConnectPubSub (PubSubImpl& p)
 {
   std::lock_guard<std::mutex> lock(mut);
 
-  CHECK (pubsub == nullptr) << "There is already a PubSub instance";
-  pubsub = &p;
+  CHECK (nodes.count (&p) == 0) << "PubSub instance is already connected";
+
+  const std::string node = p.CreateNode ();
+  nodes.emplace (&p, node);
 
-  node = pubsub->CreateNode ();
   LOG (INFO)
       << "Serving notifications for " << thread->GetType ()
       << " on PubSub node " << node;
 }
 
 void
-ServerNotification::DisconnectPubSub ()
+ServerNotification::DisconnectPubSub (PubSubImpl& p)
 {
   std::lock_guard<std::mutex> lock(mut);
 
-  pubsub = nullptr;
-  node.clear ();
+  nodes.erase (&p);
 
   LOG (INFO) << "Stopped PubSub updates for " << thread->GetType ();
 }
 
+std::string
+ServerNotification::GetNode (PubSubImpl& p) const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = nodes.find (&p);
+  CHECK (mit != nodes.end ()) << "PubSub is not connected";
+
+  return mit->second;
+}
+
+/**
+ * Status of a request received by the server, which tells whether the
+ * client is still waiting for the response.  This is shared between the
+ * code processing the request and the connection, which may cancel it.
+ */
+class RequestStatus
+{
+
+private:
+
+  /** Time after which the client no longer waits for the response.  */
+  const Clock::time_point deadline;
+
+  /** Set to true if the client cancelled the request or went away.  */
+  std::atomic<bool> cancelled;
+
+public:
+
+  explicit RequestStatus (const Clock::time_point d)
+    : deadline(d), cancelled(false)
+  {}
+
+  RequestStatus () = delete;
+  RequestStatus (const RequestStatus&) = delete;
+  void operator= (const RequestStatus&) = delete;
+
+  void
+  Cancel ()
+  {
+    cancelled = true;
+  }
+
+  bool
+  IsCancelled () const
+  {
+    return cancelled;
+  }
+
+  bool
+  IsExpired () const
+  {
+    return Clock::now () > deadline;
+  }
+
+  /**
+   * Returns true if the response is no longer needed for any reason.
+   */
+  bool
+  IsAborted () const
+  {
+    return IsCancelled () || IsExpired ();
+  }
+
+};
+
+/**
+ * Returns the deadline for a request (RpcRequest or RpcBatchRequest)
+ * received now, based on its timeout if it has one.
+ */
+template <typename Req>
+  Clock::time_point
+GetRequestDeadline (const Req& req)
+{
+  if (!req.HasTimeout ())
+    return Clock::time_point::max ();
+
+  return Clock::now ()
+            + std::min<RpcRequest::Duration> (req.GetTimeout (),
+                                              MAX_REQUEST_TIMEOUT);
+}
+
+/**
+ * Converts the result of a call to the RpcResponse stanza extension
+ * to send back to the client.
+ */
+std::unique_ptr<RpcResponse>
+MakeRpcResponse (const RpcResult& res)
+{
+  if (res.IsSuccess ())
+    return std::make_unique<RpcResponse> (res.GetRawResult ());
+
+  return std::make_unique<RpcResponse> (res.GetErrorCode (),
+                                        res.GetErrorMessage (),
+                                        res.GetErrorData ());
+}
+
 } // anonymous namespace
 
 /* ************************************************************************** */
 
 /**
- * The actual working class for our Charon server.  This uses XmppClient for
- * the actual XMPP connection, and listens for incoming IQ requests.
+ * The state of a Charon server that is shared between all its XMPP
+ * connections:  The backend used for answering requests, the cache and
+ * coalescing of calls, and the enabled notifications (with their waiter
+ * threads).
  */
-class Server::IqAnsweringClient : public XmppClient,
-                                  private gloox::MessageHandler,
-                                  private gloox::IqHandler
+class Server::SharedState
 {
 
 private:
 
+  /**
+   * The backend server to use for answering requests.  This may only be
+   * changed while all connections are disconnected.
+   */
+  AsyncRpcServer* backend;
+
+  /** Number of backend calls whose completion has not yet been invoked.  */
+  unsigned pendingCalls = 0;
+
+  /** Moving average of backend call latencies in milliseconds.  */
+  double avgLatencyMs = 0.0;
+
+  /**
+   * Moving average of the latency of successful calls per method, in
+   * milliseconds.  This is used as cost estimate for fair queueing.
+   */
+  std::map<std::string, double> methodCosts;
+
+  /** Mutex for pendingCalls, avgLatencyMs and methodCosts.  */
+  mutable std::mutex mutPending;
+
+  /** Condition variable signalled when pendingCalls drops to zero.  */
+  std::condition_variable cvPending;
+
+  /**
+   * Returns the estimated cost (in milliseconds of backend time) of
+   * a call to the given method.
+   */
+  double GetMethodCost (const std::string& method) const;
+
+  /**
+   * Marks a call as no longer pending.
+   */
+  void FinishPendingCall ();
+
+  /**
+   * Records the result and latency of a finished backend call and marks
+   * it as no longer pending.
+   */
+  void FinishBackendCall (const std::string& method, const RpcResult& res,
+                          double latencyMs);
+
+  /**
+   * Updates the adaptive concurrency limit (if enabled) for a finished
+   * backend call, and applies it to the scheduler.
+   */
+  void UpdateConcurrency (const RpcResult& res, double latencyMs);
+
+public:
+
   /** The server's version string.  */
   const std::string version;
 
-  /** The backend server to use for answering requests.  */
-  RpcServer& backend;
+  /**
+   * The cache for results, if enabled.  This must be declared before
+   * the notifications, which flush it from their waiter threads.
+   */
+  std::unique_ptr<ResultCache> cache;
+
+  /** Tracker for coalescing identical calls, if enabled.  */
+  std::unique_ptr<SingleFlight> flights;
+
+  /** Scheduler for fair queueing of backend calls, if enabled.  */
+  std::unique_ptr<FairScheduler> scheduler;
+
+  /**
+   * Adaptive limit for concurrent backend calls, if enabled.  It is
+   * enforced through the scheduler.
+   */
+  std::unique_ptr<ConcurrencyLimit> concurrency;
+
+  /** Circuit breaker tracking the backend's health, if enabled.  */
+  std::unique_ptr<CircuitBreaker> breaker;
+
+  /** Number of calls made to the backend.  */
+  std::atomic<uint64_t> executedCalls;
+
+  /** Number of calls that were coalesced with one already in flight.  */
+  std::atomic<uint64_t> coalescedCalls;
+
+  /** Number of requests not answered because their deadline passed.  */
+  std::atomic<uint64_t> expiredCalls;
+
+  /** Number of requests not answered because the client cancelled them.  */
+  std::atomic<uint64_t> cancelledCalls;
+
+  /** Number of requests rejected with a busy error.  */
+  std::atomic<uint64_t> rejectedCalls;
+
+  /** Number of requests that have not yet been answered.  */
+  std::atomic<unsigned> inFlightCalls;
+
+  /** Limits on the load beyond which we do not answer pings.  */
+  LoadLimits limits;
 
   /**
    * Enabled notifications on this server.  All of them have their waiter
-   * threads running, but they may not be publishing to a PubSub instance
-   * if the XMPP client is currently disconnected.
+   * threads running, but they may not be publishing to any PubSub instance
+   * if all XMPP clients are currently disconnected.
    */
   std::map<std::string, std::unique_ptr<ServerNotification>> notifications;
 
+  explicit SharedState (const std::string& v, AsyncRpcServer& b)
+    : backend(&b), version(v),
+      executedCalls(0), coalescedCalls(0), expiredCalls(0), cancelledCalls(0),
+      rejectedCalls(0), inFlightCalls(0)
+  {}
+
+  SharedState () = delete;
+  SharedState (const SharedState&) = delete;
+  void operator= (const SharedState&) = delete;
+
+  void
+  SetBackend (AsyncRpcServer& b)
+  {
+    backend = &b;
+  }
+
   /**
-   * Set to true when all is fully set up and ready, i.e. once all notification
-   * pubsubs have been set up.  Only then does the server reply to pings.
+   * Invalidates cached data when the backend state changes.  This is
+   * called from the notifications' waiter threads.
    */
-  bool ready = false;
+  void HandleStateUpdate ();
 
-  void handleMessage (const gloox::Message& msg,
-                      gloox::MessageSession* session) override;
-  bool handleIq (const gloox::IQ& iq) override;
-  void handleIqID (const gloox::IQ& iq, int context) override;
+  /**
+   * Adds a new notification updater and starts its waiter thread.
+   * Returns the constructed notification, so that the caller can connect
+   * it to PubSub instances as needed.
+   */
+  ServerNotification& AddNotification (std::unique_ptr<WaiterThread> upd);
 
-protected:
+  /**
+   * Processes a call to the given method, either from the cache, by
+   * attaching to an identical call in flight or by forwarding it to
+   * the backend.  The callback is invoked with the result, possibly
+   * asynchronously on another thread.  The client identifies the sender
+   * for fair queueing.  If the abort check returns true before the call
+   * is started (e.g. while it is queued), the backend call is skipped and
+   * the callback invoked with an error instead.
+   */
+  void HandleCall (const std::string& client, const std::string& method,
+                   const RawJson& params,
+                   const AsyncRpcServer::AbortCheck& aborted,
+                   AsyncRpcServer::Completion respond);
 
   /**
-   * When disconnected, we clean up our notifications.
+   * Returns the number of calls waiting for the backend, either in
+   * our scheduler or in the backend itself.
    */
-  void HandleDisconnect () override;
+  size_t GetNumQueuedCalls () const;
 
-public:
+  /**
+   * Blocks until all pending backend calls have been completed.
+   */
+  void WaitForPendingCalls ();
 
-  explicit IqAnsweringClient (const std::string& v, RpcServer& b,
-                              const gloox::JID& jid,
-                              const std::string& password);
+  /**
+   * Returns the current moving average of backend call latencies.
+   */
+  std::chrono::milliseconds GetAverageLatency () const;
 
   /**
-   * Adds a new notification updater.  This starts the corresponding waiter
-   * thread immediately, but only starts publishing to a PubSub once the
-   * client is connected.
+   * Returns true if the current load is within the limits, so that
+   * we can accept new clients.
    */
-  void AddNotification (std::unique_ptr<WaiterThread> upd);
+  bool HasCapacity () const;
 
   /**
-   * Connects all notifications to the current PubSub.  This is used to
-   * explicitly enable them if the client has just been connected to XMPP.
+   * Returns true if the queue or latency limits are exceeded, so that
+   * new requests should be rejected right away.
    */
-  void ConnectNotifications ();
+  bool IsSaturated () const;
+
+  /**
+   * Returns true unless the circuit breaker is open.
+   */
+  bool
+  IsHealthy () const
+  {
+    return breaker == nullptr || !breaker->IsOpen ();
+  }
 
   /**
-   * Returns the pubsub node for the given notification type.  This is used
-   * in testing.
+   * Returns the current load relative to the limits, i.e. a value
+   * between zero (idle) and one (at one of the limits, or if the
+   * backend is unhealthy).
    */
-  const std::string& GetNotificationNode (const std::string& type) const;
+  double GetLoadFraction () const;
 
 };
 
-Server::IqAnsweringClient::IqAnsweringClient (const std::string& v,
-                                              RpcServer& b,
-                                              const gloox::JID& jid,
-                                              const std::string& password)
-  : XmppClient(jid, password), version(v), backend(b)
+void
+Server::SharedState::HandleStateUpdate ()
 {
-  RunWithClient ([this] (gloox::Client& c)
-    {
-      c.registerStanzaExtension (new RpcRequest ());
-      c.registerStanzaExtension (new RpcResponse ());
-      c.registerStanzaExtension (new PingMessage ());
-      c.registerStanzaExtension (new PongMessage ());
-      c.registerStanzaExtension (new SupportedNotifications ());
+  if (cache != nullptr)
+    cache->Flush ();
+  if (flights != nullptr)
+    flights->Detach ();
+}
 
-      c.registerMessageHandler (this);
-      c.registerIqHandler (this, RpcRequest::EXT_TYPE);
-    });
+ServerNotification&
+Server::SharedState::AddNotification (std::unique_ptr<WaiterThread> upd)
+{
+  const auto type = upd->GetType ();
+
+  auto notifier = std::make_unique<ServerNotification> (std::move (upd),
+      [this] ()
+        {
+          HandleStateUpdate ();
+        });
+
+  const auto res = notifications.emplace (type, std::move (notifier));
+  CHECK (res.second) << "Duplicate notification: " << type;
+
+  return *res.first->second;
 }
 
 void
-Server::IqAnsweringClient::handleMessage (const gloox::Message& msg,
-                                          gloox::MessageSession* session)
+Server::SharedState::HandleCall (const std::string& client,
+                                 const std::string& method,
+                                 const RawJson& params,
+                                 const AsyncRpcServer::AbortCheck& aborted,
+                                 AsyncRpcServer::Completion respond)
 {
-  VLOG (1) << "Received message stanza from " << msg.from ().full ();
+  std::string key;
+  if (cache != nullptr || flights != nullptr)
+    key = ResultCache::GetKey (method, params.GetValue ());
 
-  auto* ping = msg.findExtension<PingMessage> (PingMessage::EXT_TYPE);
-  if (ping != nullptr)
+  ResultCache::Generation cacheGen = 0;
+  if (cache != nullptr)
     {
-      if (!ready)
+      RawJson cached;
+      if (cache->Lookup (key, cached))
         {
-          LOG (WARNING)
-              << "Server is not ready yet, ignoring ping from "
-              << msg.from ().full ();
+          VLOG (1) << "Answering call to " << method << " from cache";
+          respond (RpcResult (cached));
           return;
         }
 
-      LOG (INFO) << "Processing ping from " << msg.from ().full ();
+      cacheGen = cache->GetGeneration ();
+    }
 
-      gloox::Presence response(gloox::Presence::Available, msg.from ());
-      response.addExtension (new PongMessage (version));
+  /* If the backend is down or we are beyond our limits already, reject
+     the call right away, so that the client can fail over to another
+     server quickly instead of waiting for us.  */
+  if (!IsHealthy ())
+    {
+      VLOG (1) << "Backend is unhealthy, rejecting call to " << method;
+      ++rejectedCalls;
+      const RpcServer::Error err(RpcServer::ERROR_BUSY,
+                                 "backend is unavailable");
+      respond (RpcResult (err));
+      return;
+    }
+
+  if (IsSaturated ())
+    {
+      VLOG (1) << "Server is saturated, rejecting call to " << method;
+      ++rejectedCalls;
+      const RpcServer::Error err(RpcServer::ERROR_BUSY,
+                                 "server is overloaded");
+      respond (RpcResult (err));
+      return;
+    }
 
-      if (!notifications.empty ())
+  ++inFlightCalls;
+  respond = [this, inner = std::move (respond)] (const RpcResult& res)
+    {
+      CHECK_GT (inFlightCalls, 0);
+      --inFlightCalls;
+      inner (res);
+    };
+
+  /* If an identical call is in flight already, just attach to it.
+     Otherwise, the flight completes all attached callers (including
+     ourselves) once the backend call is done.  */
+  AsyncRpcServer::AbortCheck callAborted = aborted;
+  if (flights != nullptr)
+    {
+      auto f = flights->Join (key, std::move (respond), aborted);
+      if (f == nullptr)
         {
-          const auto service = GetPubSub ().GetService ().full ();
-          auto notificationInfo
-              = std::make_unique<SupportedNotifications> (service);
+          VLOG (1) << "Coalescing call to " << method;
+          ++coalescedCalls;
+          return;
+        }
 
-          for (const auto& entry : notifications)
-            {
-              const auto& node = entry.second->GetNode ();
-              notificationInfo->AddNotification (entry.first, node);
-            }
+      respond = [this, key, f] (const RpcResult& res)
+        {
+          flights->Complete (key, f, res);
+        };
 
-          response.addExtension (notificationInfo.release ());
+      /* Other callers may attach to the backend call while it is still
+         waiting, so it is only aborted if all of them are.  */
+      callAborted = [this, key, f] ()
+        {
+          return flights->IsAborted (key, f);
+        };
+    }
+
+  {
+    std::lock_guard<std::mutex> lock(mutPending);
+    ++pendingCalls;
+  }
+
+  auto call = [this, method, params, key, cacheGen, respond, callAborted] ()
+    {
+      if (callAborted != nullptr && callAborted ())
+        {
+          VLOG (1) << "Dropping aborted call to " << method;
+          const RpcServer::Error err(jsonrpc::Errors::ERROR_RPC_INTERNAL_ERROR,
+                                     "call aborted");
+          respond (RpcResult (err));
+          if (scheduler != nullptr)
+            scheduler->Done ();
+          FinishPendingCall ();
+          return;
         }
 
-      RunWithClient ([&response] (gloox::Client& c)
+      ++executedCalls;
+      const auto start = std::chrono::steady_clock::now ();
+      backend->HandleAbortableMethod (method, params, callAborted,
+                                      [this, method, key, cacheGen,
+                                       respond, start]
+                                          (const RpcResult& res)
         {
-          c.send (response);
-        });
-    }
-}
+          const std::chrono::duration<double, std::milli> latency
+              = std::chrono::steady_clock::now () - start;
 
-bool
-Server::IqAnsweringClient::handleIq (const gloox::IQ& iq)
-{
-  LOG (INFO) << "Received IQ request from " << iq.from ().full ();
+          if (cache != nullptr && res.IsSuccess ())
+            cache->Insert (key, cacheGen, res.GetRawResult ());
 
-  auto* req = iq.findExtension<RpcRequest> (RpcRequest::EXT_TYPE);
+          respond (res);
 
-  /* The handler should only be called by gloox if it detects the extension,
-     since that's how we registered it.  */
-  CHECK (req != nullptr) << "IQ has no RpcRequest extension";
+          /* This has to be done while the call is still counted as
+             running in the scheduler.  */
+          UpdateConcurrency (res, latency.count ());
 
-  if (!req->IsValid ())
-    {
-      LOG (WARNING) << "Ignoring invalid RpcRequest stanza";
-      return false;
-    }
+          /* This may start the next queued call right away, which is
+             already counted as pending.  */
+          if (scheduler != nullptr)
+            scheduler->Done ();
 
-  if (iq.subtype () != gloox::IQ::Get)
-    {
-      LOG (WARNING) << "Ignoring IQ of type " << iq.subtype ();
-      return false;
-    }
+          FinishBackendCall (method, res, latency.count ());
+        });
+    };
 
-  std::unique_ptr<RpcResponse> result;
-  try
+  if (scheduler == nullptr)
     {
-      const Json::Value resultJson = backend.HandleMethod (req->GetMethod (),
-                                                           req->GetParams ());
-      result = std::make_unique<RpcResponse> (resultJson);
+      call ();
+      return;
     }
-  catch (const RpcServer::Error& exc)
-    {
-      result = std::make_unique<RpcResponse> (exc.GetCode (), exc.GetMessage (),
-                                              exc.GetData ());
-    }
-
-  /* We always return an IQ type of result, even if we have a JSON-RPC error.
-     This mimics best practices for JSON-RPC over HTTP, where "error" is
-     only returned for transport-related errors.  If the XMPP IQ itself was
-     fine but the call failed, we return an IQ result with an embedded
-     JSON-RPC error response.  */
-  gloox::IQ response(gloox::IQ::Result, iq.from (), iq.id ());
-  response.addExtension (result.release ());
 
-  RunWithClient ([&response] (gloox::Client& c)
+  if (!scheduler->Submit (client, GetMethodCost (method), std::move (call)))
     {
-      c.send (response);
-    });
-
-  return true;
+      LOG (WARNING) << "Too many queued calls, rejecting call to " << method;
+      ++rejectedCalls;
+      const RpcServer::Error err(RpcServer::ERROR_BUSY,
+                                 "server is overloaded");
+      respond (RpcResult (err));
+      FinishPendingCall ();
+    }
 }
 
 void
-Server::IqAnsweringClient::handleIqID (const gloox::IQ& iq, const int context)
-{}
-
-void
-Server::IqAnsweringClient::HandleDisconnect ()
+Server::SharedState::FinishPendingCall ()
 {
-  ready = false;
-  for (auto& n : notifications)
-    n.second->DisconnectPubSub ();
+  std::lock_guard<std::mutex> lock(mutPending);
+  CHECK_GT (pendingCalls, 0);
+  --pendingCalls;
+  if (pendingCalls == 0)
+    cvPending.notify_all ();
 }
 
-void
-Server::IqAnsweringClient::AddNotification (std::unique_ptr<WaiterThread> upd)
+double
+Server::SharedState::GetMethodCost (const std::string& method) const
 {
-  const auto type = upd->GetType ();
+  std::lock_guard<std::mutex> lock(mutPending);
 
-  auto notifier = std::make_unique<ServerNotification> (std::move (upd));
-  if (IsConnected ())
-    notifier->ConnectPubSub (GetPubSub ());
+  const auto mit = methodCosts.find (method);
+  if (mit != methodCosts.end ())
+    return mit->second;
 
-  const auto res = notifications.emplace (type, std::move (notifier));
-  CHECK (res.second) << "Duplicate notification: " << type;
+  /* For methods we have not seen yet, assume an average call.  */
+  return std::max (avgLatencyMs, 1.0);
 }
 
 void
-Server::IqAnsweringClient::ConnectNotifications ()
+Server::SharedState::FinishBackendCall (const std::string& method,
+                                        const RpcResult& res,
+                                        const double latencyMs)
 {
-  for (auto& n : notifications)
-    n.second->ConnectPubSub (GetPubSub ());
-  ready = true;
-}
+  if (breaker != nullptr)
+    breaker->RecordCall (!res.IsSuccess ()
+                          && RpcServer::IsBackendFailure (res.GetErrorCode ()));
 
-const std::string&
-Server::IqAnsweringClient::GetNotificationNode (const std::string& type) const
-{
-  return notifications.at (type)->GetNode ();
-}
+  {
+    std::lock_guard<std::mutex> lock(mutPending);
 
-/* ************************************************************************** */
+    avgLatencyMs += LATENCY_SAMPLE_WEIGHT * (latencyMs - avgLatencyMs);
 
-Server::Server (const std::string& version, RpcServer& backend,
-                const std::string& jidStr, const std::string& password)
+    /* Only successful calls are taken into account for the per-method costs.
+       Otherwise clients could make the map grow without bounds by calling
+       random (non-existing) methods.  */
+    if (res.IsSuccess ())
+      {
+        const auto ins = methodCosts.emplace (method, latencyMs);
+        if (!ins.second)
+          {
+            double& cost = ins.first->second;
+            cost += LATENCY_SAMPLE_WEIGHT * (latencyMs - cost);
+          }
+      }
+  }
+
+  FinishPendingCall ();
+}
+
+void
+Server::SharedState::UpdateConcurrency (const RpcResult& res,
+                                        const double latencyMs)
+{
+  if (concurrency == nullptr)
+    return;
+
+  /* Ordinary errors (e.g. invalid calls) say nothing about the backend
+     load, but busy errors do.  */
+  const bool busy
+      = !res.IsSuccess () && res.GetErrorCode () == RpcServer::ERROR_BUSY;
+  if (!res.IsSuccess () && !busy)
+    return;
+
+  const unsigned limit
+      = concurrency->Update (latencyMs, scheduler->GetNumActive (), busy);
+  scheduler->SetMaxActive (limit);
+}
+
+size_t
+Server::SharedState::GetNumQueuedCalls () const
+{
+  size_t res = backend->GetNumQueuedCalls ();
+  if (scheduler != nullptr)
+    res += scheduler->GetQueueSize ();
+  return res;
+}
+
+void
+Server::SharedState::WaitForPendingCalls ()
+{
+  std::unique_lock<std::mutex> lock(mutPending);
+  while (pendingCalls > 0)
+    cvPending.wait (lock);
+}
+
+std::chrono::milliseconds
+Server::SharedState::GetAverageLatency () const
+{
+  std::lock_guard<std::mutex> lock(mutPending);
+  return std::chrono::milliseconds (static_cast<int64_t> (avgLatencyMs));
+}
+
+bool
+Server::SharedState::HasCapacity () const
+{
+  const unsigned inFlight = inFlightCalls;
+  const size_t queued = GetNumQueuedCalls ();
+
+  /* If we are idle, we can take new clients in any case.  This also makes
+     sure that a high latency average from a past burst does not keep
+     us from answering pings forever.  */
+  if (inFlight == 0 && queued == 0)
+    return true;
+
+  if (limits.maxInFlight > 0 && inFlight >= limits.maxInFlight)
+    return false;
+  if (limits.maxQueued > 0 && queued >= limits.maxQueued)
+    return false;
+  if (limits.maxLatency > std::chrono::milliseconds::zero ()
+        && GetAverageLatency () > limits.maxLatency)
+    return false;
+
+  return true;
+}
+
+bool
+Server::SharedState::IsSaturated () const
+{
+  /* Without any queued calls, new requests are processed right away,
+     so there is no reason to reject them.  */
+  const size_t queued = GetNumQueuedCalls ();
+  if (queued == 0)
+    return false;
+
+  if (limits.maxQueued > 0 && queued >= limits.maxQueued)
+    return true;
+  if (limits.maxLatency > std::chrono::milliseconds::zero ()
+        && GetAverageLatency () > limits.maxLatency)
+    return true;
+
+  return false;
+}
+
+double
+Server::SharedState::GetLoadFraction () const
+{
+  if (!IsHealthy ())
+    return 1.0;
+
+  const unsigned inFlight = inFlightCalls;
+  const size_t queued = GetNumQueuedCalls ();
+  if (inFlight == 0 && queued == 0)
+    return 0.0;
+
+  double res = 0.0;
+  if (limits.maxInFlight > 0)
+    res = std::max (res, static_cast<double> (inFlight) / limits.maxInFlight);
+  if (limits.maxQueued > 0)
+    res = std::max (res, static_cast<double> (queued) / limits.maxQueued);
+  if (limits.maxLatency > std::chrono::milliseconds::zero ())
+    {
+      const auto latency = GetAverageLatency ().count ();
+      res = std::max (res, static_cast<double> (latency)
+                              / limits.maxLatency.count ());
+    }
+
+  return std::min (res, 1.0);
+}
+
+/* ************************************************************************** */
+
+/**
+ * A single XMPP connection of our Charon server.  This uses XmppClient for
+ * the actual XMPP connection, and listens for incoming IQ requests and pings.
+ * Requests are processed through the server's SharedState.  We also keep
+ * track of the requests being processed, so that they can be cancelled
+ * when the client asks for it or goes offline.
+ */
+class Server::IqAnsweringClient : public XmppClient,
+                                  private gloox::MessageHandler,
+                                  private gloox::PresenceHandler,
+                                  private gloox::IqHandler
+{
+
+private:
+
+  /** The server state shared with other connections.  */
+  SharedState& shared;
+
+  /**
+   * Set to true when all is fully set up and ready, i.e. once all notification
+   * pubsubs have been set up.  Only then does the client reply to pings.
+   */
+  bool ready = false;
+
+  /**
+   * The PubSub instance to which the notifications have been connected,
+   * or null if they are not connected.  We need to keep track of it
+   * so we can disconnect them even if the XMPP client itself has already
+   * lost its connection.
+   */
+  PubSubImpl* connectedPubSub = nullptr;
+
+  /**
+   * Requests that are currently being processed, keyed by the full JID
+   * of the client that sent them and the IQ id.
+   */
+  std::map<std::string,
+           std::map<std::string, std::shared_ptr<RequestStatus>>> requests;
+
+  /** Mutex for the map of requests.  */
+  std::mutex mutRequests;
+
+  /**
+   * Adds a request to the map of those being processed.
+   */
+  void TrackRequest (const gloox::JID& from, const std::string& id,
+                     std::shared_ptr<RequestStatus> status);
+
+  /**
+   * Removes a request from the map of those being processed, if the
+   * entry there is still the given one.
+   */
+  void UntrackRequest (const gloox::JID& from, const std::string& id,
+                       const RequestStatus& status);
+
+  /**
+   * Cancels the request with the given id from the given client,
+   * if we are still processing it.
+   */
+  void CancelCall (const gloox::JID& from, const std::string& id);
+
+  /**
+   * Cancels all requests from the given full JID.
+   */
+  void CancelAllCalls (const gloox::JID& from);
+
+  /**
+   * Processes a single RpcRequest received as IQ.  Returns false if the
+   * request is invalid.
+   */
+  bool HandleRequest (const gloox::JID& from, const std::string& id,
+                      const RpcRequest& req);
+
+  /**
+   * Processes an RpcBatchRequest received as IQ.  All calls of the batch
+   * are handled independently and tracked as one request, for which we
+   * send back all results together once they are in.
+   */
+  bool HandleBatchRequest (const gloox::JID& from, const std::string& id,
+                           const RpcBatchRequest& batch);
+
+  /**
+   * Checks whether a request that just finished has been cancelled or
+   * has expired (so that we should not send a response) and updates the
+   * statistics for numCalls calls if so.  Returns true if the response
+   * should be sent.
+   */
+  bool ShouldRespond (const std::string& id, const RequestStatus& status,
+                      size_t numCalls);
+
+  /**
+   * Sends back an IQ result with the given payload extension.
+   */
+  void SendIqResult (const gloox::JID& to, const std::string& id,
+                     std::unique_ptr<gloox::StanzaExtension> ext);
+
+  void handleMessage (const gloox::Message& msg,
+                      gloox::MessageSession* session) override;
+  void handlePresence (const gloox::Presence& p) override;
+  bool handleIq (const gloox::IQ& iq) override;
+  void handleIqID (const gloox::IQ& iq, int context) override;
+
+protected:
+
+  /**
+   * When disconnected, we clean up our notifications and cancel all
+   * requests, as we can no longer send responses for them anyway.
+   */
+  void HandleDisconnect () override;
+
+public:
+
+  explicit IqAnsweringClient (SharedState& s, const gloox::JID& jid,
+                              const std::string& password);
+
+  /**
+   * Connects all notifications to the current PubSub.  This is used to
+   * explicitly enable them if the client has just been connected to XMPP.
+   */
+  void ConnectNotifications ();
+
+  /**
+   * Connects a single notification to the current PubSub.  This is used
+   * for notifications added while the client is connected.
+   */
+  void ConnectNotification (ServerNotification& n);
+
+};
+
+Server::IqAnsweringClient::IqAnsweringClient (SharedState& s,
+                                              const gloox::JID& jid,
+                                              const std::string& password)
+  : XmppClient(jid, password), shared(s)
+{
+  RunWithClient ([this] (gloox::Client& c)
+    {
+      c.registerStanzaExtension (new RpcRequest ());
+      c.registerStanzaExtension (new RpcResponse ());
+      c.registerStanzaExtension (new RpcBatchRequest ());
+      c.registerStanzaExtension (new PingMessage ());
+      c.registerStanzaExtension (new PongMessage ());
+      c.registerStanzaExtension (new SupportedNotifications ());
+      c.registerStanzaExtension (new CancelRequest ());
+
+      c.registerMessageHandler (this);
+      c.registerPresenceHandler (this);
+      c.registerIqHandler (this, RpcRequest::EXT_TYPE);
+      c.registerIqHandler (this, RpcBatchRequest::EXT_TYPE);
+    });
+}
+
+void
+Server::IqAnsweringClient::handleMessage (const gloox::Message& msg,
+                                          gloox::MessageSession* session)
+{
+  VLOG (1) << "Received message stanza from " << msg.from ().full ();
+
+  auto* cancel = msg.findExtension<CancelRequest> (CancelRequest::EXT_TYPE);
+  if (cancel != nullptr && cancel->IsValid ())
+    CancelCall (msg.from (), cancel->GetId ());
+
+  auto* ping = msg.findExtension<PingMessage> (PingMessage::EXT_TYPE);
+  if (ping != nullptr)
+    {
+      if (!ready)
+        {
+          LOG (WARNING)
+              << "Server is not ready yet, ignoring ping from "
+              << msg.from ().full ();
+          return;
+        }
+
+      if (!shared.IsHealthy ())
+        {
+          LOG (INFO)
+              << "Backend is unhealthy, ignoring ping from "
+              << msg.from ().full ();
+          return;
+        }
+
+      if (!shared.HasCapacity ())
+        {
+          LOG (INFO)
+              << "Server is overloaded, ignoring ping from "
+              << msg.from ().full ();
+          return;
+        }
+
+      LOG (INFO) << "Processing ping from " << msg.from ().full ();
+
+      gloox::Presence response(gloox::Presence::Available, msg.from ());
+      auto pong = std::make_unique<PongMessage> (shared.version,
+                                                 MAX_BATCH_SIZE);
+      pong->SetNonce (ping->GetNonce ());
+      response.addExtension (pong.release ());
+
+      if (!shared.notifications.empty ())
+        {
+          auto& pubsub = GetPubSub ();
+          const auto service = pubsub.GetService ().full ();
+          auto notificationInfo
+              = std::make_unique<SupportedNotifications> (service);
+
+          for (const auto& entry : shared.notifications)
+            {
+              const auto node = entry.second->GetNode (pubsub);
+              notificationInfo->AddNotification (entry.first, node);
+            }
+
+          response.addExtension (notificationInfo.release ());
+        }
+
+      RunWithClient ([&response] (gloox::Client& c)
+        {
+          c.send (response);
+        });
+    }
+}
+
+bool
+Server::IqAnsweringClient::handleIq (const gloox::IQ& iq)
+{
+  LOG (INFO) << "Received IQ request from " << iq.from ().full ();
+
+  if (iq.subtype () != gloox::IQ::Get)
+    {
+      LOG (WARNING) << "Ignoring IQ of type " << iq.subtype ();
+      return false;
+    }
+
+  /* The backend calls may complete asynchronously (e.g. on a worker thread),
+     so that we do not block the receive thread (and thus all other requests,
+     pings and pubsub processing) while they are going on.  The IQ itself is
+     only valid during this callback, so we copy out the data we need.  */
+  const gloox::JID from = iq.from ();
+  const std::string id = iq.id ();
+
+  auto* req = iq.findExtension<RpcRequest> (RpcRequest::EXT_TYPE);
+  if (req != nullptr)
+    return HandleRequest (from, id, *req);
+
+  /* The handler should only be called by gloox if it detects one of the
+     extensions, since that's how we registered it.  */
+  auto* batch = iq.findExtension<RpcBatchRequest> (RpcBatchRequest::EXT_TYPE);
+  CHECK (batch != nullptr) << "IQ has no RpcRequest or RpcBatchRequest";
+
+  return HandleBatchRequest (from, id, *batch);
+}
+
+bool
+Server::IqAnsweringClient::HandleRequest (const gloox::JID& from,
+                                          const std::string& id,
+                                          const RpcRequest& req)
+{
+  if (!req.IsValid ())
+    {
+      LOG (WARNING) << "Ignoring invalid RpcRequest stanza";
+      return false;
+    }
+
+  auto status = std::make_shared<RequestStatus> (GetRequestDeadline (req));
+  TrackRequest (from, id, status);
+
+  shared.HandleCall (from.bare (), req.GetMethod (), req.GetRawParams (),
+                     [status] ()
+                       {
+                         return status->IsAborted ();
+                       },
+                     [this, from, id, status] (const RpcResult& res)
+    {
+      UntrackRequest (from, id, *status);
+      if (ShouldRespond (id, *status, 1))
+        SendIqResult (from, id, MakeRpcResponse (res));
+    });
+
+  return true;
+}
+
+bool
+Server::IqAnsweringClient::HandleBatchRequest (const gloox::JID& from,
+                                               const std::string& id,
+                                               const RpcBatchRequest& batch)
+{
+  if (!batch.IsValid ())
+    {
+      LOG (WARNING) << "Ignoring invalid RpcBatchRequest stanza";
+      return false;
+    }
+
+  const size_t numCalls = batch.GetNumRequests ();
+  if (numCalls > MAX_BATCH_SIZE)
+    {
+      LOG (WARNING)
+          << "Ignoring batch of " << numCalls << " calls, which is more"
+          << " than the maximum of " << MAX_BATCH_SIZE;
+      return false;
+    }
+  VLOG (1) << "Request " << id << " is a batch of " << numCalls << " calls";
+
+  /* The whole batch is tracked (and can be cancelled) as one request.
+     The individual calls go through the shared state each, so that caching,
+     coalescing and the limits on backend calls apply to them as usual.  */
+  auto status = std::make_shared<RequestStatus> (GetRequestDeadline (batch));
+  TrackRequest (from, id, status);
+
+  auto results = std::make_shared<BatchResults> (numCalls);
+  for (size_t i = 0; i < numCalls; ++i)
+    {
+      const auto& req = batch.GetRequest (i);
+      shared.HandleCall (from.bare (), req.GetMethod (), req.GetRawParams (),
+                         [status] ()
+                           {
+                             return status->IsAborted ();
+                           },
+                         [this, from, id, status, results, i, numCalls]
+                           (const RpcResult& res)
+        {
+          if (!results->Set (i, res))
+            return;
+
+          UntrackRequest (from, id, *status);
+          if (!ShouldRespond (id, *status, numCalls))
+            return;
+
+          std::vector<std::unique_ptr<RpcResponse>> responses;
+          for (const auto& r : results->Get ())
+            responses.push_back (MakeRpcResponse (r));
+          SendIqResult (from, id,
+                        std::make_unique<RpcBatchResponse> (
+                            std::move (responses)));
+        });
+    }
+
+  return true;
+}
+
+bool
+Server::IqAnsweringClient::ShouldRespond (const std::string& id,
+                                          const RequestStatus& status,
+                                          const size_t numCalls)
+{
+  if (status.IsCancelled ())
+    {
+      VLOG (1) << "Not sending response to cancelled request " << id;
+      shared.cancelledCalls += numCalls;
+      return false;
+    }
+
+  if (status.IsExpired ())
+    {
+      VLOG (1) << "Not sending late response to request " << id;
+      shared.expiredCalls += numCalls;
+      return false;
+    }
+
+  return true;
+}
+
+void
+Server::IqAnsweringClient::handlePresence (const gloox::Presence& p)
+{
+  /* Clients send us a directed presence when they select us as their
+     server, so that we get notified with an unavailable presence
+     when they go offline.  */
+  if (p.subtype () != gloox::Presence::Unavailable)
+    return;
+
+  VLOG (1) << "Client " << p.from ().full () << " went offline";
+  CancelAllCalls (p.from ());
+}
+
+void
+Server::IqAnsweringClient::TrackRequest (const gloox::JID& from,
+                                         const std::string& id,
+                                         std::shared_ptr<RequestStatus> status)
+{
+  std::lock_guard<std::mutex> lock(mutRequests);
+  requests[from.full ()][id] = std::move (status);
+}
+
+void
+Server::IqAnsweringClient::UntrackRequest (const gloox::JID& from,
+                                           const std::string& id,
+                                           const RequestStatus& status)
+{
+  std::lock_guard<std::mutex> lock(mutRequests);
+
+  const auto mit = requests.find (from.full ());
+  if (mit == requests.end ())
+    return;
+
+  /* If the client reused the IQ id, the entry may belong to a newer
+     request already.  */
+  const auto mit2 = mit->second.find (id);
+  if (mit2 != mit->second.end () && mit2->second.get () == &status)
+    mit->second.erase (mit2);
+
+  if (mit->second.empty ())
+    requests.erase (mit);
+}
+
+void
+Server::IqAnsweringClient::CancelCall (const gloox::JID& from,
+                                       const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(mutRequests);
+
+  const auto mit = requests.find (from.full ());
+  if (mit == requests.end ())
+    return;
+
+  const auto mit2 = mit->second.find (id);
+  if (mit2 == mit->second.end ())
+    return;
+
+  LOG (INFO) << "Cancelling request " << id << " from " << from.full ();
+  mit2->second->Cancel ();
+}
+
+void
+Server::IqAnsweringClient::CancelAllCalls (const gloox::JID& from)
+{
+  std::lock_guard<std::mutex> lock(mutRequests);
+
+  const auto mit = requests.find (from.full ());
+  if (mit == requests.end ())
+    return;
+
+  LOG (INFO)
+      << "Cancelling " << mit->second.size ()
+      << " requests from " << from.full ();
+  for (auto& entry : mit->second)
+    entry.second->Cancel ();
+}
+
+void
+Server::IqAnsweringClient::SendIqResult (
+    const gloox::JID& to, const std::string& id,
+    std::unique_ptr<gloox::StanzaExtension> ext)
+{
+  /* We always return an IQ type of result, even if we have a JSON-RPC error.
+     This mimics best practices for JSON-RPC over HTTP, where "error" is
+     only returned for transport-related errors.  If the XMPP IQ itself was
+     fine but the call failed, we return an IQ result with an embedded
+     JSON-RPC error response.  */
+  gloox::IQ response(gloox::IQ::Result, to, id);
+  response.addExtension (ext.release ());
+
+  RunWithClient ([&response] (gloox::Client& c)
+    {
+      c.send (response);
+    });
+}
+
+void
+Server::IqAnsweringClient::handleIqID (const gloox::IQ& iq, const int context)
+{}
+
+void
+Server::IqAnsweringClient::HandleDisconnect ()
+{
+  ready = false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutRequests);
+    for (auto& client : requests)
+      for (auto& entry : client.second)
+        entry.second->Cancel ();
+  }
+
+  if (connectedPubSub == nullptr)
+    return;
+
+  for (auto& n : shared.notifications)
+    n.second->DisconnectPubSub (*connectedPubSub);
+  connectedPubSub = nullptr;
+}
+
+void
+Server::IqAnsweringClient::ConnectNotifications ()
+{
+  for (auto& n : shared.notifications)
+    ConnectNotification (*n.second);
+  ready = true;
+}
+
+void
+Server::IqAnsweringClient::ConnectNotification (ServerNotification& n)
+{
+  if (connectedPubSub == nullptr)
+    connectedPubSub = &GetPubSub ();
+  n.ConnectPubSub (*connectedPubSub);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Thread that periodically updates the presence priority of all connections
+ * of a server based on its load.
+ */
+class Server::PriorityUpdater
+{
+
+private:
+
+  /** The server whose connections we update.  */
+  Server& srv;
+
+  /** The priority used at full load.  */
+  const int minPriority;
+
+  /** Interval between checks of the load.  */
+  const std::chrono::milliseconds interval;
+
+  /** The priority used when idle (as passed to Server::Connect).  */
+  std::atomic<int> basePriority;
+
+  /** The priority set most recently.  */
+  std::atomic<int> current;
+
+  /** Set to true when the thread should stop.  */
+  bool shouldStop = false;
+
+  /** Mutex for shouldStop.  */
+  std::mutex mut;
+
+  /** Condition variable notified when we should stop.  */
+  std::condition_variable cv;
+
+  /** The updating thread.  */
+  std::thread loop;
+
+  /**
+   * Returns the host's CPU load as fraction of its cores, based on the
+   * one-minute load average.  The backend normally runs as a separate
+   * process on the same host, so that this (unlike the CPU time of our
+   * own process) reflects its load as well.  Returns zero if the load
+   * average is not available on the system.
+   */
+  static double GetHostLoad ();
+
+  /**
+   * Checks the load and updates the priority if necessary.
+   */
+  void Update ();
+
+public:
+
+  explicit PriorityUpdater (Server& s, int minP,
+                            std::chrono::milliseconds i, int base);
+
+  /**
+   * Stops the updating thread.
+   */
+  ~PriorityUpdater ();
+
+  PriorityUpdater () = delete;
+  PriorityUpdater (const PriorityUpdater&) = delete;
+  void operator= (const PriorityUpdater&) = delete;
+
+  /**
+   * Sets the priority used when idle.  This is called when (re)connecting
+   * the server, which resets the priority of connections to this value.
+   */
+  void
+  SetBasePriority (const int p)
+  {
+    basePriority = p;
+    current = p;
+  }
+
+  int
+  GetPriority () const
+  {
+    return current;
+  }
+
+};
+
+Server::PriorityUpdater::PriorityUpdater (Server& s, const int minP,
+                                          const std::chrono::milliseconds i,
+                                          const int base)
+  : srv(s), minPriority(minP), interval(i),
+    basePriority(base), current(base)
+{
+  loop = std::thread ([this] ()
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      while (!shouldStop)
+        {
+          cv.wait_for (lock, interval);
+          if (!shouldStop)
+            Update ();
+        }
+    });
+}
+
+Server::PriorityUpdater::~PriorityUpdater ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  loop.join ();
+}
+
+double
+Server::PriorityUpdater::GetHostLoad ()
+{
+#ifdef HAVE_GETLOADAVG
+  double avg;
+  if (getloadavg (&avg, 1) != 1)
+    return 0.0;
+
+  const unsigned cores = std::max (std::thread::hardware_concurrency (), 1u);
+  return avg / cores;
+#else
+  return 0.0;
+#endif
+}
+
+void
+Server::PriorityUpdater::Update ()
+{
+  const double load = std::min (std::max (srv.shared->GetLoadFraction (),
+                                          GetHostLoad ()),
+                                1.0);
+
+  const int base = basePriority;
+  int priority = base;
+  if (minPriority < base)
+    priority -= static_cast<int> (std::lround (load * (base - minPriority)));
+
+  if (priority == current)
+    return;
+
+  VLOG (1) << "Load is " << load << ", updating priority to " << priority;
+  current = priority;
+  for (auto& c : srv.clients)
+    c->SetPriority (priority);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Thread that periodically probes the backend's health and records the
+ * results in the circuit breaker.
+ */
+class Server::HealthChecker
+{
+
+private:
+
+  /** The circuit breaker to update.  */
+  CircuitBreaker& breaker;
+
+  /** The probe function.  */
+  const HealthProbe probe;
+
+  /** Interval between probes.  */
+  const std::chrono::milliseconds interval;
+
+  /** Set to true when the thread should stop.  */
+  bool shouldStop = false;
+
+  /** Mutex for shouldStop.  */
+  std::mutex mut;
+
+  /** Condition variable notified when we should stop.  */
+  std::condition_variable cv;
+
+  /** The probing thread.  */
+  std::thread loop;
+
+public:
+
+  explicit HealthChecker (CircuitBreaker& b, const HealthProbe& p,
+                          std::chrono::milliseconds i);
+
+  /**
+   * Stops the probing thread.  This waits for a running probe to finish.
+   */
+  ~HealthChecker ();
+
+  HealthChecker () = delete;
+  HealthChecker (const HealthChecker&) = delete;
+  void operator= (const HealthChecker&) = delete;
+
+};
+
+Server::HealthChecker::HealthChecker (CircuitBreaker& b, const HealthProbe& p,
+                                      const std::chrono::milliseconds i)
+  : breaker(b), probe(p), interval(i)
+{
+  loop = std::thread ([this] ()
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      while (!shouldStop)
+        {
+          cv.wait_for (lock, interval);
+          if (shouldStop)
+            break;
+
+          /* The probe may block for a while (e.g. until a timeout if
+             the backend hangs), so we do not hold the lock for it.  */
+          lock.unlock ();
+          const bool healthy = probe ();
+          VLOG (1) << "Health probe result: " << healthy;
+          breaker.RecordProbe (healthy);
+          lock.lock ();
+        }
+    });
+}
+
+Server::HealthChecker::~HealthChecker ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  loop.join ();
+}
+
+/* ************************************************************************** */
+
+Server::Server (const std::string& version, RpcServer& backend,
+                const std::string& jid, const std::string& password)
+  : syncBackend(&backend), priority(0)
 {
+  syncAdapter = std::make_unique<ThreadedRpcServer> (
+      backend, DEFAULT_WORKER_THREADS, DEFAULT_MAX_QUEUED_REQUESTS);
+
+  shared = std::make_unique<SharedState> (version, *syncAdapter);
+  AddConnection (jid, password);
+}
+
+Server::Server (const std::string& version, AsyncRpcServer& backend,
+                const std::string& jid, const std::string& password)
+  : priority(0)
+{
+  shared = std::make_unique<SharedState> (version, backend);
+  AddConnection (jid, password);
+}
+
+Server::~Server ()
+{
+  priorityUpdater.reset ();
+  healthChecker.reset ();
+
+  /* Make sure no more requests are received, and then wait for all
+     completion callbacks (which reference the clients and the shared
+     state) to be done.  This must happen before the adapter that may
+     be processing them is destructed.  */
+  for (auto& c : clients)
+    c->Disconnect ();
+  shared->WaitForPendingCalls ();
+
+  clients.clear ();
+  shared.reset ();
+}
+
+void
+Server::AddConnection (const std::string& jidStr, const std::string& password)
+{
+  CHECK (priorityUpdater == nullptr)
+      << "Connections must be added before enabling dynamic priorities";
+
   const gloox::JID jid(jidStr);
-  client = std::make_unique<IqAnsweringClient> (version, backend,
-                                                jid, password);
+  auto c = std::make_unique<IqAnsweringClient> (*shared, jid, password);
+
+  if (!pubsubService.empty ())
+    c->AddPubSub (gloox::JID (pubsubService));
+
+  clients.push_back (std::move (c));
+}
+
+size_t
+Server::GetNumConnections () const
+{
+  return clients.size ();
+}
+
+void
+Server::SetWorkerThreads (const unsigned threads, const size_t maxQueue)
+{
+  CHECK (syncBackend != nullptr)
+      << "Worker threads can only be set for a synchronous backend";
+  for (const auto& c : clients)
+    CHECK (!c->IsConnected ())
+        << "Backend can only be changed while disconnected";
+
+  /* Destructing the old adapter waits for its pending calls (if any) to
+     be finished.  */
+  auto adapter = std::make_unique<ThreadedRpcServer> (*syncBackend,
+                                                      threads, maxQueue);
+  shared->SetBackend (*adapter);
+  syncAdapter = std::move (adapter);
+}
+
+void
+Server::EnableCache (const size_t maxEntries)
+{
+  CHECK (shared->cache == nullptr) << "Result cache is already enabled";
+  CHECK (shared->notifications.empty ())
+      << "Result cache must be enabled before notifications are added";
+
+  shared->cache = std::make_unique<ResultCache> (maxEntries);
+}
+
+void
+Server::EnableCoalescing ()
+{
+  CHECK (shared->flights == nullptr) << "Coalescing is already enabled";
+  CHECK (shared->notifications.empty ())
+      << "Coalescing must be enabled before notifications are added";
+
+  shared->flights = std::make_unique<SingleFlight> ();
+}
+
+uint64_t
+Server::GetNumExecutedCalls () const
+{
+  return shared->executedCalls;
+}
+
+uint64_t
+Server::GetNumCoalescedCalls () const
+{
+  return shared->coalescedCalls;
+}
+
+uint64_t
+Server::GetNumExpiredCalls () const
+{
+  return shared->expiredCalls;
+}
+
+uint64_t
+Server::GetNumCancelledCalls () const
+{
+  return shared->cancelledCalls;
+}
+
+uint64_t
+Server::GetNumRejectedCalls () const
+{
+  return shared->rejectedCalls;
+}
+
+void
+Server::EnableFairQueueing (const unsigned maxActive, const size_t maxQueue)
+{
+  CHECK (shared->scheduler == nullptr) << "Fair queueing is already enabled";
+  for (const auto& c : clients)
+    CHECK (!c->IsConnected ())
+        << "Fair queueing can only be enabled while disconnected";
+
+  shared->scheduler = std::make_unique<FairScheduler> (maxActive, maxQueue);
+}
+
+void
+Server::EnableAdaptiveConcurrency (const unsigned minLimit)
+{
+  CHECK (shared->scheduler != nullptr)
+      << "Adaptive concurrency requires fair queueing";
+  CHECK (shared->concurrency == nullptr)
+      << "Adaptive concurrency is already enabled";
+  for (const auto& c : clients)
+    CHECK (!c->IsConnected ())
+        << "Adaptive concurrency can only be enabled while disconnected";
+
+  const unsigned maxLimit = shared->scheduler->GetMaxActive ();
+  shared->concurrency = std::make_unique<ConcurrencyLimit> (minLimit,
+                                                            maxLimit);
+  shared->scheduler->SetMaxActive (shared->concurrency->GetLimit ());
+}
+
+unsigned
+Server::GetConcurrencyLimit () const
+{
+  if (shared->scheduler == nullptr)
+    return 0;
+  return shared->scheduler->GetMaxActive ();
+}
+
+void
+Server::EnableHealthCheck (const HealthProbe& probe,
+                           const std::chrono::milliseconds interval)
+{
+  CHECK (healthChecker == nullptr) << "Health checks are already enabled";
+  for (const auto& c : clients)
+    CHECK (!c->IsConnected ())
+        << "Health checks can only be enabled while disconnected";
+
+  shared->breaker = std::make_unique<CircuitBreaker> (
+      BREAKER_WINDOW, BREAKER_MAX_FAILURE_RATE);
+  healthChecker = std::make_unique<HealthChecker> (*shared->breaker, probe,
+                                                   interval);
+}
+
+bool
+Server::IsBackendHealthy () const
+{
+  return shared->IsHealthy ();
+}
+
+void
+Server::SetLoadLimits (const LoadLimits& l)
+{
+  for (const auto& c : clients)
+    CHECK (!c->IsConnected ())
+        << "Load limits can only be changed while disconnected";
+
+  shared->limits = l;
+}
+
+void
+Server::EnableDynamicPriority (const int minPriority,
+                               const std::chrono::milliseconds interval)
+{
+  CHECK (priorityUpdater == nullptr) << "Dynamic priority is already enabled";
+  priorityUpdater = std::make_unique<PriorityUpdater> (*this, minPriority,
+                                                       interval, priority);
+}
+
+int
+Server::GetPriority () const
+{
+  if (priorityUpdater != nullptr)
+    return priorityUpdater->GetPriority ();
+  return priority;
+}
+
+unsigned
+Server::GetNumInFlightCalls () const
+{
+  return shared->inFlightCalls;
 }
 
-Server::~Server () = default;
+std::chrono::milliseconds
+Server::GetAverageLatency () const
+{
+  return shared->GetAverageLatency ();
+}
 
 void
 Server::AddPubSub (const std::string& service)
 {
-  CHECK (!hasPubSub);
+  CHECK (pubsubService.empty ());
 
   const gloox::JID serviceJid(service);
-  client->AddPubSub (serviceJid);
+  for (auto& c : clients)
+    c->AddPubSub (serviceJid);
 
-  hasPubSub = true;
+  pubsubService = service;
 }
 
 void
 Server::AddNotification (std::unique_ptr<WaiterThread> upd)
 {
-  CHECK (hasPubSub);
-  client->AddNotification (std::move (upd));
+  CHECK (!pubsubService.empty ());
+
+  auto& notifier = shared->AddNotification (std::move (upd));
+  for (auto& c : clients)
+    if (c->IsConnected ())
+      c->ConnectNotification (notifier);
 }
 
 bool
-Server::Connect (const int priority)
+Server::Connect (const int p)
 {
-  if (!client->Connect (priority))
-    return false;
+  priority = p;
+  if (priorityUpdater != nullptr)
+    priorityUpdater->SetBasePriority (priority);
 
-  client->ConnectNotifications ();
-  return true;
+  bool ok = true;
+  for (auto& c : clients)
+    {
+      if (c->IsConnected ())
+        continue;
+
+      if (!c->Connect (priority))
+        {
+          ok = false;
+          continue;
+        }
+
+      c->ConnectNotifications ();
+    }
+
+  return ok;
 }
 
 void
 Server::Disconnect ()
 {
-  client->Disconnect ();
+  for (auto& c : clients)
+    c->Disconnect ();
 }
 
 bool
 Server::IsConnected () const
 {
-  return client->IsConnected ();
+  for (const auto& c : clients)
+    if (!c->IsConnected ())
+      return false;
+
+  return true;
 }
 
-const std::string&
-Server::GetNotificationNode (const std::string& type) const
+std::string
+Server::GetNotificationNode (const std::string& type, const size_t conn) const
 {
-  return client->GetNotificationNode (type);
+  return shared->notifications.at (type)->GetNode (
+      clients.at (conn)->GetPubSub ());
 }
 
 /* ************************************************************************** */
@@ -488,9 +1932,9 @@ Server::ReconnectLoop::Start (const int priority)
           cv.wait_for (lock, interval);
         }
 
-      /* When the loop has been stopped, disconnect the server.  */
-      if (srv.IsConnected ())
-        srv.Disconnect ();
+      /* When the loop has been stopped, disconnect the server.  This is
+         done even if not all connections are up at the moment.  */
+      srv.Disconnect ();
     });
 }
 
@@ -22,10 +22,16 @@
 #include "rpcserver.hpp"
 #include "waiterthread.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace charon
 {
@@ -39,22 +45,53 @@ class Server
 
 private:
 
+  class HealthChecker;
   class IqAnsweringClient;
+  class PriorityUpdater;
+  class SharedState;
 
   /**
-   * The XMPP client instance (which is a class defined only in the source
-   * file and thus referenced here by pointer).
+   * If the server was constructed with a synchronous RpcServer backend,
+   * then this is that backend.
    */
-  std::unique_ptr<IqAnsweringClient> client;
+  RpcServer* syncBackend = nullptr;
 
-  /** Whether or not we have a pubsub service.  */
-  bool hasPubSub = false;
+  /**
+   * For a synchronous backend, the adapter we use to process its calls
+   * on worker threads.
+   */
+  std::unique_ptr<ThreadedRpcServer> syncAdapter;
 
   /**
-   * Returns the pubsub node for a given notification type.  This is used
-   * in tests.
+   * State shared between all XMPP connections, like the cache and
+   * notifications.  This is defined only in the source file.
    */
-  const std::string& GetNotificationNode (const std::string& type) const;
+  std::unique_ptr<SharedState> shared;
+
+  /**
+   * The XMPP client instances, one for each connection of the server
+   * (the class is defined only in the source file).
+   */
+  std::vector<std::unique_ptr<IqAnsweringClient>> clients;
+
+  /** The pubsub service we use, or empty if there is none.  */
+  std::string pubsubService;
+
+  /** The priority passed to the last call of Connect.  */
+  std::atomic<int> priority;
+
+  /** If dynamic priorities are enabled, the thread updating them.  */
+  std::unique_ptr<PriorityUpdater> priorityUpdater;
+
+  /** If health checks are enabled, the thread running the probes.  */
+  std::unique_ptr<HealthChecker> healthChecker;
+
+  /**
+   * Returns the pubsub node for a given notification type on the
+   * given connection.  This is used in tests.
+   */
+  std::string GetNotificationNode (const std::string& type,
+                                   size_t conn = 0) const;
 
   friend class ServerTests;
 
@@ -62,14 +99,230 @@ public:
 
   class ReconnectLoop;
 
+  /**
+   * Function that checks whether the backend is healthy.  It may block
+   * (e.g. for making a cheap call to the backend), but should time out
+   * in a reasonable time if the backend does not respond.
+   */
+  using HealthProbe = std::function<bool ()>;
+
+  /**
+   * Thresholds on the server load, beyond which pings are not answered.
+   * That way, new clients are directed to other (less loaded) servers
+   * instead.  A value of zero means that there is no limit.
+   *
+   * Pings are always answered if the server is idle, i.e. if no requests
+   * are being processed at all.
+   *
+   * While the queue or latency limits are exceeded (and calls are queued),
+   * new requests are also rejected with RpcServer::ERROR_BUSY, so that
+   * existing clients fail over to another server.
+   */
+  struct LoadLimits
+  {
+
+    /** Pings are ignored while this many requests are being processed.  */
+    unsigned maxInFlight = 0;
+
+    /** Pings are ignored while this many calls are queued in the backend.  */
+    size_t maxQueued = 0;
+
+    /** Pings are ignored while the average backend latency is higher.  */
+    std::chrono::milliseconds maxLatency = std::chrono::milliseconds::zero ();
+
+  };
+
+  /**
+   * Constructs a server that answers requests through the given synchronous
+   * backend.  Calls to it are made on worker threads, see SetWorkerThreads.
+   */
   explicit Server (const std::string& version, RpcServer& backend,
                    const std::string& jid, const std::string& password);
+
+  /**
+   * Constructs a server that answers requests through an asynchronous
+   * backend.  Calls are started directly on the XMPP receive thread, so the
+   * backend should not block in HandleMethodAsync.
+   */
+  explicit Server (const std::string& version, AsyncRpcServer& backend,
+                   const std::string& jid, const std::string& password);
+
   ~Server ();
 
   Server () = delete;
   Server (const Server&) = delete;
   void operator= (const Server&) = delete;
 
+  /**
+   * Adds another XMPP connection to the server, e.g. a different resource
+   * of the same account or a different account altogether.  All connections
+   * share the backend, cache and notifications, but have their own stream
+   * and receive thread, and each answers pings and requests independently.
+   * This allows to spread the XMPP processing over multiple cores.
+   *
+   * The new connection is established on the next call to Connect.
+   */
+  void AddConnection (const std::string& jid, const std::string& password);
+
+  /**
+   * Returns the number of XMPP connections (including the initial one).
+   */
+  size_t GetNumConnections () const;
+
+  /**
+   * Sets the number of worker threads used to process incoming requests
+   * (calls to the backend), and the maximum number of requests that may
+   * be waiting for a free worker.  Requests beyond that are answered with
+   * an error right away.  By default, a single worker thread is used.
+   *
+   * With more than one thread, responses may be sent out of order, and the
+   * backend RpcServer must support concurrent calls.
+   *
+   * This must only be called while the server is disconnected, and only
+   * if it has been constructed with a synchronous RpcServer backend.
+   */
+  void SetWorkerThreads (unsigned threads, size_t maxQueue);
+
+  /**
+   * Enables caching of successful results, keyed by method and params.
+   * The cache is flushed whenever one of the notifications reports a new
+   * state, and thus is only useful if notifications are enabled as well
+   * (which must be done after this call).  At most maxEntries results
+   * are kept.
+   */
+  void EnableCache (size_t maxEntries);
+
+  /**
+   * Enables coalescing of identical calls (same method and params):  If a
+   * call comes in while an identical one is being processed by the backend
+   * already, it just gets the result of that one as well.  Calls that are
+   * in flight when a notification reports a new state are not joined
+   * by new callers anymore.  This must be called before notifications
+   * are added.
+   */
+  void EnableCoalescing ();
+
+  /**
+   * Returns the number of calls that have been passed on to the backend.
+   */
+  uint64_t GetNumExecutedCalls () const;
+
+  /**
+   * Returns the number of calls that have been answered by coalescing
+   * them with an identical one in flight.
+   */
+  uint64_t GetNumCoalescedCalls () const;
+
+  /**
+   * Returns the number of calls that have not been answered because the
+   * client's timeout (as sent with the request) had passed already.
+   */
+  uint64_t GetNumExpiredCalls () const;
+
+  /**
+   * Returns the number of calls that have not been answered because the
+   * client cancelled them or went offline.
+   */
+  uint64_t GetNumCancelledCalls () const;
+
+  /**
+   * Returns the number of calls that have been rejected with a busy error
+   * because the server was overloaded.
+   */
+  uint64_t GetNumRejectedCalls () const;
+
+  /**
+   * Enables fair queueing of backend calls between clients (as identified
+   * by their bare JID):  At most maxActive calls are passed on to the
+   * backend at the same time, and up to maxQueue more are queued.  Calls
+   * beyond that are answered with an error right away.  Queued calls are
+   * processed such that each client gets the same share of backend time,
+   * based on cost estimates learnt from the latency of previous calls to
+   * each method.  That way, a few clients sending many (expensive)
+   * requests do not starve all the others.
+   *
+   * This must only be called while the server is disconnected.
+   */
+  void EnableFairQueueing (unsigned maxActive, size_t maxQueue);
+
+  /**
+   * Enables an adaptive limit on the number of backend calls running at
+   * the same time.  It starts at minLimit and is adjusted automatically
+   * based on the observed backend latency, up to the maxActive value of
+   * fair queueing.  Fair queueing must be enabled already, as calls beyond
+   * the limit are queued there.
+   *
+   * This must only be called while the server is disconnected.
+   */
+  void EnableAdaptiveConcurrency (unsigned minLimit);
+
+  /**
+   * Returns the current limit on backend calls running at the same time,
+   * or zero if fair queueing is not enabled.
+   */
+  unsigned GetConcurrencyLimit () const;
+
+  /**
+   * Enables health checking of the backend with a circuit breaker.  The
+   * probe is run once per interval on a separate thread, and the rate
+   * of backend failures (like connection errors or timeouts) of ordinary
+   * calls is tracked as well.  If a probe fails or too many recent calls
+   * failed, the breaker opens:  Then new requests are rejected right away
+   * with RpcServer::ERROR_BUSY and pings are ignored, so that clients move
+   * to other servers.  It closes again once a probe succeeds.
+   *
+   * This must only be called while the server is disconnected.
+   */
+  void EnableHealthCheck (const HealthProbe& probe,
+                          std::chrono::milliseconds interval);
+
+  /**
+   * Returns false if health checks are enabled and the circuit breaker
+   * is open at the moment.
+   */
+  bool IsBackendHealthy () const;
+
+  /**
+   * Sets the limits on server load, beyond which pings are ignored.
+   * By default, there are no limits.  This must only be called while
+   * the server is disconnected.
+   */
+  void SetLoadLimits (const LoadLimits& l);
+
+  /**
+   * Enables dynamic updates of the presence priority based on the
+   * server load.  When idle, the priority passed to Connect is used; it is
+   * lowered linearly down to minPriority at full load.  Full load means
+   * that one of the load limits (see SetLoadLimits) is reached, or that
+   * the host's load average reaches its number of CPU cores.
+   *
+   * The load is checked once per interval, and the presence is only
+   * broadcast again if the resulting priority changed.  This way, the
+   * XMPP server routes pings to less loaded servers preferably.
+   *
+   * This must be called after all connections have been added.
+   */
+  void EnableDynamicPriority (int minPriority,
+                              std::chrono::milliseconds interval);
+
+  /**
+   * Returns the current presence priority of the server's connections.
+   * Without dynamic priorities, this is the one passed to Connect.
+   */
+  int GetPriority () const;
+
+  /**
+   * Returns the number of requests currently being processed (including
+   * coalesced ones, but not those answered from the cache).
+   */
+  unsigned GetNumInFlightCalls () const;
+
+  /**
+   * Returns the exponentially weighted moving average of the time
+   * recent backend calls took.
+   */
+  std::chrono::milliseconds GetAverageLatency () const;
+
   /**
    * Adds a pubsub service that can be used for notifications on the XMPP
    * server we are connected to.
@@ -87,19 +340,19 @@ public:
   void AddNotification (std::unique_ptr<WaiterThread> upd);
 
   /**
-   * Connects to XMPP with the given priority.  Starts processing
-   * requests once the connection is established.  Returns false if the
-   * connection failed.
+   * Connects all not-yet-connected XMPP clients with the given priority.
+   * Starts processing requests on each once its connection is established.
+   * Returns false if any connection failed.
    */
   bool Connect (int priority);
 
   /**
-   * Disconnects the XMPP client and stops processing requests.
+   * Disconnects all XMPP clients and stops processing requests.
    */
   void Disconnect ();
 
   /**
-   * Returns true if the server is connected.
+   * Returns true if all connections of the server are established.
    */
   bool IsConnected () const;
 
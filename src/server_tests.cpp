@@ -34,10 +34,16 @@
 
 #include <glog/logging.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace charon
 {
@@ -112,6 +118,8 @@ TEST_F (ServerConnectionTests, Failure)
  *
  * For simplicity in the tests, we expect all results to be strings.  If we
  * receive a JSON-RPC error instead, we just set the string to "error <msg>".
+ * For batch responses, the strings of the individual results are joined
+ * with "|".
  */
 class ReceivedIqResults : public gloox::IqHandler
 {
@@ -151,14 +159,23 @@ public:
     LOG (INFO) << "Received IQ response for context " << context;
     ASSERT_EQ (iq.subtype (), gloox::IQ::Result);
 
-    const auto* ext = iq.findExtension<RpcResponse> (RpcResponse::EXT_TYPE);
-    CHECK (ext != nullptr) << "No expected RpcResult extension";
-
     std::string result;
-    if (ext->IsSuccess ())
-      result = ext->GetResult ().asString ();
+    const auto* ext = iq.findExtension<RpcResponse> (RpcResponse::EXT_TYPE);
+    if (ext != nullptr)
+      result = ResponseToString (*ext);
     else
-      result = "error " + ext->GetErrorMessage ();
+      {
+        const auto* batch = iq.findExtension<RpcBatchResponse> (
+            RpcBatchResponse::EXT_TYPE);
+        CHECK (batch != nullptr) << "No expected RpcResult extension";
+
+        for (size_t i = 0; i < batch->GetNumResponses (); ++i)
+          {
+            if (i > 0)
+              result += "|";
+            result += ResponseToString (batch->GetResponse (i));
+          }
+      }
 
     std::lock_guard<std::mutex> lock(mut);
     const auto ins = results.emplace (context, result);
@@ -167,6 +184,17 @@ public:
     cv.notify_all ();
   }
 
+  /**
+   * Converts a single response to the string we compare against.
+   */
+  static std::string
+  ResponseToString (const RpcResponse& resp)
+  {
+    if (resp.IsSuccess ())
+      return resp.GetResult ().asString ();
+    return "error " + resp.GetErrorMessage ();
+  }
+
   /**
    * Expects to receive the given messages.  Waits for them to
    * arrive as needed, and clears out the message queue at the end.
@@ -196,12 +224,10 @@ public:
 class ServerTests : public testing::Test, protected XmppClient
 {
 
-private:
+protected:
 
   TestBackend backend;
 
-protected:
-
   static constexpr int accServer = 0;
   static constexpr int accClient = 1;
 
@@ -221,6 +247,7 @@ protected:
       {
         c.registerStanzaExtension (new RpcRequest ());
         c.registerStanzaExtension (new RpcResponse ());
+        c.registerStanzaExtension (new RpcBatchResponse ());
         c.registerStanzaExtension (new PingMessage ());
         c.registerStanzaExtension (new PongMessage ());
         c.registerStanzaExtension (new SupportedNotifications ());
@@ -232,12 +259,12 @@ protected:
 
   /**
    * Returns the pubsub node corresponding to the given notification
-   * type in our server.
+   * type in our server (on the given connection).
    */
-  const std::string&
-  GetNotificationNode (const std::string& type) const
+  std::string
+  GetNotificationNode (const std::string& type, const size_t conn = 0) const
   {
-    return server.GetNotificationNode (type);
+    return server.GetNotificationNode (type, conn);
   }
 
 };
@@ -347,6 +374,16 @@ protected:
     return pongResource;
   }
 
+  /**
+   * Returns true if a pong message has been received.
+   */
+  bool
+  HasPong ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return pongMessage != nullptr;
+  }
+
   /**
    * Returns the SupportedNotifications stanza that was present on the last
    * pong message (or null if there was none).
@@ -374,6 +411,7 @@ TEST_F (ServerPingTests, GetResourceAndVersion)
   SendPing (JIDWithoutResource (GetTestAccount (accServer)));
   EXPECT_EQ (WaitForPong (), SERVER_RES);
   EXPECT_EQ (GetPongMessage ().GetVersion (), SERVER_VERSION);
+  EXPECT_GT (GetPongMessage ().GetMaxBatchSize (), 0);
   EXPECT_EQ (GetNotifications (), nullptr);
 }
 
@@ -396,6 +434,67 @@ TEST_F (ServerPingTests, SupportedNotifications)
   ));
 }
 
+TEST_F (ServerPingTests, IgnoredWhenOverloaded)
+{
+  server.Disconnect ();
+  Server::LoadLimits limits;
+  limits.maxInFlight = 1;
+  server.SetLoadLimits (limits);
+  ASSERT_TRUE (server.Connect (0));
+
+  const auto serverJid = JIDWithResource (GetTestAccount (accServer),
+                                          SERVER_RES);
+
+  /* The ping is received while the slow call is being processed, and thus
+     ignored.  */
+  ReceivedIqResults results;
+  gloox::IQ iq(gloox::IQ::Get, serverJid);
+  Json::Value params(Json::arrayValue);
+  params.append ("foo");
+  iq.addExtension (new RpcRequest ("slow", params));
+  RunWithClient ([&results, &iq] (gloox::Client& c)
+    {
+      c.send (iq, &results, 1);
+    });
+  SendPing (serverJid);
+
+  results.Expect ({{1, "foo"}});
+  EXPECT_FALSE (HasPong ());
+  EXPECT_EQ (server.GetNumInFlightCalls (), 0);
+
+  /* Now that the server is idle again, it answers.  */
+  SendPing (serverJid);
+  EXPECT_EQ (WaitForPong (), SERVER_RES);
+}
+
+TEST_F (ServerPingTests, IgnoredWhenUnhealthy)
+{
+  std::atomic<bool> healthy(false);
+
+  server.Disconnect ();
+  server.EnableHealthCheck ([&healthy] ()
+    {
+      return healthy.load ();
+    }, std::chrono::milliseconds (10));
+  ASSERT_TRUE (server.Connect (0));
+  while (server.IsBackendHealthy ())
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  const auto serverJid = JIDWithResource (GetTestAccount (accServer),
+                                          SERVER_RES);
+  SendPing (serverJid);
+
+  /* Give the server some time to (wrongly) answer the ping.  */
+  std::this_thread::sleep_for (std::chrono::milliseconds (100));
+  EXPECT_FALSE (HasPong ());
+
+  healthy = true;
+  while (!server.IsBackendHealthy ())
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  SendPing (serverJid);
+  EXPECT_EQ (WaitForPong (), SERVER_RES);
+}
+
 /* ************************************************************************** */
 
 /**
@@ -408,30 +507,99 @@ protected:
 
   ReceivedIqResults results;
 
+  /** The full JID to which requests are sent.  */
+  gloox::JID target;
+
+  ServerRpcTests ()
+    : target(JIDWithResource (GetTestAccount (accServer), SERVER_RES))
+  {}
+
   /**
-   * Sends a new request to the server.
+   * Sends a new request to the server from the given XMPP client.
+   * If a positive timeout is given, it is sent with the request.
+   * Returns the IQ id of the request.
    */
-  void
-  SendRequest (const int context, const std::string& method,
-               const std::string& param)
+  std::string
+  SendRequest (XmppClient& sender, const int context,
+               const std::string& method, const std::string& param,
+               const std::chrono::milliseconds timeout
+                  = std::chrono::milliseconds::zero ())
   {
     LOG (INFO)
         << "Sending request for context " << context << ": "
         << method << " " << param;
 
-    const gloox::JID jidTo = JIDWithResource (GetTestAccount (accServer),
-                                              SERVER_RES);
-    gloox::IQ iq(gloox::IQ::Get, jidTo);
-
     Json::Value params(Json::arrayValue);
     params.append (param);
-    auto req = std::make_unique<RpcRequest> (method, params);
-    iq.addExtension (req.release ());
+    std::unique_ptr<RpcRequest> req;
+    if (timeout > std::chrono::milliseconds::zero ())
+      req = std::make_unique<RpcRequest> (method, params, timeout);
+    else
+      req = std::make_unique<RpcRequest> (method, params);
 
-    RunWithClient ([this, context, &iq] (gloox::Client& c)
+    std::string id;
+    sender.RunWithClient ([&] (gloox::Client& c)
       {
+        id = c.getID ();
+        gloox::IQ iq(gloox::IQ::Get, target, id);
+        iq.addExtension (req.release ());
         c.send (iq, &results, context);
       });
+
+    return id;
+  }
+
+  /**
+   * Sends a new request to the server from our main test client.
+   */
+  std::string
+  SendRequest (const int context, const std::string& method,
+               const std::string& param)
+  {
+    return SendRequest (*this, context, method, param);
+  }
+
+  /**
+   * Sends a batch of calls (each given as method and string param) to
+   * the server from our main test client.
+   */
+  void
+  SendBatch (const int context,
+             const std::vector<std::pair<std::string, std::string>>& calls)
+  {
+    std::vector<std::unique_ptr<RpcRequest>> requests;
+    for (const auto& call : calls)
+      {
+        Json::Value params(Json::arrayValue);
+        params.append (call.second);
+        requests.push_back (
+            std::make_unique<RpcRequest> (call.first, params));
+      }
+
+    auto batch = std::make_unique<RpcBatchRequest> (
+        std::move (requests), RpcBatchRequest::Duration::zero ());
+    RunWithClient ([&] (gloox::Client& c)
+      {
+        gloox::IQ iq(gloox::IQ::Get, target, c.getID ());
+        iq.addExtension (batch.release ());
+        c.send (iq, &results, context);
+      });
+  }
+
+  /**
+   * Sends a message to the server that cancels the request with
+   * the given IQ id.
+   */
+  void
+  SendCancel (const std::string& id)
+  {
+    gloox::Message msg(gloox::Message::Normal, target);
+    msg.addExtension (new CancelRequest (id));
+
+    RunWithClient ([&msg] (gloox::Client& c)
+      {
+        c.send (msg);
+      });
   }
 
 };
@@ -462,6 +630,393 @@ TEST_F (ServerRpcTests, MultipleRequests)
   );
 }
 
+TEST_F (ServerRpcTests, Batch)
+{
+  SendRequest (1, "echo", "single");
+  SendBatch (2, {{"echo", "foo"}, {"error", "bar"}, {"echo", "baz"}});
+  results.Expect (
+    {
+      {1, "single"},
+      {2, "foo|error bar|baz"},
+    }
+  );
+}
+
+TEST_F (ServerRpcTests, SlowCallDoesNotBlockOthers)
+{
+  server.Disconnect ();
+  server.SetWorkerThreads (2, 10);
+  ASSERT_TRUE (server.Connect (0));
+
+  SendRequest (1, "slow", "foo");
+  SendRequest (2, "echo", "bar");
+  results.Expect ({{2, "bar"}});
+  results.Expect ({{1, "foo"}});
+}
+
+TEST_F (ServerRpcTests, ExpiredWhileQueued)
+{
+  SendRequest (1, "slow", "foo");
+  SendRequest (*this, 2, "echo", "bar", std::chrono::milliseconds (10));
+  SendRequest (3, "echo", "baz");
+
+  /* The second call expires while waiting for the slow one, and is neither
+     processed by the backend nor answered.  */
+  results.Expect ({{1, "foo"}, {3, "baz"}});
+  EXPECT_EQ (server.GetNumExpiredCalls (), 1);
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
+TEST_F (ServerRpcTests, RejectedWhenSaturated)
+{
+  server.Disconnect ();
+  Server::LoadLimits limits;
+  limits.maxQueued = 1;
+  server.SetLoadLimits (limits);
+  ASSERT_TRUE (server.Connect (0));
+
+  /* Wait for the slow call to be picked up by the worker, so that the
+     next one is queued behind it and the one after is rejected.  */
+  SendRequest (1, "slow", "foo");
+  while (backend.GetNumCalls () < 1)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  SendRequest (2, "echo", "bar");
+  SendRequest (3, "echo", "baz");
+
+  results.Expect (
+    {
+      {1, "foo"},
+      {2, "bar"},
+      {3, "error server is overloaded"},
+    }
+  );
+  EXPECT_EQ (server.GetNumRejectedCalls (), 1);
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
+TEST_F (ServerRpcTests, AdaptiveConcurrency)
+{
+  server.Disconnect ();
+  server.SetWorkerThreads (4, 10);
+  server.EnableFairQueueing (4, 100);
+  server.EnableAdaptiveConcurrency (1);
+  ASSERT_TRUE (server.Connect (0));
+  EXPECT_EQ (server.GetConcurrencyLimit (), 1);
+
+  /* The first call uses up the limit with normal latency, so the limit
+     is raised and the other two are processed in parallel afterwards.  */
+  SendRequest (1, "slow", "foo");
+  SendRequest (2, "slow", "bar");
+  SendRequest (3, "slow", "baz");
+  results.Expect ({{1, "foo"}, {2, "bar"}, {3, "baz"}});
+  EXPECT_EQ (server.GetConcurrencyLimit (), 2);
+}
+
+TEST_F (ServerRpcTests, UnhealthyBackend)
+{
+  std::atomic<bool> healthy(true);
+
+  server.Disconnect ();
+  server.EnableHealthCheck ([&healthy] ()
+    {
+      return healthy.load ();
+    }, std::chrono::milliseconds (10));
+  ASSERT_TRUE (server.Connect (0));
+  EXPECT_TRUE (server.IsBackendHealthy ());
+
+  healthy = false;
+  while (server.IsBackendHealthy ())
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  SendRequest (1, "echo", "foo");
+  results.Expect ({{1, "error backend is unavailable"}});
+  EXPECT_EQ (server.GetNumRejectedCalls (), 1);
+  EXPECT_EQ (backend.GetNumCalls (), 0);
+
+  healthy = true;
+  while (!server.IsBackendHealthy ())
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  SendRequest (2, "echo", "bar");
+  results.Expect ({{2, "bar"}});
+}
+
+TEST_F (ServerRpcTests, CancelledWhileQueued)
+{
+  SendRequest (1, "slow", "foo");
+  const auto id = SendRequest (2, "echo", "bar");
+  SendCancel (id);
+  SendRequest (3, "echo", "baz");
+
+  /* The cancelled call is neither processed by the backend nor answered.  */
+  results.Expect ({{1, "foo"}, {3, "baz"}});
+  EXPECT_EQ (server.GetNumCancelledCalls (), 1);
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
+TEST_F (ServerRpcTests, ClientWentOffline)
+{
+  auto other = std::make_unique<XmppClient> (
+      JIDWithResource (GetTestAccount (accClient), "offline"),
+      GetTestAccount (accClient).password);
+  other->RunWithClient ([] (gloox::Client& c)
+    {
+      c.registerStanzaExtension (new RpcRequest ());
+      c.registerStanzaExtension (new RpcResponse ());
+    });
+  ASSERT_TRUE (other->Connect (0));
+
+  /* Like real clients, announce ourselves to the server with a directed
+     presence.  Then it gets notified when we go offline.  */
+  other->RunWithClient ([this] (gloox::Client& c)
+    {
+      gloox::Presence presence(gloox::Presence::Available, target);
+      c.send (presence);
+    });
+
+  SendRequest (1, "slow", "foo");
+  SendRequest (*other, 2, "echo", "bar");
+  while (server.GetNumInFlightCalls () < 2)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  other.reset ();
+
+  SendRequest (3, "echo", "baz");
+  results.Expect ({{1, "foo"}, {3, "baz"}});
+  EXPECT_EQ (server.GetNumCancelledCalls (), 1);
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+}
+
+TEST_F (ServerRpcTests, DynamicPriority)
+{
+  server.Disconnect ();
+  Server::LoadLimits limits;
+  limits.maxInFlight = 2;
+  server.SetLoadLimits (limits);
+  server.EnableDynamicPriority (-10, std::chrono::milliseconds (10));
+  ASSERT_TRUE (server.Connect (0));
+
+  /* With one of two allowed calls in flight, the priority is lowered to
+     at least half the range (more if the CPU happens to be busy).  */
+  SendRequest (1, "slow", "foo");
+  while (server.GetPriority () > -5)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+  results.Expect ({{1, "foo"}});
+
+  /* When idle again, the priority goes back up.  */
+  while (server.GetPriority () < 0)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+}
+
+TEST_F (ServerRpcTests, ParallelWorkers)
+{
+  constexpr unsigned threads = 4;
+
+  server.Disconnect ();
+  server.SetWorkerThreads (threads, 10);
+  ASSERT_TRUE (server.Connect (0));
+
+  const auto start = std::chrono::steady_clock::now ();
+  std::map<int, std::string> expected;
+  for (unsigned i = 0; i < threads; ++i)
+    {
+      SendRequest (i, "slow", "foo");
+      expected.emplace (i, "foo");
+    }
+  results.Expect (expected);
+  const auto duration = std::chrono::steady_clock::now () - start;
+
+  EXPECT_LT (duration, 2 * TestBackend::SLOW_CALL_TIME);
+}
+
+/**
+ * AsyncRpcServer that just records calls (to the "echo" method), and completes
+ * them when explicitly told to by the test.
+ */
+class DeferredBackend : public AsyncRpcServer
+{
+
+private:
+
+  /** Pending calls, keyed by their argument.  */
+  std::map<std::string, Completion> pending;
+
+  /** Mutex for the pending calls.  */
+  std::mutex mut;
+
+  /** Condition variable signalled when a new call is received.  */
+  std::condition_variable cv;
+
+public:
+
+  DeferredBackend () = default;
+
+  ~DeferredBackend ()
+  {
+    EXPECT_THAT (pending, IsEmpty ()) << "Calls have not been completed";
+  }
+
+  void
+  HandleMethodAsync (const std::string& method, const RawJson& params,
+                     Completion cb) override
+  {
+    CHECK_EQ (method, "echo");
+
+    std::lock_guard<std::mutex> lock(mut);
+    const std::string arg = params.GetValue ()[0].asString ();
+    const auto ins = pending.emplace (arg, std::move (cb));
+    CHECK (ins.second) << "Duplicate pending call: " << params.GetText ();
+    cv.notify_all ();
+  }
+
+  /**
+   * Waits for a call with the given argument and completes it.
+   */
+  void
+  Complete (const std::string& arg)
+  {
+    Completion cb;
+
+    {
+      std::unique_lock<std::mutex> lock(mut);
+      while (pending.count (arg) == 0)
+        cv.wait (lock);
+
+      auto mit = pending.find (arg);
+      cb = std::move (mit->second);
+      pending.erase (mit);
+    }
+
+    cb (RpcResult (Json::Value (arg)));
+  }
+
+  /**
+   * Waits until some call is pending and expects that there is exactly
+   * one with the given argument.
+   */
+  void
+  ExpectPending (const std::string& arg)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (pending.empty ())
+      cv.wait (lock);
+
+    ASSERT_EQ (pending.size (), 1);
+    EXPECT_EQ (pending.begin ()->first, arg);
+  }
+
+};
+
+/**
+ * Test case for a server with an asynchronous backend.  This runs another
+ * server with that backend in addition to the default one of ServerTests
+ * (as different resource), and sends requests to it.
+ */
+class ServerAsyncRpcTests : public ServerRpcTests
+{
+
+protected:
+
+  DeferredBackend asyncBackend;
+  Server asyncServer;
+
+  ServerAsyncRpcTests ()
+    : asyncServer(SERVER_VERSION, asyncBackend,
+                  JIDWithResource (GetTestAccount (accServer), "async").full (),
+                  GetTestAccount (accServer).password)
+  {
+    CHECK (asyncServer.Connect (0));
+    target = JIDWithResource (GetTestAccount (accServer), "async");
+  }
+
+};
+
+TEST_F (ServerAsyncRpcTests, OutOfOrderCompletion)
+{
+  SendRequest (1, "echo", "foo");
+  SendRequest (2, "echo", "bar");
+
+  asyncBackend.Complete ("bar");
+  results.Expect ({{2, "bar"}});
+
+  asyncBackend.Complete ("foo");
+  results.Expect ({{1, "foo"}});
+}
+
+TEST_F (ServerAsyncRpcTests, Coalescing)
+{
+  asyncServer.EnableCoalescing ();
+
+  SendRequest (1, "echo", "foo");
+  SendRequest (2, "echo", "foo");
+  SendRequest (3, "echo", "bar");
+
+  while (asyncServer.GetNumCoalescedCalls () < 1)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  asyncBackend.Complete ("foo");
+  asyncBackend.Complete ("bar");
+  results.Expect (
+    {
+      {1, "foo"},
+      {2, "foo"},
+      {3, "bar"},
+    }
+  );
+
+  EXPECT_EQ (asyncServer.GetNumExecutedCalls (), 2);
+  EXPECT_EQ (asyncServer.GetNumCoalescedCalls (), 1);
+
+  /* Once completed, a new call is executed again.  */
+  SendRequest (4, "echo", "foo");
+  asyncBackend.Complete ("foo");
+  results.Expect ({{4, "foo"}});
+  EXPECT_EQ (asyncServer.GetNumExecutedCalls (), 3);
+}
+
+TEST_F (ServerAsyncRpcTests, FairQueueing)
+{
+  asyncServer.Disconnect ();
+  asyncServer.EnableFairQueueing (1, 100);
+  ASSERT_TRUE (asyncServer.Connect (0));
+
+  /* A second client (with a different bare JID than our main one) that
+     sends requests as well.  */
+  XmppClient other(JIDWithResource (GetTestAccount (accServer), "other"),
+                   GetTestAccount (accServer).password);
+  other.RunWithClient ([] (gloox::Client& c)
+    {
+      c.registerStanzaExtension (new RpcRequest ());
+      c.registerStanzaExtension (new RpcResponse ());
+    });
+  ASSERT_TRUE (other.Connect (0));
+
+  SendRequest (1, "echo", "a1");
+  asyncBackend.ExpectPending ("a1");
+  SendRequest (2, "echo", "a2");
+  SendRequest (3, "echo", "a3");
+  SendRequest (other, 4, "echo", "b1");
+  while (asyncServer.GetNumInFlightCalls () < 4)
+    std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+  /* Even though the other client's request came in last, it is processed
+     before the queued ones of our main client.  */
+  asyncBackend.Complete ("a1");
+  asyncBackend.ExpectPending ("b1");
+  asyncBackend.Complete ("b1");
+  asyncBackend.ExpectPending ("a2");
+  asyncBackend.Complete ("a2");
+  asyncBackend.Complete ("a3");
+
+  results.Expect (
+    {
+      {1, "a1"},
+      {2, "a2"},
+      {3, "a3"},
+      {4, "b1"},
+    }
+  );
+}
+
 /* ************************************************************************** */
 
 /**
@@ -597,6 +1152,166 @@ TEST_F (ServerNotificationTests, MultipleUpdates)
   r.Expect ({"a=1", "b=2", "c=3"});
 }
 
+/**
+ * Test case for the result cache, which is flushed by notifications.
+ */
+class ServerCacheTests : public ServerNotificationTests
+{
+
+protected:
+
+  ReceivedIqResults results;
+
+  ServerCacheTests ()
+  {
+    server.EnableCache (100);
+  }
+
+  /**
+   * Sends an echo request to the server and waits for its result.
+   */
+  void
+  Echo (const std::string& param)
+  {
+    const gloox::JID jidTo = JIDWithResource (GetTestAccount (accServer),
+                                              SERVER_RES);
+    gloox::IQ iq(gloox::IQ::Get, jidTo);
+
+    Json::Value params(Json::arrayValue);
+    params.append (param);
+    iq.addExtension (new RpcRequest ("echo", params));
+
+    RunWithClient ([this, &iq] (gloox::Client& c)
+      {
+        c.send (iq, &results, 1);
+      });
+
+    results.Expect ({{1, param}});
+  }
+
+};
+
+TEST_F (ServerCacheTests, CachedUntilUpdate)
+{
+  auto s = UpdatableState::Create ();
+  server.AddNotification (s->NewWaiter ("foo"));
+  NotificationReceiver r(*this, "foo", GetNotificationNode ("foo"));
+
+  s->SetState ("a", "1");
+  r.Expect ({"a=1"});
+
+  Echo ("x");
+  Echo ("y");
+  Echo ("x");
+  EXPECT_EQ (backend.GetNumCalls (), 2);
+
+  s->SetState ("b", "2");
+  r.Expect ({"b=2"});
+
+  Echo ("x");
+  Echo ("x");
+  EXPECT_EQ (backend.GetNumCalls (), 3);
+}
+
+/**
+ * Test case for a server with two XMPP connections (as different resources
+ * of the same account).
+ */
+class ServerMultiConnectionTests : public ServerNotificationTests
+{
+
+protected:
+
+  static constexpr const char* SECOND_RES = "second";
+
+  ReceivedIqResults results;
+
+  ServerMultiConnectionTests ()
+  {
+    const auto& acc = GetTestAccount (accServer);
+    server.AddConnection (JIDWithResource (acc, SECOND_RES).full (),
+                          acc.password);
+    CHECK (server.Connect (0));
+  }
+
+  /**
+   * Sends an echo request to the given resource of the server.
+   */
+  void
+  SendEcho (const std::string& res, const int context,
+            const std::string& param)
+  {
+    const gloox::JID jidTo = JIDWithResource (GetTestAccount (accServer),
+                                              res);
+    gloox::IQ iq(gloox::IQ::Get, jidTo);
+
+    Json::Value params(Json::arrayValue);
+    params.append (param);
+    iq.addExtension (new RpcRequest ("echo", params));
+
+    RunWithClient ([this, &iq, context] (gloox::Client& c)
+      {
+        c.send (iq, &results, context);
+      });
+  }
+
+};
+
+constexpr const char* ServerMultiConnectionTests::SECOND_RES;
+
+TEST_F (ServerMultiConnectionTests, RequestsOnEachConnection)
+{
+  EXPECT_EQ (server.GetNumConnections (), 2);
+  EXPECT_TRUE (server.IsConnected ());
+
+  SendEcho (SERVER_RES, 1, "foo");
+  SendEcho (SECOND_RES, 2, "bar");
+  results.Expect ({{1, "foo"}, {2, "bar"}});
+
+  EXPECT_EQ (server.GetNumExecutedCalls (), 2);
+}
+
+TEST_F (ServerMultiConnectionTests, SharedCache)
+{
+  server.EnableCache (100);
+
+  SendEcho (SERVER_RES, 1, "foo");
+  results.Expect ({{1, "foo"}});
+  SendEcho (SECOND_RES, 2, "foo");
+  results.Expect ({{2, "foo"}});
+
+  EXPECT_EQ (backend.GetNumCalls (), 1);
+}
+
+TEST_F (ServerMultiConnectionTests, NotificationsOnEachConnection)
+{
+  auto s = UpdatableState::Create ();
+  server.AddNotification (s->NewWaiter ("foo"));
+
+  const auto node1 = GetNotificationNode ("foo", 0);
+  const auto node2 = GetNotificationNode ("foo", 1);
+  EXPECT_NE (node1, node2);
+
+  NotificationReceiver r1(*this, "foo", node1);
+  NotificationReceiver r2(*this, "foo", node2);
+
+  s->SetState ("a", "1");
+  r1.Expect ({"a=1"});
+  r2.Expect ({"a=1"});
+}
+
+TEST_F (ServerMultiConnectionTests, ReconnectsMissing)
+{
+  server.Disconnect ();
+  EXPECT_FALSE (server.IsConnected ());
+
+  ASSERT_TRUE (server.Connect (0));
+  EXPECT_TRUE (server.IsConnected ());
+
+  SendEcho (SECOND_RES, 1, "foo");
+  results.Expect ({{1, "foo"}});
+}
+
 /* ************************************************************************** */
 
 class ServerReconnectLoopTests : public testing::Test
@@ -0,0 +1,103 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "serverselector.hpp"
+
+#include <glog/logging.h>
+
+#include <utility>
+
+namespace charon
+{
+
+namespace
+{
+
+/**
+ * Returns the round-trip time of the given instance that is used for
+ * comparing it to another one, and the number of samples it is based on.
+ * Call round-trip times are what the client actually experiences, but
+ * they are only known for instances that have been used already.  Thus
+ * they are compared if both instances have enough call samples, and the
+ * ping round-trip times otherwise.
+ */
+std::pair<double, unsigned>
+ComparedRtt (const ServerStats& s, const ServerStats& other,
+             const unsigned minSamples)
+{
+  if (s.callSamples >= minSamples && other.callSamples >= minSamples)
+    return std::make_pair (s.callRtt.count (), s.callSamples);
+  return std::make_pair (s.pingRtt.count (), s.pingSamples);
+}
+
+} // anonymous namespace
+
+LowestRttSelector::LowestRttSelector (const double f, const unsigned m)
+  : switchFactor(f), minSamples(m)
+{
+  CHECK_GT (switchFactor, 0.0);
+  CHECK_LE (switchFactor, 1.0);
+}
+
+std::string
+LowestRttSelector::SelectServer (const std::vector<ServerStats>& candidates,
+                                 const std::string& current)
+{
+  CHECK (!candidates.empty ());
+
+  const ServerStats* best = nullptr;
+  const ServerStats* cur = nullptr;
+  for (const auto& c : candidates)
+    {
+      if (c.resource == current)
+        cur = &c;
+
+      if (c.pingSamples == 0)
+        continue;
+      if (best == nullptr
+            || ComparedRtt (c, *best, minSamples).first
+                  < ComparedRtt (*best, c, minSamples).first)
+        best = &c;
+    }
+
+  /* Without a current instance, we just take the fastest one (or any if
+     there are no measurements at all).  */
+  if (cur == nullptr)
+    {
+      if (best == nullptr)
+        return candidates.front ().resource;
+      return best->resource;
+    }
+
+  if (best == nullptr || best == cur || cur->pingSamples == 0)
+    return current;
+
+  const auto bestRtt = ComparedRtt (*best, *cur, minSamples);
+  const auto curRtt = ComparedRtt (*cur, *best, minSamples);
+  if (bestRtt.second < minSamples)
+    return current;
+  if (bestRtt.first >= switchFactor * curRtt.first)
+    return current;
+
+  VLOG (1)
+      << "Instance " << best->resource << " is faster than " << current
+      << " (" << bestRtt.first << " vs " << curRtt.first << " us)";
+  return best->resource;
+}
+
+} // namespace charon
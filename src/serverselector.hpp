@@ -0,0 +1,136 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHARON_SERVERSELECTOR_HPP
+#define CHARON_SERVERSELECTOR_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * Round-trip times measured by a client for one server instance (i.e.
+ * XMPP resource of the server JID).  The values are moving averages
+ * over the samples seen so far.
+ */
+struct ServerStats
+{
+
+  /** Duration type used for the round-trip times.  */
+  using Duration = std::chrono::microseconds;
+
+  /** The resource of the server instance.  */
+  std::string resource;
+
+  /**
+   * Round-trip time of pings answered by the instance.  This reflects
+   * mostly the network (and XMPP server) latency.
+   */
+  Duration pingRtt = Duration::zero ();
+
+  /** Number of pongs received from the instance.  */
+  unsigned pingSamples = 0;
+
+  /**
+   * Round-trip time of RPC calls answered by the instance.  This includes
+   * the time spent processing the calls as well.  Calls that the instance
+   * rejected as busy are not counted.
+   */
+  Duration callRtt = Duration::zero ();
+
+  /** Number of call responses received from the instance.  */
+  unsigned callSamples = 0;
+
+};
+
+/**
+ * Policy for choosing the server instance a client talks to.  It is used
+ * for the initial choice among the instances that answered the client's
+ * ping within a short window, and (if enabled) periodically afterwards
+ * to decide whether the client should switch to another instance.
+ */
+class ServerSelector
+{
+
+public:
+
+  ServerSelector () = default;
+  virtual ~ServerSelector () = default;
+
+  ServerSelector (const ServerSelector&) = delete;
+  void operator= (const ServerSelector&) = delete;
+
+  /**
+   * Returns the resource of the instance to use among the given candidates
+   * (which are never empty).  current is the resource of the currently
+   * selected instance, which is then also one of the candidates, or empty
+   * if none is selected yet.  This is called with internal locks of the
+   * client held, so it must return quickly.
+   */
+  virtual std::string SelectServer (const std::vector<ServerStats>& candidates,
+                                    const std::string& current) = 0;
+
+};
+
+/**
+ * The default ServerSelector, which chooses the instance with the lowest
+ * round-trip time.  Two instances are compared by their call round-trip
+ * times if both have been used for enough calls, and by their ping
+ * round-trip times otherwise.  (Comparing the call time of one with the
+ * ping time of another would always favour instances that have not been
+ * used yet, since only calls include the backend's processing time.)
+ *
+ * To avoid flapping between instances, it only switches away from the
+ * current one if another is faster by some margin, and if that has been
+ * measured over a couple of samples already.
+ */
+class LowestRttSelector : public ServerSelector
+{
+
+private:
+
+  /**
+   * Factor by which the round-trip time of another instance must be
+   * lower than the current one's for a switch.
+   */
+  const double switchFactor;
+
+  /** Minimum number of samples of another instance for a switch.  */
+  const unsigned minSamples;
+
+public:
+
+  /**
+   * Constructs the selector.  It switches to another instance if that
+   * has at least m samples and a round-trip time below f times
+   * the current instance's.  m is also the number of call samples both
+   * instances need for comparing their call round-trip times.
+   */
+  explicit LowestRttSelector (double f = 0.7, unsigned m = 3);
+
+  std::string SelectServer (const std::vector<ServerStats>& candidates,
+                            const std::string& current) override;
+
+};
+
+} // namespace charon
+
+#endif // CHARON_SERVERSELECTOR_HPP
@@ -0,0 +1,141 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "serverselector.hpp"
+
+#include <gtest/gtest.h>
+
+namespace charon
+{
+namespace
+{
+
+/**
+ * Constructs stats for a candidate with the given ping RTT (in
+ * milliseconds) and number of samples.
+ */
+ServerStats
+Candidate (const std::string& resource, const unsigned rttMs,
+           const unsigned samples)
+{
+  ServerStats res;
+  res.resource = resource;
+  res.pingRtt = std::chrono::milliseconds (rttMs);
+  res.pingSamples = samples;
+  return res;
+}
+
+/**
+ * Constructs stats for a candidate with both ping and call RTTs.
+ */
+ServerStats
+Candidate (const std::string& resource, const unsigned pingMs,
+           const unsigned pingSamples, const unsigned callMs,
+           const unsigned callSamples)
+{
+  ServerStats res = Candidate (resource, pingMs, pingSamples);
+  res.callRtt = std::chrono::milliseconds (callMs);
+  res.callSamples = callSamples;
+  return res;
+}
+
+using LowestRttSelectorTests = testing::Test;
+
+TEST_F (LowestRttSelectorTests, InitialSelection)
+{
+  LowestRttSelector sel;
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("slow", 50, 1),
+      Candidate ("fast", 10, 1),
+      Candidate ("medium", 20, 1),
+  }, ""), "fast");
+}
+
+TEST_F (LowestRttSelectorTests, InitialWithoutSamples)
+{
+  LowestRttSelector sel;
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("first", 0, 0),
+      Candidate ("second", 0, 0),
+  }, ""), "first");
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("first", 0, 0),
+      Candidate ("second", 20, 1),
+  }, ""), "second");
+}
+
+TEST_F (LowestRttSelectorTests, SwitchesWhenMuchFaster)
+{
+  LowestRttSelector sel(0.5, 3);
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10),
+      Candidate ("other", 40, 3),
+  }, "current"), "other");
+}
+
+TEST_F (LowestRttSelectorTests, StaysWithSmallDifference)
+{
+  LowestRttSelector sel(0.5, 3);
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10),
+      Candidate ("other", 60, 10),
+  }, "current"), "current");
+}
+
+TEST_F (LowestRttSelectorTests, StaysWithTooFewSamples)
+{
+  LowestRttSelector sel(0.5, 3);
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10),
+      Candidate ("other", 10, 2),
+  }, "current"), "current");
+}
+
+TEST_F (LowestRttSelectorTests, ComparesCallRtts)
+{
+  LowestRttSelector sel(0.5, 3);
+
+  /* The ping times are similar, but calls are much faster on the
+     other instance.  */
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 10, 10, 100, 10),
+      Candidate ("other", 9, 10, 40, 3),
+  }, "current"), "other");
+
+  /* Pings are faster on the other instance, but calls are not.  */
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10, 150, 10),
+      Candidate ("other", 10, 10, 200, 5),
+  }, "current"), "current");
+}
+
+TEST_F (LowestRttSelectorTests, PingRttsWithoutEnoughCallSamples)
+{
+  LowestRttSelector sel(0.5, 3);
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10, 500, 10),
+      Candidate ("other", 40, 3, 10, 2),
+  }, "current"), "other");
+  EXPECT_EQ (sel.SelectServer ({
+      Candidate ("current", 100, 10, 500, 10),
+      Candidate ("other", 60, 3, 10, 2),
+  }, "current"), "current");
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,115 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/singleflight.hpp"
+
+#include <glog/logging.h>
+
+#include <vector>
+
+namespace charon
+{
+
+/**
+ * A single call in flight with the callers waiting for it.
+ */
+class SingleFlight::Flight
+{
+
+public:
+
+  /** The completions of all callers.  */
+  std::vector<AsyncRpcServer::Completion> callers;
+
+  /** The abort checks of all callers (null for those without one).  */
+  std::vector<AsyncRpcServer::AbortCheck> abortChecks;
+
+};
+
+SingleFlight::Handle
+SingleFlight::Join (const std::string& key, AsyncRpcServer::Completion cb,
+                    AsyncRpcServer::AbortCheck aborted)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = flights.find (key);
+  if (mit != flights.end ())
+    {
+      mit->second->callers.push_back (std::move (cb));
+      mit->second->abortChecks.push_back (std::move (aborted));
+      return nullptr;
+    }
+
+  auto f = std::make_shared<Flight> ();
+  f->callers.push_back (std::move (cb));
+  f->abortChecks.push_back (std::move (aborted));
+  flights.emplace (key, f);
+
+  return f;
+}
+
+bool
+SingleFlight::IsAborted (const std::string& key, const Handle& f)
+{
+  CHECK (f != nullptr);
+
+  std::lock_guard<std::mutex> lock(mut);
+
+  for (const auto& check : f->abortChecks)
+    if (check == nullptr || !check ())
+      return false;
+
+  const auto mit = flights.find (key);
+  if (mit != flights.end () && mit->second == f)
+    flights.erase (mit);
+
+  return true;
+}
+
+void
+SingleFlight::Complete (const std::string& key, const Handle& f,
+                        const RpcResult& res)
+{
+  CHECK (f != nullptr);
+
+  std::vector<AsyncRpcServer::Completion> callers;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    /* The flight may have been detached already, and a new one for the
+       same key started since then.  */
+    const auto mit = flights.find (key);
+    if (mit != flights.end () && mit->second == f)
+      flights.erase (mit);
+
+    callers = std::move (f->callers);
+  }
+
+  VLOG (1) << "Completing call for " << callers.size () << " callers";
+  for (const auto& cb : callers)
+    cb (res);
+}
+
+void
+SingleFlight::Detach ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  flights.clear ();
+}
+
+} // namespace charon
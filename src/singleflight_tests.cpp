@@ -0,0 +1,138 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/singleflight.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace charon
+{
+namespace
+{
+
+using testing::ElementsAre;
+
+class SingleFlightTests : public testing::Test
+{
+
+protected:
+
+  SingleFlight flights;
+
+  /** Results received by the callers, as "caller: result" strings.  */
+  std::vector<std::string> received;
+
+  /**
+   * Returns a completion callback that records the result for the
+   * given caller name.
+   */
+  AsyncRpcServer::Completion
+  Caller (const std::string& name)
+  {
+    return [this, name] (const RpcResult& res)
+      {
+        received.push_back (name + ": " + res.GetResult ().asString ());
+      };
+  }
+
+};
+
+TEST_F (SingleFlightTests, CoalescesIdenticalCalls)
+{
+  auto f = flights.Join ("foo", Caller ("a"));
+  ASSERT_NE (f, nullptr);
+  EXPECT_EQ (flights.Join ("foo", Caller ("b")), nullptr);
+
+  auto g = flights.Join ("bar", Caller ("c"));
+  ASSERT_NE (g, nullptr);
+
+  flights.Complete ("foo", f, RpcResult (Json::Value ("x")));
+  flights.Complete ("bar", g, RpcResult (Json::Value ("y")));
+
+  EXPECT_THAT (received, ElementsAre ("a: x", "b: x", "c: y"));
+}
+
+TEST_F (SingleFlightTests, NewFlightAfterCompletion)
+{
+  auto f = flights.Join ("foo", Caller ("a"));
+  flights.Complete ("foo", f, RpcResult (Json::Value ("x")));
+
+  f = flights.Join ("foo", Caller ("b"));
+  ASSERT_NE (f, nullptr);
+  flights.Complete ("foo", f, RpcResult (Json::Value ("y")));
+
+  EXPECT_THAT (received, ElementsAre ("a: x", "b: y"));
+}
+
+TEST_F (SingleFlightTests, Detach)
+{
+  auto f = flights.Join ("foo", Caller ("a"));
+  flights.Detach ();
+
+  auto g = flights.Join ("foo", Caller ("b"));
+  ASSERT_NE (g, nullptr);
+  EXPECT_EQ (flights.Join ("foo", Caller ("c")), nullptr);
+
+  flights.Complete ("foo", f, RpcResult (Json::Value ("old")));
+  EXPECT_EQ (flights.Join ("foo", Caller ("d")), nullptr);
+  flights.Complete ("foo", g, RpcResult (Json::Value ("new")));
+
+  EXPECT_THAT (received, ElementsAre ("a: old", "b: new", "c: new", "d: new"));
+}
+
+TEST_F (SingleFlightTests, AbortedOnlyIfAllCallersAre)
+{
+  bool abortA = false;
+  bool abortB = false;
+  auto f = flights.Join ("foo", Caller ("a"), [&abortA] () { return abortA; });
+  EXPECT_EQ (flights.Join ("foo", Caller ("b"),
+                           [&abortB] () { return abortB; }),
+             nullptr);
+
+  EXPECT_FALSE (flights.IsAborted ("foo", f));
+  abortA = true;
+  EXPECT_FALSE (flights.IsAborted ("foo", f));
+  abortB = true;
+  EXPECT_TRUE (flights.IsAborted ("foo", f));
+
+  /* The aborted flight is detached, so a new caller starts a new one.  */
+  auto g = flights.Join ("foo", Caller ("c"));
+  ASSERT_NE (g, nullptr);
+
+  flights.Complete ("foo", f, RpcResult (Json::Value ("aborted")));
+  flights.Complete ("foo", g, RpcResult (Json::Value ("x")));
+
+  EXPECT_THAT (received, ElementsAre ("a: aborted", "b: aborted", "c: x"));
+}
+
+TEST_F (SingleFlightTests, CallerWithoutAbortCheck)
+{
+  auto f = flights.Join ("foo", Caller ("a"), [] () { return true; });
+  EXPECT_TRUE (flights.IsAborted ("foo", f));
+
+  auto g = flights.Join ("foo", Caller ("b"), [] () { return true; });
+  EXPECT_EQ (flights.Join ("foo", Caller ("c")), nullptr);
+  EXPECT_FALSE (flights.IsAborted ("foo", g));
+}
+
+} // anonymous namespace
+} // namespace charon
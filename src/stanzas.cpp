@@ -57,22 +57,55 @@ ParseJsonFromTag (const gloox::Tag& t, Json::Value& val)
   return true;
 }
 
+/**
+ * Validates the CData contained in a given tag as JSON, and returns it
+ * as RawJson without parsing it.  Returns true if it is valid.
+ */
+bool
+ValidateJsonFromTag (const gloox::Tag& t, RawJson& val)
+{
+  if (!RawJson::FromText (t.cdata (), val))
+    {
+      LOG (WARNING) << "Invalid JSON:\n" << t.cdata ();
+      return false;
+    }
+
+  return true;
+}
+
 /**
  * Serialises the given JSON value into the CData of a new tag with
- * the given name and returns the newly created tag.
+ * the given name and returns the newly created tag.  If the value is
+ * held in serialised form already, that is used directly.
  */
 std::unique_ptr<gloox::Tag>
-SerialiseJsonToTag (const Json::Value& val, const std::string& tagName)
+SerialiseJsonToTag (const RawJson& val, const std::string& tagName)
 {
-  Json::StreamWriterBuilder wbuilder;
-  wbuilder["commentStyle"] = "None";
-  wbuilder["indentation"] = "";
-  wbuilder["enableYAMLCompatibility"] = false;
-  wbuilder["dropNullPlaceholders"] = false;
-  wbuilder["useSpecialFloats"] = false;
+  return std::make_unique<gloox::Tag> (tagName, val.GetText ());
+}
 
-  const std::string serialised = Json::writeString (wbuilder, val);
-  return std::make_unique<gloox::Tag> (tagName, serialised);
+/**
+ * Parses the optional timeout attribute of a request or batch tag.
+ * Returns false if it is present but invalid.  If it is missing,
+ * the timeout is left unchanged.
+ */
+bool
+ParseTimeoutAttribute (const gloox::Tag& t, RpcRequest::Duration& timeout)
+{
+  if (!t.hasAttribute ("timeout"))
+    return true;
+
+  std::istringstream timeoutIn(t.findAttribute ("timeout"));
+  RpcRequest::Duration::rep ms;
+  timeoutIn >> ms;
+  if (!timeoutIn || !timeoutIn.eof () || ms <= 0)
+    {
+      LOG (WARNING) << t.name () << " tag has invalid timeout";
+      return false;
+    }
+
+  timeout = RpcRequest::Duration (ms);
+  return true;
 }
 
 } // anonymous namespace
@@ -85,18 +118,30 @@ RpcRequest::RpcRequest ()
   SetValid (false);
 }
 
-RpcRequest::RpcRequest (const std::string& m, const Json::Value& p)
+RpcRequest::RpcRequest (const std::string& m, const RawJson& p)
   : ValidatedStanzaExtension(EXT_TYPE),
     method(m), params(p)
 {
   SetValid (true);
 }
 
+RpcRequest::RpcRequest (const std::string& m, const RawJson& p,
+                        const Duration t)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    method(m), params(p), timeout(t)
+{
+  CHECK_GT (timeout.count (), 0) << "Timeout must be positive";
+  SetValid (true);
+}
+
 RpcRequest::RpcRequest (const gloox::Tag& t)
   : ValidatedStanzaExtension(EXT_TYPE)
 {
   SetValid (false);
 
+  if (!ParseTimeoutAttribute (t, timeout))
+    return;
+
   const auto* child = t.findChild ("method");
   if (child == nullptr)
     {
@@ -116,9 +161,15 @@ RpcRequest::RpcRequest (const gloox::Tag& t)
       LOG (WARNING) << "request tag has no params child";
       return;
     }
-  if (!ParseJsonFromTag (*child, params))
+  if (!ValidateJsonFromTag (*child, params))
     return;
-  if (!params.isObject () && !params.isArray () && !params.isNull ())
+
+  /* The text is valid JSON already, so its first non-whitespace character
+     determines the type of value.  */
+  const auto& text = params.GetText ();
+  const size_t start = text.find_first_not_of (" \t\n\r");
+  CHECK_NE (start, std::string::npos);
+  if (text[start] != '{' && text[start] != '[' && !params.IsNull ())
     {
       LOG (WARNING) << "request params is neither object nor array";
       return;
@@ -149,6 +200,7 @@ RpcRequest::clone () const
     {
       res->method = method;
       res->params = params;
+      res->timeout = timeout;
       res->SetValid (true);
     }
   else
@@ -164,6 +216,8 @@ RpcRequest::tag () const
 
   auto res = std::make_unique<gloox::Tag> ("request");
   CHECK (res->setXmlns (XMLNS));
+  if (HasTimeout ())
+    CHECK (res->addAttribute ("timeout", std::to_string (timeout.count ())));
 
   auto child = std::make_unique<gloox::Tag> ("method", method);
   res->addChild (child.release ());
@@ -182,7 +236,7 @@ RpcResponse::RpcResponse ()
   SetValid (false);
 }
 
-RpcResponse::RpcResponse (const Json::Value& res)
+RpcResponse::RpcResponse (const RawJson& res)
   : ValidatedStanzaExtension(EXT_TYPE),
     success(true), result(res)
 {
@@ -211,7 +265,7 @@ RpcResponse::RpcResponse (const gloox::Tag& t)
           return;
         }
 
-      if (!ParseJsonFromTag (*outer, result))
+      if (!ValidateJsonFromTag (*outer, result))
         return;
 
       success = true;
@@ -252,6 +306,13 @@ RpcResponse::RpcResponse (const gloox::Tag& t)
 
 const Json::Value&
 RpcResponse::GetResult () const
+{
+  CHECK (IsSuccess ());
+  return result.GetValue ();
+}
+
+const RawJson&
+RpcResponse::GetRawResult () const
 {
   CHECK (IsSuccess ());
   return result;
@@ -349,12 +410,213 @@ RpcResponse::tag () const
 
 /* ************************************************************************** */
 
+RpcBatchRequest::RpcBatchRequest ()
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+}
+
+RpcBatchRequest::RpcBatchRequest (std::vector<std::unique_ptr<RpcRequest>> r,
+                                  const Duration t)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    requests(std::move (r)), timeout(t)
+{
+  CHECK (!requests.empty ()) << "Batch must contain at least one request";
+  CHECK_GE (timeout.count (), 0) << "Timeout must not be negative";
+  for (const auto& req : requests)
+    {
+      CHECK (req->IsValid ());
+      CHECK (!req->HasTimeout ()) << "Requests in a batch cannot have timeouts";
+    }
+
+  SetValid (true);
+}
+
+RpcBatchRequest::RpcBatchRequest (const gloox::Tag& t)
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+
+  if (!ParseTimeoutAttribute (t, timeout))
+    return;
+
+  for (const auto* child : t.findChildren ("request"))
+    {
+      auto req = std::make_unique<RpcRequest> (*child);
+      if (!req->IsValid ())
+        {
+          LOG (WARNING) << "batch contains invalid request";
+          return;
+        }
+      if (req->HasTimeout ())
+        {
+          LOG (WARNING) << "request in batch has its own timeout";
+          return;
+        }
+      requests.push_back (std::move (req));
+    }
+
+  /* This is not an error worth warning about, as it is also what happens
+     for batch responses (which share the tag name).  */
+  if (requests.empty ())
+    {
+      VLOG (1) << "batch tag has no requests";
+      return;
+    }
+
+  SetValid (true);
+}
+
+const std::string&
+RpcBatchRequest::filterString () const
+{
+  static const std::string filter = "/*/batch[@xmlns='" XMLNS "']";
+  return filter;
+}
+
+gloox::StanzaExtension*
+RpcBatchRequest::newInstance (const gloox::Tag* tag) const
+{
+  return new RpcBatchRequest (*tag);
+}
+
+gloox::StanzaExtension*
+RpcBatchRequest::clone () const
+{
+  if (!IsValid ())
+    return new RpcBatchRequest ();
+
+  std::vector<std::unique_ptr<RpcRequest>> copied;
+  for (const auto& req : requests)
+    copied.emplace_back (static_cast<RpcRequest*> (req->clone ()));
+
+  return new RpcBatchRequest (std::move (copied), timeout);
+}
+
+gloox::Tag*
+RpcBatchRequest::tag () const
+{
+  CHECK (IsValid ()) << "Trying to serialise invalid RpcBatchRequest";
+
+  auto res = std::make_unique<gloox::Tag> ("batch");
+  CHECK (res->setXmlns (XMLNS));
+  if (HasTimeout ())
+    CHECK (res->addAttribute ("timeout", std::to_string (timeout.count ())));
+
+  for (const auto& req : requests)
+    res->addChild (req->tag ());
+
+  return res.release ();
+}
+
+/* ************************************************************************** */
+
+RpcBatchResponse::RpcBatchResponse ()
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+}
+
+RpcBatchResponse::RpcBatchResponse (
+    std::vector<std::unique_ptr<RpcResponse>> r)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    responses(std::move (r))
+{
+  CHECK (!responses.empty ()) << "Batch must contain at least one response";
+  for (const auto& resp : responses)
+    CHECK (resp->IsValid ());
+
+  SetValid (true);
+}
+
+RpcBatchResponse::RpcBatchResponse (const gloox::Tag& t)
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+
+  for (const auto* child : t.findChildren ("response"))
+    {
+      auto resp = std::make_unique<RpcResponse> (*child);
+      if (!resp->IsValid ())
+        {
+          LOG (WARNING) << "batch contains invalid response";
+          return;
+        }
+      responses.push_back (std::move (resp));
+    }
+
+  /* Batch requests share the tag name, so this is not worth a warning.  */
+  if (responses.empty ())
+    {
+      VLOG (1) << "batch tag has no responses";
+      return;
+    }
+
+  SetValid (true);
+}
+
+const std::string&
+RpcBatchResponse::filterString () const
+{
+  static const std::string filter = "/*/batch[@xmlns='" XMLNS "']";
+  return filter;
+}
+
+gloox::StanzaExtension*
+RpcBatchResponse::newInstance (const gloox::Tag* tag) const
+{
+  return new RpcBatchResponse (*tag);
+}
+
+gloox::StanzaExtension*
+RpcBatchResponse::clone () const
+{
+  if (!IsValid ())
+    return new RpcBatchResponse ();
+
+  std::vector<std::unique_ptr<RpcResponse>> copied;
+  for (const auto& resp : responses)
+    copied.emplace_back (static_cast<RpcResponse*> (resp->clone ()));
+
+  return new RpcBatchResponse (std::move (copied));
+}
+
+gloox::Tag*
+RpcBatchResponse::tag () const
+{
+  CHECK (IsValid ()) << "Trying to serialise invalid RpcBatchResponse";
+
+  auto res = std::make_unique<gloox::Tag> ("batch");
+  CHECK (res->setXmlns (XMLNS));
+
+  for (const auto& resp : responses)
+    res->addChild (resp->tag ());
+
+  return res.release ();
+}
+
+/* ************************************************************************** */
+
 PingMessage::PingMessage ()
   : ValidatedStanzaExtension(EXT_TYPE)
 {
   SetValid (true);
 }
 
+PingMessage::PingMessage (const std::string& n)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    nonce(n)
+{
+  SetValid (true);
+}
+
+PingMessage::PingMessage (const gloox::Tag& t)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    nonce(t.findAttribute ("nonce"))
+{
+  SetValid (true);
+}
+
 const std::string&
 PingMessage::filterString () const
 {
@@ -365,13 +627,13 @@ PingMessage::filterString () const
 gloox::StanzaExtension*
 PingMessage::newInstance (const gloox::Tag* tag) const
 {
-  return new PingMessage ();
+  return new PingMessage (*tag);
 }
 
 gloox::StanzaExtension*
 PingMessage::clone () const
 {
-  return new PingMessage ();
+  return new PingMessage (nonce);
 }
 
 gloox::Tag*
@@ -379,6 +641,8 @@ PingMessage::tag () const
 {
   auto res = std::make_unique<gloox::Tag> ("ping");
   CHECK (res->setXmlns (XMLNS));
+  if (!nonce.empty ())
+    CHECK (res->addAttribute ("nonce", nonce));
 
   return res.release ();
 }
@@ -396,6 +660,13 @@ PongMessage::PongMessage (const std::string& v)
   SetValid (true);
 }
 
+PongMessage::PongMessage (const std::string& v, const size_t b)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    version(v), maxBatchSize(b)
+{
+  SetValid (true);
+}
+
 PongMessage::PongMessage (const gloox::Tag& t)
   : ValidatedStanzaExtension(EXT_TYPE)
 {
@@ -404,6 +675,25 @@ PongMessage::PongMessage (const gloox::Tag& t)
   /* If the attribute is not present, then we assume an empty version.
      This is totally fine.  */
   version = t.findAttribute ("version");
+  nonce = t.findAttribute ("nonce");
+
+  /* Similarly, a missing batch attribute just means that the server does
+     not support batches (e.g. an older version).  If it is present, it has
+     to be a positive number, though.  It is parsed as signed so that
+     negative values are not wrapped around to huge sizes.  */
+  if (t.hasAttribute ("batch"))
+    {
+      std::istringstream batchIn(t.findAttribute ("batch"));
+      long long b;
+      batchIn >> b;
+      if (!batchIn || !batchIn.eof () || b <= 0)
+        {
+          LOG (WARNING) << "pong has invalid batch attribute";
+          SetValid (false);
+          return;
+        }
+      maxBatchSize = b;
+    }
 }
 
 const std::string&
@@ -422,7 +712,10 @@ PongMessage::newInstance (const gloox::Tag* tag) const
 gloox::StanzaExtension*
 PongMessage::clone () const
 {
-  return new PongMessage (version);
+  auto res = std::make_unique<PongMessage> (version, maxBatchSize);
+  res->SetNonce (nonce);
+  res->SetValid (IsValid ());
+  return res.release ();
 }
 
 gloox::Tag*
@@ -432,6 +725,74 @@ PongMessage::tag () const
   CHECK (res->setXmlns (XMLNS));
   if (!version.empty ())
     CHECK (res->addAttribute ("version", version));
+  if (maxBatchSize > 0)
+    CHECK (res->addAttribute ("batch", std::to_string (maxBatchSize)));
+  if (!nonce.empty ())
+    CHECK (res->addAttribute ("nonce", nonce));
+
+  return res.release ();
+}
+
+/* ************************************************************************** */
+
+CancelRequest::CancelRequest ()
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+}
+
+CancelRequest::CancelRequest (const std::string& i)
+  : ValidatedStanzaExtension(EXT_TYPE),
+    id(i)
+{
+  CHECK (!id.empty ());
+  SetValid (true);
+}
+
+CancelRequest::CancelRequest (const gloox::Tag& t)
+  : ValidatedStanzaExtension(EXT_TYPE)
+{
+  SetValid (false);
+
+  id = t.findAttribute ("id");
+  if (id.empty ())
+    {
+      LOG (WARNING) << "Cancel message without request id";
+      return;
+    }
+
+  SetValid (true);
+}
+
+const std::string&
+CancelRequest::filterString () const
+{
+  static const std::string filter = "/*/cancel[@xmlns='" XMLNS "']";
+  return filter;
+}
+
+gloox::StanzaExtension*
+CancelRequest::newInstance (const gloox::Tag* tag) const
+{
+  return new CancelRequest (*tag);
+}
+
+gloox::StanzaExtension*
+CancelRequest::clone () const
+{
+  if (!IsValid ())
+    return new CancelRequest ();
+  return new CancelRequest (id);
+}
+
+gloox::Tag*
+CancelRequest::tag () const
+{
+  CHECK (IsValid ()) << "Trying to serialise invalid CancelRequest";
+
+  auto res = std::make_unique<gloox::Tag> ("cancel");
+  CHECK (res->setXmlns (XMLNS));
+  CHECK (res->addAttribute ("id", id));
 
   return res.release ();
 }
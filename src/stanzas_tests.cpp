@@ -25,7 +25,10 @@
 
 #include <glog/logging.h>
 
+#include <chrono>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace charon
 {
@@ -90,6 +93,57 @@ TEST_F (RpcRequestTests, ParamsObject)
   EXPECT_EQ (recreated->GetParams (), params);
 }
 
+TEST_F (RpcRequestTests, InvalidParams)
+{
+  const RpcRequest original("method", ParseJson ("[]"));
+
+  for (const std::string val : {"", "42", R"("foo")", "[1,", "{} []"})
+    {
+      std::unique_ptr<gloox::Tag> tag(original.tag ());
+      tag->findChild ("params")->setCData (val);
+
+      const RpcRequest parsed(*tag);
+      EXPECT_FALSE (parsed.IsValid ()) << "Params: " << val;
+    }
+}
+
+TEST_F (RpcRequestTests, WithoutTimeout)
+{
+  const RpcRequest original("method", ParseJson ("[]"));
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_FALSE (recreated->HasTimeout ());
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_FALSE (tag->hasAttribute ("timeout"));
+}
+
+TEST_F (RpcRequestTests, WithTimeout)
+{
+  const RpcRequest original("method", ParseJson ("[]"),
+                            std::chrono::milliseconds (1500));
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  ASSERT_TRUE (recreated->HasTimeout ());
+  EXPECT_EQ (recreated->GetTimeout (), std::chrono::milliseconds (1500));
+}
+
+TEST_F (RpcRequestTests, InvalidTimeout)
+{
+  const RpcRequest original("method", ParseJson ("[]"));
+
+  for (const std::string val : {"abc", "10x", "0", "-5"})
+    {
+      std::unique_ptr<gloox::Tag> tag(original.tag ());
+      CHECK (tag->addAttribute ("timeout", val));
+
+      const RpcRequest parsed(*tag);
+      EXPECT_FALSE (parsed.IsValid ()) << "Timeout: " << val;
+    }
+}
+
 /* ************************************************************************** */
 
 using RpcResponseTests = testing::Test;
@@ -112,6 +166,32 @@ TEST_F (RpcResponseTests, Success)
   EXPECT_EQ (recreated->GetResult (), result);
 }
 
+TEST_F (RpcResponseTests, RawResultPassedThrough)
+{
+  RawJson raw;
+  ASSERT_TRUE (RawJson::FromText (R"({ "foo" : [1, 2] })", raw));
+  const RpcResponse original(raw);
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_EQ (tag->findChild ("result")->cdata (), raw.GetText ());
+
+  const RpcResponse parsed(*tag);
+  ASSERT_TRUE (parsed.IsValid ());
+  ASSERT_TRUE (parsed.IsSuccess ());
+  EXPECT_EQ (parsed.GetRawResult ().GetText (), raw.GetText ());
+  EXPECT_EQ (parsed.GetResult (), ParseJson (R"({"foo": [1, 2]})"));
+}
+
+TEST_F (RpcResponseTests, InvalidResult)
+{
+  const RpcResponse original(ParseJson ("42"));
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  tag->findChild ("result")->setCData ("[1,");
+
+  const RpcResponse parsed(*tag);
+  EXPECT_FALSE (parsed.IsValid ());
+}
+
 TEST_F (RpcResponseTests, ErrorWithData)
 {
   const auto data = ParseJson (R"(
@@ -148,6 +228,130 @@ TEST_F (RpcResponseTests, ErrorOnlyCode)
 
 /* ************************************************************************** */
 
+using RpcBatchRequestTests = testing::Test;
+
+TEST_F (RpcBatchRequestTests, Roundtrip)
+{
+  std::vector<std::unique_ptr<RpcRequest>> requests;
+  requests.push_back (std::make_unique<RpcRequest> ("first", ParseJson ("[]")));
+  requests.push_back (std::make_unique<RpcRequest> ("second",
+                                                    ParseJson (R"({"x": 1})")));
+  const RpcBatchRequest original(std::move (requests),
+                                 std::chrono::milliseconds (1500));
+  ASSERT_TRUE (original.IsValid ());
+
+  auto recreated = ExtensionRoundtrip (original);
+  ASSERT_TRUE (recreated->IsValid ());
+  ASSERT_TRUE (recreated->HasTimeout ());
+  EXPECT_EQ (recreated->GetTimeout (), std::chrono::milliseconds (1500));
+  ASSERT_EQ (recreated->GetNumRequests (), 2);
+  EXPECT_EQ (recreated->GetRequest (0).GetMethod (), "first");
+  EXPECT_EQ (recreated->GetRequest (0).GetParams (), ParseJson ("[]"));
+  EXPECT_EQ (recreated->GetRequest (1).GetMethod (), "second");
+  EXPECT_EQ (recreated->GetRequest (1).GetParams (),
+             ParseJson (R"({"x": 1})"));
+}
+
+TEST_F (RpcBatchRequestTests, WithoutTimeout)
+{
+  std::vector<std::unique_ptr<RpcRequest>> requests;
+  requests.push_back (
+      std::make_unique<RpcRequest> ("method", ParseJson ("[]")));
+  const RpcBatchRequest original(std::move (requests),
+                                 RpcBatchRequest::Duration::zero ());
+
+  auto recreated = ExtensionRoundtrip (original);
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_FALSE (recreated->HasTimeout ());
+  EXPECT_EQ (recreated->GetNumRequests (), 1);
+}
+
+TEST_F (RpcBatchRequestTests, Invalid)
+{
+  std::vector<std::unique_ptr<RpcRequest>> requests;
+  requests.push_back (
+      std::make_unique<RpcRequest> ("method", ParseJson ("[]")));
+  const RpcBatchRequest original(std::move (requests),
+                                 RpcBatchRequest::Duration::zero ());
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  tag->findChild ("request")->findChild ("params")->setCData ("42");
+  EXPECT_FALSE (RpcBatchRequest (*tag).IsValid ());
+
+  tag.reset (original.tag ());
+  CHECK (tag->findChild ("request")->addAttribute ("timeout", "100"));
+  EXPECT_FALSE (RpcBatchRequest (*tag).IsValid ());
+
+  tag.reset (original.tag ());
+  CHECK (tag->addAttribute ("timeout", "-5"));
+  EXPECT_FALSE (RpcBatchRequest (*tag).IsValid ());
+
+  const gloox::Tag empty("batch");
+  EXPECT_FALSE (RpcBatchRequest (empty).IsValid ());
+}
+
+/* ************************************************************************** */
+
+using RpcBatchResponseTests = testing::Test;
+
+TEST_F (RpcBatchResponseTests, Roundtrip)
+{
+  std::vector<std::unique_ptr<RpcResponse>> responses;
+  responses.push_back (std::make_unique<RpcResponse> (ParseJson ("42")));
+  responses.push_back (std::make_unique<RpcResponse> (-10, "my error",
+                                                      Json::Value ()));
+  const RpcBatchResponse original(std::move (responses));
+  ASSERT_TRUE (original.IsValid ());
+
+  auto recreated = ExtensionRoundtrip (original);
+  ASSERT_TRUE (recreated->IsValid ());
+  ASSERT_EQ (recreated->GetNumResponses (), 2);
+  ASSERT_TRUE (recreated->GetResponse (0).IsSuccess ());
+  EXPECT_EQ (recreated->GetResponse (0).GetResult (), ParseJson ("42"));
+  ASSERT_FALSE (recreated->GetResponse (1).IsSuccess ());
+  EXPECT_EQ (recreated->GetResponse (1).GetErrorCode (), -10);
+  EXPECT_EQ (recreated->GetResponse (1).GetErrorMessage (), "my error");
+}
+
+TEST_F (RpcBatchResponseTests, RequestTagIsNoResponse)
+{
+  std::vector<std::unique_ptr<RpcRequest>> requests;
+  requests.push_back (
+      std::make_unique<RpcRequest> ("method", ParseJson ("[]")));
+  const RpcBatchRequest request(std::move (requests),
+                                RpcBatchRequest::Duration::zero ());
+
+  std::unique_ptr<gloox::Tag> tag(request.tag ());
+  EXPECT_FALSE (RpcBatchResponse (*tag).IsValid ());
+}
+
+/* ************************************************************************** */
+
+using PingMessageTests = testing::Test;
+
+TEST_F (PingMessageTests, WithoutNonce)
+{
+  PingMessage original;
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_EQ (recreated->GetNonce (), "");
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_FALSE (tag->hasAttribute ("nonce"));
+}
+
+TEST_F (PingMessageTests, WithNonce)
+{
+  PingMessage original("abc");
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_EQ (recreated->GetNonce (), "abc");
+}
+
+/* ************************************************************************** */
+
 using PongMessageTests = testing::Test;
 
 TEST_F (PongMessageTests, WithoutVersion)
@@ -169,6 +373,69 @@ TEST_F (PongMessageTests, WithVersion)
 
   ASSERT_TRUE (recreated->IsValid ());
   EXPECT_EQ (recreated->GetVersion (), "version");
+  EXPECT_EQ (recreated->GetMaxBatchSize (), 0);
+
+  std::unique_ptr<gloox::Tag> tag(original.tag ());
+  EXPECT_FALSE (tag->hasAttribute ("batch"));
+}
+
+TEST_F (PongMessageTests, WithBatchSize)
+{
+  PongMessage original("version", 50);
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_EQ (recreated->GetVersion (), "version");
+  EXPECT_EQ (recreated->GetMaxBatchSize (), 50);
+  EXPECT_EQ (recreated->GetNonce (), "");
+}
+
+TEST_F (PongMessageTests, InvalidBatchSize)
+{
+  const PongMessage original("version");
+
+  for (const std::string val : {"abc", "10x", "0", "-1", "-50"})
+    {
+      std::unique_ptr<gloox::Tag> tag(original.tag ());
+      CHECK (tag->addAttribute ("batch", val));
+
+      const PongMessage parsed(*tag);
+      EXPECT_FALSE (parsed.IsValid ()) << "Batch: " << val;
+
+      std::unique_ptr<gloox::StanzaExtension> cloned(parsed.clone ());
+      EXPECT_FALSE (dynamic_cast<PongMessage&> (*cloned).IsValid ());
+    }
+}
+
+TEST_F (PongMessageTests, WithNonce)
+{
+  PongMessage original("version");
+  original.SetNonce ("abc");
+  auto recreated = ExtensionRoundtrip (original);
+
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_EQ (recreated->GetNonce (), "abc");
+}
+
+/* ************************************************************************** */
+
+using CancelRequestTests = testing::Test;
+
+TEST_F (CancelRequestTests, Roundtrip)
+{
+  const CancelRequest original("request id");
+  ASSERT_TRUE (original.IsValid ());
+
+  auto recreated = ExtensionRoundtrip (original);
+  ASSERT_TRUE (recreated->IsValid ());
+  EXPECT_EQ (recreated->GetId (), "request id");
+}
+
+TEST_F (CancelRequestTests, MissingId)
+{
+  gloox::Tag tag("cancel");
+  const CancelRequest parsed(tag);
+  EXPECT_FALSE (parsed.IsValid ());
 }
 
 /* ************************************************************************** */
@@ -18,14 +18,22 @@
 
 #include "testutils.hpp"
 
+#include "rpc-stubs/testbackendserverstub.h"
+
+#include <jsonrpccpp/server/connectors/httpserver.h>
+#include <jsonrpccpp/server/connectors/unixdomainsocketserver.h>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
 #include <glog/logging.h>
 
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 
 using testing::IsEmpty;
 
@@ -140,15 +148,93 @@ TestBackend::HandleMethod (const std::string& method, const Json::Value& params)
   CHECK_EQ (params.size (), 1);
   CHECK (params[0].isString ());
 
+  ++calls;
+
   if (method == "echo")
     return params[0];
 
   if (method == "error")
     throw Error (42, params[0].asString (), Json::Value ());
 
+  if (method == "throw")
+    throw std::runtime_error (params[0].asString ());
+
+  if (method == "slow")
+    {
+      std::this_thread::sleep_for (SLOW_CALL_TIME);
+      return params[0];
+    }
+
   LOG (FATAL) << "Unexpected method: " << method;
 }
 
+constexpr std::chrono::milliseconds TestBackend::SLOW_CALL_TIME;
+
+/* ************************************************************************** */
+
+class TestRpcBackend::Implementation : public TestBackendServerStub
+{
+
+public:
+
+  explicit Implementation (jsonrpc::AbstractServerConnector& conn)
+    : TestBackendServerStub(conn)
+  {}
+
+  int
+  echobypos (const int val) override
+  {
+    return val;
+  }
+
+  int
+  echobyname (const int val) override
+  {
+    return val;
+  }
+
+  int
+  error (const int code, const Json::Value& data,
+         const std::string& msg) override
+  {
+    throw jsonrpc::JsonRpcException (code, msg, data);
+  }
+
+  int
+  donotcall () override
+  {
+    LOG (FATAL) << "backend method donotcall was called";
+  }
+
+};
+
+constexpr int TestRpcBackend::PORT;
+constexpr const char* TestRpcBackend::URL;
+constexpr const char* TestRpcBackend::SOCKET_PATH;
+constexpr const char* TestRpcBackend::UNIX_URL;
+
+TestRpcBackend::TestRpcBackend ()
+{
+  http = std::make_unique<jsonrpc::HttpServer> (PORT);
+  server = std::make_unique<Implementation> (*http);
+  server->StartListening ();
+
+  /* The socket file may be left over from an earlier run that did not
+     shut down cleanly, in which case listening on it would fail.  */
+  std::remove (SOCKET_PATH);
+  unixSocket = std::make_unique<jsonrpc::UnixDomainSocketServer> (
+      SOCKET_PATH, 4);
+  unixServer = std::make_unique<Implementation> (*unixSocket);
+  CHECK (unixServer->StartListening ())
+      << "Failed to listen on Unix socket " << SOCKET_PATH;
+}
+
+TestRpcBackend::~TestRpcBackend ()
+{
+  unixServer->StopListening ();
+  server->StopListening ();
+}
+
 /* ************************************************************************** */
 
 ReceivedMessages::~ReceivedMessages ()
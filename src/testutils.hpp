@@ -26,12 +26,20 @@
 
 #include <json/json.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
+namespace jsonrpc
+{
+class HttpServer;
+class UnixDomainSocketServer;
+} // namespace jsonrpc
+
 namespace charon
 {
 
@@ -99,21 +107,95 @@ gloox::JID JIDWithResource (const TestAccount& acc, const std::string& res);
 Json::Value ParseJson (const std::string& str);
 
 /**
- * Backend for answering RPC calls in a dummy fashion.  It supports two
- * methods (both accept a single string as positional argument):  "echo"
+ * Backend for answering RPC calls in a dummy fashion.  It supports four
+ * methods (all accept a single string as positional argument):  "echo"
  * returns the argument back to the caller, while "error" throws a JSON-RPC
- * error with the string as message.
+ * error with the string as message.  "throw" throws a std::runtime_error
+ * with the string as message instead.  "slow" is like "echo", but waits
+ * for SLOW_CALL_TIME before returning.
  */
 class TestBackend : public RpcServer
 {
 
+private:
+
+  /** Number of calls made so far.  */
+  std::atomic<unsigned> calls;
+
 public:
 
-  TestBackend () = default;
+  /** Time that the "slow" method takes.  */
+  static constexpr auto SLOW_CALL_TIME = std::chrono::milliseconds (100);
+
+  TestBackend ()
+    : calls(0)
+  {}
 
   Json::Value HandleMethod (const std::string& method,
                             const Json::Value& params) override;
 
+  /**
+   * Returns the number of calls made to HandleMethod so far.
+   */
+  unsigned
+  GetNumCalls () const
+  {
+    return calls;
+  }
+
+};
+
+/**
+ * JSON-RPC server over HTTP and a Unix domain socket that implements the
+ * methods specified in rpc-stubs/testbackend.json.  This is used as real
+ * backend for testing (and benchmarking) the forwarding of calls to it.
+ */
+class TestRpcBackend
+{
+
+private:
+
+  class Implementation;
+
+  /** The underlying HTTP server connector.  */
+  std::unique_ptr<jsonrpc::HttpServer> http;
+
+  /** The underlying Unix domain socket server connector.  */
+  std::unique_ptr<jsonrpc::UnixDomainSocketServer> unixSocket;
+
+  /** The server implementation for HTTP.  */
+  std::unique_ptr<Implementation> server;
+
+  /** The server implementation for the Unix domain socket.  */
+  std::unique_ptr<Implementation> unixServer;
+
+public:
+
+  /** The port the server listens on.  */
+  static constexpr int PORT = 42042;
+
+  /** The HTTP URL of the server.  */
+  static constexpr const char* URL = "http://localhost:42042";
+
+  /** The path of the Unix domain socket the server listens on.  */
+  static constexpr const char* SOCKET_PATH = "/tmp/charon-testbackend.sock";
+
+  /** The URL for connecting to the server through the Unix socket.  */
+  static constexpr const char* UNIX_URL = "unix:/tmp/charon-testbackend.sock";
+
+  /**
+   * Constructs the server and starts listening.
+   */
+  TestRpcBackend ();
+
+  /**
+   * Stops the server.
+   */
+  ~TestRpcBackend ();
+
+  TestRpcBackend (const TestRpcBackend&) = delete;
+  void operator= (const TestRpcBackend&) = delete;
+
 };
 
 /**
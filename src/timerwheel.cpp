@@ -0,0 +1,126 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/timerwheel.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace charon
+{
+
+constexpr size_t TimerWheel::NONE;
+
+TimerWheel::TimerWheel (const Clock::duration tick, const size_t numBuckets,
+                        const Clock::time_point start)
+  : tickLength(tick), origin(start), buckets(numBuckets, NONE)
+{
+  CHECK_GT (tickLength.count (), 0);
+  CHECK_GT (numBuckets, 0);
+}
+
+void
+TimerWheel::Unlink (const size_t id)
+{
+  auto& e = entries[id];
+
+  if (e.prev == NONE)
+    buckets[e.tick % buckets.size ()] = e.next;
+  else
+    entries[e.prev].next = e.next;
+  if (e.next != NONE)
+    entries[e.next].prev = e.prev;
+
+  e.scheduled = false;
+  --numScheduled;
+}
+
+void
+TimerWheel::Schedule (const size_t id, const Clock::time_point deadline)
+{
+  if (id >= entries.size ())
+    entries.resize (id + 1);
+
+  auto& e = entries[id];
+  CHECK (!e.scheduled) << "Timer entry " << id << " is already scheduled";
+
+  /* The deadline is rounded up to a full tick.  Anything that would be
+     due at or before the current tick (which has been processed already)
+     is put into the next one instead.  */
+  uint64_t tick = 0;
+  if (deadline > origin)
+    tick = (deadline - origin + tickLength - Clock::duration (1))
+              / tickLength;
+  e.tick = std::max (tick, currentTick + 1);
+
+  const size_t bucket = e.tick % buckets.size ();
+  e.prev = NONE;
+  e.next = buckets[bucket];
+  if (e.next != NONE)
+    entries[e.next].prev = id;
+  buckets[bucket] = id;
+
+  e.scheduled = true;
+  ++numScheduled;
+}
+
+bool
+TimerWheel::Cancel (const size_t id)
+{
+  if (id >= entries.size () || !entries[id].scheduled)
+    return false;
+
+  Unlink (id);
+  return true;
+}
+
+void
+TimerWheel::Expire (const Clock::time_point now,
+                    std::vector<size_t>& expired)
+{
+  if (now <= origin)
+    return;
+
+  const uint64_t nowTick = (now - origin) / tickLength;
+  if (nowTick <= currentTick)
+    return;
+
+  /* If more ticks than buckets have passed, each bucket is looked at
+     just once (and all due entries in it are expired).  */
+  const uint64_t steps = std::min<uint64_t> (nowTick - currentTick,
+                                             buckets.size ());
+  for (uint64_t i = 1; i <= steps; ++i)
+    {
+      size_t id = buckets[(currentTick + i) % buckets.size ()];
+      while (id != NONE)
+        {
+          const size_t next = entries[id].next;
+          if (entries[id].tick <= nowTick)
+            {
+              Unlink (id);
+              expired.push_back (id);
+            }
+          id = next;
+        }
+    }
+
+  currentTick = nowTick;
+}
+
+} // namespace charon
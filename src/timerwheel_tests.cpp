@@ -0,0 +1,153 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/timerwheel.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+namespace charon
+{
+namespace
+{
+
+using std::chrono::milliseconds;
+
+class TimerWheelTests : public testing::Test
+{
+
+protected:
+
+  /** Start time of the wheel.  */
+  const TimerWheel::Clock::time_point start;
+
+  /** The wheel under test, with 10ms ticks and 8 buckets.  */
+  TimerWheel wheel;
+
+  TimerWheelTests ()
+    : start(TimerWheel::Clock::now ()),
+      wheel(milliseconds (10), 8, start)
+  {}
+
+  /**
+   * Expires the wheel at the given offset from the start, and returns
+   * the expired IDs in sorted order.
+   */
+  std::vector<size_t>
+  ExpireAt (const milliseconds offset)
+  {
+    std::vector<size_t> res;
+    wheel.Expire (start + offset, res);
+    std::sort (res.begin (), res.end ());
+    return res;
+  }
+
+};
+
+TEST_F (TimerWheelTests, Empty)
+{
+  EXPECT_TRUE (wheel.IsEmpty ());
+  EXPECT_EQ (ExpireAt (milliseconds (1000)), std::vector<size_t> ({}));
+}
+
+TEST_F (TimerWheelTests, ExpiresInOrder)
+{
+  wheel.Schedule (0, start + milliseconds (25));
+  wheel.Schedule (1, start + milliseconds (10));
+  wheel.Schedule (2, start + milliseconds (40));
+  EXPECT_FALSE (wheel.IsEmpty ());
+
+  EXPECT_EQ (ExpireAt (milliseconds (5)), std::vector<size_t> ({}));
+  EXPECT_EQ (ExpireAt (milliseconds (10)), std::vector<size_t> ({1}));
+  EXPECT_EQ (ExpireAt (milliseconds (29)), std::vector<size_t> ({}));
+  EXPECT_EQ (ExpireAt (milliseconds (30)), std::vector<size_t> ({0}));
+  EXPECT_EQ (ExpireAt (milliseconds (50)), std::vector<size_t> ({2}));
+  EXPECT_TRUE (wheel.IsEmpty ());
+}
+
+TEST_F (TimerWheelTests, SameBucket)
+{
+  wheel.Schedule (0, start + milliseconds (10));
+  wheel.Schedule (1, start + milliseconds (10));
+  wheel.Schedule (2, start + milliseconds (10));
+
+  EXPECT_EQ (ExpireAt (milliseconds (10)), std::vector<size_t> ({0, 1, 2}));
+  EXPECT_TRUE (wheel.IsEmpty ());
+}
+
+TEST_F (TimerWheelTests, Cancel)
+{
+  wheel.Schedule (0, start + milliseconds (10));
+  wheel.Schedule (1, start + milliseconds (10));
+  wheel.Schedule (2, start + milliseconds (10));
+
+  EXPECT_TRUE (wheel.Cancel (1));
+  EXPECT_FALSE (wheel.Cancel (1));
+  EXPECT_FALSE (wheel.Cancel (42));
+
+  EXPECT_EQ (ExpireAt (milliseconds (10)), std::vector<size_t> ({0, 2}));
+  EXPECT_FALSE (wheel.Cancel (0));
+}
+
+TEST_F (TimerWheelTests, Reschedule)
+{
+  wheel.Schedule (0, start + milliseconds (10));
+  EXPECT_EQ (ExpireAt (milliseconds (10)), std::vector<size_t> ({0}));
+
+  wheel.Schedule (0, start + milliseconds (30));
+  EXPECT_EQ (ExpireAt (milliseconds (20)), std::vector<size_t> ({}));
+  EXPECT_EQ (ExpireAt (milliseconds (30)), std::vector<size_t> ({0}));
+}
+
+TEST_F (TimerWheelTests, MultipleRounds)
+{
+  /* With 8 buckets, these deadlines share a bucket but are in different
+     rounds of the wheel.  */
+  wheel.Schedule (0, start + milliseconds (20));
+  wheel.Schedule (1, start + milliseconds (100));
+  wheel.Schedule (2, start + milliseconds (180));
+
+  EXPECT_EQ (ExpireAt (milliseconds (20)), std::vector<size_t> ({0}));
+  EXPECT_EQ (ExpireAt (milliseconds (99)), std::vector<size_t> ({}));
+  EXPECT_EQ (ExpireAt (milliseconds (100)), std::vector<size_t> ({1}));
+  EXPECT_EQ (ExpireAt (milliseconds (180)), std::vector<size_t> ({2}));
+}
+
+TEST_F (TimerWheelTests, LargeJump)
+{
+  wheel.Schedule (0, start + milliseconds (10));
+  wheel.Schedule (1, start + milliseconds (50));
+  wheel.Schedule (2, start + milliseconds (500));
+  wheel.Schedule (3, start + milliseconds (1000));
+
+  EXPECT_EQ (ExpireAt (milliseconds (600)), std::vector<size_t> ({0, 1, 2}));
+  EXPECT_EQ (ExpireAt (milliseconds (1000)), std::vector<size_t> ({3}));
+}
+
+TEST_F (TimerWheelTests, PastDeadline)
+{
+  EXPECT_EQ (ExpireAt (milliseconds (100)), std::vector<size_t> ({}));
+
+  wheel.Schedule (0, start);
+  EXPECT_EQ (ExpireAt (milliseconds (100)), std::vector<size_t> ({}));
+  EXPECT_EQ (ExpireAt (milliseconds (110)), std::vector<size_t> ({0}));
+}
+
+} // anonymous namespace
+} // namespace charon
@@ -0,0 +1,107 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/workerpool.hpp"
+
+#include <glog/logging.h>
+
+namespace charon
+{
+
+WorkerPool::WorkerPool (const unsigned threads, const size_t maxQueue)
+  : maxQueued(maxQueue)
+{
+  CHECK_GT (threads, 0) << "WorkerPool needs at least one thread";
+
+  workers.reserve (threads);
+  for (unsigned i = 0; i < threads; ++i)
+    workers.emplace_back ([this] ()
+      {
+        RunWorker ();
+      });
+}
+
+WorkerPool::~WorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  for (auto& w : workers)
+    w.join ();
+
+  CHECK (queue.empty ());
+}
+
+void
+WorkerPool::RunWorker ()
+{
+  while (true)
+    {
+      Job j;
+
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        while (queue.empty () && !shouldStop)
+          cv.wait (lock);
+
+        /* When stopping, we still finish all queued jobs first.  */
+        if (queue.empty ())
+          return;
+
+        j = std::move (queue.front ());
+        queue.pop_front ();
+        ++busy;
+      }
+
+      j ();
+
+      std::lock_guard<std::mutex> lock(mut);
+      CHECK_GT (busy, 0);
+      --busy;
+    }
+}
+
+bool
+WorkerPool::Submit (Job j)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (!shouldStop);
+
+  /* Jobs in the queue up to the number of idle workers will be picked up
+     right away, so only those beyond that count as waiting.  */
+  const size_t idle = workers.size () - busy;
+  if (queue.size () >= idle + maxQueued)
+    return false;
+
+  queue.push_back (std::move (j));
+  cv.notify_one ();
+
+  return true;
+}
+
+size_t
+WorkerPool::GetQueueSize () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return queue.size ();
+}
+
+} // namespace charon
@@ -0,0 +1,172 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/workerpool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace charon
+{
+namespace
+{
+
+/**
+ * A "gate" that jobs can wait on until it is opened by the test.
+ */
+class Gate
+{
+
+private:
+
+  /** Whether or not the gate is open.  */
+  bool open = false;
+
+  /** Mutex for the state.  */
+  std::mutex mut;
+
+  /** Condition variable for waiting on the gate.  */
+  std::condition_variable cv;
+
+public:
+
+  Gate () = default;
+
+  /**
+   * Blocks until the gate is opened.
+   */
+  void
+  Wait ()
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (!open)
+      cv.wait (lock);
+  }
+
+  /**
+   * Opens the gate, letting all waiting threads through.
+   */
+  void
+  Open ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    open = true;
+    cv.notify_all ();
+  }
+
+};
+
+using WorkerPoolTests = testing::Test;
+
+TEST_F (WorkerPoolTests, RunsAllJobs)
+{
+  std::atomic<unsigned> done(0);
+
+  {
+    WorkerPool pool(3, 100);
+    for (unsigned i = 0; i < 100; ++i)
+      ASSERT_TRUE (pool.Submit ([&done] ()
+        {
+          ++done;
+        }));
+  }
+
+  EXPECT_EQ (done, 100);
+}
+
+TEST_F (WorkerPoolTests, Parallel)
+{
+  constexpr unsigned threads = 4;
+  WorkerPool pool(threads, 10);
+
+  /* Each job waits until all of them are running at the same time.  */
+  std::mutex mut;
+  std::condition_variable cv;
+  unsigned running = 0;
+
+  unsigned done = 0;
+  for (unsigned i = 0; i < threads; ++i)
+    ASSERT_TRUE (pool.Submit ([&] ()
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        ++running;
+        cv.notify_all ();
+        while (running < threads)
+          cv.wait (lock);
+        ++done;
+        cv.notify_all ();
+      }));
+
+  std::unique_lock<std::mutex> lock(mut);
+  while (done < threads)
+    cv.wait (lock);
+}
+
+TEST_F (WorkerPoolTests, QueueBound)
+{
+  Gate gate, started;
+  WorkerPool pool(1, 2);
+
+  ASSERT_TRUE (pool.Submit ([&] ()
+    {
+      started.Open ();
+      gate.Wait ();
+    }));
+  started.Wait ();
+
+  EXPECT_TRUE (pool.Submit ([] () {}));
+  EXPECT_TRUE (pool.Submit ([] () {}));
+  EXPECT_EQ (pool.GetQueueSize (), 2);
+  EXPECT_FALSE (pool.Submit ([] () {}));
+
+  gate.Open ();
+}
+
+TEST_F (WorkerPoolTests, NoQueueing)
+{
+  Gate gate, started1, started2;
+  WorkerPool pool(2, 0);
+
+  /* Jobs are accepted as long as there are idle workers, even though
+     none can wait in the queue.  */
+  ASSERT_TRUE (pool.Submit ([&] ()
+    {
+      started1.Open ();
+      gate.Wait ();
+    }));
+  ASSERT_TRUE (pool.Submit ([&] ()
+    {
+      started2.Open ();
+      gate.Wait ();
+    }));
+  started1.Wait ();
+  started2.Wait ();
+
+  EXPECT_FALSE (pool.Submit ([] () {}));
+
+  gate.Open ();
+}
+
+} // anonymous namespace
+} // namespace charon
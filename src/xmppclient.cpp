@@ -16,12 +16,26 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include "config.h"
+
 #include "private/xmppclient.hpp"
 
 #include "private/pubsub.hpp"
 
+#include <gloox/connectiontcpbase.h>
+
 #include <glog/logging.h>
 
+#if defined(HAVE_POLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#  define CHARON_EVENT_LOOP 1
+#  include <poll.h>
+#  include <sys/eventfd.h>
+#  include <unistd.h>
+#  include <cerrno>
+#  include <cstdint>
+#  include <cstring>
+#endif
+
 #include <chrono>
 #include <sstream>
 
@@ -32,8 +46,8 @@ namespace
 {
 
 /**
- * Waiting time during the receive loop to give other threads a chance on
- * locking the mutex if they want to send.
+ * Waiting time during the receive loop (in POLLING mode) to give other
+ * threads a chance on locking the mutex if they want to send.
  */
 constexpr auto WAITING_SLEEP = std::chrono::milliseconds (1);
 
@@ -41,6 +55,7 @@ constexpr auto WAITING_SLEEP = std::chrono::milliseconds (1);
 
 XmppClient::XmppClient (const gloox::JID& j, const std::string& password)
   : jid(j), client(jid, password),
+    receiveMode(ReceiveMode::EVENTS), wakeFd(-1),
     connectionState(ConnectionState::DISCONNECTED)
 {
   client.registerConnectionListener (this);
@@ -50,11 +65,24 @@ XmppClient::XmppClient (const gloox::JID& j, const std::string& password)
   /* Make sure to enforce TLS (by default, we only allow TLS but also accept
      a connection without TLS if necessary).  */
   client.setTls (gloox::TLSRequired);
+
+#ifdef CHARON_EVENT_LOOP
+  wakeFd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeFd == -1)
+    LOG (WARNING)
+        << "Failed to create eventfd, falling back to polling: "
+        << std::strerror (errno);
+#endif // CHARON_EVENT_LOOP
 }
 
 XmppClient::~XmppClient ()
 {
   Disconnect ();
+
+#ifdef CHARON_EVENT_LOOP
+  if (wakeFd != -1)
+    close (wakeFd);
+#endif // CHARON_EVENT_LOOP
 }
 
 void
@@ -97,59 +125,77 @@ XmppClient::Connect (const int priority)
   /* When the client is disconnected by the server (not through an explicit
      call to Disconnect), then the receive loop thread will exit but the
      instance will still be around.  Make sure to clean it up in this case.  */
-  if (recvLoop != nullptr)
-    {
-      stopLoop = true;
-      recvLoop->join ();
-      recvLoop.reset ();
-    }
+  StopReceiveLoop ();
 
   client.presence ().setPriority (priority);
-  connectionState = ConnectionState::CONNECTING;
+  SetConnectionState (ConnectionState::CONNECTING);
   if (!client.connect (false))
     {
       CHECK (connectionState == ConnectionState::DISCONNECTED);
       return false;
     }
 
+  const int sock = GetSocket ();
+
   stopLoop = false;
-  recvLoop = std::make_unique<std::thread> ([this] ()
+  recvLoop = std::make_unique<std::thread> ([this, sock] ()
     {
-      while (!stopLoop)
-        {
-          if (!Receive ())
-            return;
-
-          /* Give other threads a chance to lock the mutex if they want to
-             do something (e.g. through RunWithClient).  */
-          std::this_thread::sleep_for (WAITING_SLEEP);
-        }
+      if (sock == -1)
+        RunPollingLoop ();
+      else
+        RunEventLoop (sock);
     });
 
+  std::unique_lock<std::mutex> lock(mutConnectionState);
   while (true)
     switch (connectionState)
       {
       case ConnectionState::CONNECTED:
+        lock.unlock ();
         AttachPubSub ();
         return true;
       case ConnectionState::DISCONNECTED:
         return false;
       case ConnectionState::CONNECTING:
-        std::this_thread::sleep_for (WAITING_SLEEP);
+        cvConnectionState.wait (lock);
         continue;
       default:
         LOG (FATAL) << "Unexpected connection state";
       }
 }
 
+int
+XmppClient::GetSocket ()
+{
+  if (receiveMode != ReceiveMode::EVENTS || wakeFd == -1)
+    return -1;
+
+  /* Waiting on the socket directly only works if there is no layer (like
+     a proxy connection) in between that may buffer data by itself.  TLS
+     and compression are fine, as gloox processes everything it reads
+     from the socket right away.  */
+  const auto* tcp
+      = dynamic_cast<const gloox::ConnectionTCPBase*> (client.connectionImpl ());
+  if (tcp == nullptr)
+    {
+      LOG (WARNING)
+          << "Connection for " << jid.full ()
+          << " is not plain TCP, falling back to polling";
+      return -1;
+    }
+
+  return tcp->socket ();
+}
+
 bool
 XmppClient::Receive ()
 {
   std::lock_guard<std::recursive_mutex> lock(mut);
 
-  /* This method is called in a loop anyway, with sleeps in between (when not
-     holding the mut lock).  Thus it is enough to really only check if there
-     are waiting messages here without blocking for any amount of time if not.
+  /* This method is called in a loop anyway, either with sleeps in between
+     or after poll reported data on the socket (in both cases without holding
+     the mut lock).  Thus it is enough to really only check if there are
+     waiting messages here without blocking for any amount of time if not.
      This ensures the lock is not held too much, blocking threads that want
      to send messages instead.  */
   const auto res = client.recv (0);
@@ -169,6 +215,92 @@ XmppClient::Receive ()
     }
 }
 
+void
+XmppClient::RunPollingLoop ()
+{
+  while (!stopLoop)
+    {
+      if (!Receive ())
+        return;
+
+      /* Give other threads a chance to lock the mutex if they want to
+         do something (e.g. through RunWithClient).  */
+      std::this_thread::sleep_for (WAITING_SLEEP);
+    }
+}
+
+void
+XmppClient::RunEventLoop (const int sock)
+{
+#ifdef CHARON_EVENT_LOOP
+  VLOG (1) << "Running event-based receive loop for " << jid.full ();
+
+  while (!stopLoop)
+    {
+      /* Wait (without holding the lock) until either the socket has data
+         for us, or someone signals the wake-up event.  The latter is used
+         when the loop should be stopped.  */
+      pollfd fds[2];
+      fds[0].fd = sock;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = wakeFd;
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+
+      if (poll (fds, 2, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          LOG (ERROR)
+              << "poll failed for " << jid.full () << ": "
+              << std::strerror (errno);
+          return;
+        }
+
+      if (fds[1].revents != 0)
+        {
+          uint64_t value;
+          while (read (wakeFd, &value, sizeof (value)) > 0)
+            continue;
+        }
+
+      if (stopLoop)
+        return;
+
+      /* POLLHUP and POLLERR are also handled through Receive, which will
+         then notice that the connection has been closed.  */
+      if (fds[0].revents != 0 && !Receive ())
+        return;
+    }
+#else // CHARON_EVENT_LOOP
+  LOG (FATAL) << "Event-based receive loop is not supported";
+#endif // CHARON_EVENT_LOOP
+}
+
+void
+XmppClient::StopReceiveLoop ()
+{
+  if (recvLoop == nullptr)
+    return;
+
+  stopLoop = true;
+
+#ifdef CHARON_EVENT_LOOP
+  if (wakeFd != -1)
+    {
+      const uint64_t one = 1;
+      const ssize_t written = write (wakeFd, &one, sizeof (one));
+      CHECK_EQ (written, static_cast<ssize_t> (sizeof (one)))
+          << "Failed to signal eventfd: " << std::strerror (errno);
+    }
+#endif // CHARON_EVENT_LOOP
+
+  recvLoop->join ();
+  recvLoop.reset ();
+}
+
 void
 XmppClient::Disconnect ()
 {
@@ -184,16 +316,34 @@ XmppClient::Disconnect ()
   pubsub.reset ();
 
   client.disconnect ();
+  StopReceiveLoop ();
+
+  std::unique_lock<std::mutex> lock(mutConnectionState);
+  while (connectionState != ConnectionState::DISCONNECTED)
+    cvConnectionState.wait (lock);
+}
 
-  if (recvLoop != nullptr)
+void
+XmppClient::SetPriority (const int priority)
+{
+  if (!IsConnected ())
+    return;
+
+  VLOG (1)
+      << "Setting presence priority of " << jid.full ()
+      << " to " << priority;
+  RunWithClient ([priority] (gloox::Client& c)
     {
-      stopLoop = true;
-      recvLoop->join ();
-      recvLoop.reset ();
-    }
+      c.setPresence (gloox::Presence::Available, priority);
+    });
+}
 
-  while (connectionState != ConnectionState::DISCONNECTED)
-    std::this_thread::sleep_for (WAITING_SLEEP);
+void
+XmppClient::SetConnectionState (const ConnectionState s)
+{
+  std::lock_guard<std::mutex> lock(mutConnectionState);
+  connectionState = s;
+  cvConnectionState.notify_all ();
 }
 
 void
@@ -201,7 +351,7 @@ XmppClient::onConnect ()
 {
   LOG (INFO)
       << "XMPP connection to the server is established for " << jid.full ();
-  connectionState = ConnectionState::CONNECTED;
+  SetConnectionState (ConnectionState::CONNECTED);
 }
 
 void
@@ -220,7 +370,7 @@ XmppClient::onDisconnect (const gloox::ConnectionError err)
       break;
     }
 
-  connectionState = ConnectionState::DISCONNECTED;
+  SetConnectionState (ConnectionState::DISCONNECTED);
   HandleDisconnect ();
   pubsub.reset ();
 }
@@ -0,0 +1,199 @@
+/*
+    Charon - a transport system for GSP data
+    Copyright (C) 2020  Autonomous Worlds Ltd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "private/xmppclient.hpp"
+
+#include "benchutils.hpp"
+#include "testutils.hpp"
+
+#include <gloox/message.h>
+#include <gloox/messagehandler.h>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace charon
+{
+namespace
+{
+
+/** Number of round trips to measure.  */
+constexpr unsigned ROUND_TRIPS = 1000;
+
+/** Time for which we measure CPU usage of idle clients.  */
+constexpr auto IDLE_TIME = std::chrono::seconds (5);
+
+/* ************************************************************************** */
+
+/**
+ * XMPP client used for the benchmarks.  It answers "ping" chat messages
+ * with "pong", and allows waiting for "pong" replies itself.
+ */
+class BenchXmppClient : public XmppClient, private gloox::MessageHandler
+{
+
+private:
+
+  /** Mutex for the pong counter.  */
+  std::mutex mut;
+
+  /** Condition variable signalled when a pong is received.  */
+  std::condition_variable cv;
+
+  /** Number of pongs received so far.  */
+  unsigned pongs = 0;
+
+  void
+  handleMessage (const gloox::Message& msg,
+                 gloox::MessageSession* session) override
+  {
+    if (msg.body () == "ping")
+      {
+        gloox::Message reply(gloox::Message::Chat, msg.from (), "pong");
+        RunWithClient ([&reply] (gloox::Client& c)
+          {
+            c.send (reply);
+          });
+        return;
+      }
+
+    if (msg.body () == "pong")
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        ++pongs;
+        cv.notify_all ();
+      }
+  }
+
+public:
+
+  explicit BenchXmppClient (const TestAccount& acc, const ReceiveMode mode)
+    : XmppClient(JIDWithResource (acc, "bench"), acc.password)
+  {
+    SetReceiveMode (mode);
+    RunWithClient ([this] (gloox::Client& c)
+      {
+        c.registerMessageHandler (this);
+      });
+
+    CHECK (Connect (0));
+  }
+
+  /**
+   * Sends a ping to the other client and waits for its pong.
+   */
+  void
+  PingPong (const BenchXmppClient& other)
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    const unsigned before = pongs;
+
+    /* The receive thread holds the client lock while it takes mut in
+       handleMessage, so we must not hold mut while sending.  Since we
+       recorded the count before, the pong cannot be missed.  */
+    lock.unlock ();
+    gloox::Message msg(gloox::Message::Chat, other.GetJID (), "ping");
+    RunWithClient ([&msg] (gloox::Client& c)
+      {
+        c.send (msg);
+      });
+    lock.lock ();
+
+    while (pongs == before)
+      cv.wait (lock);
+  }
+
+};
+
+/**
+ * Returns a human-readable name for a receive mode.
+ */
+std::string
+ModeName (const XmppClient::ReceiveMode mode)
+{
+  switch (mode)
+    {
+    case XmppClient::ReceiveMode::POLLING:
+      return "polling";
+    case XmppClient::ReceiveMode::EVENTS:
+      return "events";
+    default:
+      LOG (FATAL) << "Unexpected receive mode";
+    }
+}
+
+class XmppClientBenchmarks
+  : public testing::TestWithParam<XmppClient::ReceiveMode>
+{};
+
+TEST_P (XmppClientBenchmarks, RoundTrip)
+{
+  BenchXmppClient c1(GetTestAccount (0), GetParam ());
+  BenchXmppClient c2(GetTestAccount (1), GetParam ());
+
+  /* Do a few round trips first to make sure everything is set up and
+     warmed up on the XMPP server.  */
+  for (unsigned i = 0; i < 10; ++i)
+    c1.PingPong (c2);
+
+  using Clock = std::chrono::steady_clock;
+  LatencySamples samples;
+  for (unsigned i = 0; i < ROUND_TRIPS; ++i)
+    {
+      const auto before = Clock::now ();
+      c1.PingPong (c2);
+      samples.Add (Clock::now () - before);
+    }
+
+  samples.Print ("Round trip (" + ModeName (GetParam ()) + ")");
+}
+
+TEST_P (XmppClientBenchmarks, IdleCpu)
+{
+  BenchXmppClient c1(GetTestAccount (0), GetParam ());
+  BenchXmppClient c2(GetTestAccount (1), GetParam ());
+  std::this_thread::sleep_for (std::chrono::seconds (1));
+
+  const CpuTimer timer;
+  std::this_thread::sleep_for (IDLE_TIME);
+  const double cpu = timer.GetSeconds ();
+
+  const double wall
+      = std::chrono::duration_cast<std::chrono::duration<double>> (
+            IDLE_TIME).count ();
+  std::cout
+      << "Idle CPU (" << ModeName (GetParam ()) << ", two clients): "
+      << cpu << " s in " << wall << " s (" << 100.0 * cpu / wall << "%)"
+      << std::endl;
+}
+
+INSTANTIATE_TEST_CASE_P (ReceiveModes, XmppClientBenchmarks,
+                         testing::Values (XmppClient::ReceiveMode::POLLING,
+                                          XmppClient::ReceiveMode::EVENTS));
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace charon
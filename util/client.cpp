@@ -35,8 +35,11 @@
 #include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <string>
 #include <unordered_map>
 
 namespace
@@ -55,14 +58,30 @@ DEFINE_bool (waitforchange, false, "If true, enable waitforchange updates");
 DEFINE_bool (waitforpendingchange, false,
              "If true, enable waitforpendingchange updates");
 
+DEFINE_int32 (cache_results, 0,
+              "If positive, cache up to this many results until the next"
+              " notification update (requires --waitforchange, and also"
+              " --waitforpendingchange if results depend on the mempool)");
+
+DEFINE_int32 (reselect_interval_ms, 0,
+              "If positive, probe the server instances at this interval"
+              " and switch to a consistently faster one");
+
 DEFINE_bool (detect_server, true,
              "Whether to run server detection immediately on start");
 
 /**
  * Local JSON-RPC server that supports stopping via notification, but otherwise
  * forwards calls to a given list of methods to a Charon client.
+ *
+ * Ordinary calls to forwarded methods are intercepted directly on the
+ * connector:  Their params are passed to the client and the result from the
+ * client written into the response without parsing and reserialising them.
+ * All other requests (e.g. the notification waiters, batches or invalid
+ * requests) are processed by the normal JSON-RPC server logic.
  */
-class LocalServer : public jsonrpc::AbstractServer<LocalServer>
+class LocalServer : public jsonrpc::AbstractServer<LocalServer>,
+                    private jsonrpc::IClientConnectionHandler
 {
 
 private:
@@ -70,6 +89,12 @@ private:
   /** Charon client to forward to.  */
   charon::Client& client;
 
+  /** The JSON-RPC server's handler for requests we do not intercept.  */
+  jsonrpc::IClientConnectionHandler* fallback;
+
+  /** Methods that are forwarded (without the notification waiters).  */
+  std::set<std::string> forwarded;
+
   /**
    * Waiter methods that are supported, with the corresponding notification
    * "type" string that should be passed to Client::WaitForChange.
@@ -107,6 +132,87 @@ private:
     LOG (FATAL) << "method call not intercepted";
   }
 
+  /**
+   * Adds a method with the given name (and any parameters) to the
+   * JSON-RPC server.
+   */
+  void
+  AddProcedure (const std::string& method)
+  {
+    jsonrpc::Procedure proc(method, jsonrpc::PARAMS_BY_POSITION,
+                            jsonrpc::JSON_OBJECT, nullptr);
+    bindAndAddMethod (proc, &LocalServer::neverCalled);
+  }
+
+  /**
+   * Tries to answer a request for a forwarded method directly.  Returns
+   * false if the request is not one we can handle that way.
+   */
+  bool
+  HandleRawRequest (const std::string& request, std::string& response)
+  {
+    std::map<std::string, charon::RawJson> members;
+    if (!charon::RawJson::SplitObject (request, members))
+      return false;
+
+    const auto mitVersion = members.find ("jsonrpc");
+    const auto mitMethod = members.find ("method");
+    const auto mitId = members.find ("id");
+    if (mitVersion == members.end () || mitVersion->second.GetValue () != "2.0"
+          || mitMethod == members.end () || mitId == members.end ())
+      return false;
+
+    const auto& method = mitMethod->second.GetValue ();
+    if (!method.isString () || forwarded.count (method.asString ()) == 0)
+      return false;
+
+    const auto& id = mitId->second.GetValue ();
+    if (!id.isString () && !id.isIntegral () && !id.isNull ())
+      return false;
+
+    charon::RawJson params;
+    const auto mitParams = members.find ("params");
+    if (mitParams != members.end ())
+      {
+        params = mitParams->second;
+        if (!params.GetValue ().isArray () && !params.GetValue ().isObject ())
+          return false;
+      }
+
+    try
+      {
+        const auto res = client.ForwardRawMethod (method.asString (), params);
+        response = R"({"jsonrpc":"2.0","id":)" + mitId->second.GetText ()
+                      + R"(,"result":)" + res.GetText () + "}";
+      }
+    catch (const jsonrpc::JsonRpcException& exc)
+      {
+        Json::Value err(Json::objectValue);
+        err["code"] = exc.GetCode ();
+        err["message"] = exc.GetMessage ();
+        if (!exc.GetData ().isNull ())
+          err["data"] = exc.GetData ();
+
+        Json::Value full(Json::objectValue);
+        full["jsonrpc"] = "2.0";
+        full["id"] = id;
+        full["error"] = err;
+
+        Json::StreamWriterBuilder wbuilder;
+        wbuilder["indentation"] = "";
+        response = Json::writeString (wbuilder, full);
+      }
+
+    return true;
+  }
+
+  void
+  HandleRequest (const std::string& request, std::string& response) override
+  {
+    if (!HandleRawRequest (request, response))
+      fallback->HandleRequest (request, response);
+  }
+
 public:
 
   explicit LocalServer (jsonrpc::AbstractServerConnector& conn,
@@ -116,6 +222,12 @@ public:
   {
     jsonrpc::Procedure stopProc("stop", jsonrpc::PARAMS_BY_POSITION, nullptr);
     bindAndAddNotification (stopProc, &LocalServer::stop);
+
+    /* The AbstractServer constructor has installed its protocol handler
+       on the connector.  We put ourselves in front of it.  */
+    fallback = conn.GetHandler ();
+    CHECK (fallback != nullptr);
+    conn.SetHandler (this);
   }
 
   ~LocalServer ()
@@ -134,9 +246,8 @@ public:
   void
   AddMethod (const std::string& method)
   {
-    jsonrpc::Procedure proc(method, jsonrpc::PARAMS_BY_POSITION,
-                            jsonrpc::JSON_OBJECT, nullptr);
-    bindAndAddMethod (proc, &LocalServer::neverCalled);
+    forwarded.insert (method);
+    AddProcedure (method);
   }
 
   /**
@@ -147,7 +258,8 @@ public:
   {
     const auto res = notifications.emplace (method, n.GetType ());
     CHECK (res.second) << "Duplicate notification method: " << method;
-    AddMethod (method);
+    forwarded.erase (method);
+    AddProcedure (method);
   }
 
   /**
@@ -219,6 +331,14 @@ main (int argc, char** argv)
       return EXIT_FAILURE;
     }
 
+  if (FLAGS_cache_results > 0 && !FLAGS_waitforchange)
+    {
+      std::cerr
+          << "Error: Result caching requires --waitforchange"
+          << std::endl;
+      return EXIT_FAILURE;
+    }
+
   LOG (INFO) << "Using " << FLAGS_server_jid << " as server";
   LOG (INFO) << "Requiring backend version " << FLAGS_backend_version;
   charon::Client client(FLAGS_server_jid, FLAGS_backend_version,
@@ -239,6 +359,12 @@ main (int argc, char** argv)
       rpcServer.AddMethod (m);
     }
 
+  if (FLAGS_cache_results > 0)
+    {
+      LOG (INFO) << "Caching up to " << FLAGS_cache_results << " results";
+      client.EnableCache (FLAGS_cache_results);
+    }
+
   if (FLAGS_waitforchange)
     {
       auto n = std::make_unique<charon::StateChangeNotification> ();
@@ -252,6 +378,10 @@ main (int argc, char** argv)
       client.AddNotification (std::move (n));
     }
 
+  if (FLAGS_reselect_interval_ms > 0)
+    client.EnableReselection (
+        std::chrono::milliseconds (FLAGS_reselect_interval_ms));
+
   LOG (INFO) << "Connecting client to XMPP as " << FLAGS_client_jid;
   client.Connect ();
 
@@ -21,59 +21,254 @@
 #include "methods.hpp"
 
 #include "notifications.hpp"
+#include "rpcbatcher.hpp"
+#include "rpcpool.hpp"
 #include "rpcserver.hpp"
 #include "rpcwaiter.hpp"
 #include "server.hpp"
 #include "waiterthread.hpp"
 
+#include <jsonrpccpp/common/exception.h>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 namespace
 {
 
 DEFINE_string (backend_rpc_url, "",
-               "URL at which the backend JSON-RPC interface is available");
+               "URL at which the backend JSON-RPC interface is available"
+               " (HTTP or unix:/path/to/socket); a comma-separated list of"
+               " URLs balances calls between multiple equivalent backends");
 DEFINE_string (backend_version, "",
                "A string identifying the version of the backend provided");
 
 DEFINE_string (server_jid, "", "Bare or full JID for the server");
 DEFINE_string (password, "", "XMPP password for the server JID");
 DEFINE_int32 (priority, 0, "Priority for the XMPP connection");
+DEFINE_int32 (min_priority, 0,
+              "If lower than --priority, lower the presence priority down"
+              " to this value depending on the server load");
+DEFINE_int32 (priority_interval_ms, 5000,
+              "Interval in milliseconds between updates of the presence"
+              " priority if --min_priority is used");
+DEFINE_int32 (connections, 1,
+              "Number of XMPP connections to open for the server account;"
+              " if --server_jid has a resource, the extra connections use"
+              " it with a numeric suffix");
 
 DEFINE_string (pubsub_service, "", "The pubsub service to use on the server");
 
+DEFINE_int32 (worker_threads, 4,
+              "Number of threads used to process requests to the backend");
+DEFINE_int32 (max_queued_requests, 1000,
+              "Maximum number of requests waiting for a worker thread"
+              " (or for being sent in a batch with --batch_size)");
+
+DEFINE_bool (fair_queueing, false,
+             "If true, queue calls to the backend per client and process"
+             " them fairly (with --worker_threads calls or batches at a time"
+             " and up to --max_queued_requests waiting)");
+DEFINE_bool (adaptive_concurrency, false,
+             "If true, adjust the number of concurrent backend calls"
+             " automatically based on their latency, up to the maximum"
+             " of --fair_queueing (which is required)");
+
+DEFINE_int32 (batch_size, 0,
+              "If positive, forward calls to the backend in JSON-RPC batches"
+              " of up to this size (using --worker_threads for sending)");
+DEFINE_int32 (batch_delay_ms, 5,
+              "Maximum time in milliseconds that a call waits for more"
+              " calls to batch it with");
+
 DEFINE_bool (waitforchange, false, "If true, enable waitforchange updates");
 DEFINE_bool (waitforpendingchange, false,
              "If true, enable waitforpendingchange updates");
 
+DEFINE_int32 (cache_results, 0,
+              "If positive, cache up to this many results until the next"
+              " notification update (requires --waitforchange, and also"
+              " --waitforpendingchange if results depend on the mempool)");
+DEFINE_bool (coalesce_calls, false,
+             "If true, identical calls in flight at the same time are"
+             " forwarded to the backend only once");
+
+DEFINE_int32 (pong_max_in_flight, 0,
+              "If positive, ignore pings while this many requests are"
+              " being processed");
+DEFINE_int32 (pong_max_queued, 0,
+              "If positive, ignore pings while this many calls are waiting"
+              " for a worker thread (or for being sent in a batch)");
+DEFINE_int32 (pong_max_latency_ms, 0,
+              "If positive, ignore pings while the average backend latency"
+              " (in milliseconds) is higher than this");
+
+DEFINE_string (health_probe_method, "",
+               "If set, call this method (without parameters) on the backend"
+               " periodically to check its health, and reject requests while"
+               " it is unhealthy");
+DEFINE_int32 (health_probe_interval_ms, 1000,
+              "Interval in milliseconds between health probes");
+DEFINE_int32 (health_probe_timeout_ms, 1000,
+              "Timeout in milliseconds for health probe calls");
+
 /**
  * Time between connection retries if the server gets disconnected.  This is
  * also the general sleep time in the main loop.
  */
 const auto RECONNECT_INTERVAL = std::chrono::seconds (5);
 
+/** Interval at which statistics about processed calls are logged.  */
+const auto STATS_INTERVAL = std::chrono::minutes (1);
+
+/**
+ * Splits the --backend_rpc_url flag into the list of backend URLs.
+ */
+std::vector<std::string>
+GetBackendUrls ()
+{
+  std::vector<std::string> res;
+  std::istringstream in(FLAGS_backend_rpc_url);
+  while (in.good ())
+    {
+      std::string cur;
+      std::getline (in, cur, ',');
+      if (!cur.empty ())
+        res.push_back (cur);
+    }
+
+  return res;
+}
+
 /**
  * Constructs a WaiterThread instance for the given notification type, using
- * the given RPC method as long-polling backend call.
+ * the given RPC method as long-polling backend call through the
+ * given connection pool.
  */
 template <typename Notification>
   std::unique_ptr<charon::WaiterThread>
-  NewWaiter (const std::string& method)
+  NewWaiter (std::shared_ptr<charon::RpcConnectionPool> pool,
+             const std::string& method)
 {
   auto n = std::make_unique<Notification> ();
   auto w = std::make_unique<charon::RpcUpdateWaiter> (
-      FLAGS_backend_rpc_url, method, n->AlwaysBlockId ());
+      std::move (pool), method, n->AlwaysBlockId ());
 
   return std::make_unique<charon::WaiterThread> (std::move (n), std::move (w));
 }
 
+/**
+ * Health probe of one backend.  The probe calls are run on a separate
+ * thread, so that they time out even on connections that do not support
+ * timeouts themselves (like Unix domain sockets).  While a timed-out call
+ * is still hanging, no new one is started and the backend is reported
+ * as unhealthy.
+ */
+class HealthProbe
+{
+
+private:
+
+  /** Index of the backend (for log messages).  */
+  const size_t index;
+
+  /** Connection pool used for the probes.  */
+  const std::shared_ptr<charon::RpcConnectionPool> pool;
+
+  /** The method to call.  */
+  const std::string method;
+
+  /** Timeout for the calls.  */
+  const std::chrono::milliseconds timeout;
+
+  /** Result of the currently running call, if any.  */
+  std::future<bool> running;
+
+  /**
+   * Performs the actual probe call and returns whether the backend is
+   * healthy.  This may block arbitrarily long.
+   */
+  static bool
+  Call (const size_t i, charon::RpcConnectionPool& p, const std::string& m)
+  {
+    try
+      {
+        auto conn = p.Get ();
+        conn->CallMethod (m, Json::Value (Json::arrayValue));
+      }
+    catch (const jsonrpc::JsonRpcException& exc)
+      {
+        /* An error returned by the backend itself still means that it is
+           up and responding.  */
+        if (charon::RpcServer::IsBackendFailure (exc.GetCode ()))
+          {
+            LOG (WARNING)
+                << "Health probe of backend " << i << " failed: "
+                << exc.what ();
+            return false;
+          }
+      }
+
+    return true;
+  }
+
+public:
+
+  explicit HealthProbe (const size_t i, const std::string& url,
+                        const std::string& m,
+                        const std::chrono::milliseconds t)
+    : index(i), pool(std::make_shared<charon::RpcConnectionPool> (url, 1)),
+      method(m), timeout(t)
+  {
+    /* For HTTP, the connection times out by itself and we do not leave
+       any hanging calls behind.  */
+    pool->SetTimeout (timeout.count ());
+  }
+
+  HealthProbe () = delete;
+  HealthProbe (const HealthProbe&) = delete;
+  void operator= (const HealthProbe&) = delete;
+
+  /**
+   * Probes the backend (or waits for a still running earlier probe)
+   * and returns whether it is healthy.
+   */
+  bool
+  Run ()
+  {
+    if (!running.valid ())
+      {
+        std::promise<bool> result;
+        running = result.get_future ();
+        std::thread ([i = index, p = pool, m = method,
+                      result = std::move (result)] () mutable
+          {
+            result.set_value (Call (i, *p, m));
+          }).detach ();
+      }
+
+    if (running.wait_for (timeout) != std::future_status::ready)
+      {
+        LOG (WARNING) << "Health probe of backend " << index << " timed out";
+        return false;
+      }
+
+    return running.get ();
+  }
+
+};
+
 } // anonymous namespace
 
 int
@@ -85,7 +280,7 @@ main (int argc, char** argv)
   gflags::SetVersionString (PACKAGE_VERSION);
   gflags::ParseCommandLineFlags (&argc, &argv, true);
 
-  if (FLAGS_backend_rpc_url.empty ())
+  if (GetBackendUrls ().empty ())
     {
       std::cerr << "Error: --backend_rpc_url must be set" << std::endl;
       return EXIT_FAILURE;
@@ -95,23 +290,130 @@ main (int argc, char** argv)
       std::cerr << "Error: --server_jid must be set" << std::endl;
       return EXIT_FAILURE;
     }
+  if (FLAGS_connections < 1)
+    {
+      std::cerr << "Error: --connections must be positive" << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (FLAGS_worker_threads < 1 || FLAGS_max_queued_requests < 0)
+    {
+      std::cerr
+          << "Error: --worker_threads must be positive"
+          << " and --max_queued_requests non-negative"
+          << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  const auto urls = GetBackendUrls ();
+  if (urls.size () > 1 && FLAGS_batch_size > 0)
+    {
+      std::cerr
+          << "Error: --batch_size is not supported with multiple backends"
+          << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (FLAGS_batch_size > 0 && FLAGS_max_queued_requests < 1)
+    {
+      std::cerr
+          << "Error: --max_queued_requests must be positive with --batch_size"
+          << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  /* All calls to a backend share one pool of connections.  Each worker
+     thread and each notification's long-polling call may need one at the
+     same time.  Notifications are always taken from the first backend.  */
+  const unsigned numWaiters = (FLAGS_waitforchange ? 1 : 0)
+                                + (FLAGS_waitforpendingchange ? 1 : 0);
+  std::vector<std::shared_ptr<charon::RpcConnectionPool>> pools;
+  for (const auto& url : urls)
+    {
+      const unsigned numConn = FLAGS_worker_threads
+                                  + (pools.empty () ? numWaiters : 0);
+      pools.push_back (std::make_shared<charon::RpcConnectionPool> (
+          url, numConn));
+      LOG (INFO) << "Forwarding calls to JSON-RPC server at " << url;
+    }
+  auto pool = pools.front ();
 
-  charon::ForwardingRpcServer backend(FLAGS_backend_rpc_url);
-  LOG (INFO)
-      << "Forwarding calls to JSON-RPC server at " << FLAGS_backend_rpc_url;
   LOG (INFO) << "Reporting backend version " << FLAGS_backend_version;
 
   const auto methods = charon::GetSelectedMethods ();
   if (methods.empty ())
     LOG (WARNING) << "No methods are selected for forwarding";
   for (const auto& m : methods)
+    LOG (INFO) << "Allowing method: " << m;
+
+  std::unique_ptr<charon::ForwardingRpcServer> forwarding;
+  std::unique_ptr<charon::BatchingRpcServer> batching;
+  std::unique_ptr<charon::Server> srv;
+  if (FLAGS_batch_size > 0)
     {
-      LOG (INFO) << "Allowing method: " << m;
-      backend.AllowMethod (m);
+      const std::chrono::milliseconds delay(FLAGS_batch_delay_ms);
+      batching = std::make_unique<charon::BatchingRpcServer> (
+          pool, FLAGS_batch_size, delay, FLAGS_worker_threads,
+          FLAGS_max_queued_requests);
+      for (const auto& m : methods)
+        batching->AllowMethod (m);
+
+      srv = std::make_unique<charon::Server> (FLAGS_backend_version, *batching,
+                                              FLAGS_server_jid, FLAGS_password);
+      LOG (INFO)
+          << "Sending batches of up to " << FLAGS_batch_size << " calls"
+          << " after at most " << FLAGS_batch_delay_ms << " ms"
+          << " with " << FLAGS_worker_threads << " threads and up to "
+          << FLAGS_max_queued_requests << " queued requests";
     }
+  else
+    {
+      forwarding = std::make_unique<charon::ForwardingRpcServer> (pools);
+      for (const auto& m : methods)
+        forwarding->AllowMethod (m);
 
-  charon::Server srv(FLAGS_backend_version, backend,
-                     FLAGS_server_jid, FLAGS_password);
+      srv = std::make_unique<charon::Server> (FLAGS_backend_version,
+                                              *forwarding,
+                                              FLAGS_server_jid, FLAGS_password);
+      srv->SetWorkerThreads (FLAGS_worker_threads, FLAGS_max_queued_requests);
+      LOG (INFO)
+          << "Using " << FLAGS_worker_threads << " worker threads with up to "
+          << FLAGS_max_queued_requests << " queued requests";
+    }
+
+  /* Additional connections share everything with the main one.  For a full
+     JID, they get distinct resources; for a bare JID, the XMPP server
+     assigns a random resource to each of them anyway.  */
+  for (int i = 1; i < FLAGS_connections; ++i)
+    {
+      std::string jid = FLAGS_server_jid;
+      if (jid.find ('/') != std::string::npos)
+        jid += "-" + std::to_string (i);
+      srv->AddConnection (jid, FLAGS_password);
+    }
+  if (FLAGS_connections > 1)
+    LOG (INFO) << "Using " << FLAGS_connections << " XMPP connections";
+
+  if (FLAGS_fair_queueing)
+    {
+      unsigned maxActive = FLAGS_worker_threads;
+      if (FLAGS_batch_size > 0)
+        maxActive *= FLAGS_batch_size;
+      srv->EnableFairQueueing (maxActive, FLAGS_max_queued_requests);
+      LOG (INFO)
+          << "Fair queueing with up to " << maxActive << " active calls";
+
+      if (FLAGS_adaptive_concurrency)
+        {
+          srv->EnableAdaptiveConcurrency (1);
+          LOG (INFO) << "Using an adaptive limit for concurrent calls";
+        }
+    }
+  else if (FLAGS_adaptive_concurrency)
+    {
+      std::cerr
+          << "Error: --adaptive_concurrency requires --fair_queueing"
+          << std::endl;
+      return EXIT_FAILURE;
+    }
 
   if (FLAGS_pubsub_service.empty ())
     {
@@ -125,23 +427,127 @@ main (int argc, char** argv)
         }
     }
   else
-    srv.AddPubSub (FLAGS_pubsub_service);
+    srv->AddPubSub (FLAGS_pubsub_service);
+
+  if (FLAGS_cache_results > 0)
+    {
+      if (!FLAGS_waitforchange)
+        {
+          std::cerr
+              << "Error: Result caching requires --waitforchange"
+              << std::endl;
+          return EXIT_FAILURE;
+        }
+
+      LOG (INFO) << "Caching up to " << FLAGS_cache_results << " results";
+      srv->EnableCache (FLAGS_cache_results);
+    }
+
+  if (FLAGS_coalesce_calls)
+    {
+      LOG (INFO) << "Coalescing identical calls";
+      srv->EnableCoalescing ();
+    }
+
+  charon::Server::LoadLimits limits;
+  limits.maxInFlight = std::max (FLAGS_pong_max_in_flight, 0);
+  limits.maxQueued = std::max (FLAGS_pong_max_queued, 0);
+  limits.maxLatency
+      = std::chrono::milliseconds (std::max (FLAGS_pong_max_latency_ms, 0));
+  srv->SetLoadLimits (limits);
+
+  if (!FLAGS_health_probe_method.empty ())
+    {
+      if (FLAGS_health_probe_interval_ms < 1
+            || FLAGS_health_probe_timeout_ms < 1)
+        {
+          std::cerr
+              << "Error: --health_probe_interval_ms and"
+                 " --health_probe_timeout_ms must be positive"
+              << std::endl;
+          return EXIT_FAILURE;
+        }
+
+      /* The probes use their own connections, so that they neither wait
+         for busy worker threads nor get stuck for longer than
+         their timeout.  */
+      const std::string method = FLAGS_health_probe_method;
+      const std::chrono::milliseconds timeout(FLAGS_health_probe_timeout_ms);
+      std::vector<std::shared_ptr<HealthProbe>> probes;
+      for (size_t i = 0; i < urls.size (); ++i)
+        probes.push_back (
+            std::make_shared<HealthProbe> (i, urls[i], method, timeout));
+
+      /* Each backend is probed individually and taken out of rotation
+         while it is unhealthy.  The server as a whole is healthy as long
+         as at least one backend is.  */
+      auto* fwd = forwarding.get ();
+      const std::chrono::milliseconds interval(FLAGS_health_probe_interval_ms);
+      srv->EnableHealthCheck ([probes, fwd] ()
+        {
+          bool anyHealthy = false;
+          for (size_t i = 0; i < probes.size (); ++i)
+            {
+              const bool healthy = probes[i]->Run ();
+              if (fwd != nullptr)
+                fwd->SetBackendHealthy (i, healthy);
+              anyHealthy = anyHealthy || healthy;
+            }
+
+          return anyHealthy;
+        }, interval);
+      LOG (INFO)
+          << "Probing backend health with " << method << " every "
+          << FLAGS_health_probe_interval_ms << " ms";
+    }
 
   if (FLAGS_waitforchange)
-    srv.AddNotification (NewWaiter<charon::StateChangeNotification> (
-        "waitforchange"));
+    srv->AddNotification (NewWaiter<charon::StateChangeNotification> (
+        pool, "waitforchange"));
   if (FLAGS_waitforpendingchange)
-    srv.AddNotification (NewWaiter<charon::PendingChangeNotification> (
-        "waitforpendingchange"));
+    srv->AddNotification (NewWaiter<charon::PendingChangeNotification> (
+        pool, "waitforpendingchange"));
+
+  if (FLAGS_min_priority < FLAGS_priority)
+    {
+      if (FLAGS_priority_interval_ms < 1)
+        {
+          std::cerr
+              << "Error: --priority_interval_ms must be positive"
+              << std::endl;
+          return EXIT_FAILURE;
+        }
+
+      const std::chrono::milliseconds interval(FLAGS_priority_interval_ms);
+      srv->EnableDynamicPriority (FLAGS_min_priority, interval);
+      LOG (INFO)
+          << "Lowering the priority down to " << FLAGS_min_priority
+          << " based on load, updated every "
+          << FLAGS_priority_interval_ms << " ms";
+    }
 
   LOG (INFO) << "Connecting server to XMPP as " << FLAGS_server_jid;
 
-  charon::Server::ReconnectLoop loop(srv, RECONNECT_INTERVAL);
+  charon::Server::ReconnectLoop loop(*srv, RECONNECT_INTERVAL);
   loop.Start (FLAGS_priority);
 
-  /* Just wait forever (until the process is terminated by signal).  */
+  /* Just wait forever (until the process is terminated by signal),
+     logging some statistics from time to time.  */
   while (true)
-    std::this_thread::sleep_for (std::chrono::seconds (1));
+    {
+      std::this_thread::sleep_for (STATS_INTERVAL);
+      LOG (INFO)
+          << "Backend calls executed: " << srv->GetNumExecutedCalls ()
+          << ", coalesced: " << srv->GetNumCoalescedCalls ()
+          << ", expired: " << srv->GetNumExpiredCalls ()
+          << ", cancelled: " << srv->GetNumCancelledCalls ()
+          << ", rejected: " << srv->GetNumRejectedCalls ()
+          << ", concurrency limit: " << srv->GetConcurrencyLimit ()
+          << ", backend healthy: " << srv->IsBackendHealthy ()
+          << ", in flight: " << srv->GetNumInFlightCalls ()
+          << ", average latency: " << srv->GetAverageLatency ().count ()
+          << " ms, priority: " << srv->GetPriority ();
+    }
 
   return EXIT_SUCCESS;
 }